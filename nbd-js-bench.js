@@ -0,0 +1,1317 @@
+/* Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/* Headless benchmark and conformance checks for web/js/nbd.js, under Node.
+ *
+ * nbd.js is loaded unchanged, and its NBDEngine is run against a fake
+ * in-process WebSocket and a synthetic Blob. A scripted NBD client performs
+ * the handshake, checks the engine's answers to a set of options and
+ * commands, on one websocket and on several, and on writable exports. It
+ * then floods it with reads, reporting throughput, latency, heap
+ * allocation and GC time.
+ *
+ *     node nbd-js-bench.js [--size=<bytes>] [--reads=<n>]
+ *         [--read-size=<bytes>[,<bytes>...]] [--depth=<n>] [--random]
+ *         [--zeroes=<pct>] [--simple] [--verify] [--set <option>=<value>]
+ */
+
+'use strict';
+
+const fs = require('fs');
+const path = require('path');
+const v8 = require('v8');
+const vm = require('vm');
+
+const NBD_JS = path.join(__dirname, 'web', 'js', 'nbd.js');
+
+const NBD_OPT_MAGIC_HI = 0x49484156;
+const NBD_OPT_MAGIC_LO = 0x454f5054;
+const NBD_REP_MAGIC_HI = 0x0003e889;
+const NBD_REP_MAGIC_LO = 0x045565a9;
+const NBD_REQUEST_MAGIC = 0x25609513;
+const NBD_SIMPLE_REPLY_MAGIC = 0x67446698;
+
+const PATTERN_CHUNK = 1024 * 1024;
+const STAMP_SIZE = 4096;
+const WRITE_EXPORT_SIZE = 4 * 1024 * 1024;
+
+/* handshake and command constants come from nbd.js itself */
+vm.runInThisContext(fs.readFileSync(NBD_JS, 'utf8'), { filename: NBD_JS });
+
+function usage()
+{
+    console.error("usage: node nbd-js-bench.js [options]\n" +
+            "  --size=<bytes>         export size (default 256 MiB)\n" +
+            "  --reads=<n>            number of reads (default 20000)\n" +
+            "  --read-size=<list>     read sizes, chosen in turn " +
+                "(default 4096,65536,131072)\n" +
+            "  --depth=<n>            reads in flight (default 32)\n" +
+            "  --random               random offsets, rather than " +
+                "sequential\n" +
+            "  --zeroes=<pct>         percentage of 1 MiB chunks that are " +
+                "zero (default 10)\n" +
+            "  --simple               don't negotiate structured replies\n" +
+            "  --verify               compare all read data with the file\n" +
+            "  --no-check             skip the conformance checks\n" +
+            "  --set <opt>=<value>    set an NBDEngine option, such as " +
+                "cache_size");
+    process.exit(1);
+}
+
+function parse_args(argv)
+{
+    var args = {
+        size: 256 * 1024 * 1024,
+        reads: 20000,
+        read_sizes: [4096, 65536, 131072],
+        depth: 32,
+        random: false,
+        zeroes: 10,
+        structured: true,
+        verify: false,
+        check: true,
+        options: {},
+    };
+
+    for (var i = 0; i < argv.length; i++) {
+        var arg = argv[i];
+        var eq = arg.indexOf('=');
+        var name = eq < 0 ? arg : arg.substring(0, eq);
+        var value = eq < 0 ? null : arg.substring(eq + 1);
+
+        if (name == '--set') {
+            value = argv[++i];
+            if (!value || value.indexOf('=') < 0)
+                usage();
+            var opt = value.split('=');
+            if (!NBD_ENGINE_OPTIONS.includes(opt[0]))
+                usage();
+            args.options[opt[0]] = Number(opt[1]);
+            continue;
+        }
+
+        switch (name) {
+        case '--size':
+            args.size = Number(value);
+            break;
+        case '--reads':
+            args.reads = Number(value);
+            break;
+        case '--read-size':
+            args.read_sizes = value.split(',').map(Number);
+            break;
+        case '--depth':
+            args.depth = Number(value);
+            break;
+        case '--random':
+            args.random = true;
+            break;
+        case '--zeroes':
+            args.zeroes = Number(value);
+            break;
+        case '--simple':
+            args.structured = false;
+            break;
+        case '--verify':
+            args.verify = true;
+            break;
+        case '--no-check':
+            args.check = false;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (!(args.size >= PATTERN_CHUNK) || !(args.depth >= 1) ||
+            args.read_sizes.some(function(n) {
+                return !(n > 0 && n <= args.size); }))
+        usage();
+
+    return args;
+}
+
+/* Deterministic pseudo-random numbers, so that runs are repeatable */
+function Rand(seed)
+{
+    this.state = seed >>> 0 || 1;
+
+    this.next = function()
+    {
+        var x = this.state;
+        x ^= x << 13;
+        x ^= x >>> 17;
+        x ^= x << 5;
+        this.state = x >>> 0;
+        return this.state;
+    }
+}
+
+/* The export's contents: 1 MiB chunks of a fixed pattern, some of which
+ * are zero. Each STAMP_SIZE block of pattern data starts with its offset,
+ * so that misrouted data is caught without comparing everything. */
+function make_file(size, zero_pct)
+{
+    var rand = new Rand(0x6e6264);
+    var base = new Uint8Array(PATTERN_CHUNK);
+    var zero = new Uint8Array(PATTERN_CHUNK);
+    var parts = [];
+    var zeroes = [];
+
+    for (var i = 0; i < base.length; i++)
+        base[i] = (i * 131 + (i >> 9)) & 0xff | 1;
+
+    for (var off = 0; off < size; off += PATTERN_CHUNK) {
+        var n = Math.min(PATTERN_CHUNK, size - off);
+        var is_zero = rand.next() % 100 < zero_pct;
+
+        zeroes.push(is_zero);
+        if (is_zero) {
+            parts.push(zero.subarray(0, n));
+            continue;
+        }
+
+        var chunk = base.slice(0, n);
+        var view = new DataView(chunk.buffer);
+        for (var s = 0; s + 8 <= n; s += STAMP_SIZE) {
+            view.setUint32(s, Math.floor((off + s) / 2**32));
+            view.setUint32(s + 4, (off + s) >>> 0);
+        }
+        parts.push(chunk);
+    }
+
+    var file = new Blob(parts);
+    file.is_zero = function(offset) {
+        return zeroes[Math.floor(offset / PATTERN_CHUNK)];
+    };
+    return file;
+}
+
+/* An in-process WebSocket: the engine's sends are collected into a byte
+ * stream for the client, and the client delivers messages to the engine
+ * through onmessage. Messages are delivered as they're sent, so nothing is
+ * ever buffered. As with a real websocket, the data is copied, so the
+ * engine may reuse its buffers once send() returns. */
+function FakeWebSocket(endpoint)
+{
+    this.endpoint = endpoint;
+    this.binaryType = 'blob';
+    this.bufferedAmount = 0;
+    this.closed = false;
+    this.peer = null;
+
+    this.send = function(data)
+    {
+        if (this.closed)
+            throw new Error("send on closed websocket");
+        if (data instanceof ArrayBuffer)
+            data = new Uint8Array(data).slice();
+        else
+            data = new Uint8Array(data.buffer, data.byteOffset,
+                    data.byteLength).slice();
+        FakeWebSocket.sent_messages++;
+        this.peer.receive(data);
+    }
+
+    this.close = function()
+    {
+        this.closed = true;
+    }
+}
+FakeWebSocket.sent_messages = 0;
+
+globalThis.WebSocket = FakeWebSocket;
+
+/* The client's view of the engine's byte stream. Data is only copied when
+ * a header or a compared region spans several messages. */
+function ByteStream()
+{
+    this.chunks = [];
+    this.length = 0;
+    this.waiter = null;
+
+    this.push = function(data)
+    {
+        this.chunks.push(data);
+        this.length += data.byteLength;
+        if (this.waiter)
+            this.waiter();
+    }
+
+    /* len bytes from off, without consuming them */
+    this.peek = function(len, off = 0)
+    {
+        var i = 0;
+        while (i < this.chunks.length && off >= this.chunks[i].byteLength)
+            off -= this.chunks[i++].byteLength;
+
+        if (!len)
+            return new Uint8Array(0);
+
+        var first = this.chunks[i];
+        if (first.byteLength - off >= len)
+            return first.subarray(off, off + len);
+
+        var buf = new Uint8Array(len);
+        for (var pos = 0; pos < len; i++, off = 0) {
+            var n = Math.min(this.chunks[i].byteLength - off, len - pos);
+            buf.set(this.chunks[i].subarray(off, off + n), pos);
+            pos += n;
+        }
+        return buf;
+    }
+
+    this.take = function(len)
+    {
+        var data = this.peek(len);
+        this.skip(len);
+        return data;
+    }
+
+    this.skip = function(len)
+    {
+        this.length -= len;
+        while (len) {
+            var first = this.chunks[0];
+            if (first.byteLength > len) {
+                this.chunks[0] = first.subarray(len);
+                break;
+            }
+            len -= first.byteLength;
+            this.chunks.shift();
+        }
+    }
+
+    /* resolves once len bytes are available */
+    this.wait = function(len)
+    {
+        if (this.length >= len)
+            return Promise.resolve();
+        return new Promise((function(resolve) {
+            this.waiter = (function() {
+                if (this.length < len)
+                    return;
+                this.waiter = null;
+                resolve();
+            }).bind(this);
+        }).bind(this));
+    }
+}
+
+function view(data)
+{
+    return new DataView(data.buffer, data.byteOffset, data.byteLength);
+}
+
+/* A scripted NBD client on one of the engine's connections */
+function Client(engine, args, conn)
+{
+    this.engine = engine;
+    this.conn = conn;
+    this.args = args;
+    this.stream = new ByteStream();
+    this.failures = 0;
+    this.reqs = new Map();
+    this.next_handle = 1;
+    this.on_reply = null;
+
+    this.receive = function(data)
+    {
+        this.stream.push(data);
+        if (this.on_reply)
+            this.on_reply();
+    }
+
+    this.send = function(buf)
+    {
+        this.conn.ws.onmessage({ data: buf });
+    }
+
+    this.check = function(name, ok, detail)
+    {
+        if (!ok)
+            this.failures++;
+        console.log((ok ? "ok    " : "FAIL  ") + name +
+                (!ok && detail ? ": " + detail : ""));
+    }
+
+    this.option = async function(opt, data)
+    {
+        var len = data ? data.byteLength : 0;
+        var buf = new Uint8Array(16 + len);
+        var v = view(buf);
+        v.setUint32(0, NBD_OPT_MAGIC_HI);
+        v.setUint32(4, NBD_OPT_MAGIC_LO);
+        v.setUint32(8, opt);
+        v.setUint32(12, len);
+        if (data)
+            buf.set(data, 16);
+        this.send(buf.buffer);
+
+        /* collect replies up to the final one */
+        var replies = [];
+        for (;;) {
+            await this.stream.wait(20);
+            var hdr = view(this.stream.peek(20));
+            var rlen = hdr.getUint32(16);
+            await this.stream.wait(20 + rlen);
+            hdr = view(this.stream.take(20));
+            var reply = {
+                magic_ok: hdr.getUint32(0) == NBD_REP_MAGIC_HI &&
+                    hdr.getUint32(4) == NBD_REP_MAGIC_LO,
+                opt: hdr.getUint32(8),
+                type: hdr.getUint32(12),
+                data: view(this.stream.take(rlen).slice()),
+            };
+            replies.push(reply);
+            if (reply.type != NBD_REP_INFO)
+                return replies;
+        }
+    }
+
+    this.info_request = function(info_types)
+    {
+        var buf = new Uint8Array(6 + 2 * info_types.length);
+        var v = view(buf);
+        v.setUint32(0, 0);
+        v.setUint16(4, info_types.length);
+        for (var i = 0; i < info_types.length; i++)
+            v.setUint16(6 + 2 * i, info_types[i]);
+        return buf;
+    }
+
+    this.negotiate = async function(check)
+    {
+        check = check ? this.check.bind(this) : function() {};
+
+        await this.stream.wait(18);
+        var greeting = view(this.stream.take(18));
+        check("greeting magic",
+                greeting.getUint32(0) == 0x4e42444d &&
+                greeting.getUint32(4) == 0x41474943 &&
+                greeting.getUint32(8) == NBD_OPT_MAGIC_HI &&
+                greeting.getUint32(12) == NBD_OPT_MAGIC_LO);
+        check("handshake flags", greeting.getUint16(16) ==
+                (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES));
+
+        var cflags = new DataView(new ArrayBuffer(4));
+        cflags.setUint32(0, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+        this.send(cflags.buffer);
+
+        var r = await this.option(0x40);
+        check("unknown option is unsupported",
+                r.length == 1 && r[0].magic_ok && r[0].opt == 0x40 &&
+                r[0].type == NBD_REP_ERR_UNSUP >>> 0);
+
+        r = await this.option(NBD_OPT_STRUCTURED_REPLY, new Uint8Array(1));
+        check("structured reply option with data is invalid",
+                r.length == 1 && r[0].type == NBD_REP_ERR_INVALID >>> 0);
+
+        r = await this.option(NBD_OPT_INFO, new Uint8Array(3));
+        check("truncated info request is invalid",
+                r.length == 1 && r[0].type == NBD_REP_ERR_INVALID >>> 0);
+
+        if (this.args.structured) {
+            r = await this.option(NBD_OPT_STRUCTURED_REPLY);
+            check("structured replies accepted",
+                    r.length == 1 && r[0].type == NBD_REP_ACK);
+        }
+
+        r = await this.option(NBD_OPT_INFO,
+                this.info_request([NBD_INFO_BLOCK_SIZE]));
+        this.check_info(check, "info", r);
+        check("still negotiating after info",
+                this.conn.state == NBD_STATE_WAIT_OPTION);
+
+        r = await this.option(NBD_OPT_GO,
+                this.info_request([NBD_INFO_BLOCK_SIZE]));
+        this.check_info(check, "go", r);
+        check("transmission after go",
+                this.conn.state == NBD_STATE_TRANSMISSION);
+    }
+
+    this.check_info = function(check, name, replies)
+    {
+        var export_info = null, block_info = null;
+
+        for (var i = 0; i < replies.length; i++) {
+            var data = replies[i].data;
+            if (replies[i].type != NBD_REP_INFO)
+                continue;
+            if (data.getUint16(0) == NBD_INFO_EXPORT)
+                export_info = data;
+            else if (data.getUint16(0) == NBD_INFO_BLOCK_SIZE)
+                block_info = data;
+        }
+
+        var last = replies[replies.length - 1];
+        check(name + ": acknowledged", last.magic_ok &&
+                last.type == NBD_REP_ACK);
+        check(name + ": export size", export_info &&
+                export_info.getUint32(2) * 2**32 +
+                export_info.getUint32(6) == this.args.size);
+        check(name + ": read-only export", export_info &&
+                (export_info.getUint16(10) &
+                 (NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY)) ==
+                (NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY));
+
+        if (!block_info) {
+            check(name + ": block size", false, "no block size info");
+            return;
+        }
+
+        var min = block_info.getUint32(2);
+        var pref = block_info.getUint32(6);
+        var max = block_info.getUint32(10);
+        check(name + ": block size", min <= pref && pref <= max &&
+                !(min & (min - 1)) && !(pref & (pref - 1)),
+                min + "/" + pref + "/" + max);
+    }
+
+    /* Send a batch of requests in one message, as the proxy would when it
+     * has several queued, or split into messages of msg_size bytes. Each
+     * request is { type, offset, length }, with the data of a write in
+     * payload, and is given a handle and completion promise. */
+    this.submit = function(reqs, msg_size)
+    {
+        var buf = new Uint8Array(reqs.reduce(function(n, req) {
+            return n + 28 + (req.type == NBD_CMD_WRITE ? req.length : 0);
+        }, 0));
+        var v = view(buf);
+        var pos = 0;
+
+        for (var i = 0; i < reqs.length; i++) {
+            var req = reqs[i];
+            req.handle = this.next_handle++;
+            req.t_sent = performance.now();
+            req.received = 0;
+            req.data = this.args.verify || req.check ?
+                new Uint8Array(req.length) : null;
+            this.reqs.set(req.handle, req);
+
+            v.setUint32(pos, NBD_REQUEST_MAGIC);
+            v.setUint16(pos + 4, 0);
+            v.setUint16(pos + 6, req.type);
+            v.setUint32(pos + 8, 0);
+            v.setUint32(pos + 12, req.handle);
+            v.setUint32(pos + 16, Math.floor(req.offset / 2**32));
+            v.setUint32(pos + 20, req.offset >>> 0);
+            v.setUint32(pos + 24, req.length);
+            if (req.payload)
+                buf.set(req.payload, pos + 28);
+            pos += 28 + (req.type == NBD_CMD_WRITE ? req.length : 0);
+        }
+
+        if (!msg_size) {
+            this.send(buf.buffer);
+            return;
+        }
+        for (pos = 0; pos < buf.byteLength; pos += msg_size)
+            this.send(buf.slice(pos, pos + msg_size).buffer);
+    }
+
+    /* Parse as many replies as are available, calling done(req) for each
+     * completed request */
+    this.parse_replies = function(done)
+    {
+        var s = this.stream;
+
+        while (s.length >= 16) {
+            var hdr = view(s.peek(Math.min(s.length, 32)));
+            var magic = hdr.getUint32(0);
+            var req;
+
+            if (magic == NBD_SIMPLE_REPLY_MAGIC) {
+                req = this.reqs.get(hdr.getUint32(12));
+                if (!req)
+                    throw new Error("reply for unknown handle");
+                var err = hdr.getUint32(4);
+                var len = !err && req.type == NBD_CMD_READ ? req.length : 0;
+                if (s.length < 16 + len)
+                    return;
+                s.skip(16);
+                if (len)
+                    this.read_data(req, 0, len);
+                req.error = err;
+                this.reqs.delete(req.handle);
+                done(req);
+                continue;
+            }
+
+            if (magic != NBD_STRUCTURED_REPLY_MAGIC)
+                throw new Error("bad reply magic 0x" + magic.toString(16));
+            if (s.length < 20)
+                return;
+
+            var flags = hdr.getUint16(4);
+            var type = hdr.getUint16(6);
+            var clen = hdr.getUint32(16);
+            req = this.reqs.get(hdr.getUint32(12));
+            if (!req)
+                throw new Error("chunk for unknown handle");
+
+            /* the fixed part of each chunk type, ahead of any data */
+            var fixed = type == NBD_REPLY_TYPE_OFFSET_DATA ? 8 :
+                type == NBD_REPLY_TYPE_OFFSET_HOLE ? 12 :
+                type == NBD_REPLY_TYPE_ERROR ? 6 : 0;
+            if (s.length < 20 + fixed ||
+                    (type != NBD_REPLY_TYPE_OFFSET_DATA &&
+                     s.length < 20 + clen))
+                return;
+            var body = view(s.peek(20 + fixed).slice(20));
+
+            if (type == NBD_REPLY_TYPE_OFFSET_DATA) {
+                if (s.length < 20 + clen)
+                    return;
+                var off = body.getUint32(0) * 2**32 + body.getUint32(4);
+                s.skip(28);
+                this.read_data(req, off - req.offset, clen - 8);
+            } else if (type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+                var off = body.getUint32(0) * 2**32 + body.getUint32(4);
+                var hlen = body.getUint32(8);
+                s.skip(20 + clen);
+                if (req.data)
+                    req.data.fill(0, off - req.offset,
+                            off - req.offset + hlen);
+                req.received += hlen;
+                req.holes = (req.holes || 0) + hlen;
+            } else if (type == NBD_REPLY_TYPE_ERROR) {
+                req.error = body.getUint32(0);
+                s.skip(20 + clen);
+            } else {
+                s.skip(20 + clen);
+            }
+
+            if (flags & NBD_REPLY_FLAG_DONE) {
+                this.reqs.delete(req.handle);
+                done(req);
+            }
+        }
+    }
+
+    /* consume len bytes of read data, at pos within the request */
+    this.read_data = function(req, pos, len)
+    {
+        var s = this.stream;
+
+        req.received += len;
+        if (req.data) {
+            req.data.set(s.take(len), pos);
+            return;
+        }
+
+        /* otherwise, just check the stamps at the start of each block */
+        var first = Math.ceil((req.offset + pos) / STAMP_SIZE) * STAMP_SIZE;
+        for (var off = first; off + 8 <= req.offset + pos + len;
+                off += STAMP_SIZE) {
+            if (this.args.file.is_zero(off))
+                continue;
+            var stamp = view(s.peek(8, off - req.offset - pos));
+            if (stamp.getUint32(0) * 2**32 + stamp.getUint32(4) != off)
+                req.bad_stamp = off;
+        }
+        s.skip(len);
+    }
+
+    /* run requests one batch at a time, resolving once all are done */
+    this.run = function(reqs, msg_size)
+    {
+        return new Promise((function(resolve, reject) {
+            var left = reqs.length;
+            this.on_reply = (function() {
+                try {
+                    this.parse_replies(function() {
+                        if (!--left)
+                            resolve(reqs);
+                    });
+                } catch (e) {
+                    reject(e);
+                }
+            }).bind(this);
+            this.submit(reqs, msg_size);
+        }).bind(this));
+    }
+}
+
+async function expected_data(file, offset, len)
+{
+    return new Uint8Array(await file.slice(offset, offset + len).arrayBuffer());
+}
+
+function same(a, b)
+{
+    return a.byteLength == b.byteLength && Buffer.compare(a, b) == 0;
+}
+
+async function conformance(client, args)
+{
+    var file = args.file;
+    var size = args.size;
+    var bs = client.engine.cache_block_size;
+    var stream_min = client.engine.stream_read_min;
+    var cases = [
+        [0, 1],
+        [0, 4096],
+        [511, 1025],
+        [bs - 100, 200],
+        [bs * 3 + 7, bs * 2 + 13],
+        [size - 4096, 4096],
+        [size - 1, 1],
+    ];
+
+    /* streamed reads, with other reads queued behind them */
+    if (stream_min) {
+        cases.push([4097, stream_min * 2 + 1001]);
+        cases.push([bs * 5, 4096]);
+        cases.push([size - stream_min, stream_min]);
+    }
+
+    var zero_case = -1;
+
+    /* a run of zeroes, for holes in structured replies */
+    for (var off = 0; off + PATTERN_CHUNK < size; off += PATTERN_CHUNK) {
+        if (file.is_zero(off)) {
+            zero_case = cases.length;
+            cases.push([Math.max(off - 5000, 0), PATTERN_CHUNK + 10000]);
+            break;
+        }
+    }
+
+    var reqs = cases.map(function(c) {
+        return {
+            type: NBD_CMD_READ,
+            offset: c[0],
+            length: Math.min(c[1], size - c[0]),
+            check: true,
+        };
+    });
+    var first = reqs;
+    await client.run(reqs);
+
+    for (var i = 0; i < reqs.length; i++) {
+        var req = reqs[i];
+        var want = await expected_data(file, req.offset, req.length);
+        client.check("read " + req.length + " bytes at " + req.offset,
+                !req.error && req.received == req.length &&
+                same(req.data, want),
+                req.error ? "error " + req.error : "data mismatch");
+    }
+
+    /* the same reads again, now that they're cached */
+    var again = cases.map(function(c) {
+        return {
+            type: NBD_CMD_READ,
+            offset: c[0],
+            length: Math.min(c[1], size - c[0]),
+            check: true,
+        };
+    });
+    await client.run(again);
+    client.check("cached reads match", again.every(function(req, i) {
+        return !req.error && same(req.data, reqs[i].data);
+    }));
+
+    var errs = [
+        ["read past the end", NBD_CMD_READ, size - 10, 20],
+        ["read beyond 2^53", NBD_CMD_READ, 2**53, 4096],
+        ["write to read-only export", NBD_CMD_WRITE, 0, 4096],
+        ["trim of read-only export", NBD_CMD_TRIM, 0, 4096],
+        ["flush of read-only export", NBD_CMD_FLUSH, 0, 0],
+        ["unknown command", 0x77, 0, 0],
+    ];
+    reqs = errs.map(function(e) {
+        return { type: e[1], offset: e[2], length: e[3] };
+    });
+    await client.run(reqs);
+    for (var i = 0; i < errs.length; i++)
+        client.check(errs[i][0] + " fails", reqs[i].error,
+                "no error");
+
+    if (zero_case >= 0 && client.conn.client.structured)
+        client.check("zeroes sent as holes",
+                first[zero_case].holes >= PATTERN_CHUNK - NBD_HOLE_SIZE);
+}
+
+/* a misrouted reply leaves its request waiting forever */
+function within(ms, promise)
+{
+    var timer;
+    var timeout = new Promise(function(resolve, reject) {
+        timer = setTimeout(reject, ms, new Error("timed out"));
+    });
+    return Promise.race([promise, timeout]).finally(function() {
+        clearTimeout(timer);
+    });
+}
+
+function connect(engine, args, conn)
+{
+    var client = new Client(engine, args, conn);
+    conn.ws.peer = client;
+    conn.ws.onopen();
+    return client;
+}
+
+/* An engine with several websockets opens the others with its first
+ * request, and answers each request on the connection it came in on */
+async function several_websockets(client, args)
+{
+    var engine = new NBDEngine('ws://bench', args.file);
+    for (var opt in args.options)
+        engine[opt] = args.options[opt];
+    engine.websockets = 3;
+    engine.start();
+
+    var clients = [connect(engine, args, engine.conns[0])];
+    await clients[0].negotiate(false);
+    await clients[0].run([{ type: NBD_CMD_READ, offset: 0, length: 4096 }]);
+    client.check("extra websockets opened", engine.conns.length == 3,
+            engine.conns.length + " connections");
+    if (engine.conns.length != 3) {
+        engine.stop();
+        return;
+    }
+
+    for (var i = 1; i < engine.conns.length; i++) {
+        clients.push(connect(engine, args, engine.conns[i]));
+        await clients[i].negotiate(false);
+    }
+
+    /* handles are unique across the session, as nbd-proxy's are, so a
+     * reply on the wrong connection is for an unknown handle */
+    var stream_len = engine.stream_read_min || 65536;
+    var runs = clients.map(function(c, i) {
+        c.next_handle = 1000 * (i + 1);
+        return c.run([
+            { type: NBD_CMD_READ, offset: 4096 * i, length: 8192,
+                check: true },
+            { type: NBD_CMD_READ, offset: stream_len * i,
+                length: stream_len + 4096 * i, check: true },
+        ]);
+    });
+
+    var matched = true;
+    try {
+        var done = await within(10000, Promise.all(runs));
+        for (var i = 0; i < done.length; i++) {
+            for (var j = 0; j < done[i].length; j++) {
+                var req = done[i][j];
+                var want = await expected_data(args.file, req.offset,
+                        req.length);
+                if (req.error || !same(req.data, want))
+                    matched = false;
+            }
+        }
+    } catch (e) {
+        matched = false;
+    }
+    client.check("reads on each websocket match the file", matched);
+
+    /* losing an extra connection leaves the session running on the rest */
+    var lost = engine.conns[2];
+    lost.ws.onclose({});
+    client.check("closed websocket dropped",
+            engine.conns.length == 2 && !engine.conns.includes(lost));
+
+    var last = await within(10000, clients[1].run([{ type: NBD_CMD_READ,
+            offset: 0, length: 4096, check: true }])).catch(function() {
+        return [{ error: -1 }];
+    });
+    client.check("remaining websockets still answer", !last[0].error &&
+            same(last[0].data, await expected_data(args.file, 0, 4096)));
+
+    var conns = engine.conns.concat([lost]);
+    engine.stop();
+    client.check("stop closes every websocket", conns.every(function(c) {
+        return c.ws.closed;
+    }));
+}
+
+/* A sink object that keeps its data in memory, like the 'memory' sink, but
+ * takes a while over each write, so that writes queue up behind it */
+function SlowSink(size)
+{
+    this.memory = new NBDMemorySink(size);
+    this.busy = 0;
+    this.flushes = 0;
+    this.flushed_busy = 0;
+
+    this.write = function(offset, chunks)
+    {
+        this.busy++;
+        return new Promise(function(resolve) {
+            setTimeout(resolve, 2);
+        }).then((function() {
+            this.busy--;
+            return this.memory.write(offset, chunks);
+        }).bind(this));
+    }
+
+    this.read = function(offset, len)
+    {
+        return this.memory.read(offset, len);
+    }
+
+    this.flush = function()
+    {
+        this.flushes++;
+        this.flushed_busy += this.busy;
+        return Promise.resolve();
+    }
+
+    this.finish = function()
+    {
+        return this.memory.finish();
+    }
+}
+
+/* A File System Access file handle, holding data. As with the real API,
+ * writes go to a copy, which only replaces the data once it's closed. */
+function FakeFileHandle(data)
+{
+    this.data = data;
+
+    this.getFile = function()
+    {
+        return Promise.resolve(new Blob([this.data]));
+    }
+
+    this.createWritable = function(options)
+    {
+        var handle = this;
+        var swap = new Uint8Array(WRITE_EXPORT_SIZE);
+
+        if (options && options.keepExistingData)
+            swap.set(this.data);
+
+        return Promise.resolve({
+            write: async function(cmd) {
+                var data = new Uint8Array(await cmd.data.arrayBuffer());
+                swap.set(data, cmd.position);
+            },
+            close: function() {
+                handle.data = swap;
+                return Promise.resolve();
+            },
+        });
+    }
+}
+
+/* file handle contents: random data, ending short of the export */
+function make_handle(seed)
+{
+    var rand = new Rand(seed);
+    var data = new Uint8Array(WRITE_EXPORT_SIZE - 50000);
+
+    for (var i = 0; i < data.length; i++)
+        data[i] = rand.next() & 0xff;
+    return new FakeFileHandle(data);
+}
+
+/* Writes to an export with a sink: write payloads split across websocket
+ * messages, reads of the written data, flushes, and the sink's result once
+ * the client disconnects */
+async function writable_export(client, args, sink)
+{
+    var name = sink == 'memory' ? "memory sink" :
+        sink instanceof FakeFileHandle ? "file handle sink" : "sink object";
+    var engine = new NBDEngine('ws://bench', null);
+    engine.sink = sink;
+    engine.export_size = WRITE_EXPORT_SIZE;
+    engine.start();
+
+    var c = connect(engine, args, engine.conns[0]);
+    await c.negotiate(false);
+
+    /* a file handle's old data shows through where nothing is written */
+    var image = new Uint8Array(WRITE_EXPORT_SIZE);
+    if (sink instanceof FakeFileHandle)
+        image.set(sink.data);
+    var rand = new Rand(0x77726974);
+    var writes = [
+        [0, 100000],
+        [100000, 300000],
+        [PATTERN_CHUNK + 123, 5000],
+        [WRITE_EXPORT_SIZE - 70000, 70000],
+    ];
+    var reqs = writes.map(function(w) {
+        var payload = new Uint8Array(w[1]);
+        for (var i = 0; i < payload.length; i++)
+            payload[i] = rand.next() & 0xff;
+        image.set(payload, w[0]);
+        return { type: NBD_CMD_WRITE, offset: w[0], length: w[1],
+            payload: payload };
+    });
+
+    /* reads sent straight behind the writes must see them */
+    var reads = [
+        [0, 400000],
+        [PATTERN_CHUNK, 8192],
+        [WRITE_EXPORT_SIZE - 100000, 100000],
+    ];
+    reads.forEach(function(r) {
+        reqs.push({ type: NBD_CMD_READ, offset: r[0], length: r[1],
+            check: true });
+    });
+
+    var done = await within(10000, c.run(reqs, 7777)).catch(function() {
+        return null;
+    });
+    client.check(name + ": writes split across messages succeed",
+            done && reqs.slice(0, writes.length).every(function(req) {
+                return !req.error;
+            }));
+    client.check(name + ": reads see the written data",
+            done && reqs.slice(writes.length).every(function(req) {
+                return !req.error && same(req.data,
+                        image.subarray(req.offset, req.offset + req.length));
+            }));
+
+    var flush = [{ type: NBD_CMD_FLUSH, offset: 0, length: 0 }];
+    done = await within(10000, c.run(flush)).catch(function() {
+        return null;
+    });
+    client.check(name + ": flush succeeds", done && !flush[0].error &&
+            (!(sink instanceof SlowSink) ||
+             (sink.flushes == 1 && !sink.flushed_busy)));
+
+    var result = await within(10000, new Promise(function(resolve) {
+        engine.onsinkdone = resolve;
+        c.submit([{ type: NBD_CMD_DISC, offset: 0, length: 0 }]);
+    })).catch(function() {
+        return null;
+    });
+
+    if (sink instanceof FakeFileHandle) {
+        client.check(name + ": file holds the writes on disconnect",
+                result === null && same(sink.data, image));
+        return;
+    }
+
+    var matched = result && result.size == WRITE_EXPORT_SIZE;
+    for (var i = 0; matched && i < result.pages.length; i++) {
+        var off = i * result.page_size;
+        var want = image.subarray(off, off + result.page_size);
+        if (result.pages[i])
+            matched = same(new Uint8Array(result.pages[i]), want);
+        else
+            matched = want.every(function(b) { return !b; });
+    }
+    client.check(name + ": sink result on disconnect holds the writes",
+            matched);
+}
+
+/* An engine won't start with a sink it can't read back from */
+function sink_without_read(client)
+{
+    var logged = [];
+    var engine = new NBDEngine('ws://bench', null);
+    engine.sink = {
+        write: function() { return Promise.resolve(); },
+    };
+    engine.export_size = WRITE_EXPORT_SIZE;
+    engine.onlog = function(msg) { logged.push(msg); };
+    engine.start();
+
+    client.check("sink without read() refused",
+            !engine.conns.length && logged.length == 1,
+            engine.conns.length + " connections");
+    engine.stop();
+}
+
+/* Once a file handle sink has dropped a written page from its overlay,
+ * reads of it fail, rather than return the file's old data */
+async function file_handle_overlay(client, args)
+{
+    var handle = make_handle(0x6f766c79);
+    var old = handle.data.slice();
+    var engine = new NBDEngine('ws://bench', null);
+    engine.sink = handle;
+    engine.export_size = WRITE_EXPORT_SIZE;
+    engine.sink_overlay_size = PATTERN_CHUNK;
+    engine.onlog = function() {};
+    engine.start();
+
+    var c = connect(engine, args, engine.conns[0]);
+    await c.negotiate(false);
+
+    var payload = new Uint8Array(PATTERN_CHUNK).fill(0x5a);
+    var write = function(offset, length) {
+        return { type: NBD_CMD_WRITE, offset: offset, length: length,
+            payload: payload.subarray(0, length) };
+    };
+    var read = function(offset) {
+        return { type: NBD_CMD_READ, offset: offset, length: 8192,
+            check: true };
+    };
+
+    /* reads wait for all queued writes, so each step is a run of its own */
+    var runs = [
+        [write(100, 5000), write(2 * PATTERN_CHUNK, PATTERN_CHUNK)],
+        [read(0), read(PATTERN_CHUNK), read(2 * PATTERN_CHUNK)],
+        [write(0, PATTERN_CHUNK)],
+        [read(0), read(2 * PATTERN_CHUNK)],
+    ];
+    var done = true;
+    for (var i = 0; done && i < runs.length; i++)
+        done = await within(10000, c.run(runs[i])).catch(function() {
+            return null;
+        });
+
+    var written = payload.subarray(0, 8192);
+    var reads = done && runs[1].concat(runs[3]);
+    client.check("file handle sink: reads of dropped pages fail",
+            done && reads[0].error == EIO && reads[4].error == EIO);
+    client.check("file handle sink: other reads see the writes",
+            done && !reads[1].error && !reads[2].error && !reads[3].error &&
+            same(reads[1].data,
+                    old.subarray(PATTERN_CHUNK, PATTERN_CHUNK + 8192)) &&
+            same(reads[2].data, written) && same(reads[3].data, written));
+    engine.stop();
+}
+
+function percentile(sorted, p)
+{
+    if (!sorted.length)
+        return 0;
+    return sorted[Math.min(sorted.length - 1,
+            Math.floor(sorted.length * p / 100))];
+}
+
+function benchmark(client, args)
+{
+    var rand = new Rand(args.random ? 0x2545f491 : 1);
+    var latencies = new Float64Array(args.reads);
+    var n_sent = 0, n_done = 0, bytes = 0, errors = 0, bad = 0;
+    var seq_offset = 0;
+    var pending = false;
+
+    args.verify_list = [];
+
+    function next_request()
+    {
+        var len = args.read_sizes[n_sent % args.read_sizes.length];
+        var blocks = Math.floor((args.size - len) / STAMP_SIZE) + 1;
+        var offset;
+
+        if (args.random) {
+            offset = (rand.next() % blocks) * STAMP_SIZE;
+        } else {
+            if (seq_offset + len > args.size)
+                seq_offset = 0;
+            offset = seq_offset;
+            seq_offset += Math.ceil(len / STAMP_SIZE) * STAMP_SIZE;
+        }
+
+        n_sent++;
+        return { type: NBD_CMD_READ, offset: offset, length: len };
+    }
+
+    return new Promise(function(resolve, reject) {
+        /* top up to the queue depth from a macrotask, as a websocket
+         * message would arrive, rather than recursing from within the
+         * engine's send */
+        function refill()
+        {
+            pending = false;
+            var batch = [];
+            while (n_sent < args.reads && n_sent - n_done < args.depth)
+                batch.push(next_request());
+            if (batch.length)
+                client.submit(batch);
+        }
+
+        function done(req)
+        {
+            latencies[n_done++] = performance.now() - req.t_sent;
+            bytes += req.received;
+            if (req.error)
+                errors++;
+            if (req.bad_stamp !== undefined || req.received != req.length)
+                bad++;
+            if (args.verify && !req.error)
+                args.verify_list.push(req);
+
+            if (n_done == args.reads) {
+                resolve({
+                    latencies: latencies,
+                    bytes: bytes,
+                    errors: errors,
+                    bad: bad,
+                });
+                return;
+            }
+
+            if (!pending) {
+                pending = true;
+                setImmediate(refill);
+            }
+        }
+
+        client.on_reply = function() {
+            try {
+                client.parse_replies(done);
+            } catch (e) {
+                reject(e);
+            }
+        };
+
+        refill();
+    });
+}
+
+function gc_profile()
+{
+    if (!v8.GCProfiler)
+        return null;
+    var profiler = new v8.GCProfiler();
+    profiler.start();
+    return profiler;
+}
+
+/* Bytes allocated on the JS heap over a run: the heap's growth, plus what
+ * each collection freed. ArrayBuffer contents live outside the heap, so
+ * they only count here through their wrapper objects. */
+function gc_summary(profile, heap_before, heap_after)
+{
+    var allocated = heap_after - heap_before;
+    var gc_us = 0;
+
+    for (var i = 0; i < profile.statistics.length; i++) {
+        var st = profile.statistics[i];
+        allocated += st.beforeGC.heapStatistics.usedHeapSize -
+            st.afterGC.heapStatistics.usedHeapSize;
+        gc_us += st.cost;
+    }
+
+    return {
+        count: profile.statistics.length,
+        ms: gc_us / 1000,
+        allocated: allocated,
+    };
+}
+
+async function main()
+{
+    var args = parse_args(process.argv.slice(2));
+    args.file = make_file(args.size, args.zeroes);
+
+    var engine = new NBDEngine('ws://bench', args.file);
+    for (var opt in args.options)
+        engine[opt] = args.options[opt];
+    engine.start();
+
+    var client = connect(engine, args, engine.conns[0]);
+    await client.negotiate(args.check);
+    if (args.check) {
+        await conformance(client, args);
+        await several_websockets(client, args);
+        await writable_export(client, args, 'memory');
+        await writable_export(client, args, new SlowSink(WRITE_EXPORT_SIZE));
+        await writable_export(client, args, make_handle(0x66696c65));
+        sink_without_read(client);
+        await file_handle_overlay(client, args);
+    }
+
+    if (global.gc)
+        global.gc();
+
+    var stats_before = engine.cache_stats();
+    var stream_reads = args.read_sizes.some(function(n) {
+        return engine.stream_read_min && n >= engine.stream_read_min;
+    });
+    var msgs_before = FakeWebSocket.sent_messages;
+    var heap_before = process.memoryUsage().heapUsed;
+    var profiler = gc_profile();
+    var t_start = performance.now();
+    var cpu_start = process.cpuUsage();
+
+    var res = await benchmark(client, args);
+
+    var secs = (performance.now() - t_start) / 1000;
+    var cpu = process.cpuUsage(cpu_start);
+    var profile = profiler ? profiler.stop() : null;
+    var heap_after = process.memoryUsage().heapUsed;
+    var stats = engine.cache_stats();
+
+    if (args.verify) {
+        var mismatched = 0;
+        for (var i = 0; i < args.verify_list.length; i++) {
+            var req = args.verify_list[i];
+            var want = await expected_data(args.file, req.offset,
+                    req.length);
+            if (!same(req.data, want))
+                mismatched++;
+        }
+        client.check("benchmark reads match the file", !mismatched,
+                mismatched + " reads differ");
+    }
+    client.check("benchmark reads complete, without errors",
+            !res.errors && !res.bad,
+            res.errors + " errors, " + res.bad + " bad replies");
+
+    var sorted = res.latencies.sort();
+    var mb = res.bytes / 1e6;
+
+    console.log("");
+    console.log("reads:       " + args.reads + " of " +
+            args.read_sizes.join("/") + " bytes, depth " + args.depth +
+            ", " + (args.random ? "random" : "sequential") + ", " +
+            (client.conn.client.structured ? "structured" : "simple") +
+            " replies");
+    console.log("throughput:  " + (mb / secs).toFixed(1) + " MB/s, " +
+            (args.reads / secs).toFixed(0) + " IOPS");
+    console.log("latency ms:  p50 " + percentile(sorted, 50).toFixed(3) +
+            ", p90 " + percentile(sorted, 90).toFixed(3) +
+            ", p99 " + percentile(sorted, 99).toFixed(3) +
+            ", max " + sorted[sorted.length - 1].toFixed(3));
+    console.log("cpu:         " +
+            ((cpu.user + cpu.system) / 1000 / mb).toFixed(3) + " ms/MB");
+    console.log("messages:    " +
+            ((FakeWebSocket.sent_messages - msgs_before) /
+             args.reads).toFixed(2) + " sends per read");
+    console.log("cache:       " + (stats.hits - stats_before.hits) +
+            " hits, " + (stats.shared - stats_before.shared) +
+            " shared, " + (stats.misses - stats_before.misses) +
+            " misses");
+    if (stream_reads)
+        console.log("streamed:    " + (stats.streamed - stats_before.streamed) +
+                " reads");
+
+    if (profile) {
+        var gc = gc_summary(profile, heap_before, heap_after);
+        console.log("heap:        " + (gc.allocated / 1e6).toFixed(1) +
+                " MB allocated, " +
+                (gc.allocated / args.reads).toFixed(0) + " bytes per read");
+        console.log("gc:          " + gc.count + " collections, " +
+                gc.ms.toFixed(1) + " ms (" +
+                (gc.ms / 10 / secs).toFixed(1) + "% of run time)");
+    } else {
+        console.log("heap:        unavailable (needs v8.GCProfiler)");
+    }
+
+    var disc = { type: NBD_CMD_DISC, offset: 0, length: 0 };
+    client.submit([disc]);
+    client.check("disconnect stops the engine",
+            engine.state == NBD_STATE_UNKNOWN && engine.conns[0].ws.closed);
+
+    if (client.failures) {
+        console.log(client.failures + " checks failed");
+        process.exit(1);
+    }
+}
+
+main().catch(function(e) {
+    console.error(e);
+    process.exit(1);
+});
@@ -0,0 +1,1267 @@
+/* Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License.  You may obtain a copy
+ * of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/* Data path benchmark for nbd-proxy, without a kernel nbd device or browser.
+ *
+ * The proxy core runs on the main thread, with the same epoll loop as a real
+ * session. In place of the kernel, client threads send NBD requests on
+ * socketpairs, as the netlink setup would pass to the kernel. In place of
+ * nbd.js on the websocket, a server thread on a pair of pipes answers them
+ * the way nbd.js does for a read-only export. All of nbd-proxy's functions
+ * are static, so we include the source directly, and rename its main().
+ *
+ * Rather than a synthetic load, the clients can also replay a trace recorded
+ * by nbd-proxy, with each request sent on its original connection, at its
+ * original time or faster.
+ *
+ * With more than one server stream, the session is striped over that many
+ * pipe pairs, each with its own server thread.
+ *
+ * The server can also answer reads with structured replies, sending some
+ * blocks of zeroes as holes, and frame its stream as a websocket client
+ * would; the proxy can run with its read cache and readahead. Every byte of
+ * read data can then be checked, so that these paths are covered as well
+ * as measured.
+ */
+#define main nbd_proxy_main
+#include "nbd-proxy.c"
+#undef main
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#define BENCH_MAX_CONNS NBD_MAX_CONNS
+#define BENCH_EXPORT_SIZE (1ull << 30)
+#define BENCH_BLOCK_SIZE 0x1000
+
+/* A request from a trace, with its time relative to the first request */
+struct bench_req
+{
+    uint64_t t_submit;
+    uint64_t offset;
+    uint32_t len;
+    uint16_t type;
+};
+
+struct bench_params
+{
+    uint32_t size;
+    int depth;
+    int conns;
+    int streams;
+    int write_pct;
+    bool random;
+    bool fixed;
+    bool verify;
+    bool websocket;
+    /* structured replies, with this percentage of blocks sent as holes, or
+     * -1 for simple replies */
+    int holes;
+    size_t cache_size;
+    size_t ra_window;
+    uint64_t extent;
+    uint64_t n_reqs;
+    uint64_t export_size;
+    uint16_t export_flags;
+    /* replay: each connection's requests from the trace, and the factor to
+     * speed them up by, or 0 to send them as fast as the depth allows */
+    bool replay;
+    struct bench_req* reqs[BENCH_MAX_CONNS];
+    uint64_t n_conn_reqs[BENCH_MAX_CONNS];
+    double speed;
+    uint64_t t_start;
+};
+
+struct bench_client
+{
+    struct bench_params* params;
+    pthread_barrier_t* done_barrier;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t sender;
+    pthread_t receiver;
+    int id;
+    int fd;
+    struct bench_req* reqs;
+    uint64_t n_reqs;
+    uint64_t sent;
+    uint64_t done;
+    uint64_t bytes;
+    uint64_t* t_sent;
+    uint32_t* lat_us;
+    uint64_t t_end;
+    bool failed;
+};
+
+struct bench_server
+{
+    pthread_t thread;
+    int in_fd;
+    int out_fd;
+    uint32_t max_len;
+    bool read_only;
+    /* fill in all of each read's data, not just its first word */
+    bool fill;
+    bool websocket;
+    int holes;
+    /* what's left of the proxy's current websocket frame */
+    uint64_t ws_left;
+};
+
+struct bench_result
+{
+    uint64_t bytes;
+    uint64_t reqs;
+    uint64_t wall_us;
+    uint64_t cpu_us;
+    uint32_t p50_us;
+    uint32_t p99_us;
+    uint64_t cache_hits;
+    uint64_t ra_hits;
+    struct tuning tune;
+};
+
+static uint8_t bench_payload[NBD_ZERO_BUF_SIZE];
+
+/* a cheap mix, so that each side can work out a request's parameters from
+ * its sequence number alone */
+static uint64_t bench_hash(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+/* Is the block at @pos one of the export's zero blocks? */
+static bool bench_zero(uint64_t pos, int holes)
+{
+    return holes > 0 &&
+           (int)(bench_hash(pos / BENCH_BLOCK_SIZE ^ 0x686f6c6573ull) % 100) <
+               holes;
+}
+
+/* The export's data: each 8-byte word holds its own offset, apart from the
+ * zero blocks */
+static void bench_fill(uint8_t* buf, uint64_t offset, uint32_t len, int holes)
+{
+    uint64_t pos, next, end = offset + len, word, lo, hi;
+    uint8_t w[8];
+
+    for (pos = offset; pos < end; pos = next)
+    {
+        next = (pos / BENCH_BLOCK_SIZE + 1) * BENCH_BLOCK_SIZE;
+        if (next > end)
+            next = end;
+
+        if (bench_zero(pos, holes))
+        {
+            memset(buf + (pos - offset), 0, next - pos);
+            continue;
+        }
+
+        for (word = pos & ~7ull; word < next; word += 8)
+        {
+            lo = word < pos ? pos : word;
+            hi = word + 8 < next ? word + 8 : next;
+            if (lo == word && hi == word + 8)
+            {
+                put_be64(buf + (word - offset), word);
+                continue;
+            }
+            put_be64(w, word);
+            memcpy(buf + (lo - offset), w + (lo - word), hi - lo);
+        }
+    }
+}
+
+static uint64_t bench_req_offset(struct bench_client* client, uint64_t seq)
+{
+    struct bench_params* p = client->params;
+    uint64_t blocks = p->extent / p->size;
+    uint64_t idx = seq * p->conns + client->id;
+
+    if (client->reqs)
+        return client->reqs[seq].offset;
+
+    if (p->random)
+        idx = bench_hash(idx);
+
+    return (idx % blocks) * p->size;
+}
+
+static uint16_t bench_req_type(struct bench_client* client, uint64_t seq)
+{
+    uint64_t h = bench_hash(~(seq * BENCH_MAX_CONNS + client->id));
+
+    if (client->reqs)
+        return client->reqs[seq].type;
+
+    return (int)(h % 100) < client->params->write_pct ? NBD_CMD_WRITE
+                                                      : NBD_CMD_READ;
+}
+
+static uint32_t bench_req_len(struct bench_client* client, uint64_t seq)
+{
+    return client->reqs ? client->reqs[seq].len : client->params->size;
+}
+
+static uint64_t bench_handle(struct bench_client* client, uint64_t seq)
+{
+    return (uint64_t)client->id << 48 | seq;
+}
+
+static int read_full(int fd, void* buf, size_t len)
+{
+    uint8_t* p = buf;
+    ssize_t rc;
+
+    while (len)
+    {
+        rc = read(fd, p, len);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        p += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+/* Read from the proxy's stream, taking its websocket frames apart if we're
+ * standing in for a websocket client */
+static int bench_server_read(struct bench_server* server, void* buf,
+                             size_t len)
+{
+    uint8_t hdr[8], op, *p = buf;
+    size_t n;
+
+    if (!server->websocket)
+        return read_full(server->in_fd, buf, len);
+
+    while (len)
+    {
+        if (!server->ws_left)
+        {
+            /* the proxy's frames are never masked */
+            if (read_full(server->in_fd, hdr, 2))
+                return -1;
+            op = hdr[0] & 0xf;
+            n = hdr[1] & 0x7f;
+            if (n == 126 && !read_full(server->in_fd, hdr + 2, 2))
+                n = get_be16(hdr + 2);
+            else if (n == 127 && !read_full(server->in_fd, hdr, 8))
+                n = get_be64(hdr);
+            else if (n >= 126)
+                return -1;
+
+            if (op != WS_OP_BINARY && op != WS_OP_CONT)
+                return -1;
+            server->ws_left = n;
+            continue;
+        }
+
+        n = len < server->ws_left ? len : server->ws_left;
+        if (read_full(server->in_fd, p, n))
+            return -1;
+        server->ws_left -= n;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Send a reply from @iov[1] onwards; @iov[0] is for a websocket frame
+ * header. Our frames are masked, as a client's must be, with a key of
+ * zero, so that the data goes out as it is. */
+static int bench_server_write(struct bench_server* server, struct iovec* iov,
+                              int n_iov)
+{
+    uint8_t hdr[WS_HDR_MAX];
+    uint64_t len = 0;
+    size_t hdr_len;
+    ssize_t rc;
+    int i, n;
+
+    if (server->websocket)
+    {
+        for (i = 1; i <= n_iov; i++)
+            len += iov[i].iov_len;
+        hdr_len = ws_frame_hdr(hdr, WS_OP_BINARY, len);
+        hdr[1] |= WS_MASK;
+        memset(hdr + hdr_len, 0, 4);
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = hdr_len + 4;
+        n_iov++;
+    }
+    else
+    {
+        iov++;
+    }
+
+    /* as writev_all(), but without a warning once the proxy has gone, with
+     * replies to its readahead still on their way */
+    for (i = 0; i < n_iov;)
+    {
+        n = n_iov - i < IOV_MAX ? n_iov - i : IOV_MAX;
+        rc = writev(server->out_fd, iov + i, n);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+
+        for (; i < n_iov && (size_t)rc >= iov[i].iov_len; i++)
+            rc -= iov[i].iov_len;
+        if (i < n_iov)
+        {
+            iov[i].iov_base = (uint8_t*)iov[i].iov_base + rc;
+            iov[i].iov_len -= rc;
+        }
+    }
+
+    return 0;
+}
+
+/* Build the chunks of a structured read reply in @iov, as nbd.js does: a
+ * hole for each run of zero blocks, and data for the rest. Returns the
+ * number of iovecs used. */
+static int bench_server_chunks(struct bench_server* server, const uint8_t* req,
+                               uint8_t* data, uint8_t* hdrs, struct iovec* iov)
+{
+    uint64_t offset = get_be64(req + 16), pos, next, end;
+    uint32_t len = get_be32(req + 24);
+    uint8_t* hdr;
+    bool zero;
+    int n = 0;
+
+    end = offset + len;
+    for (pos = offset; pos < end || !n; pos = next)
+    {
+        zero = bench_zero(pos, server->holes);
+        for (next = pos; next < end && bench_zero(next, server->holes) == zero;)
+        {
+            next = (next / BENCH_BLOCK_SIZE + 1) * BENCH_BLOCK_SIZE;
+            if (next > end)
+                next = end;
+        }
+
+        hdr = hdrs;
+        hdrs += NBD_STRUCTURED_REPLY_SIZE + NBD_CHUNK_HOLE_SIZE;
+        put_be32(hdr, NBD_STRUCTURED_REPLY_MAGIC);
+        put_be16(hdr + 4, next == end ? NBD_REPLY_FLAG_DONE : 0);
+        memcpy(hdr + 8, req + 8, 8);
+        iov[n].iov_base = hdr;
+
+        if (!len)
+        {
+            put_be16(hdr + 6, NBD_REPLY_TYPE_NONE);
+            put_be32(hdr + 16, 0);
+            iov[n++].iov_len = NBD_STRUCTURED_REPLY_SIZE;
+        }
+        else if (zero)
+        {
+            put_be16(hdr + 6, NBD_REPLY_TYPE_OFFSET_HOLE);
+            put_be32(hdr + 16, NBD_CHUNK_HOLE_SIZE);
+            put_be64(hdr + 20, pos);
+            put_be32(hdr + 28, next - pos);
+            iov[n++].iov_len = NBD_STRUCTURED_REPLY_SIZE + NBD_CHUNK_HOLE_SIZE;
+        }
+        else
+        {
+            put_be16(hdr + 6, NBD_REPLY_TYPE_OFFSET_DATA);
+            put_be32(hdr + 16, NBD_CHUNK_DATA_SIZE + (next - pos));
+            put_be64(hdr + 20, pos);
+            iov[n++].iov_len = NBD_STRUCTURED_REPLY_SIZE + NBD_CHUNK_DATA_SIZE;
+            iov[n].iov_base = data + (pos - offset);
+            iov[n++].iov_len = next - pos;
+        }
+    }
+
+    return n;
+}
+
+/* Server stand-in: answers reads with the export's data, as bench_fill()
+ * gives it, so the client can check that replies are routed correctly. As
+ * with nbd.js's read-only export, writes are consumed and then refused,
+ * unless a replayed trace was of a writable export. */
+static void* bench_server_thread(void* arg)
+{
+    struct bench_server* server = arg;
+    uint8_t req[NBD_REQUEST_SIZE], rep[NBD_REPLY_SIZE];
+    uint8_t *data = NULL, *hdrs = NULL;
+    struct iovec* iov = NULL;
+    uint32_t len, err, max_len = 0, max_chunks;
+    uint64_t offset;
+    uint16_t cmd;
+    int n_iov;
+
+    while (!bench_server_read(server, req, sizeof(req)))
+    {
+        cmd = get_be16(req + 6);
+        offset = get_be64(req + 16);
+        len = get_be32(req + 24);
+        err = 0;
+
+        if (cmd == NBD_CMD_DISC)
+            break;
+
+        /* the proxy's own reads, for its cache and readahead, can be
+         * larger than the client's */
+        if (len > max_len || !data)
+        {
+            max_len = len > server->max_len ? len : server->max_len;
+            max_chunks = max_len / BENCH_BLOCK_SIZE + 2;
+            free(data);
+            free(hdrs);
+            free(iov);
+            data = calloc(1, max_len);
+            hdrs = malloc(max_chunks * (NBD_STRUCTURED_REPLY_SIZE +
+                                        NBD_CHUNK_HOLE_SIZE));
+            iov = malloc((2 * max_chunks + 1) * sizeof(*iov));
+            if (!data || !hdrs || !iov)
+                break;
+        }
+
+        if (cmd == NBD_CMD_WRITE)
+        {
+            if (bench_server_read(server, data, len))
+                break;
+            err = server->read_only ? EPERM : 0;
+            len = 0;
+        }
+        else if (cmd != NBD_CMD_READ)
+        {
+            len = 0;
+        }
+
+        if (cmd == NBD_CMD_READ)
+            bench_fill(data, offset, server->fill || len < 8 ? len : 8,
+                       server->holes);
+
+        if (cmd == NBD_CMD_READ && server->holes >= 0)
+        {
+            n_iov = bench_server_chunks(server, req, data, hdrs, iov + 1);
+        }
+        else
+        {
+            put_be32(rep, NBD_REPLY_MAGIC);
+            put_be32(rep + 4, err);
+            memcpy(rep + 8, req + 8, 8);
+
+            iov[1].iov_base = rep;
+            iov[1].iov_len = sizeof(rep);
+            iov[2].iov_base = data;
+            iov[2].iov_len = len;
+            n_iov = len ? 2 : 1;
+        }
+
+        if (bench_server_write(server, iov, n_iov))
+            break;
+    }
+
+    free(data);
+    free(hdrs);
+    free(iov);
+    return NULL;
+}
+
+/* Wait until a replayed request is due */
+static void bench_req_wait(struct bench_client* client, uint64_t seq)
+{
+    struct bench_params* p = client->params;
+    struct timespec ts;
+    uint64_t t;
+
+    if (!client->reqs || !p->speed)
+        return;
+
+    t = p->t_start + (uint64_t)(client->reqs[seq].t_submit / p->speed);
+    ts.tv_sec = t / 1000000;
+    ts.tv_nsec = (t % 1000000) * 1000;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* Kernel stand-in, sending side: keeps up to params->depth requests in
+ * flight on this connection */
+static void* bench_sender_thread(void* arg)
+{
+    struct bench_client* client = arg;
+    struct bench_params* p = client->params;
+    uint8_t req[NBD_REQUEST_SIZE];
+    struct iovec iov[2];
+    uint16_t type;
+    uint64_t seq;
+
+    for (seq = 0; seq < client->n_reqs; seq++)
+    {
+        bench_req_wait(client, seq);
+
+        pthread_mutex_lock(&client->lock);
+        while (client->sent - client->done >= (uint64_t)p->depth &&
+               !client->failed)
+            pthread_cond_wait(&client->cond, &client->lock);
+        client->t_sent[seq] = now_us();
+        client->sent++;
+        pthread_mutex_unlock(&client->lock);
+
+        if (client->failed)
+            break;
+
+        type = bench_req_type(client, seq);
+
+        put_be32(req, NBD_REQUEST_MAGIC);
+        put_be16(req + 4, 0);
+        put_be16(req + 6, type);
+        put_be64(req + 8, bench_handle(client, seq));
+        put_be64(req + 16, bench_req_offset(client, seq));
+        put_be32(req + 24, bench_req_len(client, seq));
+
+        iov[0].iov_base = req;
+        iov[0].iov_len = sizeof(req);
+        iov[1].iov_base = bench_payload;
+        iov[1].iov_len = bench_req_len(client, seq);
+
+        if (writev_all(client->fd, iov, type == NBD_CMD_WRITE ? 2 : 1))
+        {
+            warn("client %d: request write failed", client->id);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void* bench_receiver_thread(void* arg)
+{
+    struct bench_client* client = arg;
+    struct bench_params* p = client->params;
+    uint8_t rep[NBD_REPLY_SIZE];
+    uint64_t handle, seq, t;
+    uint8_t *data, *expect;
+    uint16_t type;
+    uint32_t len;
+
+    data = malloc(p->size);
+    expect = malloc(p->size);
+    if (!data || !expect)
+        goto out;
+
+    while (client->done < client->n_reqs)
+    {
+        if (read_full(client->fd, rep, sizeof(rep)))
+        {
+            warnx("client %d: connection closed", client->id);
+            goto out;
+        }
+
+        handle = get_be64(rep + 8);
+        seq = handle & 0xffffffffffffull;
+        if (get_be32(rep) != NBD_REPLY_MAGIC ||
+            handle >> 48 != (uint64_t)client->id || seq >= client->n_reqs)
+        {
+            warnx("client %d: unexpected reply", client->id);
+            goto out;
+        }
+
+        type = bench_req_type(client, seq);
+        len = bench_req_len(client, seq);
+
+        /* writes may be refused, but we still count them as completed */
+        if (!get_be32(rep + 4) && type == NBD_CMD_READ && len)
+        {
+            if (read_full(client->fd, data, len))
+                goto out;
+
+            /* unless we're verifying everything, just check the first word,
+             * which is enough to catch misrouted replies */
+            if (!p->verify && len > 8)
+                len = 8;
+            bench_fill(expect, bench_req_offset(client, seq), len, p->holes);
+            if (memcmp(data, expect, len))
+            {
+                warnx("client %d: bad data for request %" PRIu64, client->id,
+                      seq);
+                goto out;
+            }
+            len = bench_req_len(client, seq);
+        }
+
+        t = now_us();
+        client->lat_us[seq] = t - client->t_sent[seq];
+        if (type == NBD_CMD_READ || type == NBD_CMD_WRITE)
+            client->bytes += len;
+
+        pthread_mutex_lock(&client->lock);
+        client->done++;
+        pthread_cond_signal(&client->cond);
+        pthread_mutex_unlock(&client->lock);
+    }
+
+    client->t_end = now_us();
+    free(data);
+    free(expect);
+
+    /* the proxy stops when any connection closes, so wait for the rest */
+    pthread_barrier_wait(client->done_barrier);
+    shutdown(client->fd, SHUT_WR);
+    return NULL;
+
+out:
+    free(data);
+    free(expect);
+    pthread_mutex_lock(&client->lock);
+    client->failed = true;
+    pthread_cond_signal(&client->cond);
+    pthread_mutex_unlock(&client->lock);
+    pthread_barrier_wait(client->done_barrier);
+    shutdown(client->fd, SHUT_WR);
+    return NULL;
+}
+
+static int cmp_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int bench_req_cmp(const void* a, const void* b)
+{
+    const struct bench_req *x = a, *y = b;
+
+    return x->t_submit < y->t_submit ? -1 : x->t_submit > y->t_submit;
+}
+
+static uint64_t thread_cpu_us(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_THREAD, &ru);
+
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* Run the proxy's epoll loop on this thread until a connection closes */
+static int bench_proxy(struct ctx* ctx)
+{
+    struct epoll_event events[2 + BENCH_MAX_CONNS];
+    bool exit = false;
+    int epfd, i, n, rc;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        return -1;
+
+    rc = proxy_epoll_add(ctx, epfd, 0);
+
+    while (!rc && !exit)
+    {
+        rc = pump(ctx);
+        if (rc <= 0)
+            break;
+
+        n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+        if (n < 0)
+        {
+            rc = errno == EINTR ? 0 : -1;
+            continue;
+        }
+
+        for (i = 0, rc = 0; i < n && !rc; i++)
+            rc = proxy_event(ctx, events[i].data.u32, events[i].events,
+                             &exit);
+    }
+
+    close(epfd);
+    return rc < 0 ? -1 : 0;
+}
+
+static int bench_run(struct bench_params* p, bool use_splice,
+                     struct bench_result* res)
+{
+    struct bench_client clients[BENCH_MAX_CONNS];
+    struct bench_server servers[NBD_MAX_STREAMS];
+    pthread_barrier_t barrier;
+    struct config config;
+    int up[2], down[2], sv[2], rsv[2];
+    uint64_t t_start, t_end, cpu, n_reqs;
+    struct ctx _ctx, *ctx;
+    uint32_t* lat;
+    int i, rc;
+
+    ctx = &_ctx;
+    memset(ctx, 0, sizeof(*ctx));
+    memset(&config, 0, sizeof(config));
+    memset(clients, 0, sizeof(clients));
+    memset(res, 0, sizeof(*res));
+
+    config.name = "bench";
+    config.connections = p->conns;
+    config.streams = p->streams;
+    config.cache_size = p->cache_size;
+    config.cache_block_size = cache_block_size_default;
+    config.ra_seg_size = ra_seg_size_default;
+    config.ra_window_min = ra_seg_size_default;
+    config.ra_window_max = p->ra_window;
+    if (!p->fixed)
+    {
+        config.pipe_size_max = pipe_size_max_default;
+        config.sock_buf_max = sock_buf_max_default;
+        config.chunk_max = chunk_max_default;
+    }
+    ctx->config = &config;
+    ctx->bufsize = bufsize;
+    ctx->stats_sock = -1;
+    ctx->resume.sock = ctx->resume.peer = -1;
+    ctx->no_splice = !use_splice;
+    ctx->n_conns = p->conns;
+    ctx->nbd_export_flags = p->export_flags;
+    ctx->nbd_export_size = p->export_size;
+    ctx->nbd_structured = p->holes >= 0;
+
+    if (session_init(ctx))
+    {
+        warn("can't allocate session");
+        return -1;
+    }
+
+    if (pipe2(up, O_CLOEXEC) || pipe2(down, O_CLOEXEC))
+        err(EXIT_FAILURE, "can't create pipes");
+
+    /* the proxy's side of each pipe is non-blocking, the server's isn't */
+    ctx->req_out.fd = up[1];
+    ctx->rep_in.fd = down[0];
+    ctx->rep_parser.state = NBD_PARSE_REPLY;
+    servers[0].in_fd = up[0];
+    servers[0].out_fd = down[1];
+
+    /* the websocket upgrade is taken as done */
+    if (p->websocket && !(ctx->ws = calloc(1, sizeof(*ctx->ws))))
+        err(EXIT_FAILURE, "can't allocate websocket");
+
+    /* the extra streams are taken as already negotiated */
+    for (i = 1; i < p->streams; i++)
+    {
+        if (pipe2(sv, O_CLOEXEC) || pipe2(rsv, O_CLOEXEC))
+            err(EXIT_FAILURE, "can't create pipes");
+        if (!stripe_init(ctx, rsv[0], sv[1]))
+            err(EXIT_FAILURE, "can't allocate server stream");
+        if (p->websocket &&
+            !(ctx->striping.stripes[i - 1].ws = calloc(1, sizeof(struct ws))))
+            err(EXIT_FAILURE, "can't allocate websocket");
+        ctx->striping.n++;
+        servers[i].in_fd = sv[0];
+        servers[i].out_fd = rsv[1];
+    }
+
+    for (i = 0; i < p->conns; i++)
+    {
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv))
+            err(EXIT_FAILURE, "can't create socketpair");
+        ctx->conns[i].fd = sv[0];
+        ctx->conns[i].parser.state = NBD_PARSE_REQUEST;
+        clients[i].fd = sv[1];
+    }
+
+    run_proxy_init(ctx);
+    pthread_barrier_init(&barrier, NULL, p->conns);
+
+    t_start = now_us();
+    cpu = thread_cpu_us();
+    p->t_start = t_start;
+    n_reqs = 0;
+
+    for (i = 0; i < p->streams; i++)
+    {
+        servers[i].max_len = p->size;
+        servers[i].read_only = p->export_flags & NBD_FLAG_READ_ONLY;
+        servers[i].fill = p->verify || p->cache_size || p->ra_window;
+        servers[i].websocket = p->websocket;
+        servers[i].holes = p->holes;
+        pthread_create(&servers[i].thread, NULL, bench_server_thread,
+                       &servers[i]);
+    }
+
+    for (i = 0; i < p->conns; i++)
+    {
+        struct bench_client* client = &clients[i];
+
+        client->params = p;
+        client->done_barrier = &barrier;
+        client->id = i;
+        client->reqs = p->reqs[i];
+        client->n_reqs = p->replay ? p->n_conn_reqs[i] : p->n_reqs;
+        n_reqs += client->n_reqs;
+        client->t_sent = calloc(client->n_reqs + 1, sizeof(*client->t_sent));
+        client->lat_us = calloc(client->n_reqs + 1, sizeof(*client->lat_us));
+        if (!client->t_sent || !client->lat_us)
+            err(EXIT_FAILURE, "can't allocate latency buffers");
+        pthread_mutex_init(&client->lock, NULL);
+        pthread_cond_init(&client->cond, NULL);
+        pthread_create(&client->sender, NULL, bench_sender_thread, client);
+        pthread_create(&client->receiver, NULL, bench_receiver_thread,
+                       client);
+    }
+
+    rc = bench_proxy(ctx);
+    cpu = thread_cpu_us() - cpu;
+    res->tune = ctx->tune;
+    res->cache_hits = ctx->cache.hits;
+    res->ra_hits = ctx->ra.hits;
+
+    /* closing the proxy's ends stops the servers and any stuck clients */
+    ws_free(ctx);
+    close(up[1]);
+    close(down[0]);
+    stripes_close(ctx);
+    for (i = 0; i < p->conns; i++)
+        shutdown(ctx->conns[i].fd, SHUT_RDWR);
+
+    t_end = t_start;
+    lat = malloc((n_reqs + 1) * sizeof(*lat));
+    if (!lat)
+        err(EXIT_FAILURE, "can't allocate latency buffer");
+
+    for (i = 0; i < p->conns; i++)
+    {
+        struct bench_client* client = &clients[i];
+
+        pthread_join(client->sender, NULL);
+        pthread_join(client->receiver, NULL);
+        if (client->failed)
+            rc = -1;
+        if (client->t_end > t_end)
+            t_end = client->t_end;
+
+        memcpy(lat + res->reqs, client->lat_us,
+               client->done * sizeof(*lat));
+        res->reqs += client->done;
+        res->bytes += client->bytes;
+        free(client->t_sent);
+        free(client->lat_us);
+        pthread_mutex_destroy(&client->lock);
+        pthread_cond_destroy(&client->cond);
+        close(client->fd);
+    }
+
+    for (i = 0; i < p->streams; i++)
+    {
+        pthread_join(servers[i].thread, NULL);
+        close(servers[i].in_fd);
+        close(servers[i].out_fd);
+    }
+    pthread_barrier_destroy(&barrier);
+
+    for (i = 0; i < p->conns; i++)
+        close(ctx->conns[i].fd);
+    session_free(ctx);
+
+    res->wall_us = t_end - t_start;
+    res->cpu_us = cpu;
+
+    if (res->reqs)
+    {
+        qsort(lat, res->reqs, sizeof(*lat), cmp_u32);
+        res->p50_us = lat[(res->reqs - 1) * 50 / 100];
+        res->p99_us = lat[(res->reqs - 1) * 99 / 100];
+    }
+    free(lat);
+
+    return rc;
+}
+
+/* Load a trace recorded by nbd-proxy, as each connection's requests in
+ * order of submission. The latencies recorded for them go to @rec, to
+ * compare with the replay. */
+static int bench_trace_load(const char* path, struct bench_params* p,
+                            struct bench_result* rec)
+{
+    const struct trace_header* hdr;
+    const struct trace_entry* e;
+    uint64_t i, n, t_first, t_last;
+    struct bench_req* req;
+    struct stat st;
+    uint32_t len, *lat;
+    uint8_t* map;
+    int fd, c;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st))
+    {
+        warn("can't open trace %s", path);
+        return -1;
+    }
+
+    if ((size_t)st.st_size < sizeof(*hdr))
+    {
+        warnx("trace %s is too short", path);
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        warn("can't map trace %s", path);
+        return -1;
+    }
+
+    hdr = (const struct trace_header*)map;
+    if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) ||
+        le32toh(hdr->version) != TRACE_VERSION ||
+        le32toh(hdr->entry_size) != sizeof(*e))
+    {
+        warnx("%s isn't a trace this version can read", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    p->replay = true;
+    p->export_size = le64toh(hdr->export_size);
+    p->export_flags = le16toh(hdr->export_flags) | NBD_FLAG_HAS_FLAGS;
+    p->conns = le16toh(hdr->connections);
+    if (p->conns < 1 || p->conns > BENCH_MAX_CONNS)
+        p->conns = 1;
+
+    e = (const struct trace_entry*)(map + sizeof(*hdr));
+    n = (st.st_size - sizeof(*hdr)) / sizeof(*e);
+
+    for (c = 0; c < p->conns; c++)
+    {
+        p->reqs[c] = calloc(n + 1, sizeof(*p->reqs[c]));
+        if (!p->reqs[c])
+            err(EXIT_FAILURE, "can't allocate trace");
+    }
+
+    lat = malloc((n + 1) * sizeof(*lat));
+    if (!lat)
+        err(EXIT_FAILURE, "can't allocate trace");
+
+    rec->reqs = 0;
+    rec->bytes = 0;
+    p->size = 8;
+    t_first = UINT64_MAX;
+    t_last = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (le64toh(e[i].t_submit) < t_first)
+            t_first = le64toh(e[i].t_submit);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        len = le32toh(e[i].len);
+        if (le16toh(e[i].type) == NBD_CMD_DISC)
+            continue;
+        if (len > sizeof(bench_payload))
+        {
+            warnx("trace request of %" PRIu32 " bytes is too large", len);
+            free(lat);
+            munmap(map, st.st_size);
+            return -1;
+        }
+
+        c = e[i].conn < p->conns ? e[i].conn : e[i].conn % p->conns;
+        req = &p->reqs[c][p->n_conn_reqs[c]++];
+        req->t_submit = le64toh(e[i].t_submit) - t_first;
+        req->offset = le64toh(e[i].offset);
+        req->len = len;
+        req->type = le16toh(e[i].type);
+
+        if (len > p->size)
+            p->size = len;
+        if (le64toh(e[i].t_complete) > t_last)
+            t_last = le64toh(e[i].t_complete);
+        if (req->type == NBD_CMD_READ || req->type == NBD_CMD_WRITE)
+            rec->bytes += len;
+        lat[rec->reqs++] = le64toh(e[i].t_complete) - le64toh(e[i].t_submit);
+    }
+
+    /* records are in order of completion; send in order of submission */
+    for (c = 0; c < p->conns; c++)
+        qsort(p->reqs[c], p->n_conn_reqs[c], sizeof(*p->reqs[c]),
+              bench_req_cmp);
+
+    if (rec->reqs)
+    {
+        qsort(lat, rec->reqs, sizeof(*lat), cmp_u32);
+        rec->p50_us = lat[(rec->reqs - 1) * 50 / 100];
+        rec->p99_us = lat[(rec->reqs - 1) * 99 / 100];
+    }
+    rec->wall_us = t_last > t_first ? t_last - t_first : 0;
+
+    free(lat);
+    munmap(map, st.st_size);
+    return 0;
+}
+
+static void bench_report(const char* mode, struct bench_result* res)
+{
+    double mb = res->bytes / 1e6, secs = res->wall_us / 1e6;
+
+    if (!res->wall_us || !res->bytes)
+    {
+        printf("%-8s  no data\n", mode);
+        return;
+    }
+
+    printf("%-8s %10.1f %10.0f %10" PRIu32 " %10" PRIu32 " %12.3f\n", mode,
+           mb / secs, res->reqs / secs, res->p50_us, res->p99_us,
+           res->cpu_us / 1000.0 / mb);
+    printf("%-8s pipes %zu/%zu, socket buffer %zu, chunk %zu\n", "",
+           res->tune.pipe_in, res->tune.pipe_out, res->tune.sock_buf,
+           res->tune.chunk);
+    if (res->cache_hits || res->ra_hits)
+        printf("%-8s cache hits %" PRIu64 ", readahead hits %" PRIu64 "\n",
+               "", res->cache_hits, res->ra_hits);
+}
+
+static void usage(const char* progname)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -s, --size=<bytes>     request size (default 65536)\n"
+            "  -q, --depth=<n>        requests in flight per connection "
+            "(default 16)\n"
+            "  -c, --connections=<n>  number of kernel connections "
+            "(default 1)\n"
+            "  -S, --streams=<n>      number of server streams to stripe "
+            "over\n"
+            "                         (default 1)\n"
+            "  -w, --writes=<pct>     percentage of write requests "
+            "(default 0)\n"
+            "  -r, --random           random offsets, rather than "
+            "sequential\n"
+            "  -e, --extent=<bytes>   only use the start of the export "
+            "(default 1 GiB)\n"
+            "  -b, --bytes=<bytes>    total data per run (default 1 GiB)\n"
+            "  -m, --mode=<mode>      splice, rw or both (default both)\n"
+            "  -f, --fixed            don't tune pipe, buffer and chunk "
+            "sizes\n"
+            "  -t, --trace=<file>     replay a trace recorded by nbd-proxy, "
+            "rather\n"
+            "                         than a synthetic load\n"
+            "  -x, --speed=<factor>   replay the trace this many times faster,"
+            "\n"
+            "                         or 0 for as fast as possible (default "
+            "1)\n"
+            "  -z, --holes=<pct>      send structured replies, with this "
+            "percentage\n"
+            "                         of blocks as holes\n"
+            "  -W, --websocket        frame the server streams as "
+            "websockets\n"
+            "  -C, --cache=<bytes>    size of the proxy's read cache\n"
+            "  -a, --readahead=<bytes>\n"
+            "                         the proxy's largest readahead window\n"
+            "  -v, --verify           check all of the data read, not just "
+            "its\n"
+            "                         first word\n",
+            progname);
+}
+
+int main(int argc, char** argv)
+{
+    static const struct option options[] = {
+        {"size", required_argument, 0, 's'},
+        {"depth", required_argument, 0, 'q'},
+        {"connections", required_argument, 0, 'c'},
+        {"streams", required_argument, 0, 'S'},
+        {"writes", required_argument, 0, 'w'},
+        {"random", no_argument, 0, 'r'},
+        {"bytes", required_argument, 0, 'b'},
+        {"mode", required_argument, 0, 'm'},
+        {"fixed", no_argument, 0, 'f'},
+        {"trace", required_argument, 0, 't'},
+        {"speed", required_argument, 0, 'x'},
+        {"extent", required_argument, 0, 'e'},
+        {"holes", required_argument, 0, 'z'},
+        {"websocket", no_argument, 0, 'W'},
+        {"cache", required_argument, 0, 'C'},
+        {"readahead", required_argument, 0, 'a'},
+        {"verify", no_argument, 0, 'v'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0},
+    };
+    struct bench_params params = {
+        .size = 65536,
+        .depth = 0,
+        .conns = 1,
+        .streams = 1,
+        .holes = -1,
+        .extent = BENCH_EXPORT_SIZE,
+        .export_size = BENCH_EXPORT_SIZE,
+        .export_flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY |
+                        NBD_FLAG_CAN_MULTI_CONN,
+        .speed = 1,
+    };
+    uint64_t total = 1ull << 30;
+    bool do_splice = true, do_rw = true;
+    struct bench_result res, rec = {0};
+    const char* trace = NULL;
+    char* endp;
+    int c, rc = 0;
+
+    while ((c = getopt_long(argc, argv, "s:q:c:S:w:rb:m:ft:x:e:z:WC:a:vh", options,
+                            NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 's':
+                params.size = strtoul(optarg, NULL, 0);
+                break;
+            case 'q':
+                params.depth = atoi(optarg);
+                break;
+            case 'c':
+                params.conns = atoi(optarg);
+                break;
+            case 'S':
+                params.streams = atoi(optarg);
+                break;
+            case 'w':
+                params.write_pct = atoi(optarg);
+                break;
+            case 'r':
+                params.random = true;
+                break;
+            case 'b':
+                total = strtoull(optarg, NULL, 0);
+                break;
+            case 'f':
+                params.fixed = true;
+                break;
+            case 't':
+                trace = optarg;
+                break;
+            case 'x':
+                params.speed = strtod(optarg, &endp);
+                if (*endp || params.speed < 0)
+                {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'e':
+                params.extent = strtoull(optarg, NULL, 0);
+                break;
+            case 'z':
+                params.holes = atoi(optarg);
+                break;
+            case 'W':
+                params.websocket = true;
+                break;
+            case 'C':
+                params.cache_size = strtoull(optarg, NULL, 0);
+                break;
+            case 'a':
+                params.ra_window = strtoull(optarg, NULL, 0);
+                break;
+            case 'v':
+                params.verify = true;
+                break;
+            case 'm':
+                do_splice = strcmp(optarg, "rw");
+                do_rw = strcmp(optarg, "splice");
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    /* the kernel keeps up to 128 requests in flight on each connection, so
+     * a trace isn't held back by a lower limit */
+    if (trace && bench_trace_load(trace, &params, &rec))
+        return EXIT_FAILURE;
+    if (!params.depth)
+        params.depth = trace ? 128 : 16;
+
+    if (!params.size || params.size > sizeof(bench_payload) ||
+        params.depth < 1 || params.conns < 1 ||
+        params.conns > BENCH_MAX_CONNS || params.streams < 1 ||
+        params.streams > NBD_MAX_STREAMS || params.write_pct < 0 ||
+        params.write_pct > 100 || params.holes > 100 ||
+        params.extent < params.size || params.extent > BENCH_EXPORT_SIZE ||
+        (params.ra_window && params.ra_window < ra_seg_size_default))
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    params.n_reqs = total / params.size / params.conns;
+    if (!params.n_reqs)
+        params.n_reqs = 1;
+
+    /* a peer closing its end shouldn't kill the benchmark */
+    signal(SIGPIPE, SIG_IGN);
+
+#ifndef HAVE_SPLICE
+    do_splice = false;
+#endif
+
+    if (trace)
+        printf("trace %s, %" PRIu64 " requests, depth %d, connections %d, "
+               "speed %g\n",
+               trace, rec.reqs, params.depth, params.conns, params.speed);
+    else
+        printf("size %" PRIu32 ", depth %d, connections %d, %d%% writes, "
+               "%s\n",
+               params.size, params.depth, params.conns, params.write_pct,
+               params.random ? "random" : "sequential");
+    if (params.streams > 1)
+        printf("striped over %d server streams\n", params.streams);
+    if (params.holes >= 0 || params.websocket)
+        printf("%s replies, %d%% holes%s\n",
+               params.holes >= 0 ? "structured" : "simple",
+               params.holes > 0 ? params.holes : 0,
+               params.websocket ? ", over websockets" : "");
+    if (params.cache_size || params.ra_window)
+        printf("cache %zu, readahead window %zu\n", params.cache_size,
+               params.ra_window);
+    if (params.verify)
+        printf("verifying all read data\n");
+    printf("%-8s %10s %10s %10s %10s %12s\n", "mode", "MB/s", "IOPS",
+           "p50 us", "p99 us", "cpu ms/MB");
+
+    /* the figures seen when the trace was recorded, for comparison */
+    if (trace && rec.wall_us)
+        printf("%-8s %10.1f %10.0f %10" PRIu32 " %10" PRIu32 " %12s\n",
+               "recorded", rec.bytes / 1e6 / (rec.wall_us / 1e6),
+               rec.reqs / (rec.wall_us / 1e6), rec.p50_us, rec.p99_us, "-");
+
+    if (do_splice)
+    {
+        if (bench_run(&params, true, &res))
+            rc = EXIT_FAILURE;
+        bench_report("splice", &res);
+    }
+
+    if (do_rw)
+    {
+        if (bench_run(&params, false, &res))
+            rc = EXIT_FAILURE;
+        bench_report("rw", &res);
+    }
+
+    return rc;
+}
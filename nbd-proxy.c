@@ -19,47 +19,698 @@
 
 #include "config.h"
 
+#include <linux/genetlink.h>
+#include <linux/nbd-netlink.h>
+#include <linux/nbd.h>
+#include <linux/netlink.h>
+
 #include <dirent.h>
+#include <endian.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <json.h>
 #include <libudev.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 #include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+/* Negotiation-phase protocol definitions, not covered by linux/nbd.h */
+#define NBD_MAGIC 0x4e42444d41474943ULL      /* "NBDMAGIC" */
+#define NBD_OPTS_MAGIC 0x49484156454f5054ULL /* "IHAVEOPT" */
+#define NBD_REP_MAGIC 0x0003e889045565a9ULL
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES (1 << 1)
+#define NBD_FLAG_C_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_C_NO_ZEROES (1 << 1)
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_GO 7
+#define NBD_OPT_STRUCTURED_REPLY 8
+#define NBD_REP_ACK 1
+#define NBD_REP_INFO 3
+#define NBD_REP_FLAG_ERROR (1U << 31)
+#define NBD_REP_ERR_UNSUP (NBD_REP_FLAG_ERROR | 1)
+#define NBD_INFO_EXPORT 0
+#define NBD_INFO_BLOCK_SIZE 3
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+#define NBD_REPLY_FLAG_DONE (1 << 0)
+#define NBD_REPLY_TYPE_NONE 0
+#define NBD_REPLY_TYPE_OFFSET_DATA 1
+#define NBD_REPLY_TYPE_OFFSET_HOLE 2
+#define NBD_REPLY_TYPE_ERROR_BIT (1 << 15)
+
+#define NBD_GREETING_SIZE 18
+#define NBD_CFLAGS_SIZE 4
+#define NBD_OPTION_SIZE 16
+#define NBD_OPTION_REPLY_SIZE 20
+#define NBD_EXPORT_INFO_SIZE 10
+#define NBD_EXPORT_INFO_PAD 124
+#define NBD_INFO_EXPORT_SIZE 12
+#define NBD_INFO_BLOCK_SIZE_SIZE 14
+#define NBD_REQUEST_SIZE 28
+#define NBD_REPLY_SIZE 16
+#define NBD_STRUCTURED_REPLY_SIZE 20
+#define NBD_CHUNK_DATA_SIZE 8
+#define NBD_CHUNK_HOLE_SIZE 12
+#define NBD_CHUNK_ERROR_SIZE 6
+#define NBD_HDR_MAX (NBD_STRUCTURED_REPLY_SIZE + NBD_CHUNK_HOLE_SIZE)
+
+/* holes in structured replies are passed on as references to zero_buf, so
+ * a hole in the largest kernel request (32MiB) takes NBD_ZERO_IOV_MAX
+ * iovecs */
+#define NBD_ZERO_BUF_SIZE 0x400000
+#define NBD_ZERO_IOV_MAX 8
+
+/* latency histogram: bucket n counts latencies in [2^n, 2^(n+1)) usec, with
+ * the last bucket collecting everything beyond */
+#define NBD_STATS_HIST_BUCKETS 26
+#define NBD_MAX_CONNS 16
+#define NBD_MAX_STREAMS 8
+
+/* How requests are spread over a striped session's server streams */
+enum stream_policy
+{
+    STREAM_LEAST_LOADED,
+    STREAM_ROUND_ROBIN,
+};
+
 struct config
 {
     char* name;
     bool is_default;
     char* nbd_device;
+    size_t cache_size;
+    size_t cache_block_size;
+    size_t ra_window_min;
+    size_t ra_window_max;
+    size_t ra_seg_size;
+    size_t pipe_size_min;
+    size_t pipe_size_max;
+    size_t sock_buf_min;
+    size_t sock_buf_max;
+    size_t chunk_min;
+    size_t chunk_max;
+    int connections;
+    int resume_timeout;
+    int streams;
+    enum stream_policy stream_policy;
+    char* trace_path;
+    bool trace_hash;
+    uint64_t rate_limit;
+    uint64_t iops_limit;
+    bool bulk;
     struct json_object* metadata;
 };
 
+enum nbd_parse_state
+{
+    NBD_PARSE_GREETING,
+    NBD_PARSE_CFLAGS,
+    NBD_PARSE_OPTION,
+    NBD_PARSE_OPTION_REPLY,
+    NBD_PARSE_OPTION_INFO,
+    NBD_PARSE_EXPORT_INFO,
+    NBD_PARSE_REQUEST,
+    NBD_PARSE_REPLY,
+};
+
+#define OUTQ_MAX_IOV 64
+#define OUTQ_RESERVE_IOV 4
+#define OUTQ_SCRATCH_SIZE 0x1000
+#define BUF_POOL_SIZE 16
+
+/* Output queue for one stream of the proxy. Writes are non-blocking (or
+ * posted to io_uring, in which case the first n_busy entries are in flight),
+ * so data is held here until the fd can take it. Headers, and replies generated by
+ * the proxy, are copied into scratch space; forwarded payload data is
+ * referenced in place in the source's inq, which isn't reused until the
+ * queue has drained. OUTQ_SCRATCH_SIZE bytes and OUTQ_RESERVE_IOV entries
+ * are held back for error replies, which can't be deferred. */
+struct outq
+{
+    int fd;
+    bool ready;
+    bool pending;
+    struct iovec iov[OUTQ_MAX_IOV];
+    int n_iov;
+    int n_busy;
+    uint8_t* scratch;
+    size_t scratch_len;
+    size_t scratch_size;
+    uint64_t write_us;
+    uint64_t stalls;
+};
+
+/* Input buffer for one stream. Data in [start, end) has been read but not
+ * yet parsed. Once everything has been parsed, and anything forwarded from
+ * the buffer has been written out, we start again from the beginning; until
+ * then, we stop reading from the fd when the buffer is full. */
+struct inq
+{
+    int fd;
+    bool ready;
+    bool pending;
+    bool eof;
+    uint8_t* buf;
+    size_t size;
+    size_t start;
+    size_t end;
+};
+
+/* Tracks message boundaries in one direction of the proxied stream. Headers
+ * are accumulated in hdr until complete; payload bytes are just counted off
+ * in skip, so they can be forwarded without inspection. Messages are only
+ * queued to out if the header handler leaves forward set. Request parsers
+ * for each kernel socket share the one outq to the server. */
+struct nbd_parser
+{
+    enum nbd_parse_state state;
+    uint8_t hdr[NBD_HDR_MAX];
+    size_t hdr_len;
+    uint64_t skip;
+    bool forward;
+    bool drop_hdr;
+    struct outq* out;
+    uint64_t bytes;
+};
+
+/* One kernel socket. If the export allows it, the kernel may spread its
+ * requests over several of these; we multiplex them onto the single server
+ * stream, and route each reply back to the socket its request came from. */
+struct nbd_conn
+{
+    int fd;
+    struct inq in;
+    struct outq out;
+    struct nbd_parser parser;
+    /* replies generated by the proxy, held until the server's reply stream
+     * is at a message boundary */
+    uint8_t* reply_pending;
+    size_t reply_pending_len;
+    /* where the payload of the write being received is copied, for replay
+     * if the server stream is lost */
+    uint8_t* write_data;
+    uint32_t write_pos;
+    /* running hash of the write being received, for the trace */
+    uint64_t trace_hash;
+    uint64_t trace_handle;
+};
+
+/* Requests sent to the server carry our own handle, so we can issue requests
+ * of our own, and the kernel can use the same handle on different sockets,
+ * without clashes. client_handle and conn hold the kernel's original handle
+ * and socket, and ra_slot the readahead slot for requests that the proxy
+ * originated (or -1 for kernel requests). If the session can be resumed,
+ * data holds a copy of a write's payload. resumed marks a read for the rest
+ * of a reply that was cut off, whose header the kernel already has. */
+struct nbd_inflight_req
+{
+    uint64_t handle;
+    uint64_t client_handle;
+    int conn;
+    uint64_t offset;
+    uint64_t t_submit;
+    uint32_t len;
+    uint16_t type;
+    uint16_t flags;
+    int ra_slot;
+    int stream;
+    uint8_t* data;
+    uint64_t hash;
+    bool resumed;
+    bool used;
+};
+
+/* A structured reply that's being expanded into a simple reply for the
+ * kernel, which doesn't support structured replies. The simple reply
+ * header goes out with the first data or hole chunk (or with the final
+ * chunk, for errors), then each chunk's data follows, with holes filled
+ * with zeroes. This relies on the server sending a read's chunks in order,
+ * and not interleaving chunks of different replies, as nbd.js does. */
+struct nbd_structured_reply
+{
+    bool active;
+    bool started;
+    struct nbd_inflight_req req;
+    uint64_t pos;
+    uint32_t error;
+};
+
+/* open-addressed table of requests awaiting a reply, keyed by our handle */
+struct nbd_inflight
+{
+    struct nbd_inflight_req* reqs;
+    size_t size;
+    size_t n;
+};
+
+enum nbd_stats_cmd
+{
+    NBD_STATS_READ,
+    NBD_STATS_WRITE,
+    NBD_STATS_DISC,
+    NBD_STATS_FLUSH,
+    NBD_STATS_TRIM,
+    NBD_STATS_OTHER,
+    NBD_STATS_N_CMDS,
+};
+
+struct nbd_cmd_stats
+{
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t errors;
+    uint32_t inflight;
+    uint32_t inflight_max;
+    uint64_t latency_total_us;
+    uint64_t latency_max_us;
+    uint64_t latency_hist[NBD_STATS_HIST_BUCKETS];
+};
+
+#define CACHE_NONE UINT32_MAX
+
+struct cache_block
+{
+    uint64_t blkno;
+    uint32_t hash_next;
+    uint32_t lru_prev;
+    uint32_t lru_next;
+    bool valid;
+};
+
+/* Block cache for read replies, only used for read-only exports. Block data
+ * lives in a single arena allocated at session start; blocks are indexed by
+ * a chained hash, and all blocks (valid or not) are kept on an LRU list, so
+ * the tail is always the next to be reused. */
+struct read_cache
+{
+    uint8_t* arena;
+    size_t block_size;
+    unsigned int block_shift;
+    uint32_t n_blocks;
+    struct cache_block* blocks;
+    uint32_t* buckets;
+    uint32_t bucket_mask;
+    uint32_t lru_head;
+    uint32_t lru_tail;
+    /* the read reply payload currently being received */
+    uint64_t fill_pos;
+    uint64_t fill_start;
+    uint64_t fill_end;
+    uint32_t fill_slot;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t hit_bytes;
+    uint64_t evictions;
+};
+
+enum ra_slot_state
+{
+    RA_EMPTY,
+    RA_INFLIGHT,
+    RA_READY,
+    RA_STALE,
+};
+
+struct ra_slot
+{
+    enum ra_slot_state state;
+    uint64_t offset;
+    uint32_t len;
+    uint32_t filled;
+    uint64_t t_submit;
+};
+
+/* a kernel read covered by readahead requests that are still in flight */
+struct ra_waiter
+{
+    int conn;
+    uint64_t handle;
+    uint64_t offset;
+    uint32_t len;
+    uint64_t t_submit;
+};
+
+#define RA_MAX_WAITERS 64
+#define RA_MAX_IOV 32
+
+/* Sequential readahead. Once the kernel has issued a run of contiguous reads,
+ * we issue our own read requests for the data following it, and stage the
+ * replies in slots of seg_size bytes. The amount of data requested ahead of
+ * the kernel's last read follows the estimated bandwidth-delay product of the
+ * link to the server, within the configured limits. */
+struct readahead
+{
+    uint8_t* ring;
+    size_t seg_size;
+    uint32_t n_slots;
+    struct ra_slot* slots;
+    size_t window_min;
+    size_t window_max;
+    size_t window;
+    bool active;
+    unsigned int seq_count;
+    uint64_t last_end;
+    uint64_t next;
+    uint64_t rtt_us;
+    uint64_t bw;
+    uint64_t last_complete;
+    int cur_slot;
+    struct ra_waiter waiters[RA_MAX_WAITERS];
+    int n_waiters;
+    uint64_t issued;
+    uint64_t issued_bytes;
+    uint64_t hits;
+    uint64_t hit_bytes;
+    uint64_t waits;
+    uint64_t discarded_bytes;
+};
+
+/* Transport sizing. The capacity of the stdio pipes, the send buffers of
+ * our ends of the kernel sockets, and the largest single splice follow the
+ * traffic within the configured limits. Every tune_interval requests, each
+ * is sized to hold an average message in its direction, doubled if its
+ * queue stalled in the meantime. A size is only reduced once it's more
+ * than twice what's needed. The counters are the totals at the last
+ * adjustment. */
+struct tuning
+{
+    size_t pipe_in;
+    size_t pipe_out;
+    size_t sock_buf;
+    size_t chunk;
+    uint64_t requests;
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t writes;
+    uint64_t write_bytes;
+    uint64_t out_stalls;
+    uint64_t conn_stalls;
+    uint64_t changes;
+};
+
+#define WS_OP_CONT 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xa
+#define WS_FIN 0x80
+#define WS_MASK 0x80
+#define WS_CTRL_MAX 125
+#define WS_HDR_MAX 14
+#define WS_REQ_MAX 4096
+#define WS_REQ_LINES 64
+
+/* Websocket state, when we're serving the websocket ourselves rather than
+ * running behind a proxy that gives us the payload on stdio. Frames from
+ * the client are unmasked in place in the input buffer; frames to the
+ * client are written as a header followed by the queued data, so the
+ * payload isn't copied. */
+struct ws
+{
+    /* receive: header of the current frame, and what's left of it */
+    uint8_t rx_hdr[WS_HDR_MAX];
+    size_t rx_hdr_len;
+    uint64_t rx_left;
+    unsigned int rx_mask_off;
+    uint8_t rx_ctrl[WS_CTRL_MAX];
+    size_t rx_ctrl_len;
+    bool close_rcvd;
+
+    /* transmit: header of the current data frame, and a pending control
+     * frame, sent between data frames */
+    uint8_t tx_hdr[WS_HDR_MAX];
+    size_t tx_hdr_len;
+    size_t tx_hdr_off;
+    uint64_t tx_left;
+    uint8_t tx_ctrl[2 + WS_CTRL_MAX];
+    size_t tx_ctrl_len;
+    size_t tx_ctrl_off;
+    bool close_sent;
+};
+
+#ifdef HAVE_LIBURING
+#define URING_ENTRIES 64
+#define URING_RECV_BUFS 32
+#define URING_RECV_BUF_SIZE 0x1000
+#define URING_BGID 0
+
+/* data received into a provided buffer, not yet copied to a socket's inq */
+struct uring_held
+{
+    uint16_t bid;
+    uint32_t off;
+    uint32_t len;
+};
+
+struct uring_conn
+{
+    struct uring_held held[URING_RECV_BUFS];
+    int head;
+    int n;
+    bool armed;
+};
+
+struct uring
+{
+    struct io_uring ring;
+    struct io_uring_buf_ring* buf_ring;
+    uint8_t* recv_bufs;
+    int n_held;
+    struct uring_conn conns[NBD_MAX_CONNS];
+};
+#endif
+
+/* Session resume. If the server stream is lost, we hold on to the kernel's
+ * sockets and its outstanding requests for a grace period, until a new
+ * stream is handed to us, and then send the requests again. A read reply
+ * that was cut off part-way is completed by a read of the rest of its data,
+ * which goes first, alone, so that nothing else reaches that socket before
+ * it. sock is the handoff socket, when running a single session, and peer
+ * the connection that the current stream came through. */
+struct resume
+{
+    int sock;
+    char* sock_path;
+    int peer;
+    bool detached;
+    uint64_t t_detach;
+    uint64_t deadline;
+    bool cont_pending;
+    int cont_conn;
+    uint64_t* replay;
+    size_t n_replay;
+    size_t replay_pos;
+    uint64_t resumes;
+    uint64_t replayed;
+    uint64_t detached_us;
+};
+
+/* An extra server stream, striped with the main one (rep_in and req_out in
+ * struct ctx). peer is the connection that it was handed to us through. */
+struct stripe
+{
+    struct inq in;
+    struct outq out;
+    struct ws* ws;
+    int peer;
+};
+
+/* Striping: a session may have several streams to the server, so that one
+ * stalled connection doesn't hold up every request. Each request goes
+ * whole to one stream, chosen by the configured policy, and the server
+ * answers it on the same stream. Replies from all streams pass through the
+ * one reply parser, a message at a time: owner is the stream that last fed
+ * it, whose message is still in progress if the parser isn't between
+ * messages. Streams are numbered from 0 for the main stream, so stripe n
+ * is stream n + 1. load is each stream's requests and data awaiting a
+ * reply, in bytes. */
+struct striping
+{
+    struct stripe stripes[NBD_MAX_STREAMS - 1];
+    int n;
+    int owner;
+    int next;
+    uint64_t load[NBD_MAX_STREAMS];
+    uint64_t requests[NBD_MAX_STREAMS];
+    uint64_t joins;
+};
+
+/* Request trace file format. A header is followed by one fixed-size record
+ * per completed kernel request, in order of completion, so a trace can be
+ * mapped and read as an array. All fields are little-endian, and times are
+ * in microseconds since t_start. */
+#define TRACE_MAGIC "NBDTRACE"
+#define TRACE_VERSION 1
+
+/* header flags */
+#define TRACE_HDR_HASH (1 << 0)
+
+/* record flags: the hash covers the request's payload; the read was served
+ * by the proxy's read cache or readahead, rather than the server */
+#define TRACE_F_HASH (1 << 0)
+#define TRACE_F_LOCAL (1 << 1)
+
+struct trace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t export_size;
+    uint64_t t_start;
+    uint16_t export_flags;
+    uint16_t connections;
+    uint32_t flags;
+    uint8_t reserved[24];
+};
+
+struct trace_entry
+{
+    uint64_t t_submit;
+    uint64_t t_complete;
+    uint64_t handle;
+    uint64_t offset;
+    uint64_t hash;
+    uint32_t len;
+    uint32_t error;
+    uint16_t type;
+    uint16_t cmd_flags;
+    uint8_t conn;
+    uint8_t flags;
+    uint16_t reserved;
+};
+
+#define TRACE_RING_SIZE 4096
+
+/* A session's trace. Records are queued on a single-producer,
+ * single-consumer ring, and a helper thread appends them to the file, so the
+ * data path never waits for the disk; if the ring fills, records are
+ * dropped and counted. A forwarded reply's record is held in rep until its
+ * payload has passed, so that it can be hashed. */
+struct trace
+{
+    int fd;
+    bool hash;
+    uint64_t t_start;
+    struct trace_entry* ring;
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    atomic_bool stop;
+    uint64_t dropped;
+    uint64_t write_errors;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct nbd_inflight_req rep;
+    uint64_t rep_complete;
+    uint64_t rep_hash;
+    uint32_t rep_error;
+    uint8_t rep_flags;
+    bool rep_pending;
+};
+
+/* Bandwidth shared by the sessions of all nbd-proxy processes, mapped from a
+ * file that each of them opens. tokens is a bucket of bytes, refilled at
+ * rate by whichever session gets to it first; t_refill is when the bucket
+ * was last filled, and t_interactive when an interactive session last
+ * wanted to send a request. Times are CLOCK_MONOTONIC, which all processes
+ * share. */
+#define QOS_MAGIC 0x4e425153 /* "NBQS" */
+#define QOS_VERSION 1
+
+/* Rates are bytes per second, up to a terabyte */
+#define QOS_RATE_MAX 1000000000000ll
+
+struct qos_shared
+{
+    uint32_t magic;
+    uint32_t version;
+    _Atomic uint64_t rate;
+    _Atomic int64_t tokens;
+    _Atomic uint64_t t_refill;
+    _Atomic uint64_t t_interactive;
+};
+
+/* A session's rate limits, and its use of the shared bandwidth. Buckets run
+ * a deficit: a request is admitted while the balance is positive, and its
+ * whole cost is then taken, so large requests aren't starved by small ones.
+ * Bulk sessions leave a reserve in the shared bucket while an interactive
+ * session is active. iops_tokens are in millionths of a request. */
+struct qos
+{
+    bool enabled;
+    int64_t tokens;
+    int64_t iops_tokens;
+    uint64_t t_refill;
+    uint64_t t_refill_iops;
+    bool blocked;
+    uint64_t t_blocked;
+    uint64_t t_wake;
+    uint64_t throttles;
+    uint64_t throttled_us;
+};
+
+enum client_mode
+{
+    CLIENT_AUTO,
+    CLIENT_NETLINK,
+    CLIENT_NBD_CLIENT,
+};
+
+/* Milestones in bringing up a session, in the order they're normally
+ * reached. Some steps overlap, and not every method passes through every
+ * phase. */
+enum setup_phase
+{
+    SETUP_START,
+    SETUP_CONFIG,
+    SETUP_SERVER,
+    SETUP_GREETING,
+    SETUP_MONITOR,
+    SETUP_CLIENT,
+    SETUP_NEGOTIATED,
+    SETUP_CONNECTED,
+    SETUP_READY,
+    SETUP_N_PHASES,
+};
+
 struct ctx
 {
     int sock;
-    int sock_client;
     int signal_pipe[2];
     char* sock_path;
     pid_t nbd_client_pid;
     pid_t state_hook_pid;
+    enum client_mode client_mode;
+    bool nbd_netlink;
+    uint16_t nbd_genl_family;
     int nbd_timeout;
     dev_t nbd_devno;
-    uint8_t* buf;
     size_t bufsize;
     struct config* configs;
     int n_configs;
@@ -67,14 +718,86 @@ struct ctx
     struct config* config;
     struct udev* udev;
     struct udev_monitor* monitor;
+    int stats_sock;
+    char* stats_sock_path;
+    uint32_t nbd_client_flags;
+    uint32_t nbd_pending_opt;
+    uint16_t nbd_export_flags;
+    uint64_t nbd_export_size;
+    uint32_t nbd_block_min;
+    uint32_t nbd_block_pref;
+    uint32_t nbd_block_max;
+    bool nbd_structured;
+    struct nbd_structured_reply sreply;
+    struct nbd_inflight_req rep_req;
+    uint64_t next_handle;
+    int setup_timeout_ms;
+    bool nbd_handshake_started;
+    uint64_t t_phase[SETUP_N_PHASES];
+    bool setup_reported;
+    struct nbd_conn* conns;
+    int n_conns;
+    bool disc_sent;
+    struct inq rep_in;
+    struct outq req_out;
+    struct nbd_parser rep_parser;
+    struct ws* ws;
+    bool no_splice;
+    int epfd;
+    uint32_t ev_base;
+#ifdef HAVE_LIBURING
+    struct uring* uring;
+#endif
+    struct nbd_inflight inflight;
+    struct nbd_cmd_stats stats[NBD_STATS_N_CMDS];
+    struct read_cache cache;
+    struct readahead ra;
+    struct tuning tune;
+    struct resume resume;
+    struct striping striping;
+    struct trace* trace;
+    uint64_t qos_bandwidth;
+    struct qos qos;
 };
 
 static const char* conf_path = SYSCONFDIR "/nbd-proxy/config.json";
 static const char* state_hook_path = SYSCONFDIR "/nbd-proxy/state";
 static const char* sockpath_tmpl = RUNSTATEDIR "/nbd.%d.sock";
+static const char* statssockpath_tmpl = RUNSTATEDIR "/nbd.%d.stats.sock";
+static const char* ctlsockpath = RUNSTATEDIR "/nbd-proxy.sock";
+static const char* resumesockpath_tmpl = RUNSTATEDIR "/nbd.%s.resume.sock";
+static const char* qos_path = RUNSTATEDIR "/nbd-proxy.qos";
 
 static const size_t bufsize = 0x20000;
+static uint8_t zero_buf[NBD_ZERO_BUF_SIZE];
 static const int nbd_timeout_default = 30;
+static const size_t inflight_size_default = 256;
+static const size_t cache_block_size_default = 0x1000;
+static const size_t ra_seg_size_default = 0x20000;
+static const unsigned int ra_seq_threshold = 2;
+static const size_t pipe_size_max_default = 0x100000;
+static const size_t sock_buf_max_default = 0x100000;
+static const size_t chunk_max_default = 0x100000;
+static const size_t tune_size_min = 0x1000;
+static const size_t tune_size_max = 0x4000000;
+static const uint64_t tune_interval = 64;
+static const int ws_handshake_timeout_ms = 30000;
+static const int control_timeout_ms = 1000;
+static const int trace_flush_ms = 100;
+static const uint64_t qos_burst_us = 100000;
+static const uint64_t qos_interactive_us = 500000;
+static const char* ws_guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+static const char* setup_phase_names[SETUP_N_PHASES] = {
+    "start",  "config",     "server",    "greeting", "monitor",
+    "client", "negotiated", "connected", "ready",
+};
+
+static const char* nbd_stats_cmd_names[NBD_STATS_N_CMDS] = {
+    [NBD_STATS_READ] = "read",   [NBD_STATS_WRITE] = "write",
+    [NBD_STATS_DISC] = "disc",   [NBD_STATS_FLUSH] = "flush",
+    [NBD_STATS_TRIM] = "trim",   [NBD_STATS_OTHER] = "other",
+};
 
 static int open_nbd_socket(struct ctx* ctx)
 {
@@ -130,6 +853,73 @@ err_free:
     return -1;
 }
 
+static int open_stats_socket(struct ctx* ctx)
+{
+    struct sockaddr_un addr;
+    char* path;
+    int sd, rc;
+
+    rc = asprintf(&path, statssockpath_tmpl, getpid());
+    if (rc < 0)
+        return -1;
+
+    sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd < 0)
+    {
+        warn("can't create stats socket");
+        goto err_free;
+    }
+
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    rc = bind(sd, (struct sockaddr*)&addr, sizeof(addr));
+    if (rc)
+    {
+        warn("can't bind to path %s", path);
+        goto err_close;
+    }
+
+    /* the statistics show the session's I/O patterns */
+    rc = chmod(path, 0600);
+    if (rc)
+    {
+        warn("can't set permissions on socket %s", path);
+        goto err_unlink;
+    }
+
+    rc = listen(sd, 1);
+    if (rc)
+    {
+        warn("can't listen on socket %s", path);
+        goto err_unlink;
+    }
+
+    ctx->stats_sock = sd;
+    ctx->stats_sock_path = path;
+    return 0;
+
+err_unlink:
+    unlink(path);
+err_close:
+    close(sd);
+err_free:
+    free(path);
+    return -1;
+}
+
+static void close_stats_socket(struct ctx* ctx)
+{
+    if (ctx->stats_sock < 0)
+        return;
+
+    close(ctx->stats_sock);
+    unlink(ctx->stats_sock_path);
+    free(ctx->stats_sock_path);
+    ctx->stats_sock = -1;
+    ctx->stats_sock_path = NULL;
+}
+
 static int start_nbd_client(struct ctx* ctx)
 {
     pid_t pid;
@@ -181,642 +971,7903 @@ static void stop_nbd_client(struct ctx* ctx)
     ctx->nbd_client_pid = 0;
 }
 
-static int copy_fd(struct ctx* ctx, int fd_in, int fd_out)
+static uint64_t now_us(void)
 {
-#ifdef HAVE_SPLICE
-    int rc;
+    struct timespec ts;
 
-    rc = splice(fd_in, NULL, fd_out, NULL, ctx->bufsize, 0);
-    if (rc < 0)
-        warn("splice");
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    return rc;
-#else
-    size_t len, pos;
-    ssize_t rc;
+static uint16_t get_be16(const uint8_t* p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return be16toh(v);
+}
 
-    for (;;)
-    {
-        errno = 0;
-        rc = read(fd_in, ctx->buf, ctx->bufsize);
-        if (rc < 0)
-        {
-            if (errno == EINTR)
-                continue;
-            warn("read failure");
-            return -1;
-        }
-        if (rc == 0)
-            return 0;
-        break;
-    }
+static uint32_t get_be32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return be32toh(v);
+}
 
-    len = rc;
+static uint64_t get_be64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return be64toh(v);
+}
 
-    for (pos = 0; pos < len;)
-    {
-        errno = 0;
-        rc = write(fd_out, ctx->buf + pos, len - pos);
-        if (rc < 0)
-        {
-            if (errno == EINTR)
-                continue;
-            warn("write failure");
-            return -1;
-        }
-        if (rc == 0)
-            break;
-        pos += rc;
-    }
+static void put_be16(uint8_t* p, uint16_t v)
+{
+    v = htobe16(v);
+    memcpy(p, &v, sizeof(v));
+}
 
-    return pos;
-#endif
+static void put_be32(uint8_t* p, uint32_t v)
+{
+    v = htobe32(v);
+    memcpy(p, &v, sizeof(v));
 }
 
-static int signal_pipe_fd = -1;
+static void put_be64(uint8_t* p, uint64_t v)
+{
+    v = htobe64(v);
+    memcpy(p, &v, sizeof(v));
+}
 
-static void signal_handler(int signal)
+/* handles are opaque to us, so no byte-swapping here */
+static uint64_t get_handle(const uint8_t* p)
 {
-    int rc;
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
 
-    rc = write(signal_pipe_fd, &signal, sizeof(signal));
+static size_t inflight_slot(const struct nbd_inflight* inflight,
+                            uint64_t handle)
+{
+    handle ^= handle >> 29;
+    handle *= 0x9e3779b97f4a7c15ULL;
+    return (handle >> 32) & (inflight->size - 1);
+}
 
-    /* not a lot we can do here but exit... */
-    if (rc != sizeof(signal))
-        exit(EXIT_FAILURE);
+static int inflight_init(struct nbd_inflight* inflight, size_t size)
+{
+    inflight->reqs = calloc(size, sizeof(*inflight->reqs));
+    if (!inflight->reqs)
+        return -1;
+    inflight->size = size;
+    inflight->n = 0;
+    return 0;
 }
 
-static int setup_signals(struct ctx* ctx)
+static void inflight_free(struct nbd_inflight* inflight)
 {
-    struct sigaction sa;
-    int rc;
+    free(inflight->reqs);
+    inflight->reqs = NULL;
+    inflight->size = inflight->n = 0;
+}
 
-    rc = pipe2(ctx->signal_pipe, O_CLOEXEC);
-    if (rc)
+static int inflight_add(struct nbd_inflight* inflight,
+                        const struct nbd_inflight_req* req)
+{
+    size_t i, mask;
+
+    /* keep the load factor under 1/2, so probe sequences stay short */
+    if ((inflight->n + 1) * 2 > inflight->size)
     {
-        warn("can't setup signal pipe");
-        return -1;
+        struct nbd_inflight old = *inflight;
+
+        if (inflight_init(inflight, old.size * 2))
+        {
+            *inflight = old;
+            return -1;
+        }
+
+        for (i = 0; i < old.size; i++)
+            if (old.reqs[i].used)
+                inflight_add(inflight, &old.reqs[i]);
+
+        free(old.reqs);
     }
 
-    signal_pipe_fd = ctx->signal_pipe[1];
+    mask = inflight->size - 1;
 
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = signal_handler;
+    for (i = inflight_slot(inflight, req->handle);; i = (i + 1) & mask)
+    {
+        struct nbd_inflight_req* slot = &inflight->reqs[i];
 
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
-    sigaction(SIGCHLD, &sa, NULL);
+        if (!slot->used)
+        {
+            *slot = *req;
+            slot->used = true;
+            inflight->n++;
+            return 0;
+        }
 
-    return 0;
+        if (slot->handle == req->handle)
+            return -1;
+    }
 }
 
-static void cleanup_signals(struct ctx* ctx)
+/* Remove the request for @handle from the table, into @req. Returns -1 if
+ * no such request is in flight */
+static int inflight_take(struct nbd_inflight* inflight, uint64_t handle,
+                         struct nbd_inflight_req* req)
 {
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = SIG_DFL;
-
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
-    sigaction(SIGCHLD, &sa, NULL);
-
-    close(ctx->signal_pipe[0]);
-    close(ctx->signal_pipe[1]);
-}
-
-static void process_sigchld(struct ctx* ctx, bool* exit)
-{
-    int status;
-    pid_t pid;
+    size_t mask = inflight->size - 1;
+    size_t i, j, home;
 
-    for (;;)
+    for (i = inflight_slot(inflight, handle);; i = (i + 1) & mask)
     {
-        pid = waitpid(-1, &status, WNOHANG);
-        if (pid == 0)
+        if (!inflight->reqs[i].used)
+            return -1;
+        if (inflight->reqs[i].handle == handle)
             break;
+    }
 
-        if (pid == ctx->nbd_client_pid)
-        {
-            warnx("nbd client stopped (%s: %d); exiting",
-                  WIFEXITED(status) ? "rc" : "sig",
-                  WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
-            ctx->nbd_client_pid = 0;
-            *exit = true;
-        }
-        else if (pid == ctx->state_hook_pid)
+    *req = inflight->reqs[i];
+    inflight->n--;
+
+    /* backward-shift deletion: move up any entries that would otherwise
+     * become unreachable through the newly-empty slot */
+    for (j = (i + 1) & mask; inflight->reqs[j].used; j = (j + 1) & mask)
+    {
+        home = inflight_slot(inflight, inflight->reqs[j].handle);
+        if (((j - home) & mask) >= ((j - i) & mask))
         {
-            if (!WIFEXITED(status) || WEXITSTATUS(status))
-            {
-                warnx("state hook failed (%s: %d); exiting",
-                      WIFEXITED(status) ? "rc" : "sig",
-                      WIFEXITED(status) ? WEXITSTATUS(status)
-                                        : WTERMSIG(status));
-                *exit = true;
-            }
-            ctx->state_hook_pid = 0;
+            inflight->reqs[i] = inflight->reqs[j];
+            i = j;
         }
     }
+    inflight->reqs[i].used = false;
+
+    return 0;
 }
 
-static int process_signal_pipe(struct ctx* ctx, bool* exit)
+static struct nbd_inflight_req* inflight_find(struct nbd_inflight* inflight,
+                                              uint64_t handle)
 {
-    int buf, rc;
-
-    rc = read(ctx->signal_pipe[0], &buf, sizeof(buf));
-    if (rc != sizeof(buf))
-        return -1;
-
-    *exit = false;
+    size_t mask = inflight->size - 1;
+    size_t i;
 
-    switch (buf)
+    for (i = inflight_slot(inflight, handle);; i = (i + 1) & mask)
     {
-        case SIGCHLD:
-            process_sigchld(ctx, exit);
-            break;
-        case SIGINT:
-        case SIGTERM:
-            *exit = true;
-            break;
+        if (!inflight->reqs[i].used)
+            return NULL;
+        if (inflight->reqs[i].handle == handle)
+            return &inflight->reqs[i];
     }
+}
 
-    return 0;
+static bool resume_enabled(struct ctx* ctx)
+{
+    return ctx->config->resume_timeout > 0;
 }
 
-static int wait_for_nbd_client(struct ctx* ctx)
+/* Can a running session take further server streams, to resume it or to
+ * stripe it over? */
+static bool session_joinable(struct ctx* ctx)
 {
-    struct pollfd pollfds[2];
+    return resume_enabled(ctx) || ctx->config->streams > 1;
+}
 
-    pollfds[0].fd = ctx->sock;
-    pollfds[0].events = POLLIN;
-    pollfds[1].fd = ctx->signal_pipe[0];
-    pollfds[1].events = POLLIN;
+/* Release a request's copy of its write data, once the server has replied */
+static void req_data_free(struct ctx* ctx, struct nbd_inflight_req* req)
+{
+    struct nbd_conn* conn;
 
-    for (;;)
+    if (!req->data)
+        return;
+
+    /* a server replying before it has all the data is broken, but mustn't
+     * leave us copying into freed memory */
+    conn = &ctx->conns[req->conn];
+    if (conn->write_data == req->data)
+        conn->write_data = NULL;
+
+    free(req->data);
+    req->data = NULL;
+}
+
+static int write_all(int fd, const void* buf, size_t len)
+{
+    const uint8_t* p = buf;
+    ssize_t rc;
+
+    while (len)
     {
-        errno = 0;
-        int rc;
-        rc = poll(pollfds, 2, -1);
+        rc = write(fd, p, len);
         if (rc < 0)
         {
             if (errno == EINTR)
                 continue;
-            warn("poll failed");
+            warn("write failure");
             return -1;
         }
+        if (rc == 0)
+            return -1;
+        p += rc;
+        len -= rc;
+    }
 
-        if (pollfds[0].revents)
+    return 0;
+}
+
+static int writev_all(int fd, struct iovec* iov, int n_iov)
+{
+    ssize_t rc;
+
+    while (n_iov)
+    {
+        rc = writev(fd, iov, n_iov);
+        if (rc < 0)
         {
-            rc = accept4(ctx->sock, NULL, NULL, SOCK_CLOEXEC);
-            if (rc < 0)
-            {
-                warn("can't create connection");
-                return -1;
-            }
-            ctx->sock_client = rc;
-            break;
+            if (errno == EINTR)
+                continue;
+            warn("write failure");
+            return -1;
         }
+        if (rc == 0)
+            return -1;
 
-        if (pollfds[1].revents)
+        for (; n_iov && (size_t)rc >= iov->iov_len; iov++, n_iov--)
+            rc -= iov->iov_len;
+        if (n_iov)
         {
-            bool exit;
-            rc = process_signal_pipe(ctx, &exit);
-            if (rc || exit)
-                return -1;
+            iov->iov_base = (uint8_t*)iov->iov_base + rc;
+            iov->iov_len -= rc;
         }
     }
 
     return 0;
 }
 
-static int run_state_hook(struct ctx* ctx, const char* action, bool wait)
+/* In daemon mode, buffers freed at the end of a session are kept for the
+ * next one, rather than going back to the allocator each time. Sessions use
+ * only a few buffer sizes, so we just look for an exact match. */
+static struct
 {
-    int status, rc;
-    pid_t pid;
+    void* bufs[BUF_POOL_SIZE];
+    size_t sizes[BUF_POOL_SIZE];
+    int n;
+    int max;
+} buf_pool;
 
-    /* if the hook isn't present or executable, that's not necessarily
-     * an error condition */
-    if (access(state_hook_path, X_OK))
-        return 0;
+static void* buf_alloc(size_t size)
+{
+    void* buf;
+    int i;
 
-    pid = fork();
-    if (pid < 0)
+    for (i = 0; i < buf_pool.n; i++)
     {
-        warn("can't fork to execute hook %s", state_hook_path);
-        return -1;
+        if (buf_pool.sizes[i] != size)
+            continue;
+
+        buf = buf_pool.bufs[i];
+        buf_pool.n--;
+        buf_pool.bufs[i] = buf_pool.bufs[buf_pool.n];
+        buf_pool.sizes[i] = buf_pool.sizes[buf_pool.n];
+        return buf;
     }
 
-    if (!pid)
-    {
-        const char* argv0;
+    return malloc(size);
+}
 
-        argv0 = strchr(state_hook_path, '/');
-        if (!argv0)
-            argv0 = state_hook_path;
+static void buf_free(void* buf, size_t size)
+{
+    if (buf && buf_pool.n < buf_pool.max)
+    {
+        buf_pool.bufs[buf_pool.n] = buf;
+        buf_pool.sizes[buf_pool.n] = size;
+        buf_pool.n++;
+        return;
+    }
 
-        int fd;
-        fd = open("/dev/null", O_RDWR | O_CLOEXEC);
-        if (fd < 0)
-            exit(EXIT_FAILURE);
+    free(buf);
+}
 
-        dup2(fd, STDIN_FILENO);
-        dup2(fd, STDOUT_FILENO);
-        execl(state_hook_path, argv0, action, ctx->config->name, NULL);
-        exit(EXIT_FAILURE);
-    }
+static void buf_pool_free(void)
+{
+    while (buf_pool.n)
+        free(buf_pool.bufs[--buf_pool.n]);
+    buf_pool.max = 0;
+}
 
-    if (!wait)
-    {
-        ctx->state_hook_pid = pid;
-        return 0;
-    }
+static int outq_init(struct outq* q, size_t scratch_size)
+{
+    q->fd = -1;
+    q->scratch_size = scratch_size;
+    q->scratch = buf_alloc(scratch_size);
+    return q->scratch ? 0 : -1;
+}
 
-    rc = waitpid(pid, &status, 0);
-    if (rc < 0)
-    {
-        warn("wait");
-        return -1;
-    }
+static void outq_free(struct outq* q)
+{
+    buf_free(q->scratch, q->scratch_size);
+    q->scratch = NULL;
+}
 
-    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
-    {
-        warnx("hook %s failed", state_hook_path);
-        return -1;
-    }
+/* Is there space to queue @len bytes (copied, if @copy is set), without
+ * using the reserve? */
+static bool outq_room(const struct outq* q, size_t len, bool copy)
+{
+    if (q->n_iov + OUTQ_RESERVE_IOV >= OUTQ_MAX_IOV)
+        return false;
 
-    return 0;
+    return !copy || q->scratch_len + len + OUTQ_SCRATCH_SIZE <= q->scratch_size;
 }
 
-static int udev_init(struct ctx* ctx)
+/* Queue @len bytes at @buf for output. If @copy is set, the data is copied
+ * to the queue's scratch space, and so may be reused immediately. Callers
+ * check outq_room() first; running out of space here is a bug. */
+static int outq_add(struct outq* q, const void* buf, size_t len, bool copy)
 {
-    int rc;
+    struct iovec* prev;
 
-    ctx->udev = udev_new();
-    if (!ctx->udev)
-    {
-        warn("can't create udev object");
-        return -1;
-    }
+    if (!len)
+        return 0;
 
-    ctx->monitor = udev_monitor_new_from_netlink(ctx->udev, "kernel");
-    if (!ctx->monitor)
+    if (q->n_iov == OUTQ_MAX_IOV ||
+        (copy && q->scratch_len + len > q->scratch_size))
     {
-        warn("can't create udev monitor");
-        goto out_unref_udev;
+        warnx("output queue overflow");
+        return -1;
     }
 
-    rc = udev_monitor_filter_add_match_subsystem_devtype(ctx->monitor, "block",
-                                                         "disk");
-    if (rc)
+    if (copy)
     {
-        warn("can't create udev monitor filter");
-        goto out_unref_monitor;
+        memcpy(q->scratch + q->scratch_len, buf, len);
+        buf = q->scratch + q->scratch_len;
+        q->scratch_len += len;
     }
 
-    rc = udev_monitor_enable_receiving(ctx->monitor);
-    if (rc)
+    prev = q->n_iov > q->n_busy ? &q->iov[q->n_iov - 1] : NULL;
+    if (prev && (uint8_t*)prev->iov_base + prev->iov_len == buf)
     {
-        warn("can't start udev monitor");
-        goto out_unref_monitor;
+        prev->iov_len += len;
+        return 0;
     }
 
+    q->iov[q->n_iov].iov_base = (void*)buf;
+    q->iov[q->n_iov].iov_len = len;
+    q->n_iov++;
     return 0;
-
-out_unref_monitor:
-    udev_monitor_unref(ctx->monitor);
-out_unref_udev:
-    udev_unref(ctx->udev);
-    return -1;
-}
-
-static void udev_free(struct ctx* ctx)
-{
-    udev_monitor_unref(ctx->monitor);
-    udev_unref(ctx->udev);
 }
 
-/* Check for the change event on our nbd device, signifying that the kernel
- * has finished initialising the block device. Once we see the event, we run
- * the "start" state hook, and close the udev monitor.
- *
- * Returns:
- *   0 if no processing was performed
- *  -1 on state hook error (and the nbd session should be closed)
- */
-static int udev_process(struct ctx* ctx)
+/* Drop @len bytes from the head of the queue, once written */
+static void outq_consume(struct outq* q, size_t len)
 {
-    struct udev_device* dev;
-    bool action_is_change;
-    dev_t devno;
-    int rc;
-
-    dev = udev_monitor_receive_device(ctx->monitor);
-    if (!dev)
-        return 0;
-
-    devno = udev_device_get_devnum(dev);
-    action_is_change = !strcmp(udev_device_get_action(dev), "change");
-    udev_device_unref(dev);
-
-    if (devno != ctx->nbd_devno)
-        return 0;
+    int i;
 
-    if (!action_is_change)
-        return 0;
+    for (i = 0; i < q->n_iov && len >= q->iov[i].iov_len; i++)
+        len -= q->iov[i].iov_len;
 
-    udev_monitor_unref(ctx->monitor);
-    udev_unref(ctx->udev);
-    ctx->monitor = NULL;
-    ctx->udev = NULL;
+    if (i < q->n_iov)
+    {
+        q->iov[i].iov_base = (uint8_t*)q->iov[i].iov_base + len;
+        q->iov[i].iov_len -= len;
+    }
 
-    rc = run_state_hook(ctx, "start", false);
+    q->n_iov -= i;
+    memmove(q->iov, q->iov + i, q->n_iov * sizeof(*q->iov));
 
-    return rc;
+    if (!q->n_iov)
+        q->scratch_len = 0;
 }
 
-static int run_proxy(struct ctx* ctx)
+/* Write queued data until the queue is empty or the fd would block. Sets
+ * @progress if anything was written. */
+static int outq_write(struct outq* q, bool* progress)
 {
-    struct pollfd pollfds[4];
-    bool exit = false;
-    int rc, n_fd;
+    uint64_t start;
+    ssize_t rc;
 
-    /* main proxy: forward data between stdio & socket */
-    pollfds[0].fd = ctx->sock_client;
-    pollfds[0].events = POLLIN;
-    pollfds[1].fd = STDIN_FILENO;
-    pollfds[1].events = POLLIN;
-    pollfds[2].fd = ctx->signal_pipe[0];
-    pollfds[2].events = POLLIN;
-    pollfds[3].fd = udev_monitor_get_fd(ctx->monitor);
-    pollfds[3].events = POLLIN;
+    if (!q->n_iov || !q->ready)
+        return 0;
 
-    n_fd = 4;
+    start = now_us();
 
-    for (;;)
+    while (q->n_iov)
     {
-        errno = 0;
-        rc = poll(pollfds, n_fd, -1);
+        rc = writev(q->fd, q->iov, q->n_iov);
         if (rc < 0)
         {
             if (errno == EINTR)
                 continue;
-            warn("poll failed");
-            break;
+            if (errno == EAGAIN)
+            {
+                q->ready = false;
+                q->stalls++;
+                break;
+            }
+            warn("write failure");
+            return -1;
         }
 
-        if (pollfds[0].revents)
-        {
-            rc = copy_fd(ctx, ctx->sock_client, STDOUT_FILENO);
-            if (rc <= 0)
-                break;
+        outq_consume(q, rc);
+        *progress = true;
+    }
+
+    q->write_us += now_us() - start;
+    return 0;
+}
+
+/* Send a message generated by the proxy. If nothing is queued ahead of it,
+ * we write it straight out, so only whatever the fd won't take is copied
+ * to the queue. */
+static int outq_send(struct outq* q, const struct iovec* iov, int n_iov)
+{
+    size_t done = 0, n;
+    ssize_t rc;
+    int i;
+
+    while (!q->n_iov && q->ready)
+    {
+        rc = writev(q->fd, iov, n_iov);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+            {
+                warn("write failure");
+                return -1;
+            }
+            q->ready = false;
+            q->stalls++;
+            break;
         }
+        done = rc;
+        break;
+    }
 
-        if (pollfds[1].revents)
+    for (i = 0; i < n_iov; i++)
+    {
+        n = done < iov[i].iov_len ? done : iov[i].iov_len;
+        done -= n;
+        if (outq_add(q, (const uint8_t*)iov[i].iov_base + n,
+                     iov[i].iov_len - n, true))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int inq_init(struct inq* in, size_t size)
+{
+    in->fd = -1;
+    in->size = size;
+    in->buf = buf_alloc(size);
+    return in->buf ? 0 : -1;
+}
+
+static void inq_free(struct inq* in)
+{
+    buf_free(in->buf, in->size);
+    in->buf = NULL;
+}
+
+/* Read into the free space at the end of the buffer. Returns the number of
+ * bytes read, 0 if the fd would block (or we're at end of stream), or -1 on
+ * failure. */
+static ssize_t inq_read(struct inq* in)
+{
+    ssize_t rc;
+
+    for (;;)
+    {
+        rc = read(in->fd, in->buf + in->end, in->size - in->end);
+        if (rc > 0)
+            break;
+        /* a reset connection is just as finished */
+        if (rc == 0 || errno == ECONNRESET)
         {
-            rc = copy_fd(ctx, STDIN_FILENO, ctx->sock_client);
-            if (rc <= 0)
-                break;
+            rc = 0;
+            in->eof = true;
+            in->ready = false;
+            break;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN)
+        {
+            in->ready = false;
+            return 0;
         }
+        warn("read failure");
+        return -1;
+    }
+
+    in->end += rc;
+    return rc;
+}
+
+/* Build a websocket frame header in @hdr, returning its length. We're the
+ * server, so our frames aren't masked. */
+static size_t ws_frame_hdr(uint8_t* hdr, uint8_t op, uint64_t len)
+{
+    hdr[0] = WS_FIN | op;
+    if (len < 126)
+    {
+        hdr[1] = len;
+        return 2;
+    }
+    if (len <= UINT16_MAX)
+    {
+        hdr[1] = 126;
+        put_be16(hdr + 2, len);
+        return 4;
+    }
+    hdr[1] = 127;
+    put_be64(hdr + 2, len);
+    return 10;
+}
+
+/* Queue a control frame for the client. Only one can be pending; a pong
+ * may replace an earlier one that hasn't started going out, but nothing
+ * follows a close. */
+static void ws_queue_ctrl(struct ws* ws, uint8_t op, const uint8_t* data,
+                          size_t len)
+{
+    if (ws->close_sent || ws->tx_ctrl_off)
+        return;
+
+    ws->tx_ctrl_len = ws_frame_hdr(ws->tx_ctrl, op, len);
+    memcpy(ws->tx_ctrl + ws->tx_ctrl_len, data, len);
+    ws->tx_ctrl_len += len;
 
-        if (pollfds[2].revents)
+    if (op == WS_OP_CLOSE)
+        ws->close_sent = true;
+}
+
+/* Expected size of the current frame header, given what we have so far */
+static size_t ws_rx_hdr_size(const struct ws* ws)
+{
+    size_t len = 2;
+
+    if (ws->rx_hdr_len < 2)
+        return len;
+
+    if ((ws->rx_hdr[1] & 0x7f) == 126)
+        len += 2;
+    else if ((ws->rx_hdr[1] & 0x7f) == 127)
+        len += 8;
+
+    if (ws->rx_hdr[1] & WS_MASK)
+        len += 4;
+
+    return len;
+}
+
+static void ws_frame_end(struct ws* ws)
+{
+    switch (ws->rx_hdr[0] & 0xf)
+    {
+        case WS_OP_PING:
+            ws_queue_ctrl(ws, WS_OP_PONG, ws->rx_ctrl, ws->rx_ctrl_len);
+            break;
+        case WS_OP_CLOSE:
+            /* echo the status code back, as the close handshake */
+            ws->close_rcvd = true;
+            ws_queue_ctrl(ws, WS_OP_CLOSE, ws->rx_ctrl,
+                          ws->rx_ctrl_len < 2 ? ws->rx_ctrl_len : 2);
+            break;
+    }
+
+    ws->rx_hdr_len = 0;
+}
+
+static int ws_frame_start(struct ws* ws)
+{
+    uint8_t op = ws->rx_hdr[0] & 0xf;
+    uint8_t code = ws->rx_hdr[1] & 0x7f;
+
+    if (ws->rx_hdr[0] & 0x70)
+    {
+        warnx("websocket frame with reserved bits set");
+        return -1;
+    }
+
+    if (!(ws->rx_hdr[1] & WS_MASK))
+    {
+        warnx("unmasked websocket frame from client");
+        return -1;
+    }
+
+    if (code == 126)
+        ws->rx_left = get_be16(ws->rx_hdr + 2);
+    else if (code == 127)
+        ws->rx_left = get_be64(ws->rx_hdr + 2);
+    else
+        ws->rx_left = code;
+
+    switch (op)
+    {
+        case WS_OP_CONT:
+        case WS_OP_BINARY:
+            break;
+        case WS_OP_CLOSE:
+        case WS_OP_PING:
+        case WS_OP_PONG:
+            if (!(ws->rx_hdr[0] & WS_FIN) || ws->rx_left > WS_CTRL_MAX)
+            {
+                warnx("invalid websocket control frame");
+                return -1;
+            }
+            break;
+        default:
+            warnx("unsupported websocket frame type 0x%x", op);
+            return -1;
+    }
+
+    ws->rx_mask_off = 0;
+    ws->rx_ctrl_len = 0;
+
+    if (!ws->rx_left)
+        ws_frame_end(ws);
+
+    return 0;
+}
+
+/* Decode @len bytes of raw websocket data at @buf. The unmasked payload of
+ * data frames is moved down over the frame headers, so it ends up
+ * contiguous at the start of @buf; returns its length, or -1 on a protocol
+ * error. */
+static ssize_t ws_decode(struct ws* ws, uint8_t* buf, size_t len)
+{
+    size_t in = 0, out = 0, n, i;
+    const uint8_t* mask;
+    uint8_t* dst;
+    bool ctrl;
+
+    while (in < len)
+    {
+        if (ws->rx_hdr_len < ws_rx_hdr_size(ws))
         {
-            rc = process_signal_pipe(ctx, &exit);
-            if (rc || exit)
-                break;
+            ws->rx_hdr[ws->rx_hdr_len++] = buf[in++];
+            if (ws->rx_hdr_len == ws_rx_hdr_size(ws) && ws_frame_start(ws))
+                return -1;
+            continue;
         }
 
-        if (pollfds[3].revents)
+        n = len - in < ws->rx_left ? len - in : ws->rx_left;
+        ctrl = ws->rx_hdr[0] & 0x8;
+        dst = ctrl ? ws->rx_ctrl + ws->rx_ctrl_len : buf + out;
+        mask = ws->rx_hdr + ws->rx_hdr_len - 4;
+
+        for (i = 0; i < n; i++)
+            dst[i] = buf[in + i] ^ mask[(ws->rx_mask_off + i) & 3];
+
+        ws->rx_mask_off = (ws->rx_mask_off + n) & 3;
+        ws->rx_left -= n;
+        in += n;
+        if (ctrl)
+            ws->rx_ctrl_len += n;
+        else
+            out += n;
+
+        if (!ws->rx_left)
+            ws_frame_end(ws);
+    }
+
+    return out;
+}
+
+/* inq_read() for a websocket: read frames, and leave their payload in the
+ * buffer. We keep reading until we have some payload, or the fd would
+ * block, as frames may carry no data for us. */
+static ssize_t ws_recv(struct ws* ws, struct inq* in)
+{
+    size_t end;
+    ssize_t rc;
+
+    while (in->ready && !ws->close_rcvd)
+    {
+        end = in->end;
+        rc = inq_read(in);
+        if (rc <= 0)
+            return rc;
+
+        rc = ws_decode(ws, in->buf + end, rc);
+        if (rc < 0)
+            return -1;
+
+        in->end = end + rc;
+        if (ws->close_rcvd)
+            in->eof = true;
+        if (rc)
+            return rc;
+    }
+
+    return 0;
+}
+
+/* outq_write() for a websocket: everything queued when we start a frame
+ * goes into that frame, and control frames are sent between data frames. */
+static int ws_write(struct ws* ws, struct outq* q, bool* progress)
+{
+    struct iovec iov[OUTQ_MAX_IOV + 1];
+    bool ctrl, boundary;
+    uint64_t start, left;
+    size_t n;
+    ssize_t rc;
+    int i, n_iov;
+
+    if (!q->ready)
+        return 0;
+
+    start = now_us();
+
+    for (;;)
+    {
+        boundary = ws->tx_hdr_off == ws->tx_hdr_len && !ws->tx_left;
+        ctrl = boundary && ws->tx_ctrl_off < ws->tx_ctrl_len;
+        n_iov = 0;
+
+        if (ctrl)
         {
-            rc = udev_process(ctx);
-            if (rc)
-                break;
+            iov[0].iov_base = ws->tx_ctrl + ws->tx_ctrl_off;
+            iov[0].iov_len = ws->tx_ctrl_len - ws->tx_ctrl_off;
+            n_iov = 1;
+        }
+        else
+        {
+            if (boundary)
+            {
+                if (!q->n_iov || ws->close_sent)
+                    break;
+
+                for (i = 0, left = 0; i < q->n_iov; i++)
+                    left += q->iov[i].iov_len;
+
+                ws->tx_hdr_len = ws_frame_hdr(ws->tx_hdr, WS_OP_BINARY, left);
+                ws->tx_hdr_off = 0;
+                ws->tx_left = left;
+            }
 
-            /* udev_process may have closed the udev connection,
-             * in which case we can stop polling on its fd */
-            if (!ctx->udev)
+            if (ws->tx_hdr_off < ws->tx_hdr_len)
+            {
+                iov[0].iov_base = ws->tx_hdr + ws->tx_hdr_off;
+                iov[0].iov_len = ws->tx_hdr_len - ws->tx_hdr_off;
+                n_iov = 1;
+            }
+
+            for (i = 0, left = ws->tx_left; i < q->n_iov && left; i++)
+            {
+                iov[n_iov] = q->iov[i];
+                if (iov[n_iov].iov_len > left)
+                    iov[n_iov].iov_len = left;
+                left -= iov[n_iov++].iov_len;
+            }
+        }
+
+        rc = writev(q->fd, iov, n_iov);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
             {
-                pollfds[3].fd = 0;
-                pollfds[3].revents = 0;
-                n_fd = 3;
+                q->ready = false;
+                q->stalls++;
+                break;
             }
+            warn("write failure");
+            return -1;
+        }
+
+        *progress = true;
+
+        if (ctrl)
+        {
+            ws->tx_ctrl_off += rc;
+            if (ws->tx_ctrl_off == ws->tx_ctrl_len)
+                ws->tx_ctrl_off = ws->tx_ctrl_len = 0;
+            continue;
         }
+
+        n = ws->tx_hdr_len - ws->tx_hdr_off;
+        n = (size_t)rc < n ? (size_t)rc : n;
+        ws->tx_hdr_off += n;
+        rc -= n;
+
+        outq_consume(q, rc);
+        ws->tx_left -= rc;
     }
 
-    return rc ? -1 : 0;
+    q->write_us += now_us() - start;
+    return 0;
 }
 
-static void print_metadata(struct ctx* ctx)
+/* Is there a control frame that could be sent now, on any server stream? */
+static bool ws_ctrl_pending(struct ctx* ctx)
 {
-    struct json_object* md;
+    struct stripe* st;
     int i;
 
-    md = json_object_new_object();
+    if (ctx->ws && ctx->ws->tx_ctrl_len && ctx->req_out.ready)
+        return true;
 
-    for (i = 0; i < ctx->n_configs; i++)
+    for (i = 0; i < ctx->striping.n; i++)
     {
-        struct config* config = &ctx->configs[i];
-        json_object_object_add(md, config->name,
-                               json_object_get(config->metadata));
+        st = &ctx->striping.stripes[i];
+        if (st->ws && st->ws->tx_ctrl_len && st->out.ready)
+            return true;
     }
 
-    puts(json_object_get_string(md));
+    return false;
+}
 
-    json_object_put(md);
+static int conns_init(struct ctx* ctx)
+{
+    struct nbd_conn* conn;
+    int i;
+
+    ctx->conns = calloc(ctx->config->connections, sizeof(*ctx->conns));
+    if (!ctx->conns)
+        return -1;
+
+    /* so that conns_free() is safe if we fail part-way */
+    for (i = 0; i < ctx->config->connections; i++)
+        ctx->conns[i].fd = -1;
+
+    for (i = 0; i < ctx->config->connections; i++)
+    {
+        conn = &ctx->conns[i];
+        conn->parser.state = NBD_PARSE_CFLAGS;
+        conn->parser.out = &ctx->req_out;
+        conn->reply_pending = buf_alloc(ctx->bufsize);
+        if (!conn->reply_pending)
+            return -1;
+
+        /* replies generated by the proxy are copied to the outq if the
+         * socket can't take them immediately, so allow space for those */
+        if (inq_init(&conn->in, ctx->bufsize) ||
+            outq_init(&conn->out, ctx->bufsize + OUTQ_SCRATCH_SIZE))
+            return -1;
+    }
+
+    return 0;
 }
 
-static void config_free_one(struct config* config)
+static void conns_free(struct ctx* ctx)
 {
-    if (config->metadata)
-        json_object_put(config->metadata);
-    free(config->nbd_device);
-    free(config->name);
+    int i;
+
+    if (!ctx->conns)
+        return;
+
+    for (i = 0; i < ctx->config->connections; i++)
+    {
+        if (ctx->conns[i].fd >= 0)
+            close(ctx->conns[i].fd);
+        buf_free(ctx->conns[i].reply_pending, ctx->bufsize);
+        inq_free(&ctx->conns[i].in);
+        outq_free(&ctx->conns[i].out);
+    }
+
+    free(ctx->conns);
+    ctx->conns = NULL;
+    ctx->n_conns = 0;
 }
 
-static int config_parse_one(struct config* config, const char* name,
-                            json_object* obj)
+/* Can a reply be sent straight to the kernel on @conn? Only if we're not
+ * part-way through forwarding a reply from the server to that socket.
+ * Anything already queued on the reply outq is a complete message, so may be
+ * sent after ours. */
+static bool reply_boundary(struct ctx* ctx, struct nbd_conn* conn)
 {
-    struct json_object *tmp, *meta;
-    json_bool jrc;
+    struct nbd_parser* parser = &ctx->rep_parser;
+
+    /* the rest of a reply that was cut off is still to come */
+    if (ctx->resume.cont_pending && conn == &ctx->conns[ctx->resume.cont_conn])
+        return false;
+
+    return parser->state == NBD_PARSE_REPLY &&
+           (!(parser->skip || ctx->sreply.active) || !parser->forward ||
+            parser->out != &conn->out);
+}
+
+static bool kernel_reply_ready(struct ctx* ctx, struct nbd_conn* conn,
+                               size_t len)
+{
+    if (reply_boundary(ctx, conn))
+        return outq_room(&conn->out, len, true);
+
+    return conn->reply_pending_len + len <= ctx->bufsize;
+}
+
+/* Send a reply that the proxy has generated itself, rather than one from the
+ * server. The caller must check kernel_reply_ready() first. */
+static int kernel_reply(struct ctx* ctx, struct nbd_conn* conn,
+                        struct iovec* iov, int n_iov)
+{
+    int i;
+
+    if (reply_boundary(ctx, conn))
+        return outq_send(&conn->out, iov, n_iov);
+
+    for (i = 0; i < n_iov; i++)
+    {
+        memcpy(conn->reply_pending + conn->reply_pending_len, iov[i].iov_base,
+               iov[i].iov_len);
+        conn->reply_pending_len += iov[i].iov_len;
+    }
+
+    return 0;
+}
+
+static int kernel_reply_error(struct ctx* ctx, struct nbd_conn* conn,
+                              uint64_t handle, uint32_t error)
+{
+    uint8_t hdr[NBD_REPLY_SIZE];
+    struct iovec iov;
+
+    put_be32(hdr, NBD_REPLY_MAGIC);
+    put_be32(hdr + 4, error);
+    memcpy(hdr + 8, &handle, sizeof(handle));
+
+    iov.iov_base = hdr;
+    iov.iov_len = sizeof(hdr);
+    return kernel_reply(ctx, conn, &iov, 1);
+}
+
+/* Are there held replies that can now be sent? */
+static bool reply_pending(struct ctx* ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->n_conns; i++)
+    {
+        if (ctx->conns[i].reply_pending_len &&
+            reply_boundary(ctx, &ctx->conns[i]))
+            return true;
+    }
+
+    return false;
+}
+
+/* Move held replies to their outqs, where there's now space */
+static int reply_flush_pending(struct ctx* ctx)
+{
+    struct nbd_conn* conn;
+    struct iovec iov;
+    int i, rc;
+
+    for (i = 0; i < ctx->n_conns; i++)
+    {
+        conn = &ctx->conns[i];
+        if (!conn->reply_pending_len || !reply_boundary(ctx, conn) ||
+            !outq_room(&conn->out, conn->reply_pending_len, true))
+            continue;
+
+        iov.iov_base = conn->reply_pending;
+        iov.iov_len = conn->reply_pending_len;
+        rc = outq_send(&conn->out, &iov, 1);
+        conn->reply_pending_len = 0;
+        if (rc)
+            return rc;
+    }
+
+    return 0;
+}
+
+static struct outq* stream_out(struct ctx* ctx, int stream)
+{
+    return stream ? &ctx->striping.stripes[stream - 1].out : &ctx->req_out;
+}
+
+/* What a request adds to its stream's load: its header, and the data that
+ * goes one way or the other */
+static uint64_t stream_cost(const struct nbd_inflight_req* req)
+{
+    if (req->type == NBD_CMD_READ || req->type == NBD_CMD_WRITE)
+        return NBD_REQUEST_SIZE + (uint64_t)req->len;
+
+    return NBD_REQUEST_SIZE;
+}
+
+/* Choose the server stream for the next request, among those with space
+ * to queue it, or return -1 if none has. The search starts after the last
+ * stream used, so that ties go round the streams in turn. */
+static int stream_pick(struct ctx* ctx)
+{
+    struct striping* sp = &ctx->striping;
+    int i, s, n = sp->n + 1, best = -1;
+
+    for (i = 0; i < n; i++)
+    {
+        s = (sp->next + i) % n;
+        if (!outq_room(stream_out(ctx, s), NBD_HDR_MAX, true))
+            continue;
+        if (ctx->config->stream_policy == STREAM_ROUND_ROBIN)
+            return s;
+        if (best < 0 || sp->load[s] < sp->load[best])
+            best = s;
+    }
+
+    return best;
+}
+
+/* Account for @req being sent on @stream */
+static void stream_sent(struct ctx* ctx, int stream,
+                        struct nbd_inflight_req* req)
+{
+    struct striping* sp = &ctx->striping;
+
+    req->stream = stream;
+    sp->load[stream] += stream_cost(req);
+    sp->requests[stream]++;
+    sp->next = (stream + 1) % (sp->n + 1);
+}
+
+/* ...and for its reply having arrived */
+static void stream_done(struct ctx* ctx, const struct nbd_inflight_req* req)
+{
+    uint64_t* load = &ctx->striping.load[req->stream];
+    uint64_t cost = stream_cost(req);
+
+    *load = *load > cost ? *load - cost : 0;
+}
+
+/* Is the reply parser between messages, so that a reply from any stream
+ * may come next? */
+static bool rep_idle(struct ctx* ctx)
+{
+    struct nbd_parser* parser = &ctx->rep_parser;
+
+    return !parser->hdr_len && !parser->skip && !ctx->sreply.active;
+}
+
+/* May replies from @stream be parsed now? Not while another stream's reply
+ * is part-way through. */
+static bool stream_turn(struct ctx* ctx, int stream)
+{
+    return ctx->striping.owner == stream || rep_idle(ctx);
+}
+
+static bool cache_enabled(struct ctx* ctx)
+{
+    /* we never see writes from other clients, so the only requirement
+     * for coherency is that nobody writes through us */
+    return ctx->cache.n_blocks && (ctx->nbd_export_flags & NBD_FLAG_READ_ONLY);
+}
+
+static int cache_init(struct ctx* ctx)
+{
+    struct read_cache* cache = &ctx->cache;
+    size_t n_buckets;
+    uint32_t i;
+
+    cache->fill_slot = CACHE_NONE;
+
+    if (!ctx->config->cache_size)
+        return 0;
+
+    cache->block_size = ctx->config->cache_block_size;
+    cache->block_shift = __builtin_ctzll(cache->block_size);
+    cache->n_blocks = ctx->config->cache_size / cache->block_size;
+    if (!cache->n_blocks)
+        return 0;
+
+    for (n_buckets = 1; n_buckets < cache->n_blocks; n_buckets <<= 1)
+        ;
+
+    /* the arena is allocated up-front, so the cache's memory use is fixed
+     * for the lifetime of the session */
+    cache->arena = malloc((size_t)cache->n_blocks * cache->block_size);
+    cache->blocks = calloc(cache->n_blocks, sizeof(*cache->blocks));
+    cache->buckets = malloc(n_buckets * sizeof(*cache->buckets));
+    if (!cache->arena || !cache->blocks || !cache->buckets)
+    {
+        warnx("can't allocate %zu-byte read cache", ctx->config->cache_size);
+        return -1;
+    }
+
+    cache->bucket_mask = n_buckets - 1;
+    for (i = 0; i <= cache->bucket_mask; i++)
+        cache->buckets[i] = CACHE_NONE;
+
+    for (i = 0; i < cache->n_blocks; i++)
+    {
+        cache->blocks[i].lru_prev = i ? i - 1 : CACHE_NONE;
+        cache->blocks[i].lru_next = i + 1 < cache->n_blocks ? i + 1
+                                                            : CACHE_NONE;
+    }
+    cache->lru_head = 0;
+    cache->lru_tail = cache->n_blocks - 1;
+
+    return 0;
+}
+
+static void cache_free(struct ctx* ctx)
+{
+    struct read_cache* cache = &ctx->cache;
+
+    free(cache->arena);
+    free(cache->blocks);
+    free(cache->buckets);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static uint32_t cache_bucket(struct read_cache* cache, uint64_t blkno)
+{
+    return (blkno * 0x9e3779b97f4a7c15ULL >> 32) & cache->bucket_mask;
+}
+
+static uint32_t cache_find(struct read_cache* cache, uint64_t blkno)
+{
+    uint32_t i;
+
+    for (i = cache->buckets[cache_bucket(cache, blkno)]; i != CACHE_NONE;
+         i = cache->blocks[i].hash_next)
+        if (cache->blocks[i].blkno == blkno)
+            return i;
+
+    return CACHE_NONE;
+}
+
+static void cache_hash_remove(struct read_cache* cache, uint32_t slot)
+{
+    uint32_t* p;
+
+    for (p = &cache->buckets[cache_bucket(cache, cache->blocks[slot].blkno)];
+         *p != slot; p = &cache->blocks[*p].hash_next)
+        ;
+    *p = cache->blocks[slot].hash_next;
+    cache->blocks[slot].valid = false;
+}
+
+static void cache_touch(struct read_cache* cache, uint32_t slot)
+{
+    struct cache_block* block = &cache->blocks[slot];
+
+    if (cache->lru_head == slot)
+        return;
+
+    /* unlink... */
+    cache->blocks[block->lru_prev].lru_next = block->lru_next;
+    if (block->lru_next != CACHE_NONE)
+        cache->blocks[block->lru_next].lru_prev = block->lru_prev;
+    else
+        cache->lru_tail = block->lru_prev;
+
+    /* ... and move to the head */
+    block->lru_prev = CACHE_NONE;
+    block->lru_next = cache->lru_head;
+    cache->blocks[cache->lru_head].lru_prev = slot;
+    cache->lru_head = slot;
+}
+
+/* Claim the least-recently-used block to be filled with data for @blkno.
+ * It isn't visible to lookups until the fill is complete. */
+static uint32_t cache_claim(struct read_cache* cache, uint64_t blkno)
+{
+    uint32_t slot = cache->lru_tail;
+
+    if (cache->blocks[slot].valid)
+    {
+        cache_hash_remove(cache, slot);
+        cache->evictions++;
+    }
+
+    cache->blocks[slot].blkno = blkno;
+    cache_touch(cache, slot);
+    return slot;
+}
+
+static void cache_insert(struct read_cache* cache, uint32_t slot)
+{
+    struct cache_block* block = &cache->blocks[slot];
+    uint32_t bucket = cache_bucket(cache, block->blkno);
+
+    block->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = slot;
+    block->valid = true;
+}
+
+/* Start capturing the payload of a read reply. Only whole blocks within the
+ * request are cached, and we never claim more blocks than half the cache, so
+ * a single large read can't flush everything else. */
+static void cache_fill_start(struct ctx* ctx, uint64_t offset, uint32_t len)
+{
+    struct read_cache* cache = &ctx->cache;
+    uint64_t mask = cache->block_size - 1;
+    uint64_t max = (uint64_t)cache->n_blocks / 2 * cache->block_size;
+
+    cache->fill_pos = offset;
+    cache->fill_start = (offset + mask) & ~mask;
+    cache->fill_end = (offset + len) & ~mask;
+    cache->fill_slot = CACHE_NONE;
+
+    if (cache->fill_end <= cache->fill_start)
+        cache->fill_end = cache->fill_start = cache->fill_pos;
+    else if (cache->fill_end - cache->fill_start > max)
+        cache->fill_end = cache->fill_start + max;
+}
+
+static bool cache_filling(struct ctx* ctx)
+{
+    return ctx->cache.fill_pos < ctx->cache.fill_end;
+}
+
+static void cache_fill(struct ctx* ctx, const uint8_t* buf, size_t len)
+{
+    struct read_cache* cache = &ctx->cache;
+    uint64_t mask = cache->block_size - 1;
+    size_t n, block_off;
+
+    while (len && cache->fill_pos < cache->fill_end)
+    {
+        if (cache->fill_pos < cache->fill_start)
+        {
+            n = cache->fill_start - cache->fill_pos;
+            if (n > len)
+                n = len;
+            cache->fill_pos += n;
+            buf += n;
+            len -= n;
+            continue;
+        }
+
+        block_off = cache->fill_pos & mask;
+        n = cache->block_size - block_off;
+        if (n > len)
+            n = len;
+
+        /* starting a new block: skip it if it's already cached */
+        if (!block_off)
+        {
+            uint64_t blkno = cache->fill_pos >> cache->block_shift;
+
+            cache->fill_slot = CACHE_NONE;
+            if (cache_find(cache, blkno) == CACHE_NONE)
+                cache->fill_slot = cache_claim(cache, blkno);
+        }
+
+        if (cache->fill_slot != CACHE_NONE)
+        {
+            memcpy(cache->arena + ((size_t)cache->fill_slot
+                                   << cache->block_shift) + block_off,
+                   buf, n);
+            if (block_off + n == cache->block_size)
+                cache_insert(cache, cache->fill_slot);
+        }
+
+        cache->fill_pos += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Try to serve a read request from the cache. Returns 1 if the request has
+ * been handled, and so shouldn't be forwarded to the server, 0 if not, or -1
+ * on failure. */
+static int cache_read(struct ctx* ctx, struct nbd_conn* conn,
+                      const uint8_t* req_hdr, uint64_t offset, uint32_t len)
+{
+    struct read_cache* cache = &ctx->cache;
+    uint32_t slots[IOV_MAX - 1];
+    struct iovec iov[IOV_MAX];
+    uint64_t blkno, first, last;
+    uint8_t hdr[NBD_REPLY_SIZE];
+    size_t block_off, n;
+    uint32_t remain;
+    int i, n_iov;
+
+    if (!len)
+        return 0;
+
+    first = offset >> cache->block_shift;
+    last = (offset + len - 1) >> cache->block_shift;
+    if (last - first + 1 > sizeof(slots) / sizeof(slots[0]))
+        goto miss;
+
+    for (blkno = first; blkno <= last; blkno++)
+    {
+        slots[blkno - first] = cache_find(cache, blkno);
+        if (slots[blkno - first] == CACHE_NONE)
+            goto miss;
+    }
+
+    if (!kernel_reply_ready(ctx, conn, sizeof(hdr) + len))
+        goto miss;
+
+    put_be32(hdr, NBD_REPLY_MAGIC);
+    put_be32(hdr + 4, 0);
+    memcpy(hdr + 8, req_hdr + 8, 8);
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(hdr);
+    n_iov = 1;
+
+    block_off = offset & (cache->block_size - 1);
+    for (i = 0, remain = len; remain; i++)
+    {
+        n = cache->block_size - block_off;
+        if (n > remain)
+            n = remain;
+
+        iov[n_iov].iov_base = cache->arena +
+                              ((size_t)slots[i] << cache->block_shift) +
+                              block_off;
+        iov[n_iov].iov_len = n;
+        n_iov++;
+
+        cache_touch(cache, slots[i]);
+        remain -= n;
+        block_off = 0;
+    }
+
+    if (kernel_reply(ctx, conn, iov, n_iov))
+        return -1;
+
+    cache->hits++;
+    cache->hit_bytes += len;
+    return 1;
+
+miss:
+    cache->misses++;
+    return 0;
+}
+
+static struct json_object* cache_json(struct ctx* ctx)
+{
+    struct read_cache* cache = &ctx->cache;
+    struct json_object* obj = json_object_new_object();
+
+    json_object_object_add(obj, "enabled",
+                           json_object_new_boolean(cache_enabled(ctx)));
+    json_object_object_add(
+        obj, "size",
+        json_object_new_int64((uint64_t)cache->n_blocks * cache->block_size));
+    json_object_object_add(obj, "block_size",
+                           json_object_new_int64(cache->block_size));
+    json_object_object_add(obj, "hits", json_object_new_int64(cache->hits));
+    json_object_object_add(obj, "misses",
+                           json_object_new_int64(cache->misses));
+    json_object_object_add(obj, "hit_bytes",
+                           json_object_new_int64(cache->hit_bytes));
+    json_object_object_add(obj, "evictions",
+                           json_object_new_int64(cache->evictions));
+    return obj;
+}
+
+static enum nbd_stats_cmd stats_cmd(uint16_t type)
+{
+    switch (type)
+    {
+        case NBD_CMD_READ:
+            return NBD_STATS_READ;
+        case NBD_CMD_WRITE:
+            return NBD_STATS_WRITE;
+        case NBD_CMD_DISC:
+            return NBD_STATS_DISC;
+        case NBD_CMD_FLUSH:
+            return NBD_STATS_FLUSH;
+        case NBD_CMD_TRIM:
+            return NBD_STATS_TRIM;
+    }
+    return NBD_STATS_OTHER;
+}
+
+static void stats_request(struct ctx* ctx, uint16_t type, uint32_t len)
+{
+    struct nbd_cmd_stats* stats = &ctx->stats[stats_cmd(type)];
+
+    stats->requests++;
+    stats->bytes += len;
+
+    /* disconnect requests don't get a reply, so are never in flight */
+    if (type == NBD_CMD_DISC)
+        return;
+
+    stats->inflight++;
+    if (stats->inflight > stats->inflight_max)
+        stats->inflight_max = stats->inflight;
+}
+
+static void stats_reply(struct ctx* ctx, uint16_t type, uint32_t error,
+                        uint64_t latency_us)
+{
+    struct nbd_cmd_stats* stats = &ctx->stats[stats_cmd(type)];
+    int bucket;
+
+    stats->inflight--;
+    if (error)
+        stats->errors++;
+
+    stats->latency_total_us += latency_us;
+    if (latency_us > stats->latency_max_us)
+        stats->latency_max_us = latency_us;
+
+    bucket = latency_us ? 63 - __builtin_clzll(latency_us) : 0;
+    if (bucket >= NBD_STATS_HIST_BUCKETS)
+        bucket = NBD_STATS_HIST_BUCKETS - 1;
+    stats->latency_hist[bucket]++;
+}
+
+static const uint64_t trace_hash_init = 0xcbf29ce484222325ull;
+
+/* FNV-1a: cheap enough to run over payloads as they pass through */
+static uint64_t trace_hash_update(uint64_t hash, const uint8_t* buf,
+                                  size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        hash = (hash ^ buf[i]) * 0x100000001b3ull;
+
+    return hash;
+}
+
+static bool trace_hashing(struct ctx* ctx)
+{
+    return ctx->trace && ctx->trace->hash;
+}
+
+static int trace_write(int fd, const void* buf, size_t len)
+{
+    const uint8_t* p = buf;
+    ssize_t rc;
+
+    while (len)
+    {
+        rc = write(fd, p, len);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        p += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+/* Append queued records to the file, when the ring is half full, or every
+ * trace_flush_ms otherwise */
+static void* trace_thread(void* arg)
+{
+    struct trace* trace = arg;
+    uint64_t head, tail, n;
+    struct timespec ts;
+    bool failed = false;
+    bool stop;
+
+    for (;;)
+    {
+        stop = atomic_load(&trace->stop);
+        tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+        head = atomic_load_explicit(&trace->head, memory_order_acquire);
+
+        while (tail != head)
+        {
+            /* up to the end of the ring, then from the start */
+            n = TRACE_RING_SIZE - (tail & (TRACE_RING_SIZE - 1));
+            if (n > head - tail)
+                n = head - tail;
+
+            if (!failed &&
+                trace_write(trace->fd,
+                            trace->ring + (tail & (TRACE_RING_SIZE - 1)),
+                            n * sizeof(*trace->ring)))
+            {
+                warn("can't write trace; no more records will be saved");
+                failed = true;
+            }
+
+            tail += n;
+            atomic_store_explicit(&trace->tail, tail, memory_order_release);
+        }
+
+        if (stop)
+            break;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += trace_flush_ms * 1000000l;
+        ts.tv_sec += ts.tv_nsec / 1000000000l;
+        ts.tv_nsec %= 1000000000l;
+
+        pthread_mutex_lock(&trace->lock);
+        if (!atomic_load(&trace->stop))
+            pthread_cond_timedwait(&trace->cond, &trace->lock, &ts);
+        pthread_mutex_unlock(&trace->lock);
+    }
+
+    return NULL;
+}
+
+static void trace_wake(struct trace* trace)
+{
+    pthread_mutex_lock(&trace->lock);
+    pthread_cond_signal(&trace->cond);
+    pthread_mutex_unlock(&trace->lock);
+}
+
+/* Queue a record for a completed request. This is the only producer, so the
+ * head is ours; the tail only ever moves towards it. */
+static void trace_log(struct ctx* ctx, const struct nbd_inflight_req* req,
+                      uint32_t error, uint64_t t_complete, uint8_t flags,
+                      uint64_t hash)
+{
+    struct trace* trace = ctx->trace;
+    struct trace_entry* e;
+    uint64_t head, tail;
+
+    head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&trace->tail, memory_order_acquire);
+    if (head - tail >= TRACE_RING_SIZE)
+    {
+        trace->dropped++;
+        return;
+    }
+
+    e = &trace->ring[head & (TRACE_RING_SIZE - 1)];
+    e->t_submit = htole64(req->t_submit > trace->t_start
+                              ? req->t_submit - trace->t_start
+                              : 0);
+    e->t_complete = htole64(t_complete > trace->t_start
+                                ? t_complete - trace->t_start
+                                : 0);
+    e->handle = req->client_handle;
+    e->offset = htole64(req->offset);
+    e->hash = htole64(flags & TRACE_F_HASH ? hash : 0);
+    e->len = htole32(req->len);
+    e->error = htole32(error);
+    e->type = htole16(req->type);
+    e->cmd_flags = htole16(req->flags);
+    e->conn = req->conn;
+    e->flags = flags;
+    e->reserved = 0;
+
+    atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+
+    if (head + 1 - tail == TRACE_RING_SIZE / 2)
+        trace_wake(trace);
+}
+
+/* A read that the proxy answered itself, from its cache or readahead */
+static void trace_local_read(struct ctx* ctx, int conn, uint64_t handle,
+                             uint64_t offset, uint32_t len, uint32_t error,
+                             uint64_t t_submit)
+{
+    struct nbd_inflight_req req = {
+        .client_handle = handle,
+        .conn = conn,
+        .offset = offset,
+        .t_submit = t_submit,
+        .len = len,
+        .type = NBD_CMD_READ,
+    };
+
+    if (ctx->trace)
+        trace_log(ctx, &req, error, now_us(), TRACE_F_LOCAL, 0);
+}
+
+/* The server's reply to @req has arrived. Its record waits for any payload,
+ * which we hash on the way through; a write's payload was hashed on the way
+ * in. */
+static void trace_reply_start(struct ctx* ctx,
+                              const struct nbd_inflight_req* req,
+                              uint32_t error, uint64_t now)
+{
+    struct trace* trace = ctx->trace;
+
+    trace->rep = *req;
+    trace->rep_complete = now;
+    trace->rep_error = error;
+    trace->rep_flags = 0;
+    trace->rep_hash = req->type == NBD_CMD_WRITE ? req->hash : trace_hash_init;
+
+    if (trace->hash && req->len && !error &&
+        (req->type == NBD_CMD_READ || req->type == NBD_CMD_WRITE))
+        trace->rep_flags = TRACE_F_HASH;
+
+    trace->rep_pending = true;
+}
+
+static void trace_reply_done(struct ctx* ctx)
+{
+    struct trace* trace = ctx->trace;
+
+    trace->rep_pending = false;
+    trace_log(ctx, &trace->rep, trace->rep_error, trace->rep_complete,
+              trace->rep_flags, trace->rep_hash);
+}
+
+/* A write's payload has all arrived from the kernel; keep its hash with the
+ * request until the server replies */
+static void trace_write_hashed(struct ctx* ctx, struct nbd_conn* conn)
+{
+    struct nbd_inflight_req* req;
+
+    req = inflight_find(&ctx->inflight, conn->trace_handle);
+    if (req)
+        req->hash = conn->trace_hash;
+}
+
+/* Start tracing the session's requests, if its configuration asks for it.
+ * The trace is diagnostic only, so the session carries on without it on
+ * failure. */
+static void trace_start(struct ctx* ctx)
+{
+    struct config* config = ctx->config;
+    struct trace_header hdr;
+    struct trace* trace;
+    struct timespec ts;
+    sigset_t set, old;
+    int rc;
+
+    if (!config->trace_path || ctx->trace)
+        return;
+
+    trace = calloc(1, sizeof(*trace));
+    if (!trace)
+    {
+        warnx("can't allocate trace");
+        return;
+    }
+
+    trace->ring = calloc(TRACE_RING_SIZE, sizeof(*trace->ring));
+    if (!trace->ring)
+    {
+        warnx("can't allocate trace");
+        goto err_free;
+    }
+
+    trace->fd = open(config->trace_path,
+                     O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (trace->fd < 0)
+    {
+        warn("can't open trace file %s", config->trace_path);
+        goto err_free;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = htole32(TRACE_VERSION);
+    hdr.entry_size = htole32(sizeof(struct trace_entry));
+    hdr.export_size = htole64(ctx->nbd_export_size);
+    hdr.t_start =
+        htole64((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+    hdr.export_flags = htole16(ctx->nbd_export_flags);
+    hdr.connections = htole16(ctx->n_conns);
+    hdr.flags = htole32(config->trace_hash ? TRACE_HDR_HASH : 0);
+
+    if (trace_write(trace->fd, &hdr, sizeof(hdr)))
+    {
+        warn("can't write trace file %s", config->trace_path);
+        goto err_close;
+    }
+
+    trace->hash = config->trace_hash;
+    trace->t_start = now_us();
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->cond, NULL);
+
+    /* signals are handled on the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &old);
+    rc = pthread_create(&trace->thread, NULL, trace_thread, trace);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc)
+    {
+        warnx("can't start trace thread: %s", strerror(rc));
+        pthread_mutex_destroy(&trace->lock);
+        pthread_cond_destroy(&trace->cond);
+        goto err_close;
+    }
+
+    ctx->trace = trace;
+    return;
+
+err_close:
+    close(trace->fd);
+err_free:
+    free(trace->ring);
+    free(trace);
+}
+
+static struct qos_shared* qos_shared;
+
+/* Map the shared bandwidth bucket, setting it up if we're the first */
+static struct qos_shared* qos_shared_open(uint64_t rate)
+{
+    struct qos_shared* qs;
+    struct stat st;
+    int fd;
+
+    if (qos_shared)
+        goto out;
+
+    fd = open(qos_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        warn("can't open %s", qos_path);
+        return NULL;
+    }
+
+    /* the lock keeps others out until the bucket is set up */
+    if (flock(fd, LOCK_EX) || fstat(fd, &st) ||
+        ((size_t)st.st_size < sizeof(*qs) && ftruncate(fd, sizeof(*qs))))
+    {
+        warn("can't set up %s", qos_path);
+        close(fd);
+        return NULL;
+    }
+
+    qs = mmap(NULL, sizeof(*qs), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (qs == MAP_FAILED)
+    {
+        warn("can't map %s", qos_path);
+        close(fd);
+        return NULL;
+    }
+
+    if (qs->magic != QOS_MAGIC || qs->version != QOS_VERSION)
+    {
+        atomic_store(&qs->tokens, 0);
+        atomic_store(&qs->t_refill, now_us());
+        atomic_store(&qs->t_interactive, 0);
+        qs->version = QOS_VERSION;
+        qs->magic = QOS_MAGIC;
+    }
+
+    /* the mapping keeps the file open, so closing it won't unlock it */
+    flock(fd, LOCK_UN);
+    close(fd);
+    qos_shared = qs;
+
+out:
+    /* every process reads the same configuration */
+    atomic_store(&qos_shared->rate, rate);
+    return qos_shared;
+}
+
+/* A bucket holds up to qos_burst_us worth of its rate */
+static int64_t qos_cap(uint64_t rate)
+{
+    int64_t cap = rate * qos_burst_us / 1000000;
+
+    return cap ? cap : 1;
+}
+
+/* What @rate (per second) has earned since *@t, which moves on to @now once
+ * there's anything to credit, so that slow rates still add up */
+static int64_t qos_earned(uint64_t rate, uint64_t* t, uint64_t now)
+{
+    uint64_t dt = now > *t ? now - *t : 0;
+    int64_t earned;
+
+    /* a second's worth fills any bucket, and keeps this from overflowing */
+    if (dt > 1000000)
+        dt = 1000000;
+
+    earned = dt * rate / 1000000;
+    if (earned)
+        *t = now;
+
+    return earned;
+}
+
+static int64_t qos_refill(int64_t tokens, uint64_t rate, uint64_t* t,
+                          uint64_t now)
+{
+    int64_t cap = qos_cap(rate);
+
+    tokens += qos_earned(rate, t, now);
+    return tokens < cap ? tokens : cap;
+}
+
+/* Only one session gets to credit each interval to the shared bucket: the
+ * one that moves t_refill on */
+static void qos_shared_refill(struct qos_shared* qs, uint64_t now)
+{
+    uint64_t rate = atomic_load(&qs->rate);
+    uint64_t t = atomic_load(&qs->t_refill), next = t;
+    int64_t cap = qos_cap(rate), earned, cur, val;
+
+    earned = qos_earned(rate, &next, now);
+    if (!earned || !atomic_compare_exchange_strong(&qs->t_refill, &t, next))
+        return;
+
+    cur = atomic_load(&qs->tokens);
+    do
+    {
+        val = cur + earned < cap ? cur + earned : cap;
+    } while (!atomic_compare_exchange_weak(&qs->tokens, &cur, val));
+}
+
+/* How long @rate takes to make up a deficit of @tokens */
+static uint64_t qos_wait_us(int64_t tokens, uint64_t rate)
+{
+    return (uint64_t)(1 - tokens) * 1000000 / rate + 1;
+}
+
+/* May the session start another request now? If not, note when it may. */
+static bool qos_admit(struct ctx* ctx, uint64_t now)
+{
+    struct config* config = ctx->config;
+    struct qos_shared* qs = qos_shared;
+    uint64_t rate = ctx->qos_bandwidth;
+    struct qos* q = &ctx->qos;
+    int64_t tokens, reserve = 0;
+    uint64_t wait = 0, w;
+
+    if (!q->enabled)
+        return true;
+
+    if (config->rate_limit)
+    {
+        q->tokens =
+            qos_refill(q->tokens, config->rate_limit, &q->t_refill, now);
+        if (q->tokens <= 0)
+            wait = qos_wait_us(q->tokens, config->rate_limit);
+    }
+
+    if (config->iops_limit)
+    {
+        q->iops_tokens = qos_refill(q->iops_tokens,
+                                    config->iops_limit * 1000000,
+                                    &q->t_refill_iops, now);
+        w = qos_wait_us(q->iops_tokens, config->iops_limit * 1000000);
+        if (q->iops_tokens <= 0 && w > wait)
+            wait = w;
+    }
+
+    /* bulk sessions leave half of the shared bucket to any interactive
+     * session that has wanted to send recently */
+    if (qs && rate)
+    {
+        qos_shared_refill(qs, now);
+        if (!config->bulk)
+            atomic_store(&qs->t_interactive, now);
+        else if (atomic_load(&qs->t_interactive) + qos_interactive_us > now)
+            reserve = qos_cap(rate) / 2;
+
+        tokens = atomic_load(&qs->tokens) - reserve;
+        w = qos_wait_us(tokens, rate);
+        if (tokens <= 0 && w > wait)
+            wait = w;
+    }
+
+    if (!wait)
+    {
+        if (q->blocked)
+        {
+            q->throttled_us += now - q->t_blocked;
+            q->blocked = false;
+        }
+        return true;
+    }
+
+    if (!q->blocked)
+    {
+        q->blocked = true;
+        q->t_blocked = now;
+        q->throttles++;
+    }
+    q->t_wake = now + wait;
+    return false;
+}
+
+/* Take the cost of a request that's going to the server */
+static void qos_charge(struct ctx* ctx, uint16_t type, uint32_t len)
+{
+    struct qos* q = &ctx->qos;
+
+    if (!q->enabled)
+        return;
+
+    if (type != NBD_CMD_READ && type != NBD_CMD_WRITE)
+        len = 0;
+
+    q->tokens -= len;
+    q->iops_tokens -= 1000000;
+    if (qos_shared && ctx->qos_bandwidth)
+        atomic_fetch_sub(&qos_shared->tokens, len);
+}
+
+/* How long the event loop may wait before a throttled session may send
+ * again, or -1 for no limit. Once that time has passed, the session is only
+ * throttled again if it still has something to send. */
+static int qos_wait_ms(struct ctx* ctx)
+{
+    struct qos* q = &ctx->qos;
+    uint64_t now;
+
+    if (!q->blocked)
+        return -1;
+
+    now = now_us();
+    if (now < q->t_wake)
+        return (q->t_wake - now + 999) / 1000;
+
+    q->throttled_us += now - q->t_blocked;
+    q->blocked = false;
+    return -1;
+}
+
+static void qos_init(struct ctx* ctx)
+{
+    struct config* config = ctx->config;
+    struct qos* q = &ctx->qos;
+    bool shared = false;
+
+    memset(q, 0, sizeof(*q));
+    q->t_refill = q->t_refill_iops = now_us();
+    q->tokens = qos_cap(config->rate_limit);
+    q->iops_tokens = qos_cap(config->iops_limit * 1000000);
+
+    if (ctx->qos_bandwidth)
+    {
+        shared = qos_shared_open(ctx->qos_bandwidth) != NULL;
+        if (!shared)
+            warnx("bandwidth isn't shared with other sessions");
+    }
+
+    q->enabled = config->rate_limit || config->iops_limit || shared;
+}
+
+/* Write out the rest of the trace, including a reply that was cut short */
+static void trace_stop(struct ctx* ctx)
+{
+    struct trace* trace = ctx->trace;
+
+    if (!trace)
+        return;
+
+    if (trace->rep_pending)
+    {
+        trace->rep_flags &= ~TRACE_F_HASH;
+        trace_reply_done(ctx);
+    }
+
+    pthread_mutex_lock(&trace->lock);
+    atomic_store(&trace->stop, true);
+    pthread_cond_signal(&trace->cond);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->thread, NULL);
+
+    if (trace->dropped)
+        warnx("%" PRIu64 " trace records dropped", trace->dropped);
+
+    close(trace->fd);
+    pthread_mutex_destroy(&trace->lock);
+    pthread_cond_destroy(&trace->cond);
+    free(trace->ring);
+    free(trace);
+    ctx->trace = NULL;
+}
+
+static bool ra_enabled(struct ctx* ctx)
+{
+    /* as for the cache, staged data can't go stale on read-only exports */
+    return ctx->ra.n_slots && ctx->nbd_export_size &&
+           (ctx->nbd_export_flags & NBD_FLAG_READ_ONLY);
+}
+
+static int ra_init(struct ctx* ctx)
+{
+    struct readahead* ra = &ctx->ra;
+
+    ra->cur_slot = -1;
+
+    if (!ctx->config->ra_window_max)
+        return 0;
+
+    ra->seg_size = ctx->config->ra_seg_size;
+    ra->window_min = ctx->config->ra_window_min;
+    ra->window_max = ctx->config->ra_window_max;
+    ra->window = ra->window_min;
+    ra->n_slots = ra->window_max / ra->seg_size;
+
+    ra->ring = malloc((size_t)ra->n_slots * ra->seg_size);
+    ra->slots = calloc(ra->n_slots, sizeof(*ra->slots));
+    if (!ra->ring || !ra->slots)
+    {
+        warnx("can't allocate %zu-byte readahead window", ra->window_max);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void ra_free(struct ctx* ctx)
+{
+    free(ctx->ra.ring);
+    free(ctx->ra.slots);
+    memset(&ctx->ra, 0, sizeof(ctx->ra));
+}
+
+static bool ra_slot_live(const struct ra_slot* slot)
+{
+    return slot->state == RA_INFLIGHT || slot->state == RA_READY;
+}
+
+static int ra_find(struct readahead* ra, uint64_t pos)
+{
+    uint32_t i;
+
+    for (i = 0; i < ra->n_slots; i++)
+    {
+        struct ra_slot* slot = &ra->slots[i];
+
+        if (ra_slot_live(slot) && pos >= slot->offset &&
+            pos < slot->offset + slot->len)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Is the range entirely covered by readahead data, either received or in
+ * flight? If so, @ready indicates whether all of it has been received. */
+static bool ra_covered(struct readahead* ra, uint64_t offset, uint32_t len,
+                       bool* ready)
+{
+    uint64_t pos, end = offset + len;
+    int i, n;
+
+    *ready = true;
+
+    for (pos = offset, n = 0; pos < end; n++)
+    {
+        i = ra_find(ra, pos);
+        if (i < 0 || n == RA_MAX_IOV - 1)
+            return false;
+        if (ra->slots[i].state != RA_READY)
+            *ready = false;
+        pos = ra->slots[i].offset + ra->slots[i].len;
+    }
+
+    return len > 0;
+}
+
+static bool ra_waited_on(struct readahead* ra, const struct ra_slot* slot)
+{
+    int i;
+
+    for (i = 0; i < ra->n_waiters; i++)
+    {
+        struct ra_waiter* w = &ra->waiters[i];
+
+        if (w->offset < slot->offset + slot->len &&
+            slot->offset < w->offset + w->len)
+            return true;
+    }
+
+    return false;
+}
+
+/* Release slots that end before @limit, and that no waiting kernel read
+ * still needs. Slots still in flight are marked stale, and released once
+ * their reply has been consumed. */
+static void ra_retire(struct ctx* ctx, uint64_t limit)
+{
+    struct readahead* ra = &ctx->ra;
+    uint32_t i;
+
+    for (i = 0; i < ra->n_slots; i++)
+    {
+        struct ra_slot* slot = &ra->slots[i];
+
+        if (!ra_slot_live(slot) || slot->offset + slot->len > limit ||
+            ra_waited_on(ra, slot))
+            continue;
+
+        slot->state = slot->state == RA_READY ? RA_EMPTY : RA_STALE;
+    }
+}
+
+static void ra_reset(struct ctx* ctx)
+{
+    struct readahead* ra = &ctx->ra;
+
+    ra->active = false;
+    ra->seq_count = 0;
+    ra_retire(ctx, UINT64_MAX);
+}
+
+/* Send the data for a kernel read from ready readahead slots */
+static int ra_serve(struct ctx* ctx, struct nbd_conn* conn, uint64_t handle,
+                    uint64_t offset, uint32_t len)
+{
+    struct readahead* ra = &ctx->ra;
+    uint8_t hdr[NBD_REPLY_SIZE];
+    struct iovec iov[RA_MAX_IOV];
+    uint64_t pos, end = offset + len;
+    int i, n_iov;
+
+    put_be32(hdr, NBD_REPLY_MAGIC);
+    put_be32(hdr + 4, 0);
+    memcpy(hdr + 8, &handle, sizeof(handle));
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = sizeof(hdr);
+    n_iov = 1;
+
+    for (pos = offset; pos < end && n_iov < RA_MAX_IOV;)
+    {
+        struct ra_slot* slot;
+        uint64_t slot_end;
+
+        i = ra_find(ra, pos);
+        slot = &ra->slots[i];
+        slot_end = slot->offset + slot->len;
+
+        iov[n_iov].iov_base = ra->ring + (size_t)i * ra->seg_size +
+                              (pos - slot->offset);
+        iov[n_iov].iov_len = (slot_end < end ? slot_end : end) - pos;
+        pos += iov[n_iov].iov_len;
+        n_iov++;
+    }
+
+    if (pos < end)
+        return -1;
+
+    ra->hits++;
+    ra->hit_bytes += len;
+
+    return kernel_reply(ctx, conn, iov, n_iov);
+}
+
+static int ra_issue(struct ctx* ctx, uint32_t i, int stream, uint64_t offset,
+                    uint32_t len, uint64_t now)
+{
+    struct readahead* ra = &ctx->ra;
+    struct ra_slot* slot = &ra->slots[i];
+    struct nbd_inflight_req req;
+    uint8_t hdr[NBD_REQUEST_SIZE];
+
+    req.handle = ctx->next_handle++;
+    req.client_handle = 0;
+    req.conn = -1;
+    req.offset = offset;
+    req.len = len;
+    req.type = NBD_CMD_READ;
+    req.flags = 0;
+    req.t_submit = now;
+    req.ra_slot = i;
+    req.data = NULL;
+    req.hash = 0;
+    req.resumed = false;
+
+    put_be32(hdr, NBD_REQUEST_MAGIC);
+    put_be32(hdr + 4, NBD_CMD_READ);
+    memcpy(hdr + 8, &req.handle, sizeof(req.handle));
+    put_be64(hdr + 16, offset);
+    put_be32(hdr + 24, len);
+
+    stream_sent(ctx, stream, &req);
+
+    if (inflight_add(&ctx->inflight, &req))
+        return -1;
+
+    if (outq_add(stream_out(ctx, stream), hdr, sizeof(hdr), true))
+        return -1;
+
+    qos_charge(ctx, NBD_CMD_READ, len);
+
+    slot->state = RA_INFLIGHT;
+    slot->offset = offset;
+    slot->len = len;
+    slot->filled = 0;
+    slot->t_submit = now;
+
+    ra->issued++;
+    ra->issued_bytes += len;
+    return 0;
+}
+
+/* Top up the readahead window ahead of the kernel's last read */
+static int ra_fill(struct ctx* ctx, uint64_t now)
+{
+    struct readahead* ra = &ctx->ra;
+    uint32_t i, len;
+    int stream;
+
+    if (!ra->active)
+        return 0;
+
+    if (ra->next < ra->last_end)
+        ra->next = ra->last_end;
+
+    for (i = 0; i < ra->n_slots; i++)
+    {
+        if (ra->next - ra->last_end >= ra->window ||
+            ra->next >= ctx->nbd_export_size)
+            break;
+
+        if (ra->slots[i].state != RA_EMPTY)
+            continue;
+
+        stream = stream_pick(ctx);
+        if (stream < 0 || !qos_admit(ctx, now))
+            break;
+
+        len = ra->seg_size;
+        if (ra->next + len > ctx->nbd_export_size)
+            len = ctx->nbd_export_size - ra->next;
+
+        if (ra_issue(ctx, i, stream, ra->next, len, now))
+            return -1;
+
+        ra->next += len;
+    }
+
+    return 0;
+}
+
+/* Handle a kernel read with readahead. Returns 1 if the read has been served
+ * or will be served from readahead data, 0 if it should be forwarded to the
+ * server, or -1 on failure. */
+static int ra_read(struct ctx* ctx, struct nbd_conn* conn, uint64_t handle,
+                   uint64_t offset, uint32_t len, uint64_t now)
+{
+    struct readahead* ra = &ctx->ra;
+    struct ra_waiter* w;
+    bool ready;
+    int rc;
+
+    if (ra->active && ra_covered(ra, offset, len, &ready))
+    {
+        if (ready && kernel_reply_ready(ctx, conn, NBD_REPLY_SIZE + len))
+        {
+            rc = ra_serve(ctx, conn, handle, offset, len);
+            if (rc)
+                return rc;
+            stats_reply(ctx, NBD_CMD_READ, 0, now_us() - now);
+            trace_local_read(ctx, conn - ctx->conns, handle, offset, len, 0,
+                             now);
+        }
+        else if (!ready && ra->n_waiters < RA_MAX_WAITERS)
+        {
+            w = &ra->waiters[ra->n_waiters++];
+            w->conn = conn - ctx->conns;
+            w->handle = handle;
+            w->offset = offset;
+            w->len = len;
+            w->t_submit = now;
+            ra->waits++;
+        }
+        else
+        {
+            goto forward;
+        }
+
+        if (offset + len > ra->last_end)
+            ra->last_end = offset + len;
+        ra_retire(ctx, ra->last_end);
+        return 1;
+    }
+
+forward:
+    if (offset == ra->last_end)
+    {
+        ra->seq_count++;
+    }
+    else if (ra->active || ra->seq_count)
+    {
+        ra_reset(ctx);
+    }
+
+    ra->last_end = offset + len;
+
+    if (!ra->active && ra->seq_count >= ra_seq_threshold)
+    {
+        ra->active = true;
+        ra->next = ra->last_end;
+    }
+
+    if (ra->active)
+        ra_retire(ctx, ra->last_end);
+
+    return 0;
+}
+
+/* The reply to one of our readahead requests has arrived; its payload (if
+ * any) follows. */
+static int ra_reply(struct ctx* ctx, const struct nbd_inflight_req* req,
+                    uint32_t error)
+{
+    struct readahead* ra = &ctx->ra;
+    struct ra_slot* slot = &ra->slots[req->ra_slot];
+    int i, rc;
+
+    if (!error)
+    {
+        ra->cur_slot = req->ra_slot;
+        return 0;
+    }
+
+    /* fail any kernel reads that were depending on this data; they would
+     * have seen the same error from the server */
+    for (i = 0; i < ra->n_waiters;)
+    {
+        struct ra_waiter* w = &ra->waiters[i];
+
+        if (slot->state == RA_STALE || w->offset >= slot->offset + slot->len ||
+            slot->offset >= w->offset + w->len)
+        {
+            i++;
+            continue;
+        }
+
+        rc = kernel_reply_error(ctx, &ctx->conns[w->conn], w->handle, error);
+        if (rc)
+            return rc;
+        stats_reply(ctx, NBD_CMD_READ, error, now_us() - w->t_submit);
+        trace_local_read(ctx, w->conn, w->handle, w->offset, w->len, error,
+                         w->t_submit);
+        *w = ra->waiters[--ra->n_waiters];
+    }
+
+    slot->state = RA_EMPTY;
+    ra_reset(ctx);
+    return 0;
+}
+
+static void ra_payload(struct ctx* ctx, const uint8_t* buf, size_t len)
+{
+    struct readahead* ra = &ctx->ra;
+    struct ra_slot* slot = &ra->slots[ra->cur_slot];
+
+    memcpy(ra->ring + (size_t)ra->cur_slot * ra->seg_size + slot->filled, buf,
+           len);
+    slot->filled += len;
+}
+
+static uint64_t ewma(uint64_t avg, uint64_t sample)
+{
+    return avg ? (avg * 7 + sample) / 8 : sample;
+}
+
+/* Serve any waiting kernel reads whose data is now ready, and for which
+ * there is space to queue the reply. Waiters that can't be served yet are
+ * retried on the next readahead completion, or once output has drained. */
+static int ra_serve_waiters(struct ctx* ctx, uint64_t now)
+{
+    struct readahead* ra = &ctx->ra;
+    struct nbd_conn* conn;
+    bool ready;
+    int i, rc;
+
+    for (i = 0; i < ra->n_waiters;)
+    {
+        struct ra_waiter* w = &ra->waiters[i];
+
+        conn = &ctx->conns[w->conn];
+        if (!ra_covered(ra, w->offset, w->len, &ready) || !ready ||
+            !kernel_reply_ready(ctx, conn, NBD_REPLY_SIZE + w->len))
+        {
+            i++;
+            continue;
+        }
+
+        rc = ra_serve(ctx, conn, w->handle, w->offset, w->len);
+        if (rc)
+            return rc;
+        stats_reply(ctx, NBD_CMD_READ, 0, now - w->t_submit);
+        trace_local_read(ctx, w->conn, w->handle, w->offset, w->len, 0,
+                         w->t_submit);
+        *w = ra->waiters[--ra->n_waiters];
+    }
+
+    ra_retire(ctx, ra->last_end);
+    return 0;
+}
+
+static int ra_complete(struct ctx* ctx, uint64_t now)
+{
+    struct readahead* ra = &ctx->ra;
+    struct ra_slot* slot = &ra->slots[ra->cur_slot];
+    uint64_t busy, bdp;
+
+    ra->cur_slot = -1;
+
+    if (slot->state == RA_STALE)
+    {
+        ra->discarded_bytes += slot->len;
+        slot->state = RA_EMPTY;
+        return 0;
+    }
+
+    slot->state = RA_READY;
+
+    /* The time this reply spent on the link is from its submission, or the
+     * previous completion if that was later, as replies queue behind each
+     * other. That gives us a throughput estimate, and with the round-trip
+     * time, the amount of data we need in flight to keep the link busy. */
+    busy = now - (slot->t_submit > ra->last_complete ? slot->t_submit
+                                                     : ra->last_complete);
+    ra->bw = ewma(ra->bw, (uint64_t)slot->len * 1000000 / (busy ? busy : 1));
+    ra->rtt_us = ewma(ra->rtt_us, now - slot->t_submit);
+    ra->last_complete = now;
+
+    bdp = ra->bw * ra->rtt_us / 1000000 + ra->seg_size;
+    bdp = (bdp + ra->seg_size - 1) / ra->seg_size * ra->seg_size;
+    if (bdp < ra->window_min)
+        bdp = ra->window_min;
+    if (bdp > ra->window_max)
+        bdp = ra->window_max;
+    ra->window = bdp;
+
+    return ra_serve_waiters(ctx, now);
+}
+
+static struct json_object* ra_json(struct ctx* ctx)
+{
+    struct readahead* ra = &ctx->ra;
+    struct json_object* obj = json_object_new_object();
+
+    json_object_object_add(obj, "enabled",
+                           json_object_new_boolean(ra_enabled(ctx)));
+    json_object_object_add(obj, "active", json_object_new_boolean(ra->active));
+    json_object_object_add(obj, "window", json_object_new_int64(ra->window));
+    json_object_object_add(obj, "rtt_us", json_object_new_int64(ra->rtt_us));
+    json_object_object_add(obj, "bandwidth", json_object_new_int64(ra->bw));
+    json_object_object_add(obj, "issued", json_object_new_int64(ra->issued));
+    json_object_object_add(obj, "issued_bytes",
+                           json_object_new_int64(ra->issued_bytes));
+    json_object_object_add(obj, "hits", json_object_new_int64(ra->hits));
+    json_object_object_add(obj, "hit_bytes",
+                           json_object_new_int64(ra->hit_bytes));
+    json_object_object_add(obj, "waits", json_object_new_int64(ra->waits));
+    json_object_object_add(obj, "discarded_bytes",
+                           json_object_new_int64(ra->discarded_bytes));
+    return obj;
+}
+
+static size_t tune_pow2(size_t val)
+{
+    size_t n = tune_size_min;
+
+    while (n < val && n < tune_size_max)
+        n <<= 1;
+    return n;
+}
+
+/* The next size for a resource that's @cur now, given what an average
+ * message needs, and whether its queue has stalled */
+static size_t tune_next(size_t cur, size_t need, bool stalled, size_t min,
+                        size_t max)
+{
+    size_t next = tune_pow2(need);
+
+    if (stalled && next < cur * 2)
+        next = cur * 2;
+    else if (next < cur && next * 2 > cur)
+        next = cur;
+
+    if (next < min)
+        next = min;
+    if (next > max)
+        next = max;
+    return next;
+}
+
+/* Set a pipe's capacity, returning what the kernel gave us. It rounds up
+ * to a power-of-two number of pages, and refuses to shrink a pipe below
+ * what's in it, or grow it past the system limit for unprivileged users;
+ * in those cases we keep the current size. A zero @size just reads the
+ * current capacity. */
+static size_t pipe_resize(int fd, size_t size)
+{
+    int rc = -1;
+
+    if (size)
+        rc = fcntl(fd, F_SETPIPE_SZ, (int)size);
+    if (rc < 0)
+        rc = fcntl(fd, F_GETPIPE_SZ);
+    return rc < 0 ? 0 : (size_t)rc;
+}
+
+static bool fd_is_pipe(int fd)
+{
+    struct stat st;
+
+    return fd >= 0 && !fstat(fd, &st) && S_ISFIFO(st.st_mode);
+}
+
+/* Set the send buffer size of our end of each kernel socket. As root, we
+ * can go beyond the system's wmem_max. Returns the size reported by the
+ * kernel, which includes its bookkeeping overhead. */
+static size_t sock_resize(struct ctx* ctx, size_t size)
+{
+    socklen_t len = sizeof(int);
+    int i, val = size;
+
+    for (i = 0; size && i < ctx->n_conns; i++)
+    {
+        if (setsockopt(ctx->conns[i].fd, SOL_SOCKET, SO_SNDBUFFORCE, &val,
+                       sizeof(val)))
+            setsockopt(ctx->conns[i].fd, SOL_SOCKET, SO_SNDBUF, &val,
+                       sizeof(val));
+    }
+
+    if (!ctx->n_conns ||
+        getsockopt(ctx->conns[0].fd, SOL_SOCKET, SO_SNDBUF, &val, &len))
+        return 0;
+    return val;
+}
+
+static uint64_t tune_conn_stalls(struct ctx* ctx)
+{
+    uint64_t stalls = 0;
+    int i;
+
+    for (i = 0; i < ctx->n_conns; i++)
+        stalls += ctx->conns[i].out.stalls;
+    return stalls;
+}
+
+/* Apply the configured starting sizes, once the session's fds are set up.
+ * The stdio pipe sizes are only managed if they're actually pipes. */
+static void tune_init(struct ctx* ctx)
+{
+    struct config* config = ctx->config;
+    struct tuning* tune = &ctx->tune;
+
+    memset(tune, 0, sizeof(*tune));
+
+    if (fd_is_pipe(ctx->rep_in.fd))
+        tune->pipe_in = pipe_resize(ctx->rep_in.fd,
+                                    config->pipe_size_max
+                                        ? config->pipe_size_min
+                                        : 0);
+    if (fd_is_pipe(ctx->req_out.fd))
+        tune->pipe_out = pipe_resize(ctx->req_out.fd,
+                                     config->pipe_size_max
+                                         ? config->pipe_size_min
+                                         : 0);
+
+    tune->sock_buf = sock_resize(ctx, config->sock_buf_max
+                                          ? config->sock_buf_min
+                                          : 0);
+
+    tune->chunk = config->chunk_min ? config->chunk_min : ctx->bufsize;
+}
+
+static void tune_adjust(struct ctx* ctx)
+{
+    struct nbd_cmd_stats* rd = &ctx->stats[NBD_STATS_READ];
+    struct nbd_cmd_stats* wr = &ctx->stats[NBD_STATS_WRITE];
+    struct config* config = ctx->config;
+    struct tuning* tune = &ctx->tune;
+    size_t avg_read = 0, avg_write = 0, size;
+    uint64_t conn_stalls;
+    bool out_stalled;
+
+    if (rd->requests > tune->reads)
+        avg_read = (rd->bytes - tune->read_bytes) /
+                   (rd->requests - tune->reads);
+    if (wr->requests > tune->writes)
+        avg_write = (wr->bytes - tune->write_bytes) /
+                    (wr->requests - tune->writes);
+
+    conn_stalls = tune_conn_stalls(ctx);
+    out_stalled = ctx->req_out.stalls > tune->out_stalls;
+
+    /* the server's pipe carries read replies, and ours write requests */
+    if (tune->pipe_in && config->pipe_size_max)
+    {
+        size = tune_next(tune->pipe_in, avg_read + NBD_REPLY_SIZE, false,
+                         config->pipe_size_min, config->pipe_size_max);
+        if (size != tune->pipe_in)
+        {
+            tune->pipe_in = pipe_resize(ctx->rep_in.fd, size);
+            tune->changes++;
+        }
+    }
+
+    if (tune->pipe_out && config->pipe_size_max)
+    {
+        size = tune_next(tune->pipe_out, avg_write + NBD_REQUEST_SIZE,
+                         out_stalled, config->pipe_size_min,
+                         config->pipe_size_max);
+        if (size != tune->pipe_out)
+        {
+            tune->pipe_out = pipe_resize(ctx->req_out.fd, size);
+            tune->changes++;
+        }
+    }
+
+    /* our send buffers hold read replies for the kernel. The kernel
+     * reports twice what we set, so compare against half of that. */
+    if (tune->sock_buf && config->sock_buf_max)
+    {
+        size = tune_next(tune->sock_buf / 2, avg_read + NBD_REPLY_SIZE,
+                         conn_stalls > tune->conn_stalls,
+                         config->sock_buf_min, config->sock_buf_max);
+        if (size != tune->sock_buf / 2)
+        {
+            tune->sock_buf = sock_resize(ctx, size);
+            tune->changes++;
+        }
+    }
+
+    if (config->chunk_max)
+    {
+        size = tune_next(tune->chunk,
+                         avg_read > avg_write ? avg_read : avg_write, false,
+                         config->chunk_min ? config->chunk_min : ctx->bufsize,
+                         config->chunk_max);
+        if (size != tune->chunk)
+        {
+            tune->chunk = size;
+            tune->changes++;
+        }
+    }
+
+    tune->reads = rd->requests;
+    tune->read_bytes = rd->bytes;
+    tune->writes = wr->requests;
+    tune->write_bytes = wr->bytes;
+    tune->out_stalls = ctx->req_out.stalls;
+    tune->conn_stalls = conn_stalls;
+}
+
+/* Called after each pass of the proxy; adjusts sizes once enough requests
+ * have gone by to say something about the traffic */
+static void tune_check(struct ctx* ctx)
+{
+    uint64_t requests = ctx->stats[NBD_STATS_READ].requests +
+                        ctx->stats[NBD_STATS_WRITE].requests;
+
+    if (requests - ctx->tune.requests < tune_interval)
+        return;
+
+    ctx->tune.requests = requests;
+    tune_adjust(ctx);
+}
+
+static struct json_object* tune_json(struct ctx* ctx)
+{
+    struct tuning* tune = &ctx->tune;
+    struct json_object* obj = json_object_new_object();
+
+    json_object_object_add(obj, "pipe_in", json_object_new_int64(tune->pipe_in));
+    json_object_object_add(obj, "pipe_out",
+                           json_object_new_int64(tune->pipe_out));
+    json_object_object_add(obj, "socket_buffer",
+                           json_object_new_int64(tune->sock_buf));
+    json_object_object_add(obj, "chunk", json_object_new_int64(tune->chunk));
+    json_object_object_add(obj, "changes",
+                           json_object_new_int64(tune->changes));
+    return obj;
+}
+
+static struct json_object* resume_json(struct ctx* ctx)
+{
+    struct resume* rs = &ctx->resume;
+    struct json_object* obj = json_object_new_object();
+    const char* state = "attached";
+
+    if (rs->detached)
+        state = "detached";
+    else if (rs->replay_pos < rs->n_replay)
+        state = "replaying";
+
+    json_object_object_add(obj, "state", json_object_new_string(state));
+    json_object_object_add(obj, "resumes", json_object_new_int64(rs->resumes));
+    json_object_object_add(obj, "replayed",
+                           json_object_new_int64(rs->replayed));
+    json_object_object_add(obj, "detached_us",
+                           json_object_new_int64(rs->detached_us));
+    return obj;
+}
+
+/* Striping: the server streams in use, and the requests sent on each */
+static struct json_object* streams_json(struct ctx* ctx)
+{
+    struct striping* sp = &ctx->striping;
+    struct json_object *obj = json_object_new_object(), *list, *stream;
+    int i;
+
+    json_object_object_add(
+        obj, "policy",
+        json_object_new_string(ctx->config->stream_policy == STREAM_ROUND_ROBIN
+                                   ? "round-robin"
+                                   : "least-loaded"));
+    json_object_object_add(obj, "configured",
+                           json_object_new_int(ctx->config->streams));
+    json_object_object_add(obj, "active", json_object_new_int(sp->n + 1));
+    json_object_object_add(obj, "joins", json_object_new_int64(sp->joins));
+
+    list = json_object_new_array();
+    for (i = 0; i <= sp->n; i++)
+    {
+        stream = json_object_new_object();
+        json_object_object_add(stream, "requests",
+                               json_object_new_int64(sp->requests[i]));
+        json_object_object_add(stream, "load",
+                               json_object_new_int64(sp->load[i]));
+        json_object_array_add(list, stream);
+    }
+    json_object_object_add(obj, "streams", list);
+    return obj;
+}
+
+/* Rate limiting: how often, and for how long, the session was held back */
+static struct json_object* qos_json(struct ctx* ctx)
+{
+    struct qos* q = &ctx->qos;
+    struct json_object* obj = json_object_new_object();
+
+    json_object_object_add(
+        obj, "priority",
+        json_object_new_string(ctx->config->bulk ? "bulk" : "interactive"));
+    json_object_object_add(obj, "rate_limit",
+                           json_object_new_int64(ctx->config->rate_limit));
+    json_object_object_add(obj, "iops_limit",
+                           json_object_new_int64(ctx->config->iops_limit));
+    json_object_object_add(
+        obj, "shared_bandwidth",
+        json_object_new_int64(qos_shared ? ctx->qos_bandwidth : 0));
+    json_object_object_add(obj, "throttled",
+                           json_object_new_boolean(q->blocked));
+    json_object_object_add(obj, "throttles",
+                           json_object_new_int64(q->throttles));
+    json_object_object_add(obj, "throttled_us",
+                           json_object_new_int64(q->throttled_us));
+    return obj;
+}
+
+/* Trace progress: records queued, and those written out or dropped */
+static struct json_object* trace_json(struct ctx* ctx)
+{
+    struct trace* trace = ctx->trace;
+    struct json_object* obj = json_object_new_object();
+
+    json_object_object_add(
+        obj, "records", json_object_new_int64(atomic_load(&trace->head)));
+    json_object_object_add(
+        obj, "written", json_object_new_int64(atomic_load(&trace->tail)));
+    json_object_object_add(obj, "dropped",
+                           json_object_new_int64(trace->dropped));
+    return obj;
+}
+
+static const char* parser_state_name(enum nbd_parse_state state)
+{
+    switch (state)
+    {
+        case NBD_PARSE_REQUEST:
+        case NBD_PARSE_REPLY:
+            return "transmission";
+        default:
+            return "handshake";
+    }
+}
+
+static struct json_object* stats_dir_json(uint64_t bytes, uint64_t forward_us,
+                                          uint64_t stalls)
+{
+    struct json_object* obj = json_object_new_object();
+
+    json_object_object_add(obj, "bytes", json_object_new_int64(bytes));
+    json_object_object_add(obj, "forward_us",
+                           json_object_new_int64(forward_us));
+    json_object_object_add(obj, "stalls", json_object_new_int64(stalls));
+    return obj;
+}
+
+static bool uring_active(struct ctx* ctx)
+{
+#ifdef HAVE_LIBURING
+    return ctx->uring != NULL;
+#else
+    (void)ctx;
+    return false;
+#endif
+}
+
+/* Record the first time we reach @phase */
+static void setup_phase(struct ctx* ctx, enum setup_phase phase, uint64_t now)
+{
+    if (!ctx->t_phase[phase])
+        ctx->t_phase[phase] = now;
+}
+
+/* The time of each phase reached so far, relative to the session's start */
+static struct json_object* setup_phases_json(struct ctx* ctx)
+{
+    struct json_object* obj = json_object_new_object();
+    int i;
+
+    for (i = SETUP_START + 1; i < SETUP_N_PHASES; i++)
+    {
+        if (!ctx->t_phase[i])
+            continue;
+        json_object_object_add(
+            obj, setup_phase_names[i],
+            json_object_new_int64(ctx->t_phase[i] - ctx->t_phase[SETUP_START]));
+    }
+
+    return obj;
+}
+
+/* Write the setup timings to stderr as a single line of JSON, once the
+ * device is ready, or when the session ends without getting there */
+static void setup_report(struct ctx* ctx)
+{
+    struct json_object* obj;
+
+    if (ctx->setup_reported || !ctx->t_phase[SETUP_START])
+        return;
+
+    obj = json_object_new_object();
+    json_object_object_add(obj, "config",
+                           json_object_new_string(ctx->config->name));
+    json_object_object_add(
+        obj, "method",
+        json_object_new_string(ctx->nbd_netlink ? "netlink" : "nbd-client"));
+    json_object_object_add(obj, "setup_us", setup_phases_json(ctx));
+    fprintf(stderr, "%s\n",
+            json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN));
+    json_object_put(obj);
+
+    ctx->setup_reported = true;
+}
+
+/* Device setup timings, relative to the start of client setup, and the
+ * time of each phase since the start of the session. Zero values indicate
+ * that the phase has not been reached yet. */
+static struct json_object* setup_json(struct ctx* ctx)
+{
+    uint64_t t_client = ctx->t_phase[SETUP_CLIENT];
+    uint64_t connect_us = 0, ready_us = 0;
+    struct json_object *obj, *blocks;
+
+    if (ctx->t_phase[SETUP_CONNECTED])
+        connect_us = ctx->t_phase[SETUP_CONNECTED] - t_client;
+    if (ctx->t_phase[SETUP_READY])
+        ready_us = ctx->t_phase[SETUP_READY] - t_client;
+
+    obj = json_object_new_object();
+    json_object_object_add(
+        obj, "method",
+        json_object_new_string(ctx->nbd_netlink ? "netlink" : "nbd-client"));
+    json_object_object_add(obj, "connect_us",
+                           json_object_new_int64(connect_us));
+    json_object_object_add(obj, "ready_us", json_object_new_int64(ready_us));
+    json_object_object_add(obj, "phases_us", setup_phases_json(ctx));
+    json_object_object_add(
+        obj, "io_backend",
+        json_object_new_string(uring_active(ctx) ? "io_uring" : "epoll"));
+    json_object_object_add(obj, "structured_replies",
+                           json_object_new_boolean(ctx->nbd_structured));
+
+    if (ctx->nbd_block_pref)
+    {
+        blocks = json_object_new_object();
+        json_object_object_add(blocks, "min",
+                               json_object_new_int64(ctx->nbd_block_min));
+        json_object_object_add(blocks, "preferred",
+                               json_object_new_int64(ctx->nbd_block_pref));
+        json_object_object_add(blocks, "max",
+                               json_object_new_int64(ctx->nbd_block_max));
+        json_object_object_add(obj, "block_size", blocks);
+    }
+    return obj;
+}
+
+static struct json_object* stats_json(struct ctx* ctx)
+{
+    struct json_object *obj, *cmds;
+    uint64_t bytes, forward_us, stalls;
+    int i, j;
+
+    obj = json_object_new_object();
+    json_object_object_add(obj, "config",
+                           json_object_new_string(ctx->config->name));
+    json_object_object_add(obj, "device",
+                           json_object_new_string(ctx->config->nbd_device));
+    json_object_object_add(
+        obj, "phase",
+        json_object_new_string(parser_state_name(ctx->rep_parser.state)));
+    json_object_object_add(obj, "setup", setup_json(ctx));
+
+    cmds = json_object_new_object();
+    for (i = 0; i < NBD_STATS_N_CMDS; i++)
+    {
+        struct nbd_cmd_stats* stats = &ctx->stats[i];
+        struct json_object *cmd, *hist;
+
+        cmd = json_object_new_object();
+        json_object_object_add(cmd, "requests",
+                               json_object_new_int64(stats->requests));
+        json_object_object_add(cmd, "bytes",
+                               json_object_new_int64(stats->bytes));
+        json_object_object_add(cmd, "errors",
+                               json_object_new_int64(stats->errors));
+        json_object_object_add(cmd, "inflight",
+                               json_object_new_int64(stats->inflight));
+        json_object_object_add(cmd, "inflight_max",
+                               json_object_new_int64(stats->inflight_max));
+        json_object_object_add(cmd, "latency_total_us",
+                               json_object_new_int64(stats->latency_total_us));
+        json_object_object_add(cmd, "latency_max_us",
+                               json_object_new_int64(stats->latency_max_us));
+
+        hist = json_object_new_array();
+        for (j = 0; j < NBD_STATS_HIST_BUCKETS; j++)
+            json_object_array_add(hist,
+                                  json_object_new_int64(stats->latency_hist[j]));
+        json_object_object_add(cmd, "latency_hist", hist);
+
+        json_object_object_add(cmds, nbd_stats_cmd_names[i], cmd);
+    }
+    json_object_object_add(obj, "commands", cmds);
+
+    json_object_object_add(obj, "connections",
+                           json_object_new_int(ctx->n_conns));
+
+    for (i = 0, bytes = 0; i < ctx->n_conns; i++)
+        bytes += ctx->conns[i].parser.bytes;
+    json_object_object_add(obj, "kernel_to_server",
+                           stats_dir_json(bytes, ctx->req_out.write_us,
+                                          ctx->req_out.stalls));
+
+    for (i = 0, forward_us = 0, stalls = 0; i < ctx->n_conns; i++)
+    {
+        forward_us += ctx->conns[i].out.write_us;
+        stalls += ctx->conns[i].out.stalls;
+    }
+    json_object_object_add(obj, "server_to_kernel",
+                           stats_dir_json(ctx->rep_parser.bytes, forward_us,
+                                          stalls));
+    json_object_object_add(obj, "cache", cache_json(ctx));
+    json_object_object_add(obj, "readahead", ra_json(ctx));
+    json_object_object_add(obj, "tuning", tune_json(ctx));
+    json_object_object_add(obj, "resume", resume_json(ctx));
+    if (ctx->config->streams > 1)
+        json_object_object_add(obj, "striping", streams_json(ctx));
+    if (ctx->qos.enabled)
+        json_object_object_add(obj, "qos", qos_json(ctx));
+    if (ctx->trace)
+        json_object_object_add(obj, "trace", trace_json(ctx));
+
+    return obj;
+}
+
+/* Accept a connection on the stats socket, write our current statistics as
+ * a single JSON object, and close. */
+static void stats_process(struct ctx* ctx)
+{
+    struct json_object* obj;
+    const char* str;
+    int sd;
+
+    sd = accept4(ctx->stats_sock, NULL, NULL, SOCK_CLOEXEC);
+    if (sd < 0)
+    {
+        warn("can't accept stats connection");
+        return;
+    }
+
+    obj = stats_json(ctx);
+    str = json_object_get_string(obj);
+
+    /* don't let a stalled reader hold up the proxy */
+    if (send(sd, str, strlen(str), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        warn("can't send stats");
+
+    json_object_put(obj);
+    close(sd);
+}
+
+static bool parser_structured(struct nbd_parser* parser)
+{
+    return parser->state == NBD_PARSE_REPLY && parser->hdr_len >= 4 &&
+           get_be32(parser->hdr) == NBD_STRUCTURED_REPLY_MAGIC;
+}
+
+/* The magic tells us whether a reply is simple or structured; for a
+ * structured reply chunk, the type tells us how much of it to parse. */
+static size_t reply_hdr_size(struct nbd_parser* parser)
+{
+    uint16_t type;
+
+    if (!parser_structured(parser))
+        return NBD_REPLY_SIZE;
+
+    if (parser->hdr_len < NBD_STRUCTURED_REPLY_SIZE)
+        return NBD_STRUCTURED_REPLY_SIZE;
+
+    type = get_be16(parser->hdr + 6);
+    if (type == NBD_REPLY_TYPE_OFFSET_DATA)
+        return NBD_STRUCTURED_REPLY_SIZE + NBD_CHUNK_DATA_SIZE;
+    if (type == NBD_REPLY_TYPE_OFFSET_HOLE)
+        return NBD_STRUCTURED_REPLY_SIZE + NBD_CHUNK_HOLE_SIZE;
+    if (type & NBD_REPLY_TYPE_ERROR_BIT)
+        return NBD_STRUCTURED_REPLY_SIZE + NBD_CHUNK_ERROR_SIZE;
+
+    return NBD_STRUCTURED_REPLY_SIZE;
+}
+
+static size_t parser_hdr_size(struct nbd_parser* parser)
+{
+    switch (parser->state)
+    {
+        case NBD_PARSE_GREETING:
+            return NBD_GREETING_SIZE;
+        case NBD_PARSE_CFLAGS:
+            return NBD_CFLAGS_SIZE;
+        case NBD_PARSE_OPTION:
+            return NBD_OPTION_SIZE;
+        case NBD_PARSE_OPTION_REPLY:
+            return NBD_OPTION_REPLY_SIZE;
+        case NBD_PARSE_OPTION_INFO:
+            return NBD_INFO_EXPORT_SIZE;
+        case NBD_PARSE_EXPORT_INFO:
+            return NBD_EXPORT_INFO_SIZE;
+        case NBD_PARSE_REQUEST:
+            return NBD_REQUEST_SIZE;
+        case NBD_PARSE_REPLY:
+            return reply_hdr_size(parser);
+    }
+    return 0;
+}
+
+/* Handle a complete header from the kernel side: client flags and options
+ * during the handshake, then requests during transmission. */
+static int parse_req_hdr(struct ctx* ctx, struct nbd_conn* conn, uint64_t now)
+{
+    struct nbd_parser* parser = &conn->parser;
+    struct nbd_inflight_req req;
+    const uint8_t* hdr = parser->hdr;
+    uint32_t opt;
+    int rc, stream;
+
+    switch (parser->state)
+    {
+        case NBD_PARSE_CFLAGS:
+            ctx->nbd_client_flags = get_be32(hdr);
+            parser->state = NBD_PARSE_OPTION;
+            break;
+
+        case NBD_PARSE_OPTION:
+            if (get_be64(hdr) != NBD_OPTS_MAGIC)
+            {
+                warnx("invalid option magic from nbd client");
+                return -1;
+            }
+            opt = get_be32(hdr + 8);
+            parser->skip = get_be32(hdr + 12);
+            ctx->nbd_pending_opt = opt;
+
+            /* EXPORT_NAME has no option reply; the server goes straight
+             * to the export details, and then transmission */
+            if (opt == NBD_OPT_EXPORT_NAME)
+            {
+                parser->state = NBD_PARSE_REQUEST;
+                ctx->rep_parser.state = NBD_PARSE_EXPORT_INFO;
+            }
+            break;
+
+        case NBD_PARSE_REQUEST:
+            if (get_be32(hdr) != NBD_REQUEST_MAGIC)
+            {
+                warnx("invalid request magic from nbd client");
+                return -1;
+            }
+            req.type = get_be32(hdr + 4) & 0xffff;
+            req.flags = get_be32(hdr + 4) >> 16;
+            req.client_handle = get_handle(hdr + 8);
+            req.conn = conn - ctx->conns;
+            req.offset = get_be64(hdr + 16);
+            req.len = get_be32(hdr + 24);
+            req.t_submit = now;
+            req.ra_slot = -1;
+            req.stream = 0;
+            req.data = NULL;
+            req.hash = 0;
+            req.resumed = false;
+
+            if (req.type == NBD_CMD_WRITE)
+                parser->skip = req.len;
+
+            stats_request(ctx, req.type, req.len);
+
+            if (req.type == NBD_CMD_READ && cache_enabled(ctx))
+            {
+                rc = cache_read(ctx, conn, hdr, req.offset, req.len);
+                if (rc < 0)
+                    return -1;
+                if (rc)
+                {
+                    parser->forward = false;
+                    stats_reply(ctx, req.type, 0, now_us() - now);
+                    trace_local_read(ctx, req.conn, req.client_handle,
+                                     req.offset, req.len, 0, now);
+                    break;
+                }
+            }
+
+            if (req.type == NBD_CMD_READ && ra_enabled(ctx))
+            {
+                rc = ra_read(ctx, conn, req.client_handle, req.offset,
+                             req.len, now);
+                if (rc < 0)
+                    return -1;
+                if (rc)
+                {
+                    parser->forward = false;
+                    break;
+                }
+            }
+
+            qos_charge(ctx, req.type, req.len);
+
+            /* the server sees our handle, not the kernel's */
+            req.handle = ctx->next_handle++;
+            memcpy(parser->hdr + 8, &req.handle, sizeof(req.handle));
+
+            /* the kernel disconnects each of its sockets, but the server
+             * only needs to hear about it once */
+            if (req.type == NBD_CMD_DISC)
+            {
+                parser->forward = !ctx->disc_sent;
+                parser->out = &ctx->req_out;
+                ctx->disc_sent = true;
+                if (ctx->trace)
+                    trace_log(ctx, &req, 0, now, 0, 0);
+                break;
+            }
+
+            if (req.type == NBD_CMD_WRITE && trace_hashing(ctx))
+            {
+                conn->trace_hash = trace_hash_init;
+                conn->trace_handle = req.handle;
+            }
+
+            /* the write's data would be gone by the time we needed to send
+             * it again */
+            if (req.type == NBD_CMD_WRITE && req.len && resume_enabled(ctx))
+            {
+                req.data = malloc(req.len);
+                if (!req.data)
+                {
+                    warnx("can't allocate %u bytes for write data", req.len);
+                    return -1;
+                }
+                conn->write_data = req.data;
+                conn->write_pos = 0;
+            }
+
+            /* the request, and any data, go whole to one server stream;
+             * parser_room() has made sure that one has space */
+            stream = stream_pick(ctx);
+            if (stream < 0)
+            {
+                warnx("no server stream for request");
+                return -1;
+            }
+            parser->out = stream_out(ctx, stream);
+            stream_sent(ctx, stream, &req);
+
+            if (inflight_add(&ctx->inflight, &req))
+            {
+                warn("can't track request");
+                return -1;
+            }
+            break;
+
+        default:
+            warnx("invalid request parser state %d", parser->state);
+            return -1;
+    }
+
+    return 0;
+}
+
+static void parser_payload(struct ctx* ctx, struct nbd_parser* parser,
+                           const uint8_t* buf, size_t len);
+
+/* Start the simple reply for the current structured reply */
+static int sreply_start(struct ctx* ctx, uint64_t now)
+{
+    struct nbd_structured_reply* sr = &ctx->sreply;
+    struct nbd_parser* parser = &ctx->rep_parser;
+    struct nbd_inflight_req* req = &sr->req;
+    uint8_t hdr[NBD_REPLY_SIZE];
+
+    sr->started = true;
+
+    if (req->ra_slot >= 0)
+        return ra_reply(ctx, req, sr->error);
+
+    if (req->type == NBD_CMD_READ && !sr->error && cache_enabled(ctx))
+        cache_fill_start(ctx, req->offset, req->len);
+
+    put_be32(hdr, NBD_REPLY_MAGIC);
+    put_be32(hdr + 4, sr->error);
+    memcpy(hdr + 8, &req->client_handle, sizeof(req->client_handle));
+
+    parser->out = &ctx->conns[req->conn].out;
+    stats_reply(ctx, req->type, sr->error, now - req->t_submit);
+    if (ctx->trace)
+        trace_reply_start(ctx, req, sr->error, now);
+
+    return outq_add(parser->out, hdr, sizeof(hdr), true);
+}
+
+/* Handle a structured reply chunk header. The chunk header itself is never
+ * forwarded; data chunk payloads are, as the parser's skip. */
+static int parse_structured_reply(struct ctx* ctx, uint64_t now)
+{
+    struct nbd_structured_reply* sr = &ctx->sreply;
+    struct nbd_parser* parser = &ctx->rep_parser;
+    const uint8_t* hdr = parser->hdr;
+    uint64_t handle, offset, end;
+    uint16_t flags, type;
+    uint32_t len, n;
+    size_t zlen;
+
+    if (!ctx->nbd_structured)
+    {
+        warnx("unexpected structured reply from nbd server");
+        return -1;
+    }
+
+    flags = get_be16(hdr + 4);
+    type = get_be16(hdr + 6);
+    handle = get_handle(hdr + 8);
+    len = get_be32(hdr + 16);
+
+    if (!sr->active)
+    {
+        if (inflight_take(&ctx->inflight, handle, &sr->req))
+        {
+            warnx("reply for unknown handle from nbd server");
+            return -1;
+        }
+        stream_done(ctx, &sr->req);
+        sr->active = true;
+        sr->started = sr->req.resumed;
+        sr->pos = sr->req.offset;
+        sr->error = 0;
+
+        /* the kernel already has the header of a reply we're completing */
+        if (sr->req.resumed)
+        {
+            ctx->resume.cont_pending = false;
+            parser->out = &ctx->conns[sr->req.conn].out;
+        }
+    }
+    else if (handle != sr->req.handle)
+    {
+        warnx("interleaved structured replies from nbd server");
+        return -1;
+    }
+
+    end = sr->req.offset + sr->req.len;
+
+    if (type == NBD_REPLY_TYPE_OFFSET_DATA ||
+        type == NBD_REPLY_TYPE_OFFSET_HOLE)
+    {
+        offset = get_be64(hdr + 20);
+        if (type == NBD_REPLY_TYPE_OFFSET_DATA)
+            n = len - NBD_CHUNK_DATA_SIZE;
+        else
+            n = get_be32(hdr + 28);
+
+        if (sr->req.type != NBD_CMD_READ || sr->error ||
+            len < NBD_CHUNK_DATA_SIZE ||
+            (type == NBD_REPLY_TYPE_OFFSET_HOLE &&
+             len != NBD_CHUNK_HOLE_SIZE) ||
+            offset != sr->pos || n > end - offset)
+        {
+            warnx("unexpected read reply chunk from nbd server");
+            return -1;
+        }
+
+        if (!sr->started && sreply_start(ctx, now))
+            return -1;
+
+        parser->forward = sr->req.ra_slot < 0;
+        sr->pos += n;
+
+        if (type == NBD_REPLY_TYPE_OFFSET_DATA)
+        {
+            parser->skip = n;
+        }
+        else
+        {
+            for (; n; n -= zlen)
+            {
+                zlen = n < sizeof(zero_buf) ? n : sizeof(zero_buf);
+                parser_payload(ctx, parser, zero_buf, zlen);
+                if (parser->forward &&
+                    outq_add(parser->out, zero_buf, zlen, false))
+                    return -1;
+            }
+        }
+    }
+    else if (type & NBD_REPLY_TYPE_ERROR_BIT)
+    {
+        /* the kernel has already been told the read succeeded */
+        if (sr->started || len < NBD_CHUNK_ERROR_SIZE)
+        {
+            warnx("unexpected error reply chunk from nbd server");
+            return -1;
+        }
+        sr->error = get_be32(hdr + 20);
+        if (!sr->error)
+            sr->error = EIO;
+        parser->skip = len - NBD_CHUNK_ERROR_SIZE;
+        parser->forward = false;
+    }
+    else if (type != NBD_REPLY_TYPE_NONE || len)
+    {
+        warnx("unsupported reply chunk type %d from nbd server", type);
+        return -1;
+    }
+
+    if (!(flags & NBD_REPLY_FLAG_DONE))
+        return 0;
+
+    sr->active = false;
+    req_data_free(ctx, &sr->req);
+
+    /* the last chunk's data may still be to come; if the stream is lost
+     * during it, the rest is resumed as for a simple reply */
+    ctx->rep_req = sr->req;
+
+    if (sr->req.type == NBD_CMD_READ && !sr->error && sr->pos != end)
+    {
+        warnx("incomplete read reply from nbd server");
+        return -1;
+    }
+
+    if (!sr->started && sreply_start(ctx, now))
+        return -1;
+
+    /* a readahead reply is complete once any payload has been parsed */
+    if (ctx->ra.cur_slot >= 0 && !parser->skip)
+        return ra_complete(ctx, now);
+
+    return 0;
+}
+
+/* Handle a complete header from the server side: greeting and option
+ * replies during the handshake, then replies during transmission. */
+static int parse_rep_hdr(struct ctx* ctx, uint64_t now)
+{
+    struct nbd_parser* parser = &ctx->rep_parser;
+    struct nbd_inflight_req req;
+    const uint8_t* hdr = parser->hdr;
+    uint32_t error;
+
+    switch (parser->state)
+    {
+        case NBD_PARSE_GREETING:
+            if (get_be64(hdr) != NBD_MAGIC ||
+                get_be64(hdr + 8) != NBD_OPTS_MAGIC)
+            {
+                warnx("invalid greeting from nbd server");
+                return -1;
+            }
+            setup_phase(ctx, SETUP_GREETING, now);
+            parser->state = NBD_PARSE_OPTION_REPLY;
+            break;
+
+        case NBD_PARSE_OPTION_REPLY:
+            if (get_be64(hdr) != NBD_REP_MAGIC)
+            {
+                warnx("invalid option reply magic from nbd server");
+                return -1;
+            }
+            parser->skip = get_be32(hdr + 16);
+
+            if (get_be32(hdr + 8) == NBD_OPT_GO &&
+                get_be32(hdr + 12) == NBD_REP_ACK)
+            {
+                parser->state = NBD_PARSE_REPLY;
+                ctx->conns[0].parser.state = NBD_PARSE_REQUEST;
+                setup_phase(ctx, SETUP_CONNECTED, now);
+            }
+            else if (get_be32(hdr + 12) == NBD_REP_INFO &&
+                     parser->skip == NBD_INFO_EXPORT_SIZE)
+            {
+                /* possibly export details: parse rather than skip */
+                parser->skip = 0;
+                parser->state = NBD_PARSE_OPTION_INFO;
+            }
+            break;
+
+        case NBD_PARSE_OPTION_INFO:
+            if (get_be16(hdr) == NBD_INFO_EXPORT)
+            {
+                ctx->nbd_export_size = get_be64(hdr + 2);
+                ctx->nbd_export_flags = get_be16(hdr + 10);
+            }
+            parser->state = NBD_PARSE_OPTION_REPLY;
+            break;
+
+        case NBD_PARSE_EXPORT_INFO:
+            ctx->nbd_export_size = get_be64(hdr);
+            ctx->nbd_export_flags = get_be16(hdr + 8);
+            if (!(ctx->nbd_client_flags & NBD_FLAG_C_NO_ZEROES))
+                parser->skip = NBD_EXPORT_INFO_PAD;
+            parser->state = NBD_PARSE_REPLY;
+            setup_phase(ctx, SETUP_CONNECTED, now);
+            break;
+
+        case NBD_PARSE_REPLY:
+            if (get_be32(hdr) == NBD_STRUCTURED_REPLY_MAGIC)
+                return parse_structured_reply(ctx, now);
+
+            if (get_be32(hdr) != NBD_REPLY_MAGIC)
+            {
+                warnx("invalid reply magic from nbd server");
+                return -1;
+            }
+            error = get_be32(hdr + 4);
+
+            if (inflight_take(&ctx->inflight, get_handle(hdr + 8), &req))
+            {
+                warnx("reply for unknown handle from nbd server");
+                return -1;
+            }
+            stream_done(ctx, &req);
+            req_data_free(ctx, &req);
+            ctx->rep_req = req;
+
+            /* the rest of a reply that was cut off: only its data goes to
+             * the kernel, which already has the header */
+            if (req.resumed)
+            {
+                if (error)
+                {
+                    warnx("error completing interrupted read from nbd "
+                          "server");
+                    return -1;
+                }
+                ctx->resume.cont_pending = false;
+                parser->skip = req.len;
+                parser->drop_hdr = true;
+                parser->out = &ctx->conns[req.conn].out;
+                return 0;
+            }
+
+            /* replies to our own requests are never forwarded */
+            if (req.ra_slot >= 0)
+            {
+                parser->forward = false;
+                if (!error)
+                    parser->skip = req.len;
+                return ra_reply(ctx, &req, error);
+            }
+
+            if (req.type == NBD_CMD_READ && !error)
+            {
+                parser->skip = req.len;
+                if (cache_enabled(ctx))
+                    cache_fill_start(ctx, req.offset, req.len);
+            }
+
+            memcpy(parser->hdr + 8, &req.client_handle,
+                   sizeof(req.client_handle));
+
+            /* route the reply to the socket that the request came from */
+            parser->out = &ctx->conns[req.conn].out;
+
+            stats_reply(ctx, req.type, error, now - req.t_submit);
+            if (ctx->trace)
+                trace_reply_start(ctx, &req, error, now);
+            break;
+
+        default:
+            warnx("invalid reply parser state %d", parser->state);
+            return -1;
+    }
+
+    return 0;
+}
+
+static void parser_payload(struct ctx* ctx, struct nbd_parser* parser,
+                           const uint8_t* buf, size_t len)
+{
+    struct trace* trace = ctx->trace;
+
+    if (parser == &ctx->rep_parser)
+    {
+        if (ctx->ra.cur_slot >= 0)
+            ra_payload(ctx, buf, len);
+        else if (cache_filling(ctx))
+            cache_fill(ctx, buf, len);
+
+        if (trace && trace->rep_pending && (trace->rep_flags & TRACE_F_HASH))
+            trace->rep_hash = trace_hash_update(trace->rep_hash, buf, len);
+    }
+}
+
+/* Is there space to queue the parser's next piece of output? For a reply
+ * header, we don't know which socket it's going to until it is parsed, so
+ * need space on all of them; a request may go on any server stream with
+ * space. */
+static bool parser_room(struct ctx* ctx, struct nbd_parser* parser)
+{
+    int i;
+
+    if (parser->skip)
+        return !parser->forward || outq_room(parser->out, 0, false);
+
+    if (parser->state == NBD_PARSE_REQUEST)
+        return stream_pick(ctx) >= 0;
+
+    if (parser != &ctx->rep_parser || parser->state != NBD_PARSE_REPLY)
+        return outq_room(parser->out, NBD_HDR_MAX, true);
+
+    for (i = 0; i < ctx->n_conns; i++)
+    {
+        if (!outq_room(&ctx->conns[i].out, NBD_HDR_MAX, true))
+            return false;
+        if (ctx->nbd_structured && ctx->conns[i].out.n_iov + NBD_ZERO_IOV_MAX +
+                                           OUTQ_RESERVE_IOV >=
+                                       OUTQ_MAX_IOV)
+            return false;
+    }
+
+    return true;
+}
+
+/* Feed up to @len bytes of the stream through @parser, handling each header
+ * as it is completed, and queueing forwarded data to the parser's outq.
+ * @conn is the kernel socket that the data came from, or NULL for data from
+ * the server. Returns the number of bytes consumed, which may be short if we
+ * stop at a message boundary to send queued replies, if the outq is full or
+ * the session is throttled, or -1 on failure. */
+static ssize_t parse_stream(struct ctx* ctx, struct nbd_conn* conn,
+                            struct nbd_parser* parser, const uint8_t* buf,
+                            size_t len, uint64_t now)
+{
+    bool is_req = conn != NULL;
+    size_t n, hdr_size, pos;
+    int rc;
+
+    for (pos = 0; pos < len && parser_room(ctx, parser);)
+    {
+        if (parser->skip)
+        {
+            n = parser->skip < len - pos ? parser->skip : len - pos;
+            parser_payload(ctx, parser, buf + pos, n);
+            if (parser->forward && outq_add(parser->out, buf + pos, n, false))
+                return -1;
+            if (is_req && conn->write_data)
+            {
+                memcpy(conn->write_data + conn->write_pos, buf + pos, n);
+                conn->write_pos += n;
+            }
+            if (is_req && trace_hashing(ctx))
+                conn->trace_hash =
+                    trace_hash_update(conn->trace_hash, buf + pos, n);
+            parser->skip -= n;
+            pos += n;
+
+            if (is_req && !parser->skip)
+            {
+                conn->write_data = NULL;
+                if (trace_hashing(ctx))
+                    trace_write_hashed(ctx, conn);
+            }
+
+            if (!parser->skip && !is_req && ctx->ra.cur_slot >= 0 &&
+                !ctx->sreply.active && ra_complete(ctx, now))
+                return -1;
+        }
+        else
+        {
+            /* striped sessions hand the reply parser over between replies */
+            if (!is_req && pos && ctx->striping.n && rep_idle(ctx))
+                break;
+
+            /* throttled sessions hold back requests that haven't started */
+            if (is_req && !parser->hdr_len &&
+                parser->state == NBD_PARSE_REQUEST && !qos_admit(ctx, now))
+                break;
+
+            hdr_size = parser_hdr_size(parser);
+            n = hdr_size - parser->hdr_len;
+            if (n > len - pos)
+                n = len - pos;
+
+            memcpy(parser->hdr + parser->hdr_len, buf + pos, n);
+            parser->hdr_len += n;
+            pos += n;
+
+            if (parser->hdr_len < hdr_size)
+                break;
+
+            /* the header size may depend on what we've parsed so far */
+            hdr_size = parser_hdr_size(parser);
+            if (parser->hdr_len < hdr_size)
+                continue;
+
+            parser->forward = true;
+            parser->drop_hdr = false;
+            rc = is_req ? parse_req_hdr(ctx, conn, now)
+                        : parse_rep_hdr(ctx, now);
+            if (rc)
+                return -1;
+
+            /* structured reply chunk headers are replaced by their handler,
+             * but the payload may still be forwarded */
+            if (parser->forward && !parser->drop_hdr &&
+                !parser_structured(parser) &&
+                outq_add(parser->out, parser->hdr, hdr_size, true))
+                return -1;
+            parser->hdr_len = 0;
+
+            /* any readahead requests go out after the kernel's */
+            if (is_req && ra_enabled(ctx) && ra_fill(ctx, now))
+                return -1;
+        }
+
+        /* a forwarded reply is logged once all of its payload has passed */
+        if (!is_req && ctx->trace && ctx->trace->rep_pending &&
+            !parser->skip && !ctx->sreply.active)
+            trace_reply_done(ctx);
+
+        if (!is_req && reply_pending(ctx))
+            break;
+    }
+
+    parser->bytes += pos;
+    return pos;
+}
+
+/* Is @conn part-way through sending a request to the server? If so, no other
+ * socket's requests may be forwarded until it is complete. */
+static bool conn_busy(struct nbd_conn* conn)
+{
+    return conn->parser.skip && conn->parser.forward;
+}
+
+/* tags for I/O events; kernel sockets follow EV_CONN, and the input and
+ * output of each extra server stream follow EV_STRIPE */
+enum
+{
+    EV_STDIN,
+    EV_STDOUT,
+    EV_SIGNAL,
+    EV_STATS,
+    EV_UDEV,
+    EV_CONTROL,
+    EV_RESUME,
+    EV_CONN,
+    EV_STRIPE = EV_CONN + NBD_MAX_CONNS,
+};
+
+#ifdef HAVE_LIBURING
+/* io_uring backend. Rather than waiting for readiness, reads and writes on
+ * the data streams are kept posted on the ring: stdin is read into its inq
+ * buffer, which is registered with the ring, and the kernel sockets use
+ * multishot receives into a ring of provided buffers, copied to each
+ * socket's inq as it has space. The other fds are polled through the same
+ * ring. */
+
+enum uring_op
+{
+    UR_READ = 1,
+    UR_WRITE,
+    UR_RECV,
+    UR_POLL,
+};
+
+static uint64_t uring_data(enum uring_op op, uint32_t tag)
+{
+    return (uint64_t)op << 32 | tag;
+}
+
+static struct io_uring_sqe* uring_sqe(struct uring* ur)
+{
+    struct io_uring_sqe* sqe;
+
+    sqe = io_uring_get_sqe(&ur->ring);
+    if (!sqe)
+    {
+        io_uring_submit(&ur->ring);
+        sqe = io_uring_get_sqe(&ur->ring);
+    }
+
+    if (!sqe)
+        warnx("io_uring submission queue full");
+
+    return sqe;
+}
+
+static int uring_poll(struct uring* ur, int fd, uint32_t tag)
+{
+    struct io_uring_sqe* sqe;
+
+    sqe = uring_sqe(ur);
+    if (!sqe)
+        return -1;
+
+    io_uring_prep_poll_multishot(sqe, fd, POLLIN);
+    io_uring_sqe_set_data64(sqe, uring_data(UR_POLL, tag));
+    return 0;
+}
+
+static void uring_recycle(struct uring* ur, uint16_t bid)
+{
+    io_uring_buf_ring_add(ur->buf_ring,
+                          ur->recv_bufs + (size_t)bid * URING_RECV_BUF_SIZE,
+                          URING_RECV_BUF_SIZE, bid,
+                          io_uring_buf_ring_mask(URING_RECV_BUFS), 0);
+    io_uring_buf_ring_advance(ur->buf_ring, 1);
+}
+
+static int uring_init(struct ctx* ctx)
+{
+    struct uring* ur;
+    struct iovec iov;
+    int i, rc;
+
+    ur = calloc(1, sizeof(*ur));
+    if (!ur)
+        return -1;
+
+    rc = io_uring_queue_init(URING_ENTRIES, &ur->ring, 0);
+    if (rc)
+    {
+        free(ur);
+        return -1;
+    }
+
+    iov.iov_base = ctx->rep_in.buf;
+    iov.iov_len = ctx->rep_in.size;
+    rc = io_uring_register_buffers(&ur->ring, &iov, 1);
+    if (rc)
+        goto err_exit;
+
+    ur->recv_bufs = malloc(URING_RECV_BUFS * URING_RECV_BUF_SIZE);
+    if (!ur->recv_bufs)
+        goto err_exit;
+
+    ur->buf_ring = io_uring_setup_buf_ring(&ur->ring, URING_RECV_BUFS,
+                                           URING_BGID, 0, &rc);
+    if (!ur->buf_ring)
+        goto err_free;
+
+    for (i = 0; i < URING_RECV_BUFS; i++)
+        uring_recycle(ur, i);
+
+    ctx->uring = ur;
+    return 0;
+
+err_free:
+    free(ur->recv_bufs);
+err_exit:
+    io_uring_queue_exit(&ur->ring);
+    free(ur);
+    return -1;
+}
+
+static void uring_free(struct ctx* ctx)
+{
+    struct uring* ur = ctx->uring;
+
+    if (!ur)
+        return;
+
+    io_uring_free_buf_ring(&ur->ring, ur->buf_ring, URING_RECV_BUFS,
+                           URING_BGID);
+    io_uring_queue_exit(&ur->ring);
+    free(ur->recv_bufs);
+    free(ur);
+    ctx->uring = NULL;
+}
+
+/* Make more input available on @in. For stdin, we post a read if there isn't
+ * one outstanding; for a kernel socket, we copy over any received data, and
+ * re-arm the receive if it has stopped. Returns the number of bytes added to
+ * @in. */
+static ssize_t uring_read(struct ctx* ctx, struct nbd_conn* conn,
+                          struct inq* in)
+{
+    struct uring* ur = ctx->uring;
+    struct io_uring_sqe* sqe;
+    struct uring_conn* uc;
+    struct uring_held* h;
+    size_t n, total = 0;
+
+    if (in->pending || in->eof)
+        return 0;
+
+    if (!conn)
+    {
+        sqe = uring_sqe(ur);
+        if (!sqe)
+            return -1;
+        io_uring_prep_read_fixed(sqe, in->fd, in->buf + in->end,
+                                 in->size - in->end, -1, 0);
+        io_uring_sqe_set_data64(sqe, uring_data(UR_READ, EV_STDIN));
+        in->pending = true;
+        return 0;
+    }
+
+    uc = &ur->conns[conn - ctx->conns];
+    while (uc->n && in->end < in->size)
+    {
+        h = &uc->held[uc->head];
+        n = in->size - in->end < h->len ? in->size - in->end : h->len;
+        memcpy(in->buf + in->end,
+               ur->recv_bufs + (size_t)h->bid * URING_RECV_BUF_SIZE + h->off,
+               n);
+        in->end += n;
+        h->off += n;
+        h->len -= n;
+        total += n;
+
+        if (!h->len)
+        {
+            uring_recycle(ur, h->bid);
+            uc->head = (uc->head + 1) % URING_RECV_BUFS;
+            uc->n--;
+            ur->n_held--;
+        }
+    }
+
+    /* the receive stops when the provided buffers run out, so don't re-arm
+     * it until some have been returned */
+    if (!uc->armed && ur->n_held < URING_RECV_BUFS)
+    {
+        sqe = uring_sqe(ur);
+        if (!sqe)
+            return -1;
+        io_uring_prep_recv_multishot(sqe, in->fd, NULL, 0, 0);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+        io_uring_sqe_set_data64(sqe,
+                                uring_data(UR_RECV, EV_CONN + (conn - ctx->conns)));
+        uc->armed = true;
+    }
+
+    return total;
+}
+
+static int uring_write(struct ctx* ctx, struct outq* q, uint32_t tag)
+{
+    struct io_uring_sqe* sqe;
+
+    if (q->pending || !q->n_iov)
+        return 0;
+
+    sqe = uring_sqe(ctx->uring);
+    if (!sqe)
+        return -1;
+
+    io_uring_prep_writev(sqe, q->fd, q->iov, q->n_iov, -1);
+    io_uring_sqe_set_data64(sqe, uring_data(UR_WRITE, tag));
+    q->pending = true;
+    q->n_busy = q->n_iov;
+    return 0;
+}
+#endif
+
+/* Read more input for a stream, through whichever I/O backend is in use.
+ * Returns the number of bytes added, or -1 on failure. */
+static ssize_t stream_read(struct ctx* ctx, struct nbd_conn* conn,
+                           struct inq* in)
+{
+#ifdef HAVE_LIBURING
+    if (ctx->uring)
+        return uring_read(ctx, conn, in);
+#endif
+    if (!in->ready)
+        return 0;
+
+    if (!conn && ctx->ws)
+        return ws_recv(ctx->ws, in);
+
+    return inq_read(in);
+}
+
+static int stream_write(struct ctx* ctx, struct outq* q, uint32_t tag,
+                        bool* progress)
+{
+#ifdef HAVE_LIBURING
+    if (ctx->uring)
+        return uring_write(ctx, q, tag);
+#else
+    (void)tag;
+#endif
+    if (q == &ctx->req_out && ctx->ws)
+        return ws_write(ctx->ws, q, progress);
+
+    return outq_write(q, progress);
+}
+
+/* Is anything queued on @q still to be written from @in's buffer? */
+static bool outq_refers(const struct outq* q, const struct inq* in)
+{
+    const uint8_t* p;
+    int i;
+
+    for (i = 0; i < q->n_iov; i++)
+    {
+        p = q->iov[i].iov_base;
+        if (p >= in->buf && p < in->buf + in->size)
+            return true;
+    }
+
+    return false;
+}
+
+/* Can the input buffer @in be reused from the start? Only once everything
+ * forwarded from it has been written out. With several server streams,
+ * the kernel's queues are always taking replies from one or another, so we
+ * look for data from this stream's buffer in particular. */
+static bool inq_drained(struct ctx* ctx, struct nbd_conn* conn,
+                        const struct inq* in)
+{
+    int i;
+
+    if (conn)
+    {
+        for (i = 0; i < ctx->striping.n; i++)
+        {
+            if (ctx->striping.stripes[i].out.n_iov)
+                return false;
+        }
+        return !ctx->req_out.n_iov;
+    }
+
+    for (i = 0; i < ctx->n_conns; i++)
+    {
+        if (ctx->striping.n ? outq_refers(&ctx->conns[i].out, in)
+                            : ctx->conns[i].out.n_iov)
+            return false;
+    }
+
+    return true;
+}
+
+#ifdef HAVE_SPLICE
+/* A non-blocking splice doesn't tell us which side would block, so check
+ * both; the fds are edge-triggered, so we mustn't clear the ready flag of
+ * an fd that is actually ready. Returns true if both are ready again. */
+static bool splice_wait(struct inq* in, struct outq* out)
+{
+    struct pollfd pollfds[2];
+
+    pollfds[0].fd = in->fd;
+    pollfds[0].events = POLLIN;
+    pollfds[1].fd = out->fd;
+    pollfds[1].events = POLLOUT;
+
+    if (poll(pollfds, 2, 0) < 0)
+        return false;
+
+    in->ready = pollfds[0].revents;
+    out->ready = pollfds[1].revents;
+    if (!out->ready)
+        out->stalls++;
+
+    return in->ready && out->ready;
+}
+#endif
+
+/* Move data from one input stream to its output queues, until the input
+ * would block, or there's no space left on the output side. @conn is the
+ * kernel socket to read, or NULL for the server stream. Sets @progress if
+ * anything was done. */
+static int pump_stream(struct ctx* ctx, struct nbd_conn* conn, bool* progress)
+{
+    struct nbd_parser* parser = conn ? &conn->parser : &ctx->rep_parser;
+    struct inq* in = conn ? &conn->in : &ctx->rep_in;
+    ssize_t rc;
+    int i;
+
+    for (;;)
+    {
+        if (in->start < in->end)
+        {
+            /* requests from one socket can't be forwarded while another
+             * is part-way through sending one */
+            for (i = 0; conn && i < ctx->n_conns; i++)
+            {
+                if (&ctx->conns[i] != conn && conn_busy(&ctx->conns[i]))
+                    return 0;
+            }
+
+            /* nor replies from the main stream while a stripe is part-way
+             * through one */
+            if (!conn && !stream_turn(ctx, 0))
+                break;
+
+            if (!conn && reply_flush_pending(ctx))
+                return -1;
+
+            rc = parse_stream(ctx, conn, parser, in->buf + in->start,
+                              in->end - in->start, now_us());
+            if (rc < 0)
+                return -1;
+            if (!rc)
+                break;
+
+            in->start += rc;
+            *progress = true;
+
+            /* with several server streams, take turns between replies */
+            if (!conn && ctx->striping.n)
+            {
+                ctx->striping.owner = 0;
+                if (rep_idle(ctx))
+                    break;
+            }
+            continue;
+        }
+
+        if (!in->pending && inq_drained(ctx, conn, in))
+            in->start = in->end = 0;
+
+#ifdef HAVE_SPLICE
+        /* payload data doesn't need to be parsed, so we can pass it straight
+         * through, unless we're keeping a copy of it, or it's framed. It has
+         * to follow anything already queued for the output. */
+        if (parser->skip && parser->forward &&
+            !(conn ? conn->write_data != NULL : cache_filling(ctx)) &&
+            !trace_hashing(ctx) && !uring_active(ctx) && !ctx->ws &&
+            !ctx->striping.n && !ctx->no_splice)
+        {
+            struct outq* out = parser->out;
+            size_t len;
+
+            if (!in->ready || !out->ready || out->n_iov)
+                break;
+
+            len = parser->skip < ctx->tune.chunk ? parser->skip
+                                                 : ctx->tune.chunk;
+            rc = splice(in->fd, NULL, out->fd, NULL, len, SPLICE_F_NONBLOCK);
+            if (rc < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN)
+                {
+                    if (splice_wait(in, out))
+                        continue;
+                    break;
+                }
+                warn("splice");
+                return -1;
+            }
+            if (rc == 0)
+            {
+                in->eof = true;
+                in->ready = false;
+                break;
+            }
+
+            parser->skip -= rc;
+            parser->bytes += rc;
+            *progress = true;
+            continue;
+        }
+#endif
+
+        if (in->end == in->size)
+            break;
+
+        rc = stream_read(ctx, conn, in);
+        if (rc < 0)
+            return -1;
+        if (!rc)
+            break;
+
+        *progress = true;
+    }
+
+    return 0;
+}
+
+/* Are the kernel's requests being held back, while there's no server
+ * stream, or until our outstanding requests have been sent again? */
+static bool resume_busy(struct ctx* ctx)
+{
+    return ctx->resume.detached ||
+           ctx->resume.replay_pos < ctx->resume.n_replay;
+}
+
+/* Send our outstanding requests to a new server, as space allows. A write
+ * that the kernel is still sending goes last, with the data we have so
+ * far, and the rest of it is forwarded as usual. */
+static int resume_replay(struct ctx* ctx, bool* progress)
+{
+    struct resume* rs = &ctx->resume;
+    uint8_t hdr[NBD_REQUEST_SIZE];
+    struct nbd_inflight_req* req;
+    uint32_t len;
+
+    for (; rs->replay_pos < rs->n_replay; rs->replay_pos++)
+    {
+        /* nothing else may be answered until a cut-off reply is complete */
+        if (rs->cont_pending && rs->replay_pos)
+            break;
+
+        req = inflight_find(&ctx->inflight, rs->replay[rs->replay_pos]);
+        if (!req)
+            continue;
+
+        if (!outq_room(&ctx->req_out, sizeof(hdr), true))
+            break;
+
+        stream_sent(ctx, 0, req);
+
+        put_be32(hdr, NBD_REQUEST_MAGIC);
+        put_be16(hdr + 4, req->flags);
+        put_be16(hdr + 6, req->type);
+        memcpy(hdr + 8, &req->handle, sizeof(req->handle));
+        put_be64(hdr + 16, req->offset);
+        put_be32(hdr + 24, req->len);
+
+        len = 0;
+        if (req->data)
+            len = ctx->conns[req->conn].write_data == req->data
+                      ? ctx->conns[req->conn].write_pos
+                      : req->len;
+
+        if (outq_add(&ctx->req_out, hdr, sizeof(hdr), true) ||
+            outq_add(&ctx->req_out, req->data, len, false))
+            return -1;
+
+        rs->replayed++;
+        *progress = true;
+    }
+
+    if (rs->replay && rs->replay_pos == rs->n_replay)
+    {
+        free(rs->replay);
+        rs->replay = NULL;
+        rs->n_replay = rs->replay_pos = 0;
+    }
+
+    return 0;
+}
+
+/* Move data to and from an extra server stream, as pump_stream() and
+ * stream_write() do for the main one. Replies are parsed only when it's
+ * this stream's turn. A stream that fails is marked as at its end. */
+static int pump_stripe(struct ctx* ctx, int stream, bool* progress)
+{
+    struct stripe* st = &ctx->striping.stripes[stream - 1];
+    struct inq* in = &st->in;
+    ssize_t rc;
+
+    rc = st->ws ? ws_write(st->ws, &st->out, progress)
+                : outq_write(&st->out, progress);
+    if (rc)
+    {
+        in->eof = true;
+        in->ready = st->out.ready = false;
+        return 0;
+    }
+
+    for (;;)
+    {
+        if (in->start < in->end)
+        {
+            if (!stream_turn(ctx, stream))
+                break;
+
+            if (reply_flush_pending(ctx))
+                return -1;
+
+            rc = parse_stream(ctx, NULL, &ctx->rep_parser,
+                              in->buf + in->start, in->end - in->start,
+                              now_us());
+            if (rc < 0)
+                return -1;
+            if (!rc)
+                break;
+
+            in->start += rc;
+            ctx->striping.owner = stream;
+            *progress = true;
+            if (rep_idle(ctx))
+                break;
+            continue;
+        }
+
+        if (inq_drained(ctx, NULL, in))
+            in->start = in->end = 0;
+
+        if (in->end == in->size || !in->ready)
+            break;
+
+        rc = st->ws ? ws_recv(st->ws, in) : inq_read(in);
+        if (rc < 0)
+            return -1;
+        if (!rc)
+            break;
+
+        *progress = true;
+    }
+
+    return 0;
+}
+
+static int session_detach(struct ctx* ctx);
+
+/* Run both directions of the proxy until nothing more can be done without
+ * waiting for an fd. Returns 1 to continue, 0 at the end of either stream,
+ * or -1 on failure. */
+static int pump(struct ctx* ctx)
+{
+    bool progress, held;
+    int i;
+
+    if (ctx->resume.detached && now_us() >= ctx->resume.deadline)
+    {
+        warnx("server stream not resumed in time; stopping");
+        return 0;
+    }
+
+    do
+    {
+        progress = false;
+        held = resume_busy(ctx);
+
+        for (i = 0; !held && i < ctx->n_conns; i++)
+        {
+            if (pump_stream(ctx, &ctx->conns[i], &progress))
+                return -1;
+        }
+
+        if (!ctx->resume.detached)
+        {
+            if (resume_replay(ctx, &progress))
+                return -1;
+
+            /* a stream that can't be written has gone too */
+            if (stream_write(ctx, &ctx->req_out, EV_STDOUT, &progress))
+            {
+                if (!resume_enabled(ctx))
+                    return -1;
+                ctx->rep_in.eof = true;
+                break;
+            }
+
+            if (pump_stream(ctx, NULL, &progress))
+                return -1;
+
+            for (i = 1; i <= ctx->striping.n; i++)
+            {
+                if (pump_stripe(ctx, i, &progress))
+                    return -1;
+            }
+
+            if (reply_flush_pending(ctx))
+                return -1;
+
+            if (ctx->ra.n_waiters && reply_boundary(ctx, &ctx->conns[0]) &&
+                ra_serve_waiters(ctx, now_us()))
+                return -1;
+        }
+
+        for (i = 0; i < ctx->n_conns; i++)
+        {
+            if (stream_write(ctx, &ctx->conns[i].out, EV_CONN + i, &progress))
+                return -1;
+        }
+    } while (progress || ws_ctrl_pending(ctx));
+
+    tune_check(ctx);
+
+    /* losing any of the server streams loses the session's stream */
+    for (i = 0; i < ctx->striping.n; i++)
+    {
+        if (ctx->striping.stripes[i].in.eof)
+            ctx->rep_in.eof = true;
+    }
+
+    /* only stop once we've sent everything we can, and then only if we
+     * can't wait for the session to be resumed */
+    if (ctx->rep_in.eof && session_detach(ctx))
+        return 0;
+
+    for (i = 0; i < ctx->n_conns; i++)
+    {
+        if (ctx->conns[i].in.eof)
+            return 0;
+    }
+
+    return 1;
+}
+
+static int signal_pipe_fd = -1;
+
+static void signal_handler(int signal)
+{
+    int rc;
+
+    rc = write(signal_pipe_fd, &signal, sizeof(signal));
+
+    /* not a lot we can do here but exit... */
+    if (rc != sizeof(signal))
+        exit(EXIT_FAILURE);
+}
+
+static int setup_signals(struct ctx* ctx)
+{
+    struct sigaction sa;
+    int rc;
+
+    rc = pipe2(ctx->signal_pipe, O_CLOEXEC);
+    if (rc)
+    {
+        warn("can't setup signal pipe");
+        return -1;
+    }
+
+    signal_pipe_fd = ctx->signal_pipe[1];
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    /* a server stream that has gone away shows up as a write error */
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    return 0;
+}
+
+static void cleanup_signals(struct ctx* ctx)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGCHLD, &sa, NULL);
+    sigaction(SIGPIPE, &sa, NULL);
+
+    close(ctx->signal_pipe[0]);
+    close(ctx->signal_pipe[1]);
+}
+
+static void process_sigchld(struct ctx* ctx, bool* exit)
+{
+    int status;
+    pid_t pid;
+
+    for (;;)
+    {
+        pid = waitpid(-1, &status, WNOHANG);
+        if (pid == 0)
+            break;
+
+        if (pid == ctx->nbd_client_pid)
+        {
+            warnx("nbd client stopped (%s: %d); exiting",
+                  WIFEXITED(status) ? "rc" : "sig",
+                  WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+            ctx->nbd_client_pid = 0;
+            *exit = true;
+        }
+        else if (pid == ctx->state_hook_pid)
+        {
+            if (!WIFEXITED(status) || WEXITSTATUS(status))
+            {
+                warnx("state hook failed (%s: %d); exiting",
+                      WIFEXITED(status) ? "rc" : "sig",
+                      WIFEXITED(status) ? WEXITSTATUS(status)
+                                        : WTERMSIG(status));
+                *exit = true;
+            }
+            ctx->state_hook_pid = 0;
+        }
+    }
+}
+
+static int process_signal_pipe(struct ctx* ctx, bool* exit)
+{
+    int buf, rc;
+
+    rc = read(ctx->signal_pipe[0], &buf, sizeof(buf));
+    if (rc != sizeof(buf))
+        return -1;
+
+    *exit = false;
+
+    switch (buf)
+    {
+        case SIGCHLD:
+            process_sigchld(ctx, exit);
+            break;
+        case SIGINT:
+        case SIGTERM:
+            *exit = true;
+            break;
+    }
+
+    return 0;
+}
+
+static int wait_for_nbd_client(struct ctx* ctx)
+{
+    struct pollfd pollfds[2];
+
+    pollfds[0].fd = ctx->sock;
+    pollfds[0].events = POLLIN;
+    pollfds[1].fd = ctx->signal_pipe[0];
+    pollfds[1].events = POLLIN;
+
+    for (;;)
+    {
+        errno = 0;
+        int rc;
+        rc = poll(pollfds, 2, -1);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            warn("poll failed");
+            return -1;
+        }
+
+        if (pollfds[0].revents)
+        {
+            rc = accept4(ctx->sock, NULL, NULL, SOCK_CLOEXEC);
+            if (rc < 0)
+            {
+                warn("can't create connection");
+                return -1;
+            }
+            ctx->conns[0].fd = rc;
+            ctx->n_conns = 1;
+            break;
+        }
+
+        if (pollfds[1].revents)
+        {
+            bool exit;
+            rc = process_signal_pipe(ctx, &exit);
+            if (rc || exit)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* SHA-1, only for the websocket accept key */
+static void sha1(const void* data, size_t len, uint8_t digest[20])
+{
+    uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                     0xc3d2e1f0};
+    const uint8_t* p = data;
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    uint8_t block[64];
+    size_t off, n;
+    int i;
+
+    for (off = 0; off <= len + 8; off += 64)
+    {
+        /* the final blocks carry the 0x80 terminator and bit length */
+        n = off < len ? len - off : 0;
+        n = n < 64 ? n : 64;
+        memset(block, 0, sizeof(block));
+        memcpy(block, p + off, n);
+        if (n < 64 && off + n == len)
+            block[n] = 0x80;
+        if (off + 64 > len + 8)
+            put_be64(block + 56, (uint64_t)len * 8);
+
+        for (i = 0; i < 16; i++)
+            w[i] = get_be32(block + i * 4);
+        for (; i < 80; i++)
+        {
+            t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = t << 1 | t >> 31;
+        }
+
+        a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (i = 0; i < 80; i++)
+        {
+            if (i < 20)
+                f = (b & c) | (~b & d), k = 0x5a827999;
+            else if (i < 40)
+                f = b ^ c ^ d, k = 0x6ed9eba1;
+            else if (i < 60)
+                f = (b & c) | (b & d) | (c & d), k = 0x8f1bbcdc;
+            else
+                f = b ^ c ^ d, k = 0xca62c1d6;
+
+            t = (a << 5 | a >> 27) + f + e + k + w[i];
+            e = d, d = c, c = b << 30 | b >> 2, b = a, a = t;
+        }
+
+        h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e;
+    }
+
+    for (i = 0; i < 5; i++)
+        put_be32(digest + i * 4, h[i]);
+}
+
+static void base64_encode(const uint8_t* data, size_t len, char* out)
+{
+    static const char tbl[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint32_t v;
+    size_t i;
+
+    for (i = 0; i < len; i += 3)
+    {
+        v = data[i] << 16;
+        if (i + 1 < len)
+            v |= data[i + 1] << 8;
+        if (i + 2 < len)
+            v |= data[i + 2];
+
+        *out++ = tbl[v >> 18];
+        *out++ = tbl[(v >> 12) & 0x3f];
+        *out++ = i + 1 < len ? tbl[(v >> 6) & 0x3f] : '=';
+        *out++ = i + 2 < len ? tbl[v & 0x3f] : '=';
+    }
+    *out = '\0';
+}
+
+/* Wait for @fd to become readable, while still handling signals. Returns
+ * 0 when readable, or -1 on timeout, exit or failure. */
+static int ws_poll(struct ctx* ctx, int fd, int timeout_ms)
+{
+    struct pollfd pollfds[2];
+    bool exit;
+    int rc;
+
+    pollfds[0].fd = fd;
+    pollfds[0].events = POLLIN;
+    pollfds[1].fd = ctx->signal_pipe[0];
+    pollfds[1].events = POLLIN;
+
+    for (;;)
+    {
+        rc = poll(pollfds, 2, timeout_ms);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            warn("poll failed");
+            return -1;
+        }
+
+        if (rc == 0)
+        {
+            warnx("timeout waiting for websocket client");
+            return -1;
+        }
+
+        if (pollfds[1].revents)
+        {
+            rc = process_signal_pipe(ctx, &exit);
+            if (rc || exit)
+                return -1;
+        }
+
+        if (pollfds[0].revents)
+            return 0;
+    }
+}
+
+/* Find header @name in the request @lines, and return its value */
+static char* http_header(char** lines, int n_lines, const char* name)
+{
+    size_t len = strlen(name);
+    int i;
+
+    for (i = 1; i < n_lines; i++)
+    {
+        if (!strncasecmp(lines[i], name, len) && lines[i][len] == ':')
+            return lines[i] + len + 1 + strspn(lines[i] + len + 1, " \t");
+    }
+
+    return NULL;
+}
+
+/* Perform the server side of the websocket opening handshake on @fd. Any
+ * frame data that arrives with the request is decoded into rep_in. */
+static int ws_upgrade(struct ctx* ctx, int fd)
+{
+    char req[WS_REQ_MAX + 1], resp[256], accept[29];
+    char *upgrade, *key, *version, *end, *p, *eol, *t;
+    char* lines[WS_REQ_LINES];
+    size_t len = 0, extra;
+    int n_lines = 0;
+    uint8_t digest[20];
+    ssize_t rc;
+    char* buf;
+
+    for (;;)
+    {
+        if (ws_poll(ctx, fd, ws_handshake_timeout_ms))
+            return -1;
+
+        rc = read(fd, req + len, WS_REQ_MAX - len);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+        {
+            warnx("websocket client closed connection during handshake");
+            return -1;
+        }
+        len += rc;
+        req[len] = '\0';
+
+        end = strstr(req, "\r\n\r\n");
+        if (end)
+            break;
+
+        if (len == WS_REQ_MAX)
+        {
+            warnx("websocket request too large");
+            return -1;
+        }
+    }
+
+    /* split the request into lines, without trailing whitespace */
+    for (p = req; p < end + 2 && n_lines < WS_REQ_LINES; p = eol + 2)
+    {
+        eol = strstr(p, "\r\n");
+        lines[n_lines++] = p;
+        *eol = '\0';
+        for (t = eol; t > p && (t[-1] == ' ' || t[-1] == '\t');)
+            *--t = '\0';
+    }
+
+    end += 4;
+    extra = req + len - end;
+
+    upgrade = http_header(lines, n_lines, "Upgrade");
+    key = http_header(lines, n_lines, "Sec-WebSocket-Key");
+    version = http_header(lines, n_lines, "Sec-WebSocket-Version");
+
+    if (strncmp(req, "GET ", 4) || !upgrade ||
+        strcasecmp(upgrade, "websocket") || !key || !version ||
+        strcmp(version, "13"))
+    {
+        warnx("invalid websocket upgrade request");
+        write_all(fd, "HTTP/1.1 400 Bad Request\r\n\r\n", 28);
+        return -1;
+    }
+
+    rc = asprintf(&buf, "%s%s", key, ws_guid);
+    if (rc < 0)
+        return -1;
+    sha1(buf, rc, digest);
+    free(buf);
+    base64_encode(digest, sizeof(digest), accept);
+
+    rc = snprintf(resp, sizeof(resp),
+                  "HTTP/1.1 101 Switching Protocols\r\n"
+                  "Upgrade: websocket\r\n"
+                  "Connection: Upgrade\r\n"
+                  "Sec-WebSocket-Accept: %s\r\n\r\n",
+                  accept);
+    if (write_all(fd, resp, rc))
+        return -1;
+
+    /* a client shouldn't send frames before our response, but handle it */
+    if (extra)
+    {
+        memmove(ctx->rep_in.buf, end, extra);
+        rc = ws_decode(ctx->ws, ctx->rep_in.buf, extra);
+        if (rc < 0)
+            return -1;
+        ctx->rep_in.end = rc;
+    }
+
+    return 0;
+}
+
+/* Listen on @addr for a websocket client, and return the connected fd.
+ * @addr is a unix socket path if it contains a '/', otherwise a TCP
+ * [host:]port. */
+static int ws_accept(struct ctx* ctx, const char* addr)
+{
+    struct addrinfo hints, *ai = NULL;
+    struct sockaddr_un sun;
+    char *host = NULL, *port;
+    int sd, fd = -1, rc;
+    const int one = 1;
+    bool bound;
+
+    if (strchr(addr, '/'))
+    {
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(addr) >= sizeof(sun.sun_path))
+        {
+            warnx("websocket socket path too long");
+            return -1;
+        }
+        strcpy(sun.sun_path, addr);
+
+        sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sd < 0)
+        {
+            warn("can't create websocket socket");
+            return -1;
+        }
+
+        rc = bind(sd, (struct sockaddr*)&sun, sizeof(sun));
+    }
+    else
+    {
+        host = strdup(addr);
+        if (!host)
+            return -1;
+        port = strrchr(host, ':');
+        if (port)
+            *port++ = '\0';
+        else
+            port = host;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+
+        rc = getaddrinfo(port == host ? NULL : host, port, &hints, &ai);
+        if (rc)
+        {
+            warnx("can't resolve websocket address %s: %s", addr,
+                  gai_strerror(rc));
+            free(host);
+            return -1;
+        }
+
+        sd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sd < 0)
+        {
+            warn("can't create websocket socket");
+            goto out_free;
+        }
+
+        setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        rc = bind(sd, ai->ai_addr, ai->ai_addrlen);
+    }
+
+    bound = !rc;
+    if (rc || listen(sd, 1))
+    {
+        warn("can't listen on %s", addr);
+        goto out_close;
+    }
+
+    if (ws_poll(ctx, sd, -1))
+        goto out_close;
+
+    fd = accept4(sd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+        warn("can't accept websocket connection");
+
+out_close:
+    close(sd);
+    if (!host && bound)
+        unlink(addr);
+out_free:
+    if (ai)
+        freeaddrinfo(ai);
+    free(host);
+    return fd;
+}
+
+/* Use a connected socket as the server stream. We give each direction its
+ * own fd, so they can be registered with epoll separately. */
+static int server_stream_init(struct ctx* ctx, int fd)
+{
+    int out;
+
+    out = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (out < 0)
+    {
+        warn("can't set up server stream");
+        return -1;
+    }
+
+    ctx->rep_in.fd = fd;
+    ctx->req_out.fd = out;
+    return 0;
+}
+
+/* Serve the websocket ourselves, either on an inherited connection (@fd),
+ * or by accepting one on @addr. The connection takes the place of stdio. */
+static int ws_init(struct ctx* ctx, const char* addr, int fd)
+{
+    ctx->ws = calloc(1, sizeof(*ctx->ws));
+    if (!ctx->ws)
+        return -1;
+
+    if (addr)
+    {
+        fd = ws_accept(ctx, addr);
+        if (fd < 0)
+            goto err_free;
+    }
+
+    if (ws_upgrade(ctx, fd) || server_stream_init(ctx, fd))
+        goto err_close;
+
+    return 0;
+
+err_close:
+    close(fd);
+err_free:
+    free(ctx->ws);
+    ctx->ws = NULL;
+    return -1;
+}
+
+/* Try to complete the close handshake on @fd before we go away */
+static void ws_close(struct ws* ws, int fd)
+{
+    uint8_t status[2];
+
+    if (!ws)
+        return;
+
+    if (!ws->tx_left && ws->tx_hdr_off == ws->tx_hdr_len && fd >= 0)
+    {
+        put_be16(status, 1000);
+        ws_queue_ctrl(ws, WS_OP_CLOSE, status, sizeof(status));
+        if (ws->tx_ctrl_off < ws->tx_ctrl_len)
+            (void)!write(fd, ws->tx_ctrl + ws->tx_ctrl_off,
+                         ws->tx_ctrl_len - ws->tx_ctrl_off);
+    }
+
+    free(ws);
+}
+
+static void ws_free(struct ctx* ctx)
+{
+    ws_close(ctx->ws, ctx->req_out.fd);
+    ctx->ws = NULL;
+}
+
+/* Drop all of the extra server streams. Their buffers are kept, as the
+ * kernel's outqs may still refer to replies in them. */
+static void stripes_close(struct ctx* ctx)
+{
+    struct striping* sp = &ctx->striping;
+    struct stripe* st;
+    int i;
+
+    for (i = 0; i < sp->n; i++)
+    {
+        st = &sp->stripes[i];
+        ws_close(st->ws, st->out.fd);
+        st->ws = NULL;
+
+        epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, st->in.fd, NULL);
+        epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, st->out.fd, NULL);
+        close(st->in.fd);
+        close(st->out.fd);
+        if (st->peer >= 0)
+            close(st->peer);
+        st->in.fd = st->out.fd = st->peer = -1;
+
+        st->in.start = st->in.end = 0;
+        st->in.ready = st->in.eof = false;
+        st->out.n_iov = st->out.n_busy = 0;
+        st->out.scratch_len = 0;
+        st->out.ready = false;
+    }
+
+    sp->n = sp->owner = sp->next = 0;
+    memset(sp->load, 0, sizeof(sp->load));
+
+    /* a request part-way through being forwarded is sent again in full */
+    for (i = 0; i < ctx->n_conns; i++)
+        ctx->conns[i].parser.out = &ctx->req_out;
+}
+
+/* Send a message to the server during the handshake, as a single frame if
+ * we're serving the websocket ourselves. */
+static int server_send(struct ctx* ctx, const void* hdr, size_t hdr_len,
+                       const void* data, size_t len)
+{
+    struct iovec iov[3];
+    uint8_t ws_hdr[WS_HDR_MAX];
+    int n_iov = 0;
+
+    if (ctx->ws)
+    {
+        iov[n_iov].iov_base = ws_hdr;
+        iov[n_iov++].iov_len =
+            ws_frame_hdr(ws_hdr, WS_OP_BINARY, hdr_len + len);
+    }
+
+    iov[n_iov].iov_base = (void*)hdr;
+    iov[n_iov++].iov_len = hdr_len;
+    iov[n_iov].iov_base = (void*)data;
+    iov[n_iov++].iov_len = len;
+
+    return writev_all(ctx->req_out.fd, iov, n_iov);
+}
+
+/* Allocate a session's data path state, once its configuration is known */
+static int session_init(struct ctx* ctx)
+{
+    /* the request outq only holds copies of headers */
+    if (inflight_init(&ctx->inflight, inflight_size_default) ||
+        inq_init(&ctx->rep_in, ctx->bufsize) ||
+        outq_init(&ctx->req_out, 2 * OUTQ_SCRATCH_SIZE))
+        return -1;
+
+    if (cache_init(ctx) || ra_init(ctx))
+        return -1;
+
+    return conns_init(ctx);
+}
+
+static void session_free(struct ctx* ctx)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->inflight.size; i++)
+    {
+        if (ctx->inflight.reqs[i].used)
+            free(ctx->inflight.reqs[i].data);
+    }
+    if (ctx->sreply.active)
+        free(ctx->sreply.req.data);
+    free(ctx->resume.replay);
+    ctx->resume.replay = NULL;
+
+    trace_stop(ctx);
+    ws_free(ctx);
+    stripes_close(ctx);
+    for (i = 0; i < NBD_MAX_STREAMS - 1; i++)
+    {
+        inq_free(&ctx->striping.stripes[i].in);
+        outq_free(&ctx->striping.stripes[i].out);
+    }
+    conns_free(ctx);
+    inflight_free(&ctx->inflight);
+    cache_free(ctx);
+    ra_free(ctx);
+    inq_free(&ctx->rep_in);
+    outq_free(&ctx->req_out);
+}
+
+/* Read exactly @len bytes from stdin, while still handling signals */
+static int stdin_read_full(struct ctx* ctx, void* buf, size_t len)
+{
+    struct inq* in = &ctx->rep_in;
+    struct pollfd pollfds[2];
+    uint8_t* p = buf;
+    ssize_t rc;
+    size_t n;
+
+    pollfds[0].fd = in->fd;
+    pollfds[0].events = POLLIN;
+    pollfds[1].fd = ctx->signal_pipe[0];
+    pollfds[1].events = POLLIN;
+
+    while (len)
+    {
+        /* websocket frames are decoded into rep_in, and anything past the
+         * handshake stays there for the data path */
+        if (ctx->ws && in->start < in->end)
+        {
+            n = in->end - in->start < len ? in->end - in->start : len;
+            memcpy(p, in->buf + in->start, n);
+            in->start += n;
+            p += n;
+            len -= n;
+            continue;
+        }
+
+        errno = 0;
+        rc = poll(pollfds, 2,
+                  ctx->setup_timeout_ms ? ctx->setup_timeout_ms : -1);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            warn("poll failed");
+            return -1;
+        }
+
+        if (rc == 0)
+        {
+            warnx("timeout waiting for nbd server during handshake");
+            return -1;
+        }
+
+        if (pollfds[1].revents)
+        {
+            bool exit;
+            rc = process_signal_pipe(ctx, &exit);
+            if (rc || exit)
+                return -1;
+        }
+
+        if (!pollfds[0].revents)
+            continue;
+
+        if (ctx->ws)
+        {
+            in->start = in->end = 0;
+            in->ready = true;
+            rc = ws_recv(ctx->ws, in);
+            if (rc < 0)
+                return -1;
+            if (!in->eof)
+                continue;
+            rc = 0;
+        }
+        else
+            rc = read(in->fd, p, len);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+        {
+            warnx("nbd server closed connection during handshake");
+            return -1;
+        }
+        p += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+static int nbd_send_option(struct ctx* ctx, uint32_t opt, const void* data,
+                           uint32_t len)
+{
+    uint8_t hdr[NBD_OPTION_SIZE];
+
+    put_be64(hdr, NBD_OPTS_MAGIC);
+    put_be32(hdr + 8, opt);
+    put_be32(hdr + 12, len);
+
+    return server_send(ctx, hdr, sizeof(hdr), data, len);
+}
+
+/* Read the reply to our request for structured replies, so the server can
+ * send holes rather than zeroes. Returns 0 whether or not the server
+ * agrees, or -1 on failure. */
+static int nbd_handshake_structured(struct ctx* ctx)
+{
+    uint8_t hdr[NBD_OPTION_REPLY_SIZE];
+    uint8_t discard[64];
+    uint32_t type, len;
+    size_t n;
+
+    if (stdin_read_full(ctx, hdr, sizeof(hdr)))
+        return -1;
+
+    if (get_be64(hdr) != NBD_REP_MAGIC ||
+        get_be32(hdr + 8) != NBD_OPT_STRUCTURED_REPLY)
+    {
+        warnx("invalid option reply from nbd server");
+        return -1;
+    }
+
+    type = get_be32(hdr + 12);
+    for (len = get_be32(hdr + 16); len; len -= n)
+    {
+        n = len < sizeof(discard) ? len : sizeof(discard);
+        if (stdin_read_full(ctx, discard, n))
+            return -1;
+    }
+
+    ctx->nbd_structured = type == NBD_REP_ACK;
+    return 0;
+}
+
+/* Read the replies to NBD_OPT_GO. Returns 0 once we're in transmission,
+ * 1 if the server doesn't support the option, or -1 on failure. */
+static int nbd_handshake_go(struct ctx* ctx)
+{
+    uint8_t hdr[NBD_OPTION_REPLY_SIZE], info[NBD_INFO_BLOCK_SIZE_SIZE];
+    uint32_t type, len;
+    uint8_t discard[64];
+    size_t n;
+
+    for (;;)
+    {
+        if (stdin_read_full(ctx, hdr, sizeof(hdr)))
+            return -1;
+
+        if (get_be64(hdr) != NBD_REP_MAGIC || get_be32(hdr + 8) != NBD_OPT_GO)
+        {
+            warnx("invalid option reply from nbd server");
+            return -1;
+        }
+
+        type = get_be32(hdr + 12);
+        len = get_be32(hdr + 16);
+
+        if (type == NBD_REP_INFO && len == NBD_INFO_EXPORT_SIZE)
+        {
+            if (stdin_read_full(ctx, info, len))
+                return -1;
+            if (get_be16(info) == NBD_INFO_EXPORT)
+            {
+                ctx->nbd_export_size = get_be64(info + 2);
+                ctx->nbd_export_flags = get_be16(info + 10);
+            }
+            continue;
+        }
+
+        if (type == NBD_REP_INFO && len == NBD_INFO_BLOCK_SIZE_SIZE)
+        {
+            if (stdin_read_full(ctx, info, len))
+                return -1;
+            if (get_be16(info) == NBD_INFO_BLOCK_SIZE)
+            {
+                ctx->nbd_block_min = get_be32(info + 2);
+                ctx->nbd_block_pref = get_be32(info + 6);
+                ctx->nbd_block_max = get_be32(info + 10);
+            }
+            continue;
+        }
+
+        for (; len; len -= n)
+        {
+            n = len < sizeof(discard) ? len : sizeof(discard);
+            if (stdin_read_full(ctx, discard, n))
+                return -1;
+        }
+
+        if (type == NBD_REP_ACK)
+            return 0;
+
+        if (type == NBD_REP_ERR_UNSUP)
+            return 1;
+
+        if (type & NBD_REP_FLAG_ERROR)
+        {
+            warnx("nbd server rejected export (error 0x%x)", type);
+            return -1;
+        }
+    }
+}
+
+/* Start negotiating with the server, for when the kernel is handed a
+ * socket that's already in the transmission phase. Once we have the
+ * greeting, our flags and options all go in one write: the server answers
+ * options in order, so there's no need to wait for each reply, and the
+ * caller can get on with other setup while the server replies. */
+static int nbd_handshake_start(struct ctx* ctx)
+{
+    uint8_t buf[NBD_CFLAGS_SIZE + 2 * NBD_OPTION_SIZE + 8];
+    uint8_t* p = buf;
+    uint16_t gflags;
+
+    if (stdin_read_full(ctx, buf, NBD_GREETING_SIZE))
+        return -1;
+
+    if (get_be64(buf) != NBD_MAGIC || get_be64(buf + 8) != NBD_OPTS_MAGIC)
+    {
+        warnx("invalid greeting from nbd server");
+        return -1;
+    }
+
+    setup_phase(ctx, SETUP_GREETING, now_us());
+
+    gflags = get_be16(buf + 16);
+    ctx->nbd_client_flags = NBD_FLAG_C_FIXED_NEWSTYLE;
+    if (gflags & NBD_FLAG_NO_ZEROES)
+        ctx->nbd_client_flags |= NBD_FLAG_C_NO_ZEROES;
+
+    put_be32(p, ctx->nbd_client_flags);
+    p += NBD_CFLAGS_SIZE;
+
+    if (gflags & NBD_FLAG_FIXED_NEWSTYLE)
+    {
+        put_be64(p, NBD_OPTS_MAGIC);
+        put_be32(p + 8, NBD_OPT_STRUCTURED_REPLY);
+        put_be32(p + 12, 0);
+        p += NBD_OPTION_SIZE;
+
+        /* empty export name, and a request for the server's block sizes */
+        put_be64(p, NBD_OPTS_MAGIC);
+        put_be32(p + 8, NBD_OPT_GO);
+        put_be32(p + 12, 8);
+        put_be32(p + 16, 0);
+        put_be16(p + 20, 1);
+        put_be16(p + 22, NBD_INFO_BLOCK_SIZE);
+        p += NBD_OPTION_SIZE + 8;
+        ctx->nbd_pending_opt = NBD_OPT_GO;
+    }
+    else
+    {
+        put_be64(p, NBD_OPTS_MAGIC);
+        put_be32(p + 8, NBD_OPT_EXPORT_NAME);
+        put_be32(p + 12, 0);
+        p += NBD_OPTION_SIZE;
+        ctx->nbd_pending_opt = NBD_OPT_EXPORT_NAME;
+    }
+
+    if (server_send(ctx, buf, p - buf, NULL, 0))
+        return -1;
+
+    ctx->nbd_handshake_started = true;
+    return 0;
+}
+
+/* Read the server's replies to the options sent by nbd_handshake_start() */
+static int nbd_handshake_finish(struct ctx* ctx)
+{
+    uint8_t buf[NBD_EXPORT_INFO_SIZE + NBD_EXPORT_INFO_PAD];
+    size_t len;
+    int rc;
+
+    if (ctx->nbd_pending_opt == NBD_OPT_GO)
+    {
+        if (nbd_handshake_structured(ctx))
+            return -1;
+
+        rc = nbd_handshake_go(ctx);
+        if (rc < 0)
+            return -1;
+        if (rc > 0 && nbd_send_option(ctx, NBD_OPT_EXPORT_NAME, NULL, 0))
+            return -1;
+        if (rc > 0)
+            ctx->nbd_pending_opt = NBD_OPT_EXPORT_NAME;
+    }
+
+    if (ctx->nbd_pending_opt == NBD_OPT_EXPORT_NAME)
+    {
+        len = NBD_EXPORT_INFO_SIZE;
+        if (!(ctx->nbd_client_flags & NBD_FLAG_C_NO_ZEROES))
+            len += NBD_EXPORT_INFO_PAD;
+
+        if (stdin_read_full(ctx, buf, len))
+            return -1;
+
+        ctx->nbd_export_size = get_be64(buf);
+        ctx->nbd_export_flags = get_be16(buf + 8);
+    }
+
+    ctx->nbd_pending_opt = 0;
+    ctx->rep_parser.state = NBD_PARSE_REPLY;
+    setup_phase(ctx, SETUP_NEGOTIATED, now_us());
+    return 0;
+}
+
+struct nl_msg
+{
+    union
+    {
+        struct nlmsghdr nlh;
+        uint8_t buf[512];
+    };
+};
+
+static void nl_msg_init(struct nl_msg* msg, uint16_t family, uint8_t cmd,
+                        uint8_t version)
+{
+    struct genlmsghdr* genl;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->nlh.nlmsg_type = family;
+    msg->nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    msg->nlh.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+
+    genl = NLMSG_DATA(&msg->nlh);
+    genl->cmd = cmd;
+    genl->version = version;
+}
+
+static struct nlattr* nl_attr_put(struct nl_msg* msg, uint16_t type,
+                                  const void* data, size_t len)
+{
+    size_t offset = NLMSG_ALIGN(msg->nlh.nlmsg_len);
+    struct nlattr* nla = (struct nlattr*)(msg->buf + offset);
+
+    if (offset + NLA_HDRLEN + NLA_ALIGN(len) > sizeof(msg->buf))
+        return NULL;
+
+    nla->nla_type = type;
+    nla->nla_len = NLA_HDRLEN + len;
+    if (len)
+        memcpy((uint8_t*)nla + NLA_HDRLEN, data, len);
+
+    msg->nlh.nlmsg_len = offset + NLA_ALIGN(nla->nla_len);
+    return nla;
+}
+
+static void nl_attr_nest_end(struct nl_msg* msg, struct nlattr* nla)
+{
+    nla->nla_len = msg->buf + msg->nlh.nlmsg_len - (uint8_t*)nla;
+}
+
+/* Send @msg and wait for the kernel's ack. Any other messages received
+ * before the ack are passed to @cb. */
+static int nl_transact(int sd, struct nl_msg* msg,
+                       void (*cb)(struct nlmsghdr*, void*), void* data)
+{
+    uint8_t buf[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr* nlh;
+    ssize_t len;
+
+    if (send(sd, msg->buf, msg->nlh.nlmsg_len, 0) < 0)
+        return -1;
+
+    for (;;)
+    {
+        len = recv(sd, buf, sizeof(buf), 0);
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (nlh = (struct nlmsghdr*)buf; NLMSG_OK(nlh, (size_t)len);
+             nlh = NLMSG_NEXT(nlh, len))
+        {
+            if (nlh->nlmsg_type == NLMSG_ERROR)
+            {
+                struct nlmsgerr* nlerr = NLMSG_DATA(nlh);
+
+                errno = -nlerr->error;
+                return nlerr->error ? -1 : 0;
+            }
+
+            if (cb)
+                cb(nlh, data);
+        }
+    }
+}
+
+static void nl_family_cb(struct nlmsghdr* nlh, void* data)
+{
+    struct genlmsghdr* genl = NLMSG_DATA(nlh);
+    struct nlattr* nla = (struct nlattr*)((uint8_t*)genl + GENL_HDRLEN);
+    int len = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+
+    for (; len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN &&
+           nla->nla_len <= len;
+         len -= NLA_ALIGN(nla->nla_len),
+         nla = (struct nlattr*)((uint8_t*)nla + NLA_ALIGN(nla->nla_len)))
+    {
+        if ((nla->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_FAMILY_ID)
+            memcpy(data, (uint8_t*)nla + NLA_HDRLEN, sizeof(uint16_t));
+    }
+}
+
+static int nl_open(void)
+{
+    struct sockaddr_nl addr;
+    int sd;
+
+    sd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+    if (sd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    if (bind(sd, (struct sockaddr*)&addr, sizeof(addr)))
+    {
+        close(sd);
+        return -1;
+    }
+
+    return sd;
+}
+
+/* Look up the nbd generic netlink family. If this fails, the kernel has no
+ * netlink nbd interface, and we'll need to use nbd-client instead. */
+static int netlink_init(struct ctx* ctx)
+{
+    struct nl_msg msg;
+    uint16_t family = 0;
+    int sd, rc;
+
+    sd = nl_open();
+    if (sd < 0)
+        return -1;
+
+    nl_msg_init(&msg, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 1);
+    nl_attr_put(&msg, CTRL_ATTR_FAMILY_NAME, NBD_GENL_FAMILY_NAME,
+                sizeof(NBD_GENL_FAMILY_NAME));
+
+    rc = nl_transact(sd, &msg, nl_family_cb, &family);
+    close(sd);
+
+    if (rc || !family)
+        return -1;
+
+    ctx->nbd_genl_family = family;
+    return 0;
+}
+
+static int nbd_device_index(struct ctx* ctx, uint32_t* index)
+{
+    const char* name = strrchr(ctx->config->nbd_device, '/');
+    int n = 0;
+
+    name = name ? name + 1 : ctx->config->nbd_device;
+    if (sscanf(name, "nbd%" SCNu32 "%n", index, &n) != 1 || name[n])
+    {
+        warnx("can't determine nbd index for %s", ctx->config->nbd_device);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Connect the kernel nbd device directly, over one end of a socketpair for
+ * each connection. We perform the handshake with the server first, as the
+ * kernel expects the sockets to be ready for transmission. */
+static int start_nbd_netlink(struct ctx* ctx)
+{
+    struct nlattr *socks, *item;
+    uint64_t size, blksize, timeout, flags;
+    int sv[NBD_MAX_CONNS][2];
+    struct nl_msg msg;
+    int i, n, sd, rc;
+    uint32_t index;
+
+    rc = nbd_device_index(ctx, &index);
+    if (rc)
+        return -1;
+
+    setup_phase(ctx, SETUP_CLIENT, now_us());
+
+    if (!ctx->nbd_handshake_started && nbd_handshake_start(ctx))
+        return -1;
+
+    rc = nbd_handshake_finish(ctx);
+    if (rc)
+        return -1;
+
+    n = ctx->config->connections;
+    if (n > 1 && !(ctx->nbd_export_flags & NBD_FLAG_CAN_MULTI_CONN))
+    {
+        warnx("nbd server doesn't allow multiple connections");
+        n = 1;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        rc = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv[i]);
+        if (rc)
+        {
+            warn("can't create nbd socketpair");
+            n = i;
+            goto err_close;
+        }
+    }
+
+    sd = nl_open();
+    if (sd < 0)
+    {
+        warn("can't open netlink socket");
+        goto err_close;
+    }
+
+    /* the kernel's logical block size must be a power of two between 512
+     * and the page size; use the server's minimum within that range */
+    size = ctx->nbd_export_size;
+    blksize = 512;
+    while (blksize < ctx->nbd_block_min && blksize < 4096)
+        blksize <<= 1;
+    timeout = ctx->nbd_timeout;
+    flags = ctx->nbd_export_flags;
+
+    nl_msg_init(&msg, ctx->nbd_genl_family, NBD_CMD_CONNECT, NBD_GENL_VERSION);
+    nl_attr_put(&msg, NBD_ATTR_INDEX, &index, sizeof(index));
+    nl_attr_put(&msg, NBD_ATTR_SIZE_BYTES, &size, sizeof(size));
+    nl_attr_put(&msg, NBD_ATTR_BLOCK_SIZE_BYTES, &blksize, sizeof(blksize));
+    nl_attr_put(&msg, NBD_ATTR_TIMEOUT, &timeout, sizeof(timeout));
+    nl_attr_put(&msg, NBD_ATTR_SERVER_FLAGS, &flags, sizeof(flags));
+    socks = nl_attr_put(&msg, NBD_ATTR_SOCKETS | NLA_F_NESTED, NULL, 0);
+    for (i = 0; i < n; i++)
+    {
+        item = nl_attr_put(&msg, NBD_SOCK_ITEM | NLA_F_NESTED, NULL, 0);
+        nl_attr_put(&msg, NBD_SOCK_FD, &(uint32_t){sv[i][1]},
+                    sizeof(uint32_t));
+        nl_attr_nest_end(&msg, item);
+    }
+    nl_attr_nest_end(&msg, socks);
+
+    rc = nl_transact(sd, &msg, NULL, NULL);
+    close(sd);
+    if (rc)
+    {
+        warn("can't connect nbd device %s", ctx->config->nbd_device);
+        goto err_close;
+    }
+
+    /* the kernel holds its own reference to its end of the sockets */
+    for (i = 0; i < n; i++)
+    {
+        close(sv[i][1]);
+        ctx->conns[i].fd = sv[i][0];
+        ctx->conns[i].parser.state = NBD_PARSE_REQUEST;
+    }
+
+    ctx->n_conns = n;
+    ctx->nbd_netlink = true;
+    setup_phase(ctx, SETUP_CONNECTED, now_us());
+    return 0;
+
+err_close:
+    for (i = 0; i < n; i++)
+    {
+        close(sv[i][0]);
+        close(sv[i][1]);
+    }
+    return -1;
+}
+
+static void stop_nbd_netlink(struct ctx* ctx)
+{
+    struct nl_msg msg;
+    uint32_t index;
+    int sd;
+
+    if (!ctx->nbd_netlink || nbd_device_index(ctx, &index))
+        return;
+
+    sd = nl_open();
+    if (sd < 0)
+        return;
+
+    nl_msg_init(&msg, ctx->nbd_genl_family, NBD_CMD_DISCONNECT,
+                NBD_GENL_VERSION);
+    nl_attr_put(&msg, NBD_ATTR_INDEX, &index, sizeof(index));
+
+    if (nl_transact(sd, &msg, NULL, NULL))
+        warn("can't disconnect nbd device %s", ctx->config->nbd_device);
+
+    close(sd);
+    ctx->nbd_netlink = false;
+}
+
+/* Decide how to attach the nbd device: netlink if the kernel supports it
+ * (and the configuration allows), otherwise through nbd-client. */
+static int select_client(struct ctx* ctx)
+{
+    if (ctx->client_mode != CLIENT_NBD_CLIENT && !netlink_init(ctx))
+        return 0;
+
+    if (ctx->client_mode == CLIENT_NETLINK)
+    {
+        warnx("kernel has no netlink nbd interface");
+        return -1;
+    }
+
+    if (ctx->config->connections > 1)
+        warnx("multiple connections need netlink; using one");
+
+    return 0;
+}
+
+static int connect_nbd_device(struct ctx* ctx)
+{
+    int rc;
+
+    if (ctx->nbd_genl_family)
+        return start_nbd_netlink(ctx);
+
+    setup_phase(ctx, SETUP_CLIENT, now_us());
+
+    rc = start_nbd_client(ctx);
+    if (rc)
+        return rc;
+
+    return wait_for_nbd_client(ctx);
+}
+
+static int run_state_hook(struct ctx* ctx, const char* action, bool wait)
+{
+    int status, rc;
+    pid_t pid;
+
+    /* if the hook isn't present or executable, that's not necessarily
+     * an error condition */
+    if (access(state_hook_path, X_OK))
+        return 0;
+
+    pid = fork();
+    if (pid < 0)
+    {
+        warn("can't fork to execute hook %s", state_hook_path);
+        return -1;
+    }
+
+    if (!pid)
+    {
+        const char* argv0;
+
+        argv0 = strchr(state_hook_path, '/');
+        if (!argv0)
+            argv0 = state_hook_path;
+
+        int fd;
+        fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+            exit(EXIT_FAILURE);
+
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        execl(state_hook_path, argv0, action, ctx->config->name, NULL);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!wait)
+    {
+        ctx->state_hook_pid = pid;
+        return 0;
+    }
+
+    rc = waitpid(pid, &status, 0);
+    if (rc < 0)
+    {
+        warn("wait");
+        return -1;
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        warnx("hook %s failed", state_hook_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int udev_init(struct ctx* ctx)
+{
+    int rc;
+
+    ctx->udev = udev_new();
+    if (!ctx->udev)
+    {
+        warn("can't create udev object");
+        return -1;
+    }
+
+    ctx->monitor = udev_monitor_new_from_netlink(ctx->udev, "kernel");
+    if (!ctx->monitor)
+    {
+        warn("can't create udev monitor");
+        goto out_unref_udev;
+    }
+
+    rc = udev_monitor_filter_add_match_subsystem_devtype(ctx->monitor, "block",
+                                                         "disk");
+    if (rc)
+    {
+        warn("can't create udev monitor filter");
+        goto out_unref_monitor;
+    }
+
+    rc = udev_monitor_enable_receiving(ctx->monitor);
+    if (rc)
+    {
+        warn("can't start udev monitor");
+        goto out_unref_monitor;
+    }
+
+    return 0;
+
+out_unref_monitor:
+    udev_monitor_unref(ctx->monitor);
+out_unref_udev:
+    udev_unref(ctx->udev);
+    return -1;
+}
+
+static void udev_free(struct ctx* ctx)
+{
+    udev_monitor_unref(ctx->monitor);
+    udev_unref(ctx->udev);
+}
+
+/* Receive an event from @monitor. Returns true if it is a change event, with
+ * the device number in @devno. */
+static bool udev_receive_change(struct udev_monitor* monitor, dev_t* devno)
+{
+    struct udev_device* dev;
+    bool action_is_change;
+
+    dev = udev_monitor_receive_device(monitor);
+    if (!dev)
+        return false;
+
+    *devno = udev_device_get_devnum(dev);
+    action_is_change = !strcmp(udev_device_get_action(dev), "change");
+    udev_device_unref(dev);
+
+    return action_is_change;
+}
+
+/* The kernel has finished initialising the block device */
+static int session_ready(struct ctx* ctx)
+{
+    setup_phase(ctx, SETUP_READY, now_us());
+    setup_report(ctx);
+    return run_state_hook(ctx, "start", false);
+}
+
+/* Check for the change event on our nbd device, signifying that the kernel
+ * has finished initialising the block device. Once we see the event, we run
+ * the "start" state hook, and close the udev monitor.
+ *
+ * Returns:
+ *   0 if no processing was performed
+ *  -1 on state hook error (and the nbd session should be closed)
+ */
+static int udev_process(struct ctx* ctx)
+{
+    dev_t devno;
+
+    if (!udev_receive_change(ctx->monitor, &devno))
+        return 0;
+
+    if (devno != ctx->nbd_devno)
+        return 0;
+
+    udev_monitor_unref(ctx->monitor);
+    udev_unref(ctx->udev);
+    ctx->monitor = NULL;
+    ctx->udev = NULL;
+
+    return session_ready(ctx);
+}
+
+static int epoll_add(int epfd, int fd, uint32_t events, uint32_t tag)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.u32 = tag;
+
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int set_nonblock(int fd)
+{
+    int flags;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+        return -1;
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Watch stripe @i's fds, as proxy_epoll_add() does the main stream's */
+static int stripe_epoll_add(struct ctx* ctx, int i)
+{
+    struct stripe* st = &ctx->striping.stripes[i];
+    uint32_t tag = ctx->ev_base + EV_STRIPE + 2 * i;
+
+    st->in.ready = st->out.ready = true;
+
+    if (set_nonblock(st->in.fd) || set_nonblock(st->out.fd) ||
+        epoll_add(ctx->epfd, st->in.fd, EPOLLIN | EPOLLET, tag) ||
+        epoll_add(ctx->epfd, st->out.fd, EPOLLOUT | EPOLLET, tag + 1))
+        return -1;
+
+    return 0;
+}
+
+/* Stop using the current server stream. Closing the connection that it was
+ * handed to us through lets the process that handed it over exit. */
+static void resume_close_stream(struct ctx* ctx)
+{
+    int fds[2] = {ctx->rep_in.fd, ctx->req_out.fd};
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        if (fds[i] < 0)
+            continue;
+        epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, fds[i], NULL);
+        close(fds[i]);
+    }
+
+    ctx->rep_in.fd = ctx->req_out.fd = -1;
+    ctx->rep_in.ready = ctx->req_out.ready = false;
+
+    if (ctx->resume.peer >= 0)
+    {
+        close(ctx->resume.peer);
+        ctx->resume.peer = -1;
+    }
+}
+
+/* The server stream has gone. If the session can be resumed, drop the
+ * stream, and put back the request whose reply we were part-way through:
+ * if the kernel has seen some of the reply, we need the rest of the data,
+ * otherwise the whole request goes again. Returns 0 if we're now waiting
+ * for a new stream, or -1 if the session should end. */
+static int session_detach(struct ctx* ctx)
+{
+    struct nbd_structured_reply* sr = &ctx->sreply;
+    struct nbd_parser* parser = &ctx->rep_parser;
+    struct resume* rs = &ctx->resume;
+    struct nbd_inflight_req req;
+    bool have = true, cut = false;
+    uint64_t done = 0;
+
+    if (!resume_enabled(ctx) || parser->state != NBD_PARSE_REPLY ||
+        ctx->disc_sent)
+        return -1;
+
+    if (sr->active)
+    {
+        req = sr->req;
+        cut = sr->started && req.ra_slot < 0;
+        done = sr->pos - parser->skip - req.offset;
+    }
+    else if (parser->skip)
+    {
+        req = ctx->rep_req;
+        cut = parser->forward;
+        done = req.len - parser->skip;
+    }
+    else
+        have = false;
+
+    /* the kernel may already have all of the data */
+    if (have && cut && done == req.len)
+        have = false;
+
+    if (have)
+    {
+        if (cut)
+        {
+            req.offset += done;
+            req.len -= done;
+            req.resumed = true;
+            rs->cont_pending = true;
+            rs->cont_conn = req.conn;
+        }
+        if (req.ra_slot >= 0)
+            ctx->ra.slots[req.ra_slot].filled = 0;
+        if (inflight_add(&ctx->inflight, &req))
+            return -1;
+    }
+
+    /* the rest of the reply's data won't pass as one, to be hashed */
+    if (ctx->trace && ctx->trace->rep_pending)
+    {
+        ctx->trace->rep_flags &= ~TRACE_F_HASH;
+        trace_reply_done(ctx);
+    }
+
+    sr->active = false;
+    parser->skip = 0;
+    parser->hdr_len = 0;
+    parser->forward = false;
+    ctx->ra.cur_slot = -1;
+    ctx->cache.fill_end = ctx->cache.fill_pos;
+
+    /* anything unparsed or unsent belongs to the old stream. Everything
+     * we've sent is still in flight, and will be sent again. */
+    ctx->rep_in.start = ctx->rep_in.end;
+    ctx->rep_in.eof = false;
+    ctx->req_out.n_iov = ctx->req_out.n_busy = 0;
+    ctx->req_out.scratch_len = 0;
+    free(rs->replay);
+    rs->replay = NULL;
+    rs->n_replay = rs->replay_pos = 0;
+
+    ws_free(ctx);
+    resume_close_stream(ctx);
+    stripes_close(ctx);
+
+    rs->detached = true;
+    rs->t_detach = now_us();
+    rs->deadline =
+        rs->t_detach + (uint64_t)ctx->config->resume_timeout * 1000000;
+
+    warnx("server stream lost; waiting %d seconds for it to be resumed",
+          ctx->config->resume_timeout);
+    return 0;
+}
+
+/* Write out everything queued for the kernel, waiting if need be. Reply
+ * data is forwarded from the server stream's input buffer, which the new
+ * stream is about to reuse. */
+static int resume_drain(struct ctx* ctx)
+{
+    struct pollfd pollfd;
+    struct outq* q;
+    bool progress;
+    int i, rc;
+
+    for (i = 0; i < ctx->n_conns; i++)
+    {
+        q = &ctx->conns[i].out;
+        q->ready = true;
+
+        while (q->n_iov)
+        {
+            if (outq_write(q, &progress))
+                return -1;
+            if (!q->n_iov)
+                break;
+
+            pollfd.fd = q->fd;
+            pollfd.events = POLLOUT;
+            rc = poll(&pollfd, 1, ws_handshake_timeout_ms);
+            if (rc < 0 && errno == EINTR)
+                continue;
+            if (rc <= 0)
+            {
+                warnx("timeout waiting for nbd device");
+                return -1;
+            }
+            q->ready = true;
+        }
+    }
+
+    return 0;
+}
+
+static int handle_cmp(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* List our outstanding requests to send again, in the order they were
+ * first sent: after the rest of any cut-off read, and before a write that
+ * the kernel is still sending. */
+static int resume_replay_init(struct ctx* ctx)
+{
+    struct resume* rs = &ctx->resume;
+    struct nbd_inflight_req* req;
+    uint64_t first = 0, last = 0;
+    bool has_first = false, has_last = false;
+    uint64_t* list;
+    size_t i, n = 0;
+
+    free(rs->replay);
+    rs->n_replay = rs->replay_pos = 0;
+    rs->replay = malloc((ctx->inflight.n + 1) * sizeof(*rs->replay));
+    if (!rs->replay)
+        return -1;
+
+    list = rs->replay + 1;
+
+    for (i = 0; i < ctx->inflight.size; i++)
+    {
+        req = &ctx->inflight.reqs[i];
+        if (!req->used)
+            continue;
+
+        if (req->resumed)
+        {
+            first = req->handle;
+            has_first = true;
+        }
+        else if (req->data && ctx->conns[req->conn].write_data == req->data)
+        {
+            last = req->handle;
+            has_last = true;
+        }
+        else
+            list[n++] = req->handle;
+    }
+
+    qsort(list, n, sizeof(*list), handle_cmp);
+
+    /* the list was built after a space for the cut-off read */
+    if (has_first)
+    {
+        rs->replay[0] = first;
+        n++;
+    }
+    else
+        memmove(rs->replay, list, n * sizeof(*list));
+
+    if (has_last)
+        rs->replay[n++] = last;
+
+    rs->n_replay = n;
+    return 0;
+}
+
+/* Take @in and @out as the server stream (@out is -1 for a socket, which
+ * serves for both), negotiate with the new server, and queue our
+ * outstanding requests to be sent again. A stream that the session is
+ * still using is dropped first. On failure, the new fds are closed, and
+ * the session carries on waiting for another stream. */
+static int session_resume(struct ctx* ctx, int in, int out, bool websocket)
+{
+    uint16_t flags = ctx->nbd_export_flags;
+    uint64_t size = ctx->nbd_export_size;
+    int timeout = ctx->setup_timeout_ms;
+    struct config* config = ctx->config;
+    struct resume* rs = &ctx->resume;
+    int rc;
+
+    if (out < 0)
+        out = fcntl(in, F_DUPFD_CLOEXEC, 0);
+    if (out < 0 || (!rs->detached && session_detach(ctx)) ||
+        resume_drain(ctx))
+        goto err_close;
+
+    ctx->rep_in.fd = in;
+    ctx->req_out.fd = out;
+    ctx->rep_in.start = ctx->rep_in.end = 0;
+
+    if (websocket)
+    {
+        ctx->ws = calloc(1, sizeof(*ctx->ws));
+        if (!ctx->ws || ws_upgrade(ctx, in))
+            goto err_detach;
+    }
+
+    /* the new server knows nothing of the session so far */
+    ctx->setup_timeout_ms = ws_handshake_timeout_ms;
+    rc = nbd_handshake_start(ctx) || nbd_handshake_finish(ctx);
+    ctx->setup_timeout_ms = timeout;
+    if (rc)
+        goto err_detach;
+
+    if (ctx->nbd_export_size != size ||
+        ((ctx->nbd_export_flags ^ flags) & NBD_FLAG_READ_ONLY))
+    {
+        warnx("resumed nbd server has a different export");
+        goto err_detach;
+    }
+
+    if (set_nonblock(in) || set_nonblock(out) ||
+        epoll_add(ctx->epfd, in, EPOLLIN | EPOLLET, ctx->ev_base + EV_STDIN) ||
+        epoll_add(ctx->epfd, out, EPOLLOUT | EPOLLET,
+                  ctx->ev_base + EV_STDOUT))
+    {
+        warn("can't set up resumed server stream");
+        goto err_detach;
+    }
+    ctx->rep_in.ready = ctx->req_out.ready = true;
+
+    if (resume_replay_init(ctx))
+        goto err_detach;
+
+    /* keep the pipe sizes we'd settled on, if the new stream is pipes */
+    ctx->tune.pipe_in =
+        fd_is_pipe(in)
+            ? pipe_resize(in, config->pipe_size_max ? ctx->tune.pipe_in : 0)
+            : 0;
+    ctx->tune.pipe_out =
+        fd_is_pipe(out)
+            ? pipe_resize(out, config->pipe_size_max ? ctx->tune.pipe_out : 0)
+            : 0;
+
+    rs->detached = false;
+    rs->resumes++;
+    rs->detached_us += now_us() - rs->t_detach;
+
+    warnx("server stream resumed after %" PRIu64 " ms; sending %zu "
+          "requests again",
+          (now_us() - rs->t_detach) / 1000, rs->n_replay);
+    return 0;
+
+err_detach:
+    ctx->nbd_export_size = size;
+    ctx->nbd_export_flags = flags;
+    free(ctx->ws);
+    ctx->ws = NULL;
+    resume_close_stream(ctx);
+    return -1;
+
+err_close:
+    close(in);
+    if (out >= 0)
+        close(out);
+    return -1;
+}
+
+/* Does the session want another server stream to stripe over? Only while
+ * it has a working one to add it to. */
+static bool stripe_wanted(struct ctx* ctx)
+{
+    return ctx->striping.n + 1 < ctx->config->streams &&
+           !ctx->resume.detached && !ctx->disc_sent &&
+           ctx->rep_parser.state == NBD_PARSE_REPLY;
+}
+
+/* Set up the next stripe for @in and @out, allocating its buffers the
+ * first time it's used */
+static struct stripe* stripe_init(struct ctx* ctx, int in, int out)
+{
+    struct stripe* st = &ctx->striping.stripes[ctx->striping.n];
+
+    if ((!st->in.buf && inq_init(&st->in, ctx->bufsize)) ||
+        (!st->out.scratch && outq_init(&st->out, 2 * OUTQ_SCRATCH_SIZE)))
+        return NULL;
+
+    st->in.fd = in;
+    st->out.fd = out;
+    st->in.start = st->in.end = 0;
+    st->in.eof = false;
+    st->ws = NULL;
+    st->peer = -1;
+    return st;
+}
+
+/* Take @in and @out (as for session_resume()) as an extra server stream,
+ * negotiating with its server as we did with the first. Requests are
+ * spread across the streams, and each server replies on the stream its
+ * requests came from. On failure, the new fds are closed, and the session
+ * carries on with the streams it has. */
+static int session_stripe(struct ctx* ctx, int in, int out, bool websocket)
+{
+    struct striping* sp = &ctx->striping;
+    struct stripe* st = NULL;
+    uint32_t block_min = ctx->nbd_block_min, block_pref = ctx->nbd_block_pref;
+    uint32_t block_max = ctx->nbd_block_max;
+    uint32_t client_flags = ctx->nbd_client_flags;
+    uint16_t flags = ctx->nbd_export_flags;
+    uint64_t size = ctx->nbd_export_size;
+    bool structured = ctx->nbd_structured;
+    int timeout = ctx->setup_timeout_ms;
+    struct inq main_in;
+    struct outq main_out;
+    struct ws* main_ws;
+    int rc;
+
+    if (out < 0)
+        out = fcntl(in, F_DUPFD_CLOEXEC, 0);
+    if (out >= 0)
+        st = stripe_init(ctx, in, out);
+    if (!st)
+        goto err_close;
+
+    if (websocket)
+    {
+        st->ws = calloc(1, sizeof(*st->ws));
+        if (!st->ws)
+            goto err_free;
+    }
+
+    /* the handshake is done on the session's stream fields, so swap the
+     * new stream in for it */
+    main_in = ctx->rep_in;
+    main_out = ctx->req_out;
+    main_ws = ctx->ws;
+    ctx->rep_in = st->in;
+    ctx->req_out = st->out;
+    ctx->ws = st->ws;
+
+    ctx->setup_timeout_ms = ws_handshake_timeout_ms;
+    rc = (websocket && ws_upgrade(ctx, in)) || nbd_handshake_start(ctx) ||
+         nbd_handshake_finish(ctx);
+    ctx->setup_timeout_ms = timeout;
+
+    st->in = ctx->rep_in;
+    st->out = ctx->req_out;
+    ctx->rep_in = main_in;
+    ctx->req_out = main_out;
+    ctx->ws = main_ws;
+
+    if (!rc && (ctx->nbd_export_size != size ||
+                ((ctx->nbd_export_flags ^ flags) & NBD_FLAG_READ_ONLY)))
+    {
+        warnx("striped nbd server has a different export");
+        rc = -1;
+    }
+
+    /* the session keeps what it negotiated first; replies may be
+     * structured if any server's are */
+    ctx->nbd_export_size = size;
+    ctx->nbd_export_flags = flags;
+    ctx->nbd_client_flags = client_flags;
+    ctx->nbd_block_min = block_min;
+    ctx->nbd_block_pref = block_pref;
+    ctx->nbd_block_max = block_max;
+    ctx->nbd_structured = structured || ctx->nbd_structured;
+    if (rc)
+        goto err_free;
+
+    if (stripe_epoll_add(ctx, sp->n))
+    {
+        warn("can't set up striped server stream");
+        epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, in, NULL);
+        goto err_free;
+    }
+
+    sp->n++;
+    sp->joins++;
+
+    warnx("server stream %d joined; striping over %d streams", sp->n,
+          sp->n + 1);
+    return 0;
+
+err_free:
+    free(st->ws);
+    st->ws = NULL;
+    st->in.fd = st->out.fd = -1;
+    st->in.start = st->in.end = 0;
+err_close:
+    close(in);
+    if (out >= 0)
+        close(out);
+    return -1;
+}
+
+/* Take a new server stream for the session, either to stripe over, or to
+ * resume it with. Returns 1 if it was added as a stripe, 0 if it resumed
+ * the session, or -1 on failure, with the fds closed. */
+static int session_join(struct ctx* ctx, int in, int out, bool websocket)
+{
+    if (stripe_wanted(ctx))
+        return session_stripe(ctx, in, out, websocket) ? -1 : 1;
+
+    if (resume_enabled(ctx))
+        return session_resume(ctx, in, out, websocket);
+
+    warnx("session already has all of its server streams");
+    close(in);
+    if (out >= 0)
+        close(out);
+    return -1;
+}
+
+/* How long the event loop may wait before a detached session's grace
+ * period is up, or -1 for no limit */
+static int resume_wait_ms(struct ctx* ctx)
+{
+    uint64_t now;
+
+    if (!ctx->resume.detached)
+        return -1;
+
+    now = now_us();
+    if (now >= ctx->resume.deadline)
+        return 0;
+
+    return (ctx->resume.deadline - now + 999) / 1000;
+}
+
+/* How long the event loop may wait before the session has timed work */
+static int session_wait_ms(struct ctx* ctx)
+{
+    int resume = resume_wait_ms(ctx), qos = qos_wait_ms(ctx);
+
+    if (resume < 0 || (qos >= 0 && qos < resume))
+        return qos;
+    return resume;
+}
+
+/* Receive a control request, and up to @max_fds fds passed with it */
+static ssize_t control_recv(int sd, char* buf, size_t len, int* fds,
+                            int max_fds)
+{
+    union
+    {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } cbuf;
+    struct iovec iov = {.iov_base = buf, .iov_len = len - 1};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf.buf,
+        .msg_controllen = sizeof(cbuf.buf),
+    };
+    struct cmsghdr* cmsg;
+    struct pollfd pollfd;
+    int i, n, fd;
+    ssize_t rc;
+
+    for (i = 0; i < max_fds; i++)
+        fds[i] = -1;
+
+    pollfd.fd = sd;
+    pollfd.events = POLLIN;
+    rc = poll(&pollfd, 1, control_timeout_ms);
+    if (rc <= 0)
+        return -1;
+
+    rc = recvmsg(sd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    if (rc < 0)
+        return -1;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < n; i++)
+        {
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (i < max_fds)
+                fds[i] = fd;
+            else
+                close(fd);
+        }
+    }
+
+    buf[rc] = '\0';
+    return rc;
+}
+
+/* Accept a server stream handed over by another nbd-proxy, started for a
+ * new connection to our configuration, to resume or stripe the session
+ * with. The request is "resume" with the input and output fds, or "resume
+ * websocket" with a connection to upgrade. We keep the connection open
+ * while we use the stream, as the other process has to stay around for its
+ * websocket proxy. */
+static void resume_accept(struct ctx* ctx)
+{
+    char buf[64], *cmd, *arg, *save;
+    const char* reply = "ok";
+    int sd, fds[2], rc = -1;
+
+    sd = accept4(ctx->resume.sock, NULL, NULL, SOCK_CLOEXEC);
+    if (sd < 0)
+    {
+        warn("can't accept resume connection");
+        return;
+    }
+
+    if (control_recv(sd, buf, sizeof(buf), fds, 2) < 0)
+    {
+        warnx("invalid resume request");
+        close(sd);
+        return;
+    }
+
+    cmd = strtok_r(buf, " \n", &save);
+    arg = strtok_r(NULL, " \n", &save);
+
+    if (!cmd || strcmp(cmd, "resume"))
+        reply = "error: unknown command";
+    else if (arg ? strcmp(arg, "websocket") || fds[0] < 0 || fds[1] >= 0
+                 : fds[1] < 0)
+        reply = "error: invalid stream";
+    else
+    {
+        rc = session_join(ctx, fds[0], arg ? -1 : fds[1], !!arg);
+        if (rc < 0)
+            reply = "error: can't join session";
+        fds[0] = fds[1] = -1;
+    }
+
+    if (send(sd, reply, strlen(reply), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        warn("can't send resume reply");
+
+    if (fds[0] >= 0)
+        close(fds[0]);
+    if (fds[1] >= 0)
+        close(fds[1]);
+
+    if (rc < 0)
+        close(sd);
+    else if (rc)
+        ctx->striping.stripes[ctx->striping.n - 1].peer = sd;
+    else
+        ctx->resume.peer = sd;
+}
+
+static char* resume_sock_path(struct ctx* ctx)
+{
+    char* path;
+
+    if (asprintf(&path, resumesockpath_tmpl, ctx->config->name) < 0)
+        return NULL;
+
+    return path;
+}
+
+/* Listen for server streams to resume the session with, on a socket named
+ * for the configuration, where a later nbd-proxy for the same
+ * configuration will look. */
+static int open_resume_socket(struct ctx* ctx)
+{
+    struct sockaddr_un addr;
+    char* path;
+    int sd, rc;
+
+    path = resume_sock_path(ctx);
+    if (!path)
+        return -1;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        warnx("resume socket path too long");
+        goto err_free;
+    }
+
+    sd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sd < 0)
+    {
+        warn("can't create resume socket");
+        goto err_free;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* as for the control socket, this hands out access to the device */
+    unlink(path);
+    rc = bind(sd, (struct sockaddr*)&addr, sizeof(addr));
+    if (rc || chmod(path, 0600) || listen(sd, 1))
+    {
+        warn("can't listen on resume socket %s", path);
+        if (!rc)
+            unlink(path);
+        close(sd);
+        goto err_free;
+    }
+
+    ctx->resume.sock = sd;
+    ctx->resume.sock_path = path;
+    return 0;
+
+err_free:
+    free(path);
+    return -1;
+}
+
+static void close_resume_socket(struct ctx* ctx)
+{
+    if (ctx->resume.peer >= 0)
+    {
+        close(ctx->resume.peer);
+        ctx->resume.peer = -1;
+    }
+
+    if (ctx->resume.sock < 0)
+        return;
+
+    close(ctx->resume.sock);
+    unlink(ctx->resume.sock_path);
+    free(ctx->resume.sock_path);
+    ctx->resume.sock = -1;
+    ctx->resume.sock_path = NULL;
+}
+
+/* If a session for our configuration is waiting to be resumed, hand it our
+ * server stream: stdio, or the websocket connection, which it upgrades
+ * itself. We then stay until the session is done with the stream, as a
+ * websocket proxy may close the connection once we exit. Returns 1 if
+ * there's no session to hand over to, 0 once the session is done with the
+ * stream, or -1 on failure. */
+static int resume_handoff(struct ctx* ctx, const char* ws_addr, int ws_fd)
+{
+    union
+    {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } cbuf;
+    struct msghdr msg = {0};
+    struct sockaddr_un addr;
+    struct cmsghdr* cmsg;
+    char reply[256], *path;
+    int sd, n_fds, fds[2], rc = -1;
+    struct iovec iov;
+    const char* req;
+    ssize_t len;
+
+    path = resume_sock_path(ctx);
+    if (!path)
+        return -1;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        free(path);
+        return 1;
+    }
+
+    sd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sd < 0)
+    {
+        warn("can't create resume socket");
+        free(path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (connect(sd, (struct sockaddr*)&addr, sizeof(addr)))
+    {
+        rc = errno == ENOENT || errno == ECONNREFUSED ? 1 : -1;
+        if (rc < 0)
+            warn("can't connect to %s", path);
+        goto out_close;
+    }
+
+    if (ws_addr || ws_fd >= 0)
+    {
+        fds[0] = ws_addr ? ws_accept(ctx, ws_addr) : ws_fd;
+        if (fds[0] < 0)
+            goto out_close;
+        n_fds = 1;
+        req = "resume websocket";
+    }
+    else
+    {
+        fds[0] = STDIN_FILENO;
+        fds[1] = STDOUT_FILENO;
+        n_fds = 2;
+        req = "resume";
+    }
+
+    iov.iov_base = (void*)req;
+    iov.iov_len = strlen(req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf.buf;
+    msg.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof(int));
+
+    len = sendmsg(sd, &msg, MSG_NOSIGNAL);
+
+    /* the session has its own copy of a websocket connection */
+    if (n_fds == 1)
+        close(fds[0]);
+
+    if (len < 0)
+    {
+        warn("can't hand over server stream");
+        goto out_close;
+    }
+
+    /* the reply comes once the session has negotiated with the server */
+    if (ws_poll(ctx, sd, -1))
+        goto out_close;
+
+    len = recv(sd, reply, sizeof(reply) - 1, 0);
+    if (len <= 0)
+    {
+        warnx("no reply to resume request");
+        goto out_close;
+    }
+    reply[len] = '\0';
+
+    if (strcmp(reply, "ok"))
+    {
+        warnx("can't resume session: %s", reply);
+        goto out_close;
+    }
+
+    while (!ws_poll(ctx, sd, -1) && recv(sd, reply, sizeof(reply), 0) > 0)
+        ;
+    rc = 0;
+
+out_close:
+    close(sd);
+    free(path);
+    return rc;
+}
+
+static void run_proxy_init(struct ctx* ctx)
+{
+    struct nbd_conn* conn;
+    int i;
+
+    ctx->rep_parser.out = &ctx->conns[0].out;
+
+    for (i = 0; i < ctx->n_conns; i++)
+    {
+        conn = &ctx->conns[i];
+        conn->in.fd = conn->out.fd = conn->fd;
+    }
+
+    tune_init(ctx);
+    trace_start(ctx);
+    qos_init(ctx);
+}
+
+#ifdef HAVE_LIBURING
+static int uring_complete(struct ctx* ctx, struct io_uring_cqe* cqe,
+                          bool* exit)
+{
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    uint32_t tag = data & 0xffffffff;
+    struct uring* ur = ctx->uring;
+    struct uring_conn* uc;
+    struct uring_held* h;
+    struct outq* q;
+    struct inq* in;
+    int res = cqe->res;
+
+    if (res == -EINTR || res == -EAGAIN)
+        res = 0;
+
+    switch (data >> 32)
+    {
+        case UR_READ:
+            in = &ctx->rep_in;
+            in->pending = false;
+            if (res < 0)
+                break;
+            if (!res && cqe->res == 0)
+                in->eof = true;
+            in->end += res;
+            return 0;
+
+        case UR_WRITE:
+            q = tag == EV_STDOUT ? &ctx->req_out : &ctx->conns[tag - EV_CONN].out;
+            q->pending = false;
+            q->n_busy = 0;
+            if (res < 0)
+                break;
+            outq_consume(q, res);
+            return 0;
+
+        case UR_RECV:
+            in = &ctx->conns[tag - EV_CONN].in;
+            uc = &ur->conns[tag - EV_CONN];
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                uc->armed = false;
+            if (res == -ENOBUFS)
+                return 0;
+            if (res < 0)
+                break;
+            if (!res)
+            {
+                if (cqe->res == 0)
+                    in->eof = true;
+                return 0;
+            }
+            h = &uc->held[(uc->head + uc->n) % URING_RECV_BUFS];
+            h->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            h->off = 0;
+            h->len = res;
+            uc->n++;
+            ur->n_held++;
+            return 0;
+
+        case UR_POLL:
+            if (res < 0)
+                return res == -ECANCELED ? 0 : -1;
+            if (tag == EV_SIGNAL)
+                res = process_signal_pipe(ctx, exit);
+            else if (tag == EV_STATS)
+                stats_process(ctx);
+            else if (tag == EV_UDEV && ctx->udev)
+                res = udev_process(ctx);
+
+            /* once udev_process has closed the monitor, stop polling it */
+            if (tag == EV_UDEV && !ctx->udev)
+            {
+                struct io_uring_sqe* sqe = uring_sqe(ur);
+                if (!sqe)
+                    return -1;
+                io_uring_prep_cancel64(sqe, data, 0);
+                io_uring_sqe_set_data64(sqe, 0);
+            }
+            else if (!(cqe->flags & IORING_CQE_F_MORE))
+            {
+                if (uring_poll(ur, tag == EV_SIGNAL  ? ctx->signal_pipe[0]
+                                   : tag == EV_STATS ? ctx->stats_sock
+                                                     : udev_monitor_get_fd(
+                                                           ctx->monitor),
+                               tag))
+                    return -1;
+            }
+            return res;
+
+        default:
+            return 0;
+    }
+
+    errno = -res;
+    warn("%s failure", data >> 32 == UR_WRITE ? "write" : "read");
+    return -1;
+}
+/* io_uring data path: the stream fds stay blocking, as the ring does the
+ * waiting, and all other fds are polled through the ring too. */
+static int run_proxy_uring(struct ctx* ctx)
+{
+    struct uring* ur = ctx->uring;
+    struct __kernel_timespec ts;
+    struct io_uring_cqe* cqe;
+    bool exit = false;
+    unsigned int head, n;
+    int rc, wait;
+
+    rc = uring_poll(ur, ctx->signal_pipe[0], EV_SIGNAL);
+    rc = rc || uring_poll(ur, udev_monitor_get_fd(ctx->monitor), EV_UDEV);
+    if (!rc && ctx->stats_sock >= 0)
+        rc = uring_poll(ur, ctx->stats_sock, EV_STATS);
+    if (rc)
+        return -1;
+
+    for (;;)
+    {
+        rc = pump(ctx);
+        if (rc <= 0)
+            break;
+
+        /* a throttled session wakes up once it may send again */
+        wait = session_wait_ms(ctx);
+        if (wait < 0)
+        {
+            rc = io_uring_submit_and_wait(&ur->ring, 1);
+        }
+        else
+        {
+            ts.tv_sec = wait / 1000;
+            ts.tv_nsec = (wait % 1000) * 1000000ll;
+            rc = io_uring_submit_and_wait_timeout(&ur->ring, &cqe, 1, &ts,
+                                                  NULL);
+        }
+        if (rc < 0)
+        {
+            if (rc == -EINTR || rc == -ETIME)
+                continue;
+            errno = -rc;
+            warn("io_uring wait failed");
+            rc = -1;
+            break;
+        }
+
+        n = 0;
+        rc = 0;
+        io_uring_for_each_cqe(&ur->ring, head, cqe)
+        {
+            n++;
+            if (!rc && !exit)
+                rc = uring_complete(ctx, cqe, &exit);
+        }
+        io_uring_cq_advance(&ur->ring, n);
+
+        if (rc || exit)
+            break;
+    }
+
+    return rc < 0 ? -1 : 0;
+}
+#endif
+
+/* epoll data path: all stream fds are non-blocking, and edge-triggered in
+ * epoll, so we keep track of their readiness ourselves. They start out
+ * marked ready, and are only marked unready once they return EAGAIN. Tags
+ * for a session's fds have @base added, so that several sessions can share
+ * one epoll instance. */
+static int proxy_epoll_add(struct ctx* ctx, int epfd, uint32_t base)
+{
+    struct nbd_conn* conn;
+    int i, rc;
+
+    ctx->rep_in.ready = true;
+    ctx->req_out.ready = true;
+    ctx->epfd = epfd;
+    ctx->ev_base = base;
+
+    rc = set_nonblock(ctx->rep_in.fd) || set_nonblock(ctx->req_out.fd);
+    rc = rc || epoll_add(epfd, ctx->rep_in.fd, EPOLLIN | EPOLLET,
+                         base + EV_STDIN);
+    rc = rc || epoll_add(epfd, ctx->req_out.fd, EPOLLOUT | EPOLLET,
+                         base + EV_STDOUT);
+    if (!rc && ctx->stats_sock >= 0)
+        rc = epoll_add(epfd, ctx->stats_sock, EPOLLIN, base + EV_STATS);
+    if (!rc && ctx->resume.sock >= 0)
+        rc = epoll_add(epfd, ctx->resume.sock, EPOLLIN, base + EV_RESUME);
+
+    for (i = 0; !rc && i < ctx->n_conns; i++)
+    {
+        conn = &ctx->conns[i];
+        conn->in.ready = conn->out.ready = true;
+
+        rc = set_nonblock(conn->fd) ||
+             epoll_add(epfd, conn->fd, EPOLLIN | EPOLLOUT | EPOLLET,
+                       base + EV_CONN + i);
+    }
+
+    for (i = 0; !rc && i < ctx->striping.n; i++)
+        rc = stripe_epoll_add(ctx, i);
+
+    return rc ? -1 : 0;
+}
+
+/* Handle an epoll event for one of a session's fds */
+static int proxy_event(struct ctx* ctx, uint32_t tag, uint32_t ev, bool* exit)
+{
+    struct nbd_conn* conn;
+    struct stripe* st;
+
+    switch (tag)
+    {
+        case EV_STDIN:
+            ctx->rep_in.ready = true;
+            break;
+        case EV_STDOUT:
+            ctx->req_out.ready = true;
+            break;
+        case EV_SIGNAL:
+            return process_signal_pipe(ctx, exit);
+        case EV_STATS:
+            stats_process(ctx);
+            break;
+        case EV_RESUME:
+            resume_accept(ctx);
+            break;
+        case EV_UDEV:
+            /* udev_process may close the udev connection, which removes
+             * its fd from the epoll set */
+            return udev_process(ctx);
+        default:
+            if (tag >= EV_STRIPE)
+            {
+                st = &ctx->striping.stripes[(tag - EV_STRIPE) / 2];
+                if ((tag - EV_STRIPE) % 2)
+                    st->out.ready = true;
+                else
+                    st->in.ready = true;
+                break;
+            }
+            conn = &ctx->conns[tag - EV_CONN];
+            if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                conn->in.ready = true;
+            if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                conn->out.ready = true;
+            break;
+    }
+
+    return 0;
+}
+
+static int run_proxy_epoll(struct ctx* ctx)
+{
+    struct epoll_event events[4 + NBD_MAX_CONNS + 2 * NBD_MAX_STREAMS];
+    bool exit = false;
+    int epfd, i, n, rc;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        warn("can't create epoll instance");
+        return -1;
+    }
+
+    rc = epoll_add(epfd, ctx->signal_pipe[0], EPOLLIN, EV_SIGNAL) ||
+         epoll_add(epfd, udev_monitor_get_fd(ctx->monitor), EPOLLIN,
+                   EV_UDEV) ||
+         proxy_epoll_add(ctx, epfd, 0);
+    if (rc)
+    {
+        warn("can't set up proxy fds");
+        goto out_close;
+    }
+
+    /* main proxy: forward data between stdio & sockets */
+    for (;;)
+    {
+        rc = pump(ctx);
+        if (rc <= 0)
+            break;
+
+        n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]),
+                       session_wait_ms(ctx));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            warn("epoll_wait failed");
+            rc = -1;
+            break;
+        }
+
+        for (i = 0, rc = 0; i < n && !rc && !exit; i++)
+            rc = proxy_event(ctx, events[i].data.u32, events[i].events,
+                             &exit);
+
+        if (rc || exit)
+            break;
+    }
+
+out_close:
+    close(epfd);
+    return rc < 0 ? -1 : 0;
+}
+
+/* Run the proxy through io_uring if we have it, and the kernel supports
+ * everything we need; otherwise, fall back to epoll. */
+static int run_proxy(struct ctx* ctx)
+{
+    int rc;
+
+    run_proxy_init(ctx);
+
+#ifdef HAVE_LIBURING
+    /* websocket framing, and replacing or adding server streams, are
+     * only done on the epoll path */
+    if (!ctx->ws && !session_joinable(ctx) && !uring_init(ctx))
+    {
+        rc = run_proxy_uring(ctx);
+        uring_free(ctx);
+        return rc;
+    }
+#endif
+
+    rc = run_proxy_epoll(ctx);
+    return rc;
+}
+
+static void print_metadata(struct ctx* ctx)
+{
+    struct json_object* md;
+    int i;
+
+    md = json_object_new_object();
+
+    for (i = 0; i < ctx->n_configs; i++)
+    {
+        struct config* config = &ctx->configs[i];
+        json_object_object_add(md, config->name,
+                               json_object_get(config->metadata));
+    }
+
+    puts(json_object_get_string(md));
+
+    json_object_put(md);
+}
+
+static void config_free_one(struct config* config)
+{
+    if (config->metadata)
+        json_object_put(config->metadata);
+    free(config->nbd_device);
+    free(config->trace_path);
+    free(config->name);
+}
+
+/* Parse the <key>-min and <key>-max limits for one of the tuned transport
+ * sizes. A zero minimum starts from the system default, and a zero maximum
+ * leaves that resource alone. */
+static int config_parse_tune(struct json_object* obj, const char* name,
+                             const char* key, size_t min_default,
+                             size_t max_default, size_t* min, size_t* max)
+{
+    struct json_object* tmp;
+    char setting[64];
+    int64_t val;
+    int i;
+
+    *min = min_default;
+    *max = max_default;
+
+    for (i = 0; i < 2; i++)
+    {
+        snprintf(setting, sizeof(setting), "%s-%s", key, i ? "max" : "min");
+        if (!json_object_object_get_ex(obj, setting, &tmp))
+            continue;
+
+        val = json_object_get_int64(tmp);
+        if (val && (val < (int64_t)tune_size_min ||
+                    val > (int64_t)tune_size_max))
+        {
+            warnx("config %s has invalid %s", name, setting);
+            return -1;
+        }
+        *(i ? max : min) = val;
+    }
+
+    if (*max && *min > *max)
+    {
+        warnx("config %s has %s-min larger than %s-max", name, key, key);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int config_parse_one(struct config* config, const char* name,
+                            json_object* obj)
+{
+    struct json_object *tmp, *meta;
+    json_bool jrc;
+
+    jrc = json_object_object_get_ex(obj, "nbd-device", &tmp);
+    if (!jrc)
+    {
+        warnx("config %s doesn't specify a nbd-device", name);
+        return -1;
+    }
+
+    if (!json_object_is_type(tmp, json_type_string))
+    {
+        warnx("config %s has invalid nbd-device", name);
+        return -1;
+    }
+
+    config->nbd_device = strdup(json_object_get_string(tmp));
+    config->name = strdup(name);
+
+    config->cache_block_size = cache_block_size_default;
+    jrc = json_object_object_get_ex(obj, "cache-block-size", &tmp);
+    if (jrc)
+    {
+        int64_t val = json_object_get_int64(tmp);
+
+        if (val < 512 || val > 0x100000 || (val & (val - 1)))
+        {
+            warnx("config %s has invalid cache-block-size", name);
+            return -1;
+        }
+        config->cache_block_size = val;
+    }
+
+    config->ra_seg_size = ra_seg_size_default;
+    jrc = json_object_object_get_ex(obj, "readahead-segment-size", &tmp);
+    if (jrc)
+    {
+        int64_t val = json_object_get_int64(tmp);
+
+        /* the NBD protocol limits requests to 32MB */
+        if (val < 0x1000 || val > 0x2000000)
+        {
+            warnx("config %s has invalid readahead-segment-size", name);
+            return -1;
+        }
+        config->ra_seg_size = val;
+    }
+
+    config->ra_window_max = 0;
+    jrc = json_object_object_get_ex(obj, "readahead-window-max", &tmp);
+    if (jrc)
+    {
+        int64_t val = json_object_get_int64(tmp);
+
+        if (val && (val < (int64_t)config->ra_seg_size ||
+                    val / config->ra_seg_size > INT_MAX))
+        {
+            warnx("config %s has invalid readahead-window-max", name);
+            return -1;
+        }
+        config->ra_window_max = val;
+    }
+
+    config->ra_window_min = config->ra_seg_size;
+    jrc = json_object_object_get_ex(obj, "readahead-window-min", &tmp);
+    if (jrc)
+    {
+        int64_t val = json_object_get_int64(tmp);
+
+        if (val <= 0 || (config->ra_window_max &&
+                         (uint64_t)val > config->ra_window_max))
+        {
+            warnx("config %s has invalid readahead-window-min", name);
+            return -1;
+        }
+        config->ra_window_min = val;
+    }
+
+    if (config_parse_tune(obj, name, "pipe-size", 0, pipe_size_max_default,
+                          &config->pipe_size_min, &config->pipe_size_max) ||
+        config_parse_tune(obj, name, "socket-buffer", 0,
+                          sock_buf_max_default, &config->sock_buf_min,
+                          &config->sock_buf_max) ||
+        config_parse_tune(obj, name, "chunk-size", 0, chunk_max_default,
+                          &config->chunk_min, &config->chunk_max))
+        return -1;
+
+    config->connections = 1;
+    jrc = json_object_object_get_ex(obj, "connections", &tmp);
+    if (jrc)
+    {
+        int val = json_object_get_int(tmp);
+
+        if (val < 1 || val > NBD_MAX_CONNS)
+        {
+            warnx("config %s has invalid connections", name);
+            return -1;
+        }
+        config->connections = val;
+    }
+
+    config->resume_timeout = 0;
+    jrc = json_object_object_get_ex(obj, "resume-timeout", &tmp);
+    if (jrc)
+    {
+        int val = json_object_get_int(tmp);
+
+        if (val < 0 || val > 3600)
+        {
+            warnx("config %s has invalid resume-timeout", name);
+            return -1;
+        }
+        config->resume_timeout = val;
+    }
+
+    config->streams = 1;
+    jrc = json_object_object_get_ex(obj, "streams", &tmp);
+    if (jrc)
+    {
+        int val = json_object_get_int(tmp);
+
+        if (val < 1 || val > NBD_MAX_STREAMS)
+        {
+            warnx("config %s has invalid streams", name);
+            return -1;
+        }
+        config->streams = val;
+    }
+
+    config->stream_policy = STREAM_LEAST_LOADED;
+    jrc = json_object_object_get_ex(obj, "stream-policy", &tmp);
+    if (jrc)
+    {
+        const char* str = json_object_get_string(tmp);
+
+        if (!str ||
+            (strcmp(str, "least-loaded") && strcmp(str, "round-robin")))
+        {
+            warnx("config %s has invalid stream-policy", name);
+            return -1;
+        }
+        if (!strcmp(str, "round-robin"))
+            config->stream_policy = STREAM_ROUND_ROBIN;
+    }
+
+    config->cache_size = 0;
+    jrc = json_object_object_get_ex(obj, "cache-size", &tmp);
+    if (jrc)
+    {
+        int64_t val = json_object_get_int64(tmp);
+
+        if (val < 0 || (uint64_t)val / config->cache_block_size >= CACHE_NONE)
+        {
+            warnx("config %s has invalid cache-size", name);
+            return -1;
+        }
+        config->cache_size = val;
+    }
+
+    config->rate_limit = 0;
+    jrc = json_object_object_get_ex(obj, "rate-limit", &tmp);
+    if (jrc)
+    {
+        int64_t val = json_object_get_int64(tmp);
+
+        if (val < 0 || val > QOS_RATE_MAX)
+        {
+            warnx("config %s has invalid rate-limit", name);
+            return -1;
+        }
+        config->rate_limit = val;
+    }
+
+    config->iops_limit = 0;
+    jrc = json_object_object_get_ex(obj, "iops-limit", &tmp);
+    if (jrc)
+    {
+        int64_t val = json_object_get_int64(tmp);
+
+        if (val < 0 || val > 1000000)
+        {
+            warnx("config %s has invalid iops-limit", name);
+            return -1;
+        }
+        config->iops_limit = val;
+    }
+
+    config->bulk = false;
+    jrc = json_object_object_get_ex(obj, "priority", &tmp);
+    if (jrc)
+    {
+        const char* str = json_object_get_string(tmp);
+
+        if (!str || (strcmp(str, "interactive") && strcmp(str, "bulk")))
+        {
+            warnx("config %s has invalid priority", name);
+            return -1;
+        }
+        config->bulk = !strcmp(str, "bulk");
+    }
+
+    config->trace_path = NULL;
+    jrc = json_object_object_get_ex(obj, "trace", &tmp);
+    if (jrc)
+    {
+        if (!json_object_is_type(tmp, json_type_string))
+        {
+            warnx("config %s has invalid trace", name);
+            return -1;
+        }
+        config->trace_path = strdup(json_object_get_string(tmp));
+    }
+
+    jrc = json_object_object_get_ex(obj, "trace-payload-hash", &tmp);
+    config->trace_hash = jrc && json_object_get_boolean(tmp);
+
+    jrc = json_object_object_get_ex(obj, "default", &tmp);
+    config->is_default = jrc && json_object_get_boolean(tmp);
+
+    jrc = json_object_object_get_ex(obj, "metadata", &meta);
+    if (jrc && json_object_is_type(meta, json_type_object))
+        config->metadata = json_object_get(meta);
+    else
+        config->metadata = NULL;
+
+    return 0;
+}
+
+static void config_free(struct ctx* ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->n_configs; i++)
+        config_free_one(&ctx->configs[i]);
+
+    free(ctx->configs);
+    ctx->n_configs = 0;
+}
+
+static int config_init(struct ctx* ctx)
+{
+    struct json_object *obj, *tmp;
+    json_bool jrc;
+    int i, rc;
+
+    /* apply defaults */
+    ctx->nbd_timeout = nbd_timeout_default;
+
+    obj = json_object_from_file(conf_path);
+    if (!obj)
+    {
+        warnx("can't read configuration from %s\n", conf_path);
+        return -1;
+    }
+
+    /* global configuration */
+    jrc = json_object_object_get_ex(obj, "timeout", &tmp);
+    if (jrc)
+    {
+        errno = 0;
+        ctx->nbd_timeout = json_object_get_int(tmp);
+        if (ctx->nbd_timeout == 0 && errno)
+        {
+            warnx("can't parse timeout value");
+            goto err_free;
+        }
+    }
+
+    jrc = json_object_object_get_ex(obj, "bandwidth", &tmp);
+    if (jrc)
+    {
+        int64_t val = json_object_get_int64(tmp);
+
+        if (val < 0 || val > QOS_RATE_MAX)
+        {
+            warnx("invalid bandwidth value");
+            goto err_free;
+        }
+        ctx->qos_bandwidth = val;
+    }
+
+    jrc = json_object_object_get_ex(obj, "client", &tmp);
+    if (jrc)
+    {
+        const char* str;
+
+        if (!json_object_is_type(tmp, json_type_string))
+        {
+            warnx("invalid client value");
+            goto err_free;
+        }
+
+        str = json_object_get_string(tmp);
+        if (!strcmp(str, "auto"))
+            ctx->client_mode = CLIENT_AUTO;
+        else if (!strcmp(str, "netlink"))
+            ctx->client_mode = CLIENT_NETLINK;
+        else if (!strcmp(str, "nbd-client"))
+            ctx->client_mode = CLIENT_NBD_CLIENT;
+        else
+        {
+            warnx("invalid client value '%s'", str);
+            goto err_free;
+        }
+    }
+
+    /* per-config configuration */
+    jrc = json_object_object_get_ex(obj, "configurations", &tmp);
+    if (!jrc)
+    {
+        warnx("no configurations specified");
+        goto err_free;
+    }
+
+    if (!json_object_is_type(tmp, json_type_object))
+    {
+        warnx("invalid configurations format");
+        goto err_free;
+    }
+
+    ctx->n_configs = json_object_object_length(tmp);
+    ctx->configs = calloc(ctx->n_configs, sizeof(*ctx->configs));
+
+    i = 0;
+    json_object_object_foreach(tmp, name, config_json)
+    {
+        struct config* config = &ctx->configs[i];
+
+        rc = config_parse_one(config, name, config_json);
+        if (rc)
+            goto err_free;
+
+        if (config->is_default)
+        {
+            if (ctx->default_config)
+            {
+                warn("multiple configs flagged as default");
+                goto err_free;
+            }
+            ctx->default_config = config;
+        }
+        i++;
+    }
+
+    json_object_put(obj);
+
+    if (ctx->n_configs == 1)
+        ctx->default_config = &ctx->configs[0];
+
+    return 0;
+
+err_free:
+    warnx("failed to load config from %s", conf_path);
+    json_object_put(obj);
+    return -1;
+}
+
+/* Check that the configuration's nbd device exists, and get its number */
+static int config_check_device(struct config* config, dev_t* devno)
+{
+    struct stat statbuf;
+    int rc;
+
+    rc = stat(config->nbd_device, &statbuf);
+    if (rc)
+    {
+        warn("can't stat nbd device %s", config->nbd_device);
+        return -1;
+    }
+
+    if (!S_ISBLK(statbuf.st_mode))
+    {
+        warn("specified nbd path %s isn't a block device", config->nbd_device);
+        return -1;
+    }
+
+    *devno = statbuf.st_rdev;
+    return 0;
+}
+
+static int config_select(struct ctx* ctx, const char* name)
+{
+    struct config* config;
+    int rc;
+
+    config = NULL;
+
+    if (!name)
+    {
+        /* no config specified: use the default */
+        if (!ctx->default_config)
+        {
+            warnx("no config specified, and no default");
+            return -1;
+        }
+        config = ctx->default_config;
+    }
+    else
+    {
+        /* find a matching config... */
+        for (int i = 0; i < ctx->n_configs; i++)
+        {
+            if (!strcmp(ctx->configs[i].name, name))
+            {
+                config = &ctx->configs[i];
+                break;
+            }
+        }
+
+        if (!config)
+        {
+            warnx("no such configuration '%s'", name);
+            return -1;
+        }
+    }
+
+    rc = config_check_device(config, &ctx->nbd_devno);
+    if (rc)
+        return -1;
+
+    ctx->config = config;
+    return 0;
+}
+
+/* Daemon mode: one process serving every configuration, with sessions
+ * started on request over a control socket. The configuration, signal pipe,
+ * udev monitor and netlink family are set up once, in the base ctx; each
+ * session has its own ctx for the data path, and all share one epoll loop.
+ * Event tags for a session's fds are offset by its slot. */
+#define DAEMON_TAG_SHIFT 8
+
+struct daemon_slot
+{
+    struct ctx* session;
+    dev_t devno;
+};
+
+struct daemon
+{
+    struct ctx* base;
+    struct daemon_slot* slots;
+    int ctl_sock;
+    int epfd;
+};
+
+static uint32_t daemon_tag_base(int slot)
+{
+    return (uint32_t)(slot + 1) << DAEMON_TAG_SHIFT;
+}
+
+static int daemon_find(struct daemon* d, const char* name)
+{
+    int i;
+
+    for (i = 0; name && i < d->base->n_configs; i++)
+    {
+        if (!strcmp(d->base->configs[i].name, name))
+            return i;
+    }
+
+    return -1;
+}
+
+static void daemon_stop(struct daemon* d, int slot)
+{
+    struct ctx* ctx = d->slots[slot].session;
+
+    if (ctx->nbd_netlink)
+        run_state_hook(ctx, "stop", true);
+
+    setup_report(ctx);
+    stop_nbd_netlink(ctx);
+    session_free(ctx);
+
+    /* closing the fds removes them from the epoll set */
+    if (ctx->rep_in.fd >= 0)
+        close(ctx->rep_in.fd);
+    if (ctx->req_out.fd >= 0)
+        close(ctx->req_out.fd);
+
+    free(ctx);
+    d->slots[slot].session = NULL;
+}
+
+/* Start a session for configuration @slot, with @fd as the server stream.
+ * The handshake with the server is done here, before returning to the
+ * event loop, so it's bounded by a timeout. */
+static int daemon_start(struct daemon* d, int slot, int fd, bool websocket)
+{
+    struct ctx* ctx;
 
-    jrc = json_object_object_get_ex(obj, "nbd-device", &tmp);
-    if (!jrc)
+    ctx = calloc(1, sizeof(*ctx));
+    if (!ctx)
     {
-        warnx("config %s doesn't specify a nbd-device", name);
+        close(fd);
         return -1;
     }
 
-    if (!json_object_is_type(tmp, json_type_string))
+    ctx->config = &d->base->configs[slot];
+    ctx->nbd_devno = d->slots[slot].devno;
+    ctx->nbd_genl_family = d->base->nbd_genl_family;
+    ctx->nbd_timeout = d->base->nbd_timeout;
+    ctx->qos_bandwidth = d->base->qos_bandwidth;
+    ctx->bufsize = d->base->bufsize;
+    ctx->setup_timeout_ms = ws_handshake_timeout_ms;
+    ctx->sock = -1;
+    ctx->stats_sock = -1;
+    ctx->signal_pipe[0] = ctx->signal_pipe[1] = -1;
+    ctx->rep_parser.state = NBD_PARSE_GREETING;
+    ctx->rep_in.fd = ctx->req_out.fd = -1;
+    ctx->resume.sock = ctx->resume.peer = -1;
+    d->slots[slot].session = ctx;
+    setup_phase(ctx, SETUP_START, now_us());
+
+    if (session_init(ctx) || server_stream_init(ctx, fd))
     {
-        warnx("config %s has invalid nbd-device", name);
-        return -1;
+        close(fd);
+        goto err_stop;
     }
 
-    config->nbd_device = strdup(json_object_get_string(tmp));
-    config->name = strdup(name);
+    if (websocket)
+    {
+        ctx->ws = calloc(1, sizeof(*ctx->ws));
+        if (!ctx->ws || ws_upgrade(ctx, fd))
+            goto err_stop;
+    }
 
-    jrc = json_object_object_get_ex(obj, "default", &tmp);
-    config->is_default = jrc && json_object_get_boolean(tmp);
+    setup_phase(ctx, SETUP_SERVER, now_us());
 
-    jrc = json_object_object_get_ex(obj, "metadata", &meta);
-    if (jrc && json_object_is_type(meta, json_type_object))
-        config->metadata = json_object_get(meta);
-    else
-        config->metadata = NULL;
+    if (start_nbd_netlink(ctx))
+        goto err_stop;
+
+    run_proxy_init(ctx);
+    if (proxy_epoll_add(ctx, d->epfd, daemon_tag_base(slot)))
+    {
+        warn("can't set up proxy fds");
+        goto err_stop;
+    }
 
     return 0;
+
+err_stop:
+    daemon_stop(d, slot);
+    return -1;
 }
 
-static void config_free(struct ctx* ctx)
+static void daemon_sigchld(struct daemon* d)
+{
+    struct ctx* ctx;
+    int status, i;
+    pid_t pid;
+
+    for (;;)
+    {
+        pid = waitpid(-1, &status, WNOHANG);
+        if (pid <= 0)
+            break;
+
+        for (i = 0; i < d->base->n_configs; i++)
+        {
+            ctx = d->slots[i].session;
+            if (!ctx || pid != ctx->state_hook_pid)
+                continue;
+
+            ctx->state_hook_pid = 0;
+            if (!WIFEXITED(status) || WEXITSTATUS(status))
+            {
+                warnx("state hook for %s failed; stopping session",
+                      ctx->config->name);
+                daemon_stop(d, i);
+            }
+        }
+    }
+}
+
+static void daemon_udev(struct daemon* d)
 {
+    struct ctx* ctx;
+    dev_t devno;
     int i;
 
-    for (i = 0; i < ctx->n_configs; i++)
-        config_free_one(&ctx->configs[i]);
+    if (!udev_receive_change(d->base->monitor, &devno))
+        return;
 
-    free(ctx->configs);
-    ctx->n_configs = 0;
+    for (i = 0; i < d->base->n_configs; i++)
+    {
+        ctx = d->slots[i].session;
+        if (!ctx || ctx->t_phase[SETUP_READY] || devno != d->slots[i].devno)
+            continue;
+
+        if (session_ready(ctx))
+            daemon_stop(d, i);
+    }
 }
 
-static int config_init(struct ctx* ctx)
+/* Handle one request on the control socket. Requests are single messages:
+ *
+ *   start <config> [websocket]  - with the server stream fd attached
+ *   stop <config>
+ *   stats <config>
+ *
+ * and the reply is "ok", "error: <reason>", or the statistics JSON. */
+static void daemon_control(struct daemon* d)
 {
-    struct json_object *obj, *tmp;
-    json_bool jrc;
-    int i, rc;
+    struct json_object* obj = NULL;
+    char buf[256], *cmd, *name, *arg, *save;
+    const char* reply = "ok";
+    int sd, fd, slot;
 
-    /* apply defaults */
-    ctx->nbd_timeout = nbd_timeout_default;
+    sd = accept4(d->ctl_sock, NULL, NULL, SOCK_CLOEXEC);
+    if (sd < 0)
+    {
+        warn("can't accept control connection");
+        return;
+    }
 
-    obj = json_object_from_file(conf_path);
-    if (!obj)
+    if (control_recv(sd, buf, sizeof(buf), &fd, 1) < 0)
     {
-        warnx("can't read configuration from %s\n", conf_path);
-        return -1;
+        warnx("invalid control request");
+        goto out_close;
     }
 
-    /* global configuration */
-    jrc = json_object_object_get_ex(obj, "timeout", &tmp);
-    if (jrc)
+    cmd = strtok_r(buf, " \n", &save);
+    name = strtok_r(NULL, " \n", &save);
+    arg = strtok_r(NULL, " \n", &save);
+    slot = daemon_find(d, name);
+
+    if (!cmd)
+        reply = "error: no command";
+    else if (slot < 0)
+        reply = "error: no such configuration";
+    else if (!strcmp(cmd, "start"))
     {
-        errno = 0;
-        ctx->nbd_timeout = json_object_get_int(tmp);
-        if (ctx->nbd_timeout == 0 && errno)
+        /* a new stream for an active session is striped over, or
+         * replaces its current one, if it can be resumed */
+        if (d->slots[slot].session &&
+            !session_joinable(d->slots[slot].session))
+            reply = "error: session already active";
+        else if (fd < 0)
+            reply = "error: no stream fd";
+        else if (arg && strcmp(arg, "websocket"))
+            reply = "error: invalid stream type";
+        else if (d->slots[slot].session)
         {
-            warnx("can't parse timeout value");
-            goto err_free;
+            if (session_join(d->slots[slot].session, fd, -1, !!arg) < 0)
+                reply = "error: can't join session";
+            fd = -1;
+        }
+        else
+        {
+            if (daemon_start(d, slot, fd, !!arg))
+                reply = "error: can't start session";
+            fd = -1;
         }
     }
-
-    /* per-config configuration */
-    jrc = json_object_object_get_ex(obj, "configurations", &tmp);
-    if (!jrc)
+    else if (!strcmp(cmd, "stop"))
     {
-        warnx("no configurations specified");
-        goto err_free;
+        if (d->slots[slot].session)
+            daemon_stop(d, slot);
+        else
+            reply = "error: no active session";
     }
-
-    if (!json_object_is_type(tmp, json_type_object))
+    else if (!strcmp(cmd, "stats"))
     {
-        warnx("invalid configurations format");
-        goto err_free;
+        if (d->slots[slot].session)
+        {
+            obj = stats_json(d->slots[slot].session);
+            reply = json_object_get_string(obj);
+        }
+        else
+            reply = "error: no active session";
     }
+    else
+        reply = "error: unknown command";
 
-    ctx->n_configs = json_object_object_length(tmp);
-    ctx->configs = calloc(ctx->n_configs, sizeof(*ctx->configs));
+    if (send(sd, reply, strlen(reply), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        warn("can't send control reply");
 
-    i = 0;
-    json_object_object_foreach(tmp, name, config_json)
-    {
-        struct config* config = &ctx->configs[i];
+    if (obj)
+        json_object_put(obj);
+    if (fd >= 0)
+        close(fd);
+out_close:
+    close(sd);
+}
 
-        rc = config_parse_one(config, name, config_json);
-        if (rc)
-            goto err_free;
+static int open_control_socket(struct daemon* d, const char* path)
+{
+    struct sockaddr_un addr;
+    int sd, rc;
 
-        if (config->is_default)
-        {
-            if (ctx->default_config)
-            {
-                warn("multiple configs flagged as default");
-                goto err_free;
-            }
-            ctx->default_config = config;
-        }
-        i++;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        warnx("control socket path too long");
+        return -1;
     }
 
-    json_object_put(obj);
+    sd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sd < 0)
+    {
+        warn("can't create control socket");
+        return -1;
+    }
 
-    if (ctx->n_configs == 1)
-        ctx->default_config = &ctx->configs[0];
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
 
-    return 0;
+    /* the control socket hands out access to the nbd devices, so it is
+     * only for the owner; remove any stale socket from a previous run */
+    unlink(path);
+    rc = bind(sd, (struct sockaddr*)&addr, sizeof(addr));
+    if (rc || chmod(path, 0600) || listen(sd, 4))
+    {
+        warn("can't listen on control socket %s", path);
+        if (!rc)
+            unlink(path);
+        close(sd);
+        return -1;
+    }
 
-err_free:
-    warnx("failed to load config from %s", conf_path);
-    json_object_put(obj);
-    return -1;
+    d->ctl_sock = sd;
+    return 0;
 }
 
-static int config_select(struct ctx* ctx, const char* name)
+static int run_daemon(struct ctx* base, const char* ctl_path)
 {
-    struct config* config;
-    struct stat statbuf;
-    int rc;
+    struct epoll_event events[16];
+    struct daemon _d, *d = &_d;
+    int i, n, rc, wait, timeout;
+    bool exit = false;
+    uint32_t tag;
 
-    config = NULL;
+    memset(d, 0, sizeof(*d));
+    d->base = base;
+    d->ctl_sock = -1;
+    d->epfd = -1;
 
-    if (!name)
+    /* sessions are connected through netlink, as we have no nbd-client
+     * socket to offer */
+    if (base->client_mode == CLIENT_NBD_CLIENT || netlink_init(base))
     {
-        /* no config specified: use the default */
-        if (!ctx->default_config)
+        warnx("daemon mode needs the netlink nbd interface");
+        return -1;
+    }
+
+    d->slots = calloc(base->n_configs, sizeof(*d->slots));
+    if (!d->slots)
+        return -1;
+
+    /* check all devices now, so that starting a session doesn't have to */
+    for (i = 0; i < base->n_configs; i++)
+    {
+        if (config_check_device(&base->configs[i], &d->slots[i].devno))
         {
-            warnx("no config specified, and no default");
+            free(d->slots);
             return -1;
         }
-        config = ctx->default_config;
     }
-    else
+
+    buf_pool.max = BUF_POOL_SIZE;
+
+    rc = setup_signals(base);
+    if (rc)
+        goto out_free;
+
+    rc = udev_init(base);
+    if (rc)
+        goto out_signals;
+
+    rc = open_control_socket(d, ctl_path);
+    if (rc)
+        goto out_udev;
+
+    d->epfd = epoll_create1(EPOLL_CLOEXEC);
+    rc = d->epfd < 0 ||
+         epoll_add(d->epfd, base->signal_pipe[0], EPOLLIN, EV_SIGNAL) ||
+         epoll_add(d->epfd, udev_monitor_get_fd(base->monitor), EPOLLIN,
+                   EV_UDEV) ||
+         epoll_add(d->epfd, d->ctl_sock, EPOLLIN, EV_CONTROL);
+    if (rc)
     {
-        /* find a matching config... */
-        for (int i = 0; i < ctx->n_configs; i++)
+        warn("can't set up daemon event loop");
+        rc = -1;
+        goto out_close;
+    }
+
+    while (!exit)
+    {
+        timeout = -1;
+
+        for (i = 0; i < base->n_configs; i++)
         {
-            if (!strcmp(ctx->configs[i].name, name))
+            if (!d->slots[i].session)
+                continue;
+
+            if (pump(d->slots[i].session) <= 0)
             {
-                config = &ctx->configs[i];
-                break;
+                daemon_stop(d, i);
+                continue;
             }
+
+            wait = session_wait_ms(d->slots[i].session);
+            if (wait >= 0 && (timeout < 0 || wait < timeout))
+                timeout = wait;
         }
 
-        if (!config)
+        n = epoll_wait(d->epfd, events, sizeof(events) / sizeof(events[0]),
+                       timeout);
+        if (n < 0)
         {
-            warnx("no such configuration '%s'", name);
-            return -1;
+            if (errno == EINTR)
+                continue;
+            warn("epoll_wait failed");
+            rc = -1;
+            break;
         }
-    }
 
-    /* check that the device exists */
-    rc = stat(config->nbd_device, &statbuf);
-    if (rc)
-    {
-        warn("can't stat nbd device %s", config->nbd_device);
-        return -1;
+        for (i = 0; i < n && !exit; i++)
+        {
+            tag = events[i].data.u32;
+
+            if (tag >> DAEMON_TAG_SHIFT)
+            {
+                int slot = (tag >> DAEMON_TAG_SHIFT) - 1;
+                struct ctx* ctx = d->slots[slot].session;
+                bool unused;
+
+                /* the session may have gone since this event was queued */
+                if (ctx && proxy_event(ctx, tag & ((1 << DAEMON_TAG_SHIFT) - 1),
+                                       events[i].events, &unused))
+                    daemon_stop(d, slot);
+                continue;
+            }
+
+            switch (tag)
+            {
+                case EV_SIGNAL:
+                {
+                    int sig;
+
+                    if (read(base->signal_pipe[0], &sig, sizeof(sig)) !=
+                        sizeof(sig))
+                        break;
+                    if (sig == SIGCHLD)
+                        daemon_sigchld(d);
+                    else
+                        exit = true;
+                    break;
+                }
+                case EV_UDEV:
+                    daemon_udev(d);
+                    break;
+                case EV_CONTROL:
+                    daemon_control(d);
+                    break;
+            }
+        }
     }
 
-    if (!S_ISBLK(statbuf.st_mode))
+    for (i = 0; i < base->n_configs; i++)
     {
-        warn("specified nbd path %s isn't a block device", config->nbd_device);
-        return -1;
+        if (d->slots[i].session)
+            daemon_stop(d, i);
     }
 
-    /* ... and apply it */
-    ctx->config = config;
-    ctx->nbd_devno = statbuf.st_rdev;
-
-    return 0;
+out_close:
+    if (d->epfd >= 0)
+        close(d->epfd);
+    close(d->ctl_sock);
+    unlink(ctl_path);
+out_udev:
+    udev_free(base);
+out_signals:
+    cleanup_signals(base);
+out_free:
+    buf_pool_free();
+    free(d->slots);
+    return rc ? -1 : 0;
 }
 
 static const struct option options[] = {
     {.name = "help", .val = 'h'},
     {.name = "metadata", .val = 'm'},
+    {.name = "websocket", .has_arg = required_argument, .val = 'w'},
+    {.name = "websocket-fd", .has_arg = required_argument, .val = 'W'},
+    {.name = "daemon", .has_arg = optional_argument, .val = 'd'},
     {0},
 };
 
@@ -824,21 +8875,27 @@ enum action
 {
     ACTION_PROXY,
     ACTION_METADATA,
+    ACTION_DAEMON,
 };
 
 static void print_usage(const char* progname)
 {
     fprintf(stderr, "usage:\n");
     fprintf(stderr, "\t%s [configuration]\n", progname);
+    fprintf(stderr, "\t%s --websocket=<path|[host:]port> [configuration]\n",
+            progname);
+    fprintf(stderr, "\t%s --websocket-fd=<fd> [configuration]\n", progname);
     fprintf(stderr, "\t%s --metadata\n", progname);
+    fprintf(stderr, "\t%s --daemon[=<control-socket>]\n", progname);
 }
 
 int main(int argc, char** argv)
 {
     enum action action = ACTION_PROXY;
-    const char* config_name;
+    const char *config_name, *ws_addr = NULL, *ctl_path = ctlsockpath;
     struct ctx _ctx, *ctx;
-    int rc;
+    int rc, ws_fd = -1;
+    char* endp;
 
     config_name = NULL;
 
@@ -853,6 +8910,22 @@ int main(int argc, char** argv)
             case 'm':
                 action = ACTION_METADATA;
                 break;
+            case 'd':
+                action = ACTION_DAEMON;
+                if (optarg)
+                    ctl_path = optarg;
+                break;
+            case 'w':
+                ws_addr = optarg;
+                break;
+            case 'W':
+                ws_fd = strtol(optarg, &endp, 10);
+                if (*endp || ws_fd < 0)
+                {
+                    warnx("invalid websocket fd '%s'", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
             case 'h':
             case '?':
                 print_usage(argv[0]);
@@ -865,8 +8938,12 @@ int main(int argc, char** argv)
 
     ctx = &_ctx;
     memset(ctx, 0, sizeof(*ctx));
+    setup_phase(ctx, SETUP_START, now_us());
     ctx->bufsize = bufsize;
-    ctx->buf = malloc(ctx->bufsize);
+    ctx->sock = -1;
+    ctx->stats_sock = -1;
+    ctx->resume.sock = ctx->resume.peer = -1;
+    ctx->rep_parser.state = NBD_PARSE_GREETING;
 
     rc = config_init(ctx);
     if (rc)
@@ -878,38 +8955,106 @@ int main(int argc, char** argv)
         goto out_free;
     }
 
+    if (action == ACTION_DAEMON)
+    {
+        rc = run_daemon(ctx, ctl_path);
+        goto out_free;
+    }
+
     rc = config_select(ctx, config_name);
     if (rc)
         goto out_free;
 
-    rc = open_nbd_socket(ctx);
+    rc = session_init(ctx);
+    if (rc)
+        goto out_free;
+
+    ctx->rep_in.fd = STDIN_FILENO;
+    ctx->req_out.fd = STDOUT_FILENO;
+
+    rc = select_client(ctx);
     if (rc)
         goto out_free;
 
+    setup_phase(ctx, SETUP_CONFIG, now_us());
+
+    /* nbd-client needs a socket to connect to; with netlink, we hand the
+     * kernel a socketpair instead */
+    if (!ctx->nbd_genl_family)
+    {
+        rc = open_nbd_socket(ctx);
+        if (rc)
+            goto out_free;
+    }
+
     rc = setup_signals(ctx);
     if (rc)
         goto out_close;
 
-    rc = start_nbd_client(ctx);
-    if (rc)
-        goto out_stop_client;
+    /* an earlier session for this configuration may be waiting for a new
+     * server stream, or want another to stripe over, in which case this
+     * process only passes ours on */
+    if (session_joinable(ctx))
+    {
+        rc = resume_handoff(ctx, ws_addr, ws_fd);
+        if (rc <= 0)
+        {
+            ctx->setup_reported = true;
+            goto out_stop_client;
+        }
+        rc = 0;
+    }
 
-    rc = wait_for_nbd_client(ctx);
-    if (rc)
-        goto out_stop_client;
+    if (ws_addr || ws_fd >= 0)
+    {
+        rc = ws_init(ctx, ws_addr, ws_fd);
+        if (rc)
+            goto out_stop_client;
+    }
+
+    setup_phase(ctx, SETUP_SERVER, now_us());
+
+    /* with netlink, we negotiate with the server ourselves; get the options
+     * on their way, and finish the rest of our setup while it replies */
+    if (ctx->nbd_genl_family)
+    {
+        rc = nbd_handshake_start(ctx);
+        if (rc)
+            goto out_stop_client;
+    }
+
+    /* statistics are diagnostic only; carry on without them on failure */
+    if (open_stats_socket(ctx))
+        warnx("statistics socket unavailable");
+
+    if (session_joinable(ctx))
+    {
+        rc = open_resume_socket(ctx);
+        if (rc)
+            goto out_stop_client;
+    }
 
+    /* start monitoring before the device is connected, so we can't miss the
+     * change event */
     rc = udev_init(ctx);
     if (rc)
         goto out_stop_client;
 
-    rc = run_proxy(ctx);
+    setup_phase(ctx, SETUP_MONITOR, now_us());
+
+    rc = connect_nbd_device(ctx);
+    if (!rc)
+    {
+        rc = run_proxy(ctx);
+        run_state_hook(ctx, "stop", true);
+    }
 
     if (ctx->udev)
         udev_free(ctx);
 
-    run_state_hook(ctx, "stop", true);
-
 out_stop_client:
+    setup_report(ctx);
+
     /* we cleanup signals before stopping the client, because we
      * no longer care about SIGCHLD from the stopping nbd-client
      * process. stop_nbd_client will be a no-op if the client hasn't
@@ -917,18 +9062,21 @@ out_stop_client:
     cleanup_signals(ctx);
 
     stop_nbd_client(ctx);
-    close(ctx->sock_client);
+    stop_nbd_netlink(ctx);
 
 out_close:
+    close_stats_socket(ctx);
+    close_resume_socket(ctx);
     if (ctx->sock_path)
     {
         unlink(ctx->sock_path);
         free(ctx->sock_path);
     }
-    close(ctx->sock);
+    if (ctx->sock >= 0)
+        close(ctx->sock);
 out_free:
+    session_free(ctx);
     config_free(ctx);
-    free(ctx->buf);
     return rc ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
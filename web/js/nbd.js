@@ -22,11 +22,37 @@ const NBD_FLAG_NO_ZEROES = 0x2;
 /* transmission flags */
 const NBD_FLAG_HAS_FLAGS = 0x1;
 const NBD_FLAG_READ_ONLY = 0x2;
+const NBD_FLAG_SEND_FLUSH = 0x4;
+const NBD_FLAG_CAN_MULTI_CONN = 0x100;
 
 /* option negotiation */
 const NBD_OPT_EXPORT_NAME = 0x1;
+const NBD_OPT_INFO = 0x6;
+const NBD_OPT_GO = 0x7;
+const NBD_OPT_STRUCTURED_REPLY = 0x8;
+const NBD_REP_ACK = 0x1;
+const NBD_REP_INFO = 0x3;
 const NBD_REP_FLAG_ERROR = 0x1 << 31;
 const NBD_REP_ERR_UNSUP = NBD_REP_FLAG_ERROR | 1;
+const NBD_REP_ERR_INVALID = NBD_REP_FLAG_ERROR | 3;
+const NBD_INFO_EXPORT = 0;
+const NBD_INFO_BLOCK_SIZE = 3;
+
+/* structured replies */
+const NBD_STRUCTURED_REPLY_MAGIC = 0x668e33ef;
+const NBD_REPLY_FLAG_DONE = 0x1;
+const NBD_REPLY_TYPE_NONE = 0;
+const NBD_REPLY_TYPE_OFFSET_DATA = 1;
+const NBD_REPLY_TYPE_OFFSET_HOLE = 2;
+const NBD_REPLY_TYPE_ERROR = (0x1 << 15) | 1;
+
+/* read replies are sent as holes for aligned blocks of this size that are
+ * all zeroes */
+const NBD_HOLE_SIZE = 4096;
+
+/* how often a streamed read checks whether the websocket has room for its
+ * next chunk, in milliseconds */
+const NBD_STREAM_POLL_MS = 5;
 
 /* command definitions */
 const NBD_CMD_READ = 0;
@@ -51,27 +77,445 @@ const NBD_STATE_WAIT_CFLAGS = 3;
 const NBD_STATE_WAIT_OPTION = 4;
 const NBD_STATE_TRANSMISSION = 5;
 
-function NBDServer(endpoint, file)
+/* nbd.js is loaded on the page, where NBDServer is the interface, and
+ * again in a Worker, which runs the NBDEngine that implements the
+ * protocol. */
+const NBD_SCRIPT = typeof document != 'undefined' && document.currentScript ?
+    document.currentScript.src : null;
+
+/* engine settings that can be set on an NBDServer before start() */
+const NBD_ENGINE_OPTIONS = [
+    'max_reads',
+    'max_read_span',
+    'cache_block_size',
+    'cache_size',
+    'sink',
+    'export_size',
+    'sink_overlay_size',
+    'max_write_batch',
+    'max_write_queue',
+    'stream_read_min',
+    'stream_chunk_size',
+    'stream_budget',
+    'websockets',
+];
+
+/* Write sinks: an export is writable when it has a sink. A sink has
+ * write(offset, chunks), taking an array of Uint8Arrays to write
+ * contiguously from offset, and read(offset, length), returning the data
+ * as it has been written, as an ArrayBuffer, or failing if it can't. It may
+ * also have flush(), and finish(), called once the session is over. Each
+ * returns a Promise. The engine won't start with a sink that has no
+ * read(): the export's reads would miss its writes. */
+
+/* call fn(page, page_off, pos, n) for each page in a range */
+function nbd_walk_pages(page_size, offset, len, fn)
+{
+    for (var pos = 0; pos < len; ) {
+        var page = Math.floor((offset + pos) / page_size);
+        var page_off = (offset + pos) % page_size;
+        var n = Math.min(len - pos, page_size - page_off);
+        fn(page, page_off, pos, n);
+        pos += n;
+    }
+}
+
+/* A sink that keeps the written data in memory, in pages allocated as
+ * they're written to. finish() hands over the pages, which the page's
+ * NBDServer assembles into a Blob for oncomplete. */
+function NBDMemorySink(size)
+{
+    this.size = size;
+    this.page_size = 1024 * 1024;
+    this.pages = new Array(Math.ceil(size / this.page_size)).fill(null);
+
+    this.write = function(offset, chunks)
+    {
+        for (var i = 0; i < chunks.length; i++) {
+            var chunk = chunks[i];
+            nbd_walk_pages(this.page_size, offset, chunk.byteLength,
+                    (function(page, page_off, pos, n) {
+                if (!this.pages[page])
+                    this.pages[page] = new Uint8Array(this.page_size);
+                this.pages[page].set(chunk.subarray(pos, pos + n), page_off);
+            }).bind(this));
+            offset += chunk.byteLength;
+        }
+        return Promise.resolve();
+    }
+
+    this.read = function(offset, len)
+    {
+        var buf = new Uint8Array(len);
+        nbd_walk_pages(this.page_size, offset, len,
+                (function(page, page_off, pos, n) {
+            if (this.pages[page])
+                buf.set(this.pages[page].subarray(page_off, page_off + n),
+                        pos);
+        }).bind(this));
+        return Promise.resolve(buf.buffer);
+    }
+
+    this.finish = function()
+    {
+        var pages = this.pages.map(function(page) {
+            return page ? page.buffer : null;
+        });
+        this.pages = [];
+        return Promise.resolve({
+            size: this.size,
+            page_size: this.page_size,
+            pages: pages,
+        });
+    }
+}
+
+/* A sink writing to a File System Access file handle. The API has no
+ * flush, and written data is only committed to the file when the session
+ * ends, so until then the file still holds the old data. Reads of written
+ * pages come from an overlay of up to overlay_size bytes, with pages loaded
+ * from the file when first written to; once a page has been dropped from
+ * the overlay, reads of it fail rather than return the old data. */
+function NBDFileHandleSink(handle, size, overlay_size)
+{
+    this.size = size;
+    this.page_size = 1024 * 1024;
+    this.max_pages = Math.max(1, Math.floor(overlay_size / this.page_size));
+    this.pages = new Map();     /* least recently written first */
+    this.dropped = new Set();
+    this.file = handle.getFile();
+    this.stream = handle.createWritable({ keepExistingData: true });
+
+    /* the file's data for a range, zero-filled past its end */
+    this._read_file = function(offset, len)
+    {
+        return this.file.then(function(file) {
+            return file.slice(offset, offset + len).arrayBuffer();
+        }).then(function(data) {
+            var buf = new Uint8Array(len);
+            buf.set(new Uint8Array(data));
+            return buf;
+        });
+    }
+
+    /* add the pages in a range to the overlay. Pages the write covers
+     * start out empty, others are loaded from the file, unless they have
+     * been dropped. */
+    this._load = function(offset, len)
+    {
+        var loads = [];
+
+        nbd_walk_pages(this.page_size, offset, len,
+                (function(page, page_off, pos, n) {
+            var start = page * this.page_size;
+            var page_len = Math.min(this.page_size, this.size - start);
+
+            if (this.pages.has(page))
+                return;
+
+            if (page_off == 0 && n == page_len) {
+                this.dropped.delete(page);
+                this.pages.set(page, new Uint8Array(page_len));
+            } else if (!this.dropped.has(page)) {
+                loads.push(this._read_file(start, page_len).then(
+                    (function(buf) {
+                        this.pages.set(page, buf);
+                    }).bind(this)));
+            }
+        }).bind(this));
+
+        return Promise.all(loads);
+    }
+
+    this.write = function(offset, chunks)
+    {
+        var len = 0;
+
+        for (var i = 0; i < chunks.length; i++)
+            len += chunks[i].byteLength;
+
+        return this._load(offset, len).then((function() {
+            var pos = offset;
+
+            for (var i = 0; i < chunks.length; i++) {
+                var chunk = chunks[i];
+                nbd_walk_pages(this.page_size, pos, chunk.byteLength,
+                        (function(page, page_off, chunk_pos, n) {
+                    var data = this.pages.get(page);
+                    if (!data)
+                        return;
+                    data.set(chunk.subarray(chunk_pos, chunk_pos + n),
+                            page_off);
+                    this.pages.delete(page);
+                    this.pages.set(page, data);
+                }).bind(this));
+                pos += chunk.byteLength;
+            }
+
+            while (this.pages.size > this.max_pages) {
+                var oldest = this.pages.keys().next().value;
+                this.pages.delete(oldest);
+                this.dropped.add(oldest);
+            }
+
+            return this.stream;
+        }).bind(this)).then(function(stream) {
+            return stream.write({
+                type: 'write',
+                position: offset,
+                data: new Blob(chunks),
+            });
+        });
+    }
+
+    this.read = function(offset, len)
+    {
+        var parts = [];
+        var from_file = false;
+        var dropped = false;
+
+        /* take the overlay's pages now, as they may be dropped while the
+         * file is read */
+        nbd_walk_pages(this.page_size, offset, len,
+                (function(page, page_off, pos, n) {
+            var data = this.pages.get(page);
+            if (data)
+                parts.push({ data: data.subarray(page_off, page_off + n),
+                    pos: pos });
+            else if (this.dropped.has(page))
+                dropped = true;
+            else
+                from_file = true;
+        }).bind(this));
+
+        if (dropped)
+            return Promise.reject(new Error("written data at 0x" +
+                    offset.toString(16) + " is no longer held"));
+
+        var read = from_file ? this._read_file(offset, len) :
+            Promise.resolve(new Uint8Array(len));
+
+        return read.then(function(buf) {
+            for (var i = 0; i < parts.length; i++)
+                buf.set(parts[i].data, parts[i].pos);
+            return buf.buffer;
+        });
+    }
+
+    this.finish = function()
+    {
+        this.pages = new Map();
+        return this.stream.then(function(stream) {
+            return stream.close();
+        }).then(function() {
+            return null;
+        });
+    }
+}
+
+function nbd_is_zero(buf)
+{
+    var i = 0;
+
+    if (buf.byteOffset % 4 == 0) {
+        var words = new Uint32Array(buf.buffer, buf.byteOffset,
+                buf.byteLength >> 2);
+        for (; i < words.length; i++) {
+            if (words[i])
+                return false;
+        }
+        i = words.length * 4;
+    }
+
+    for (; i < buf.byteLength; i++) {
+        if (buf[i])
+            return false;
+    }
+
+    return true;
+}
+
+/* Received data, kept as the list of websocket messages it arrived in.
+ * Handlers parse from the head of the queue in place; data is only copied
+ * when a field spans two messages. */
+function NBDRecvQueue()
+{
+    this.chunks = [];
+    this.offset = 0;
+    this.length = 0;
+
+    this.push = function(buf)
+    {
+        if (!buf.byteLength)
+            return;
+        this.chunks.push(new Uint8Array(buf));
+        this.length += buf.byteLength;
+    }
+
+    /* get len bytes at off from the head of the queue, as a view of the
+     * received data if it's within one message, otherwise as a copy */
+    this.bytes = function(off, len)
+    {
+        var i = 0;
+        var pos = this.offset + off;
+
+        if (len == 0)
+            return new Uint8Array(0);
+
+        while (pos >= this.chunks[i].byteLength) {
+            pos -= this.chunks[i].byteLength;
+            i++;
+        }
+
+        if (pos + len <= this.chunks[i].byteLength)
+            return this.chunks[i].subarray(pos, pos + len);
+
+        var buf = new Uint8Array(len);
+        for (var n = 0; n < len; i++, pos = 0) {
+            var part = this.chunks[i].subarray(pos, pos + len - n);
+            buf.set(part, n);
+            n += part.byteLength;
+        }
+        return buf;
+    }
+
+    this.view = function(off, len)
+    {
+        var bytes = this.bytes(off, len);
+        return new DataView(bytes.buffer, bytes.byteOffset, len);
+    }
+
+    this.consume = function(len)
+    {
+        this.length -= len;
+        len += this.offset;
+        while (this.chunks.length && len >= this.chunks[0].byteLength) {
+            len -= this.chunks[0].byteLength;
+            this.chunks.shift();
+        }
+        this.offset = len;
+    }
+}
+
+function NBDEngine(endpoint, file)
 {
     this.file = file;
     this.endpoint = endpoint;
-    this.ws = null;
     this.state = NBD_STATE_UNKNOWN;
-    this.msgbuf = null;
+
+    /* connections: the session starts on one websocket, and once the
+     * client is using it, websockets - 1 more are opened to the same
+     * endpoint, for nbd-proxy to spread its requests over. Each connection
+     * negotiates separately, and each request is answered on the
+     * connection it arrived on. */
+    this.websockets = 1;
+    this.conns = [];
+    this.conns_opened = false;
+
+    /* read scheduling: at most max_reads file reads are in flight at once,
+     * and queued requests are started in the order they arrived. Queued
+     * requests for adjacent regions are merged into a single read of up
+     * to max_read_span bytes. */
+    this.max_reads = 8;
+    this.max_read_span = 4 * 1024 * 1024;
+    this.read_queue = [];
+    this.reads_inflight = 0;
+
+    /* block cache: file data is read and cached in aligned blocks of
+     * cache_block_size bytes, up to cache_size bytes in total. Blocks that
+     * are already being read are shared between requests, whether or not
+     * they will be cached. */
+    this.cache_block_size = 64 * 1024;
+    this.cache_size = 32 * 1024 * 1024;
+
+    /* writes: sink is 'memory', a FileSystemFileHandle or a sink object,
+     * and export_size overrides the File's size. A FileSystemFileHandle
+     * sink keeps up to sink_overlay_size bytes of written data for reads
+     * of it. Writes are acknowledged once queued, and the queue is written
+     * out in order, with contiguous writes merged into sink writes of up
+     * to max_write_batch bytes. Once max_write_queue bytes are queued,
+     * acknowledgements wait for the queue to drain. */
+    this.sink = null;
+    this.export_size = null;
+    this.sink_overlay_size = 64 * 1024 * 1024;
+    this.max_write_batch = 4 * 1024 * 1024;
+    this.max_write_queue = 64 * 1024 * 1024;
+    this.writer = null;
+
+    /* streamed reads: reads of at least stream_read_min bytes from a
+     * read-only export bypass the block cache, and are sent as the file is
+     * read, stream_chunk_size bytes at a time, so the first data goes out
+     * before the whole range has been read. The next chunk is only read
+     * once the websocket has less than stream_budget bytes waiting to be
+     * sent, so these reads hold about that much memory, whatever their
+     * size and number. One streamed reply is sent at a time on each
+     * connection, and other replies on it are held back until it is
+     * complete. */
+    this.stream_read_min = 1024 * 1024;
+    this.stream_chunk_size = 256 * 1024;
+    this.stream_budget = 4 * 1024 * 1024;
 
     this.start = function()
     {
+        if (!this._writer_init()) {
+            this._log("sink has no read(), not starting");
+            return;
+        }
+
         this.state = NBD_STATE_OPEN;
-        this.ws = new WebSocket(this.endpoint);
-        this.ws.binaryType = 'arraybuffer';
-        this.ws.onmessage = this._on_ws_message.bind(this);
-        this.ws.onopen = this._on_ws_open.bind(this);
+        this.conns = [];
+        this.conns_opened = false;
+        this.read_queue = [];
+        this.reads_inflight = 0;
+        this._cache_init();
+        this._connect();
     }
 
     this.stop = function()
     {
-        this.ws.close();
+        if (this.state == NBD_STATE_UNKNOWN)
+            return;
+
         this.state = NBD_STATE_UNKNOWN;
+        this.read_queue = [];
+
+        for (var i = 0; i < this.conns.length; i++)
+            this._close(this.conns[i]);
+
+        if (this.writer)
+            this._writer_finish();
+    }
+
+    /* open a websocket, with the state for its connection */
+    this._connect = function()
+    {
+        var c = {
+            ws: new WebSocket(this.endpoint),
+            state: NBD_STATE_OPEN,
+            rxq: new NBDRecvQueue(),
+            client: null,
+            streams: [],
+            stream: null,
+            held: [],
+        };
+
+        c.ws.binaryType = 'arraybuffer';
+        c.ws.onmessage = this._on_ws_message.bind(this, c);
+        c.ws.onopen = this._on_ws_open.bind(this, c);
+        c.ws.onclose = this._on_ws_close.bind(this, c);
+        this.conns.push(c);
+    }
+
+    this._close = function(c)
+    {
+        c.ws.close();
+        c.state = NBD_STATE_UNKNOWN;
+
+        if (c.stream)
+            c.stream.reader.cancel().catch(function() {});
+        c.streams = [];
+        c.stream = null;
+        c.held = [];
     }
 
     this._log = function(msg)
@@ -81,38 +525,30 @@ function NBDServer(endpoint, file)
     }
 
     /* websocket event handlers */
-    this._on_ws_open = function(ev)
+    this._on_ws_open = function(c, ev)
     {
-        this.client = {
+        c.client = {
             flags: 0,
+            structured: false,
         };
-        this._negotiate();
+        this._negotiate(c);
     }
 
-    this._on_ws_message = function(ev)
+    this._on_ws_message = function(c, ev)
     {
-        var data = ev.data;
-
-        if (this.msgbuf == null) {
-            this.msgbuf = data;
-        } else {
-            var tmp = new Uint8Array(this.msgbuf.byteLength + data.byteLength);
-            tmp.set(new Uint8Array(this.msgbuf), 0);
-            tmp.set(new Uint8Array(data), this.msgbuf.byteLength);
-            this.msgbuf = tmp.buffer;
-        }
+        c.rxq.push(ev.data);
 
-        for (;;) {
-            var handler = this.recv_handlers[this.state];
+        while (c.rxq.length) {
+            var handler = this.recv_handlers[c.state];
             if (!handler) {
-                this._log("no handler for state " + this.state);
+                this._log("no handler for state " + c.state);
                 this.stop();
                 break;
             }
 
-            var consumed = handler(this.msgbuf);
+            var consumed = handler(c, c.rxq);
             if (consumed < 0) {
-                this._log("handler[state=" + this.state +
+                this._log("handler[state=" + c.state +
                         "] returned error " + consumed);
                 this.stop();
                 break;
@@ -121,17 +557,24 @@ function NBDServer(endpoint, file)
             if (consumed == 0)
                 break;
 
-            if (consumed > 0) {
-                if (consumed == this.msgbuf.byteLength) {
-                    this.msgbuf = null;
-                    break;
-                }
-                this.msgbuf = this.msgbuf.slice(consumed);
-            }
+            c.rxq.consume(consumed);
         }
     }
 
-    this._negotiate = function()
+    /* an extra connection that nbd-proxy has turned down, or dropped, is
+     * just forgotten; the session carries on with the others */
+    this._on_ws_close = function(c, ev)
+    {
+        if (c == this.conns[0] || c.state == NBD_STATE_UNKNOWN)
+            return;
+
+        this._log("websocket closed; " + (this.conns.length - 1) +
+                " connections left");
+        this._close(c);
+        this.conns.splice(this.conns.indexOf(c), 1);
+    }
+
+    this._negotiate = function(c)
     {
         var buf = new ArrayBuffer(18);
         var data = new DataView(buf, 0, 18);
@@ -147,32 +590,34 @@ function NBDServer(endpoint, file)
         /* flags: fixed newstyle negotiation, no padding */
         data.setUint16(16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
 
-        this.state = NBD_STATE_WAIT_CFLAGS;
-        this.ws.send(buf);
+        c.state = NBD_STATE_WAIT_CFLAGS;
+        c.ws.send(buf);
     }
 
-    /* handlers */
-    this._handle_cflags = function(buf)
+    /* handlers: each parses from the head of a connection's receive queue,
+     * and returns the number of bytes consumed, 0 if more data is needed,
+     * or negative on error */
+    this._handle_cflags = function(c, q)
     {
-        if (buf.byteLength < 4)
+        if (q.length < 4)
             return 0;
 
-        var data = new DataView(buf, 0, 4);
-        this.client.flags = data.getUint32(0);
+        var data = q.view(0, 4);
+        c.client.flags = data.getUint32(0);
 
         this._log("client flags received: 0x" +
-                this.client.flags.toString(16));
+                c.client.flags.toString(16));
 
-        this.state = NBD_STATE_WAIT_OPTION;
+        c.state = NBD_STATE_WAIT_OPTION;
         return 4;
     }
 
-    this._handle_option = function(buf)
+    this._handle_option = function(c, q)
     {
-        if (buf.byteLength < 16)
+        if (q.length < 16)
             return 0;
 
-        var data = new DataView(buf, 0, 16);
+        var data = q.view(0, 16);
         if (data.getUint32(0) != 0x49484156 ||
                 data.getUint32(4) != 0x454F5054) {
             this._log("invalid option magic");
@@ -184,65 +629,322 @@ function NBDServer(endpoint, file)
 
         this._log("client option received: 0x" + opt.toString(16));
 
-        if (buf.byteLength < 16 + len)
+        if (q.length < 16 + len)
             return 0;
 
         switch (opt) {
         case NBD_OPT_EXPORT_NAME:
             this._log("negotiation complete, starting transmission mode");
             var n = 10;
-            if (!(this.client.flags & NBD_FLAG_NO_ZEROES))
+            if (!(c.client.flags & NBD_FLAG_NO_ZEROES))
                 n += 124;
             var resp = new ArrayBuffer(n);
             var view = new DataView(resp, 0, 10);
             /* export size. */
-            var size = this.file.size;
+            var size = this._export_size();
             view.setUint32(0, Math.floor(size / (2**32)));
             view.setUint32(4, size & 0xffffffff);
-            /* transmission flags: read-only */
-            view.setUint16(8, NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY);
-            this.ws.send(resp);
+            view.setUint16(8, this._export_flags());
+            c.ws.send(resp);
 
-            this.state = NBD_STATE_TRANSMISSION;
+            c.state = NBD_STATE_TRANSMISSION;
+            break;
+
+        case NBD_OPT_INFO:
+        case NBD_OPT_GO:
+            this._handle_opt_info(c, opt, q.view(16, len));
+            break;
+
+        case NBD_OPT_STRUCTURED_REPLY:
+            if (len) {
+                this._send_option_reply(c, opt, NBD_REP_ERR_INVALID);
+                break;
+            }
+            c.client.structured = true;
+            this._send_option_reply(c, opt, NBD_REP_ACK);
             break;
 
         default:
             /* reject other options */
-            var resp = new ArrayBuffer(20);
-            var view = new DataView(resp, 0, 20);
-            view.setUint32(0, 0x0003e889);
-            view.setUint32(4, 0x045565a9);
-            view.setUint32(8, opt);
-            view.setUint32(12, NBD_REP_ERR_UNSUP);
-            view.setUint32(16, 0);
-            this.ws.send(resp);
+            this._send_option_reply(c, opt, NBD_REP_ERR_UNSUP);
         }
 
         return 16 + len;
     }
 
-    this._create_cmd_response = function(req, rc, data = null)
+    this._export_size = function()
+    {
+        if (this.export_size != null)
+            return this.export_size;
+        return this.file ? this.file.size : 0;
+    }
+
+    /* transmission flags: all connections end up at this one engine, and a
+     * flush waits for every queued write, so it's safe for the client to
+     * spread requests over multiple connections */
+    this._export_flags = function()
+    {
+        var flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_CAN_MULTI_CONN;
+
+        if (this.writer)
+            flags |= NBD_FLAG_SEND_FLUSH;
+        else
+            flags |= NBD_FLAG_READ_ONLY;
+
+        return flags;
+    }
+
+    /* Block size hints for the client. The minimum is a sector, unless the
+     * file isn't a whole number of sectors. The preferred size is a cache
+     * block, so the client's reads are whole blocks, and the maximum is
+     * the largest single read from the file. */
+    this._block_sizes = function()
+    {
+        var size = this._export_size();
+        var min = size % 512 ? 1 : 512;
+        var pref = this.cache_block_size;
+
+        while (pref > min && pref > size)
+            pref /= 2;
+
+        return {
+            min: min,
+            pref: pref,
+            max: Math.max(this.max_read_span, pref),
+        };
+    }
+
+    this._send_option_reply = function(c, opt, type, data = null)
     {
-        var len = 16;
+        var len = data ? data.byteLength : 0;
+        var resp = new ArrayBuffer(20 + len);
+        var view = new DataView(resp, 0, 20);
+        view.setUint32(0, 0x0003e889);
+        view.setUint32(4, 0x045565a9);
+        view.setUint32(8, opt);
+        view.setUint32(12, type);
+        view.setUint32(16, len);
         if (data)
-            len += data.byteLength;
-        var resp = new ArrayBuffer(len);
+            new Uint8Array(resp, 20).set(new Uint8Array(data));
+        c.ws.send(resp);
+    }
+
+    /* NBD_OPT_INFO and NBD_OPT_GO: the export name is ignored, as we only
+     * have the one export */
+    this._handle_opt_info = function(c, opt, data)
+    {
+        if (data.byteLength < 6 ||
+                data.byteLength < 6 + data.getUint32(0)) {
+            this._send_option_reply(c, opt, NBD_REP_ERR_INVALID);
+            return;
+        }
+
+        var off = 4 + data.getUint32(0);
+        var n_reqs = data.getUint16(off);
+        var want_block_size = false;
+
+        if (data.byteLength != off + 2 + 2 * n_reqs) {
+            this._send_option_reply(c, opt, NBD_REP_ERR_INVALID);
+            return;
+        }
+
+        for (var i = 0; i < n_reqs; i++) {
+            if (data.getUint16(off + 2 + 2 * i) == NBD_INFO_BLOCK_SIZE)
+                want_block_size = true;
+        }
+
+        var info = new DataView(new ArrayBuffer(12));
+        var size = this._export_size();
+        info.setUint16(0, NBD_INFO_EXPORT);
+        info.setUint32(2, Math.floor(size / (2**32)));
+        info.setUint32(6, size & 0xffffffff);
+        info.setUint16(10, this._export_flags());
+        this._send_option_reply(c, opt, NBD_REP_INFO, info.buffer);
+
+        if (want_block_size) {
+            var sizes = this._block_sizes();
+            info = new DataView(new ArrayBuffer(14));
+            info.setUint16(0, NBD_INFO_BLOCK_SIZE);
+            info.setUint32(2, sizes.min);
+            info.setUint32(6, sizes.pref);
+            info.setUint32(10, sizes.max);
+            this._send_option_reply(c, opt, NBD_REP_INFO, info.buffer);
+        }
+
+        this._send_option_reply(c, opt, NBD_REP_ACK);
+
+        if (opt == NBD_OPT_GO) {
+            this._log("negotiation complete, starting transmission mode");
+            c.state = NBD_STATE_TRANSMISSION;
+        }
+    }
+
+    this._create_cmd_response = function(req, rc)
+    {
+        var resp = new ArrayBuffer(16);
         var view = new DataView(resp, 0, 16);
         view.setUint32(0, 0x67446698);
         view.setUint32(4, rc);
         view.setUint32(8, req.handle_msB);
         view.setUint32(12, req.handle_lsB);
-        if (data)
-            new Uint8Array(resp, 16).set(new Uint8Array(data));
         return resp;
     }
 
-    this._handle_cmd = function(buf)
+    /* a structured reply chunk header, with room for the first fixed
+     * bytes of its len bytes of payload */
+    this._create_chunk = function(req, flags, type, len, fixed = len)
+    {
+        var chunk = new DataView(new ArrayBuffer(20 + fixed));
+        chunk.setUint32(0, NBD_STRUCTURED_REPLY_MAGIC);
+        chunk.setUint16(4, flags);
+        chunk.setUint16(6, type);
+        chunk.setUint32(8, req.handle_msB);
+        chunk.setUint32(12, req.handle_lsB);
+        chunk.setUint32(16, len);
+        return chunk;
+    }
+
+    /* Send a message for req during transmission, on the connection that
+     * req came from. While a streamed read reply is being sent there, other
+     * messages are held back until it's done; stream is the streamed read
+     * that buf belongs to, if any. */
+    this._send = function(req, buf, stream = null)
     {
-        if (buf.byteLength < 28)
+        var c = req.conn;
+
+        if (c.stream && c.stream != stream)
+            c.held.push(buf);
+        else
+            c.ws.send(buf);
+    }
+
+    /* with structured replies, reads must have structured replies, even
+     * for errors */
+    this._send_cmd_response = function(req, rc, stream = null)
+    {
+        if (rc && req.type == NBD_CMD_READ && req.conn.client.structured) {
+            var chunk = this._create_chunk(req, NBD_REPLY_FLAG_DONE,
+                    NBD_REPLY_TYPE_ERROR, 6);
+            chunk.setUint32(20, rc);
+            chunk.setUint16(24, 0);
+            this._send(req, chunk.buffer, stream);
+            return;
+        }
+
+        this._send(req, this._create_cmd_response(req, rc), stream);
+    }
+
+    /* Send the reply to a successful read, with data in parts, which cover
+     * the request in order. The server treats the websocket as a byte
+     * stream, so each part is sent as a separate message straight after
+     * the header, rather than being copied in behind it. */
+    this._send_read_reply = function(req, offset, parts)
+    {
+        if (!req.conn.client.structured) {
+            this._send(req, this._create_cmd_response(req, 0));
+            for (var i = 0; i < parts.length; i++) {
+                if (parts[i].byteLength)
+                    this._send(req, parts[i]);
+            }
+            return;
+        }
+
+        var runs = this._find_holes(offset, parts);
+
+        if (!runs.length) {
+            this._send(req, this._create_chunk(req, NBD_REPLY_FLAG_DONE,
+                    NBD_REPLY_TYPE_NONE, 0).buffer);
+            return;
+        }
+
+        this._send_runs(req, runs, true);
+    }
+
+    /* Send a chunk for each of runs, from _find_holes(). The last one is
+     * marked as the end of the reply if done is set. */
+    this._send_runs = function(req, runs, done, stream = null)
+    {
+        for (var i = 0; i < runs.length; i++) {
+            var run = runs[i];
+            var flags = done && i == runs.length - 1 ?
+                NBD_REPLY_FLAG_DONE : 0;
+            var chunk;
+
+            if (run.hole) {
+                chunk = this._create_chunk(req, flags,
+                        NBD_REPLY_TYPE_OFFSET_HOLE, 12);
+                chunk.setUint32(20, Math.floor(run.offset / (2**32)));
+                chunk.setUint32(24, run.offset & 0xffffffff);
+                chunk.setUint32(28, run.length);
+                this._send(req, chunk.buffer, stream);
+                continue;
+            }
+
+            chunk = this._create_chunk(req, flags,
+                    NBD_REPLY_TYPE_OFFSET_DATA, 8 + run.length, 8);
+            chunk.setUint32(20, Math.floor(run.offset / (2**32)));
+            chunk.setUint32(24, run.offset & 0xffffffff);
+            this._send(req, chunk.buffer, stream);
+            for (var j = 0; j < run.parts.length; j++) {
+                var piece = run.parts[j];
+                this._send(req, piece.part.subarray(piece.from, piece.to),
+                        stream);
+            }
+        }
+    }
+
+    /* Split the data for a read at offset into runs of data and holes.
+     * Holes are made of whole, aligned NBD_HOLE_SIZE blocks of zeroes;
+     * data runs refer to ranges of the parts. */
+    this._find_holes = function(offset, parts)
+    {
+        var runs = [];
+        var run = null;
+        var pos = offset;
+
+        for (var i = 0; i < parts.length; i++) {
+            var part = parts[i];
+
+            for (var off = 0; off < part.byteLength; ) {
+                var n = Math.min(part.byteLength - off,
+                        NBD_HOLE_SIZE - pos % NBD_HOLE_SIZE);
+                var hole = n == NBD_HOLE_SIZE &&
+                    nbd_is_zero(part.subarray(off, off + n));
+
+                if (!run || run.hole != hole) {
+                    run = {
+                        hole: hole,
+                        offset: pos,
+                        length: 0,
+                        parts: [],
+                    };
+                    runs.push(run);
+                }
+
+                run.length += n;
+
+                if (!hole) {
+                    var last = run.parts[run.parts.length - 1];
+                    if (last && last.part == part && last.to == off)
+                        last.to += n;
+                    else
+                        run.parts.push({ part: part, from: off, to: off + n });
+                }
+
+                off += n;
+                pos += n;
+            }
+        }
+
+        return runs;
+    }
+
+    this._handle_cmd = function(c, q)
+    {
+        if (q.length < 28)
             return 0;
 
-        var view = new DataView(buf, 0, 28);
+        var view = q.view(0, 28);
 
         if (view.getUint32(0) != 0x25609513) {
             this._log("invalid request magic");
@@ -257,11 +959,9 @@ function NBDServer(endpoint, file)
             offset_msB: view.getUint32(16),
             offset_lsB: view.getUint32(20),
             length: view.getUint32(24),
+            conn: c,
         };
 
-        /* we don't support writes, so nothing needs the data at present */
-        /* req.data = buf.slice(28); */
-
         var err = 0;
 	var consumed = 28;
 
@@ -281,12 +981,22 @@ function NBDServer(endpoint, file)
         case NBD_CMD_WRITE:
 	    /* we also need length bytes of data to consume a write
 	     * request */
-	    if (buf.byteLength < 28 + req.length)
+	    if (q.length < 28 + req.length)
 		    return 0;
 	    consumed += req.length;
-	    err = EPERM;
+	    if (this.writer)
+		    err = this._handle_cmd_write(req, q.bytes(28, req.length));
+	    else
+		    err = EPERM;
 	    break;
 
+        case NBD_CMD_FLUSH:
+            if (this.writer)
+                err = this._handle_cmd_flush(req);
+            else
+                err = EINVAL;
+            break;
+
         case NBD_CMD_TRIM:
             err = EPERM;
             break;
@@ -296,9 +1006,15 @@ function NBDServer(endpoint, file)
             err = EINVAL;
         }
 
-        if (err) {
-            var resp = this._create_cmd_response(req, err);
-            this.ws.send(resp);
+        if (err)
+            this._send_cmd_response(req, err);
+
+        /* the rest of the connections are opened once the first is in
+         * use, when nbd-proxy is ready to take them */
+        if (!this.conns_opened && this.state != NBD_STATE_UNKNOWN) {
+            this.conns_opened = true;
+            for (var i = 1; i < this.websockets; i++)
+                this._connect();
         }
 
         return consumed;
@@ -316,38 +1032,573 @@ function NBDServer(endpoint, file)
         if (offset + req.length > Number.MAX_SAFE_INTEGER)
             return ENOSPC;
 
-        if (offset + req.length > file.size)
+        if (offset + req.length > this._export_size())
             return ENOSPC;
 
         this._log("read: 0x" + req.length.toString(16) +
                 " bytes, offset 0x" + offset.toString(16));
 
-        var blob = this.file.slice(offset, offset + req.length);
-        var reader = new FileReader();
+        if (this.writer) {
+            this._read_written(req, offset);
+            return 0;
+        }
 
-        reader.onload = (function(ev) {
-            var reader = ev.target;
-            if (reader.readyState != FileReader.DONE)
-                return;
-            var resp = this._create_cmd_response(req, 0, reader.result);
-            this.ws.send(resp);
-        }).bind(this);
+        if (this.stream_read_min && req.length >= this.stream_read_min) {
+            this._stream_read(req, offset);
+            return 0;
+        }
+
+        var bs = this.cache_block_size;
+        var first = Math.floor(offset / bs);
+        var n = req.length ?
+            Math.floor((offset + req.length - 1) / bs) - first + 1 : 0;
+        var op = {
+            req: req,
+            offset: offset,
+            first: first,
+            blocks: new Array(n),
+            remaining: n,
+            err: 0,
+        };
+        var fetch = null;
+
+        for (var i = 0; i < n; i++) {
+            var block = first + i;
+            var entry = this.cache.get(block);
+
+            if (entry) {
+                this.stats.hits++;
+                entry.pri = this.cache_clock + entry.cost;
+                op.blocks[i] = entry.data;
+                op.remaining--;
+                fetch = null;
+                continue;
+            }
 
-        reader.onerror = (function(ev) {
-            var reader = ev.target;
-            this._log("error reading file: " + reader.error);
-            var resp = this._create_cmd_response(req, EIO);
-            this.ws.send(resp);
-        }).bind(this);
+            var waiters = this.cache_pending.get(block);
+            if (waiters) {
+                this.stats.shared++;
+                waiters.push({ op: op, idx: i });
+                fetch = null;
+                continue;
+            }
 
-        reader.readAsArrayBuffer(blob);
+            this.stats.misses++;
+            this.cache_pending.set(block, [{ op: op, idx: i }]);
+
+            /* extend the last fetch if it ends at this block */
+            if (fetch) {
+                fetch.length += bs;
+                fetch.n++;
+                continue;
+            }
+            fetch = { offset: block * bs, length: bs, first: block, n: 1 };
+            this.read_queue.push(fetch);
+        }
+
+        if (!op.remaining)
+            this._finish_read(op);
+        else
+            this._schedule_reads();
 
         return 0;
     }
 
+    this._schedule_reads = function()
+    {
+        while (this.reads_inflight < this.max_reads &&
+                this.read_queue.length) {
+            var fetches = [this.read_queue.shift()];
+            var start = fetches[0].offset;
+            var end = start + fetches[0].length;
+
+            while (this.read_queue.length) {
+                var next = this.read_queue[0];
+                if (next.offset != end ||
+                        end + next.length - start > this.max_read_span)
+                    break;
+                fetches.push(this.read_queue.shift());
+                end += next.length;
+            }
+
+            this._start_read(fetches, start, end);
+        }
+    }
+
+    this._start_read = function(fetches, start, end)
+    {
+        var conns = this.conns;
+        var t = performance.now();
+
+        this.reads_inflight++;
+
+        this.file.slice(start, end).arrayBuffer().then(
+            (function(buf) {
+                this._complete_read(conns, fetches, start, buf, 0, t);
+            }).bind(this),
+            (function(err) {
+                this._log("error reading file: " + err);
+                this._complete_read(conns, fetches, start, null, EIO, t);
+            }).bind(this));
+    }
+
+    this._complete_read = function(conns, fetches, start, buf, err, t)
+    {
+        /* ignore reads that complete after their session has gone */
+        if (conns != this.conns)
+            return;
+
+        this.reads_inflight--;
+
+        var bs = this.cache_block_size;
+        var cost = performance.now() - t;
+
+        for (var i = 0; i < fetches.length; i++) {
+            var fetch = fetches[i];
+            for (var j = 0; j < fetch.n; j++) {
+                var block = fetch.first + j;
+                var data = null;
+
+                if (!err) {
+                    var off = block * bs - start;
+                    var len = Math.min(bs, buf.byteLength - off);
+                    data = new Uint8Array(buf, off, len);
+                    this._cache_insert(block, data, cost);
+                }
+
+                var waiters = this.cache_pending.get(block);
+                this.cache_pending.delete(block);
+
+                for (var k = 0; k < waiters.length; k++) {
+                    var op = waiters[k].op;
+                    op.blocks[waiters[k].idx] = data;
+                    if (err)
+                        op.err = err;
+                    if (!--op.remaining)
+                        this._finish_read(op);
+                }
+            }
+        }
+
+        this._schedule_reads();
+    }
+
+    this._finish_read = function(op)
+    {
+        var req = op.req;
+
+        if (req.conn.state != NBD_STATE_TRANSMISSION)
+            return;
+
+        if (op.err) {
+            this._send_cmd_response(req, op.err);
+            return;
+        }
+
+        /* send the parts of each block covered by the request as-is */
+        var bs = this.cache_block_size;
+        var end = op.offset + req.length;
+        var parts = [];
+        for (var i = 0; i < op.blocks.length; i++) {
+            var base = (op.first + i) * bs;
+            var data = op.blocks[i];
+            var from = Math.max(op.offset, base) - base;
+            var to = Math.min(end, base + data.byteLength) - base;
+            parts.push(data.subarray(from, to));
+        }
+
+        this._send_read_reply(req, op.offset, parts);
+    }
+
+    /* Streamed reads are sent one at a time on each connection, in the
+     * order they arrived */
+    this._stream_read = function(req, offset)
+    {
+        var c = req.conn;
+
+        c.streams.push({
+            req: req,
+            conn: c,
+            pos: offset,
+            end: offset + req.length,
+            reader: null,
+            buf: null,
+            started: false,
+        });
+
+        if (!c.stream)
+            this._stream_next(c);
+    }
+
+    this._stream_next = function(c)
+    {
+        /* replies held back by the last stream go first */
+        var held = c.held;
+        c.held = [];
+        c.stream = null;
+        for (var i = 0; i < held.length; i++)
+            c.ws.send(held[i]);
+
+        var s = c.streams.shift();
+        if (!s)
+            return;
+
+        c.stream = s;
+        this.stats.streamed++;
+
+        /* a BYOB reader lets us read each chunk into the same buffer;
+         * otherwise chunks are whatever size the browser reads */
+        var stream = this.file.slice(s.pos, s.end).stream();
+        try {
+            s.reader = stream.getReader({ mode: 'byob' });
+            s.buf = new ArrayBuffer(this.stream_chunk_size);
+        } catch (e) {
+            s.reader = stream.getReader();
+        }
+
+        this._stream_pump(s);
+    }
+
+    /* read the stream's next chunk, once the websocket has room for it */
+    this._stream_pump = function(s)
+    {
+        if (s != s.conn.stream)
+            return;
+
+        var queued = s.conn.ws.bufferedAmount;
+        if (queued && queued + this.stream_chunk_size > this.stream_budget) {
+            setTimeout(this._stream_pump.bind(this, s), NBD_STREAM_POLL_MS);
+            return;
+        }
+
+        var read;
+        if (s.buf)
+            read = s.reader.read(new Uint8Array(s.buf, 0,
+                    Math.min(s.buf.byteLength, s.end - s.pos)));
+        else
+            read = s.reader.read();
+
+        read.then(
+            (function(result) {
+                this._stream_data(s, result);
+            }).bind(this),
+            (function(err) {
+                this._log("error reading file: " + err);
+                this._stream_error(s, EIO);
+            }).bind(this));
+    }
+
+    this._stream_data = function(s, result)
+    {
+        /* ignore reads that complete after their session has gone */
+        if (s != s.conn.stream)
+            return;
+
+        if (result.done) {
+            this._log("file ended during a read");
+            this._stream_error(s, EIO);
+            return;
+        }
+
+        /* the websocket has copied each chunk by the time send() returns,
+         * so its buffer can be read into again */
+        var data = result.value;
+        var done = s.pos + data.byteLength >= s.end;
+        if (s.buf)
+            s.buf = data.buffer;
+
+        if (!s.conn.client.structured) {
+            if (!s.started)
+                s.conn.ws.send(this._create_cmd_response(s.req, 0));
+            s.conn.ws.send(data);
+        } else {
+            this._send_runs(s.req, this._find_holes(s.pos, [data]), done, s);
+        }
+
+        s.started = true;
+        s.pos += data.byteLength;
+
+        if (done)
+            this._stream_next(s.conn);
+        else
+            this._stream_pump(s);
+    }
+
+    this._stream_error = function(s, err)
+    {
+        if (s != s.conn.stream)
+            return;
+
+        s.reader.cancel().catch(function() {});
+
+        /* a simple reply's header has already promised all of the data, so
+         * there's no way to report the error */
+        if (s.started && !s.conn.client.structured) {
+            this._log("read failed part-way through its reply");
+            this.stop();
+            return;
+        }
+
+        this._send_cmd_response(s.req, err, s);
+        this._stream_next(s.conn);
+    }
+
+    /* Cache eviction follows GreedyDual: each block's priority is its read
+     * cost (the time taken to read it from the file) plus the current
+     * clock value. The lowest-priority block is evicted, and the clock
+     * advances to its priority, so blocks that are expensive to re-read
+     * survive longer, and those not used recently age out.
+     *
+     * Cached blocks are views of the buffer they were read into, so a
+     * coalesced read's buffer lives as long as any of its blocks. */
+    this._cache_init = function()
+    {
+        this.cache = new Map();
+        this.cache_pending = new Map();
+        this.cache_bytes = 0;
+        this.cache_clock = 0;
+        this.stats = {
+            hits: 0,
+            misses: 0,
+            shared: 0,
+            evictions: 0,
+            streamed: 0,
+        };
+    }
+
+    this._cache_insert = function(block, data, cost)
+    {
+        if (data.byteLength > this.cache_size)
+            return;
+
+        while (this.cache_bytes + data.byteLength > this.cache_size) {
+            var victim = null;
+            var victim_pri = Infinity;
+
+            for (var [key, entry] of this.cache) {
+                if (entry.pri < victim_pri) {
+                    victim = key;
+                    victim_pri = entry.pri;
+                }
+            }
+
+            this.cache_clock = victim_pri;
+            this.cache_bytes -= this.cache.get(victim).data.byteLength;
+            this.cache.delete(victim);
+            this.stats.evictions++;
+        }
+
+        this.cache.set(block, {
+            data: data,
+            cost: cost,
+            pri: this.cache_clock + cost,
+        });
+        this.cache_bytes += data.byteLength;
+    }
+
+    /* cache statistics: hits and misses count blocks; shared blocks were
+     * already being read for another request. streamed counts the reads
+     * that bypassed the cache. */
+    this.cache_stats = function()
+    {
+        var lookups = this.stats.hits + this.stats.misses + this.stats.shared;
+
+        return {
+            hits: this.stats.hits,
+            misses: this.stats.misses,
+            shared: this.stats.shared,
+            evictions: this.stats.evictions,
+            streamed: this.stats.streamed,
+            hit_rate: lookups ? (this.stats.hits + this.stats.shared) / lookups : 0,
+            size: this.cache_bytes,
+        };
+    }
+
+    /* Reads from a writable export wait for queued writes, and bypass the
+     * block cache, so that they see all acknowledged writes */
+    this._read_written = function(req, offset)
+    {
+        this._when_writes_idle((function() {
+            this.writer.read(offset, req.length).then(
+                (function(buf) {
+                    if (req.conn.state == NBD_STATE_TRANSMISSION)
+                        this._send_read_reply(req, offset,
+                                [new Uint8Array(buf)]);
+                }).bind(this),
+                (function(err) {
+                    this._log("error reading: " + err);
+                    if (req.conn.state == NBD_STATE_TRANSMISSION)
+                        this._send_cmd_response(req, EIO);
+                }).bind(this));
+        }).bind(this));
+    }
+
+    this._handle_cmd_write = function(req, data)
+    {
+        var offset = (req.offset_msB * 2**32) + req.offset_lsB;
+
+        if (offset + req.length > this._export_size())
+            return ENOSPC;
+
+        /* a failed sink write is reported on the next write or flush */
+        if (this.write_error)
+            return this.write_error;
+
+        var last = this.write_queue[this.write_queue.length - 1];
+        if (last && last.offset + last.length == offset &&
+                last.length + req.length <= this.max_write_batch) {
+            last.chunks.push(data);
+            last.length += req.length;
+        } else {
+            this.write_queue.push({
+                offset: offset,
+                chunks: [data],
+                length: req.length,
+            });
+        }
+        this.write_queued += req.length;
+
+        if (!this.write_acks.length &&
+                this.write_queued <= this.max_write_queue)
+            this._send_cmd_response(req, 0);
+        else
+            this.write_acks.push(req);
+
+        this._pump_writes();
+        return 0;
+    }
+
+    this._handle_cmd_flush = function(req)
+    {
+        this._when_writes_idle((function() {
+            var done = (function(err) {
+                if (req.conn.state == NBD_STATE_TRANSMISSION)
+                    this._send_cmd_response(req, err);
+            }).bind(this);
+
+            if (this.write_error || !this.writer.flush) {
+                done(this.write_error);
+                return;
+            }
+
+            this.writer.flush().then(
+                function() { done(0); },
+                (function(err) {
+                    this._log("error flushing: " + err);
+                    done(EIO);
+                }).bind(this));
+        }).bind(this));
+
+        return 0;
+    }
+
+    /* set up the sink, if any. Returns false if it can't be read from. */
+    this._writer_init = function()
+    {
+        var sink = this.sink;
+
+        this.write_queue = [];
+        this.write_queued = 0;
+        this.write_busy = null;
+        this.write_acks = [];
+        this.write_idle = [];
+        this.write_error = 0;
+
+        if (!sink)
+            this.writer = null;
+        else if (sink == 'memory')
+            this.writer = new NBDMemorySink(this._export_size());
+        else if (typeof sink.createWritable == 'function')
+            this.writer = new NBDFileHandleSink(sink, this._export_size(),
+                    this.sink_overlay_size);
+        else
+            this.writer = sink;
+
+        if (this.writer && typeof this.writer.read != 'function') {
+            this.writer = null;
+            return false;
+        }
+        return true;
+    }
+
+    /* write out the oldest queued batch, if the sink is idle */
+    this._pump_writes = function()
+    {
+        if (this.write_busy || !this.write_queue.length)
+            return;
+
+        var batch = this.write_queue.shift();
+        this.write_busy = batch;
+
+        this.writer.write(batch.offset, batch.chunks).then(
+            (function() {
+                this._write_done(batch, 0);
+            }).bind(this),
+            (function(err) {
+                this._log("error writing: " + err);
+                this._write_done(batch, EIO);
+            }).bind(this));
+    }
+
+    this._write_done = function(batch, err)
+    {
+        this.write_busy = null;
+        this.write_queued -= batch.length;
+        if (err)
+            this.write_error = err;
+
+        while (this.write_acks.length &&
+                (this.write_queued <= this.max_write_queue ||
+                 this.write_error)) {
+            var req = this.write_acks.shift();
+            if (req.conn.state == NBD_STATE_TRANSMISSION)
+                this._send_cmd_response(req, this.write_error);
+        }
+
+        this._pump_writes();
+
+        if (!this.write_busy) {
+            var idle = this.write_idle;
+            this.write_idle = [];
+            for (var i = 0; i < idle.length; i++)
+                idle[i]();
+        }
+    }
+
+    this._when_writes_idle = function(fn)
+    {
+        if (!this.write_busy && !this.write_queue.length)
+            fn();
+        else
+            this.write_idle.push(fn);
+    }
+
+    /* once the queue has been written out, finish the sink, and pass on
+     * its result */
+    this._writer_finish = function()
+    {
+        this._when_writes_idle((function() {
+            if (!this.writer.finish)
+                return;
+
+            this.writer.finish().then(
+                (function(result) {
+                    if (this.onsinkdone)
+                        this.onsinkdone(result);
+                }).bind(this),
+                (function(err) {
+                    this._log("error finishing writes: " + err);
+                }).bind(this));
+        }).bind(this));
+    }
+
     this._handle_cmd_disconnect = function(req)
     {
+            var stats = this.cache_stats();
             this._log("disconnect received");
+            this._log("cache: " + stats.hits + " hits, " + stats.shared +
+                    " shared, " + stats.misses + " misses (" +
+                    (stats.hit_rate * 100).toFixed(1) + "%)");
             this.stop();
             return 0;
     }
@@ -357,6 +1608,171 @@ function NBDServer(endpoint, file)
         [NBD_STATE_WAIT_OPTION]: this._handle_option.bind(this),
         [NBD_STATE_TRANSMISSION]: this._handle_cmd.bind(this),
     });
+
+    this._cache_init();
 }
 
+/* The page's interface to an NBDEngine. The engine runs in a dedicated
+ * Worker, so the websocket and file reads aren't held up when the page is
+ * busy; only log messages and statistics come back to this thread. If
+ * workers aren't available, the engine runs here instead. */
+function NBDServer(endpoint, file)
+{
+    this.file = file;
+    this.endpoint = endpoint;
+    this.worker = null;
+    this.engine = null;
+    this.stats = null;
+
+    this.start = function()
+    {
+        var options = {};
+
+        for (var i = 0; i < NBD_ENGINE_OPTIONS.length; i++) {
+            var name = NBD_ENGINE_OPTIONS[i];
+            if (this[name] !== undefined)
+                options[name] = this[name];
+        }
 
+        /* sink objects can't be passed to a worker */
+        var local_sink = this.sink && typeof this.sink.write == 'function';
+
+        if (!NBD_SCRIPT || typeof Worker == 'undefined' || local_sink) {
+            this.engine = new NBDEngine(this.endpoint, this.file);
+            Object.assign(this.engine, options);
+            this.engine.onlog = this._log.bind(this);
+            this.engine.onsinkdone = this._on_sink_done.bind(this);
+            this.engine.start();
+            return;
+        }
+
+        if (!this.worker) {
+            this.worker = new Worker(NBD_SCRIPT);
+            this.worker.onmessage = this._on_worker_message.bind(this);
+        }
+
+        this.worker.postMessage({
+            type: 'start',
+            endpoint: this.endpoint,
+            file: this.file,
+            options: options,
+        });
+    }
+
+    this.stop = function()
+    {
+        if (this.engine)
+            this.engine.stop();
+        else if (this.worker)
+            this.worker.postMessage({ type: 'stop' });
+    }
+
+    /* request the engine's statistics, which are passed to onstats */
+    this.update_stats = function()
+    {
+        if (this.engine)
+            this._on_stats(this.engine.cache_stats());
+        else if (this.worker)
+            this.worker.postMessage({ type: 'stats' });
+    }
+
+    this._log = function(msg)
+    {
+        if (this.onlog)
+            this.onlog(msg);
+    }
+
+    this._on_stats = function(stats)
+    {
+        this.stats = stats;
+        if (this.onstats)
+            this.onstats(stats);
+    }
+
+    /* a memory sink's pages, assembled into a Blob for oncomplete */
+    this._on_sink_done = function(result)
+    {
+        if (!result || !this.oncomplete)
+            return;
+
+        var zeroes = new Uint8Array(result.page_size);
+        var parts = [];
+
+        for (var i = 0; i < result.pages.length; i++) {
+            var len = Math.min(result.page_size,
+                    result.size - i * result.page_size);
+            if (result.pages[i])
+                parts.push(new Uint8Array(result.pages[i], 0, len));
+            else
+                parts.push(zeroes.subarray(0, len));
+        }
+
+        this.oncomplete(new Blob(parts));
+    }
+
+    this._on_worker_message = function(ev)
+    {
+        var msg = ev.data;
+
+        switch (msg.type) {
+        case 'log':
+            this._log(msg.msg);
+            break;
+        case 'stats':
+            this._on_stats(msg.stats);
+            break;
+        case 'sink':
+            this._on_sink_done(msg.result);
+            break;
+        }
+    }
+}
+
+/* worker side: run an engine on behalf of the page's NBDServer */
+if (typeof WorkerGlobalScope != 'undefined' &&
+        self instanceof WorkerGlobalScope) {
+    var nbd_engine = null;
+
+    /* data posted to the page, with any buffers in transfer moved rather
+     * than copied */
+    function nbd_post(msg, transfer = [])
+    {
+        self.postMessage(msg, transfer);
+    }
+
+    self.onmessage = function(ev)
+    {
+        var msg = ev.data;
+
+        switch (msg.type) {
+        case 'start':
+            if (nbd_engine && nbd_engine.state != NBD_STATE_UNKNOWN)
+                nbd_engine.stop();
+            nbd_engine = new NBDEngine(msg.endpoint, msg.file);
+            Object.assign(nbd_engine, msg.options);
+            nbd_engine.onlog = function(log) {
+                nbd_post({ type: 'log', msg: log });
+            };
+            nbd_engine.onsinkdone = function(result) {
+                var transfer = [];
+                if (result)
+                    transfer = result.pages.filter(function(page) {
+                        return page;
+                    });
+                nbd_post({ type: 'sink', result: result }, transfer);
+            };
+            nbd_engine.start();
+            break;
+
+        case 'stop':
+            if (nbd_engine)
+                nbd_engine.stop();
+            break;
+
+        case 'stats':
+            if (nbd_engine)
+                nbd_post({ type: 'stats', stats: nbd_engine.cache_stats() });
+            break;
+        }
+    }
+}